@@ -66,6 +66,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "app/config/statefile.h"
+#include "app/main/log_writer.h"
 #include "app/main/main.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
@@ -345,6 +346,9 @@ static const config_var_t option_vars_[] = {
   VAR("AuthoritativeDirectory",  BOOL, AuthoritativeDir,    "0"),
   V(AutomapHostsOnResolve,       BOOL,     "0"),
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
+  V(AsyncLogging,                BOOL,     "0"),
+  V(AsyncLoggingBufferSize,      MEMUNIT,  "1 MB"),
+  V(AsyncLoggingDropWhenFull,    BOOL,     "0"),
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "1 GB"),
   V(BandwidthRate,               MEMUNIT,  "1 GB"),
@@ -677,6 +681,7 @@ static const config_var_t option_vars_[] = {
   V(StrictNodes,                 BOOL,     "0"),
   OBSOLETE("Support022HiddenServices"),
   V(TestSocks,                   BOOL,     "0"),
+  V(TLSSessionResumption,        BOOL,     "1"),
   V_IMMUTABLE(TokenBucketRefillInterval,   MSEC_INTERVAL, "100 msec"),
   OBSOLETE("Tor2webMode"),
   OBSOLETE("Tor2webRendezvousPoints"),
@@ -2234,6 +2239,20 @@ options_act,(const or_options_t *old_options))
     finish_daemon(options->DataDirectory);
   }
 
+  /* Start or stop the log writer thread.  We do this after we have forked,
+   * since the thread would not survive the fork. */
+  if (options->AsyncLogging) {
+    log_async_policy_t policy = options->AsyncLoggingDropWhenFull ?
+      LOG_ASYNC_DROP : LOG_ASYNC_BLOCK;
+    if (log_writer_start((size_t)options->AsyncLoggingBufferSize,
+                         policy) < 0) {
+      log_warn(LD_CONFIG, "Unable to start the log writer thread. "
+               "Logging synchronously.");
+    }
+  } else {
+    log_writer_stop();
+  }
+
   if (options_act_relay(old_options) < 0)
     return -1;
 
@@ -3348,6 +3367,11 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
   if (options_init_logs(old_options, options, 1)<0)
     REJECT("Failed to validate Log options. See logs for details.");
 
+  if (options->AsyncLoggingBufferSize < 64*1024 ||
+      options->AsyncLoggingBufferSize > INT32_MAX) {
+    REJECT("AsyncLoggingBufferSize must be between 64 KB and 2 GB.");
+  }
+
   /* XXXX require that the only port not be DirPort? */
   /* XXXX require that at least one port be listened-upon. */
   if (n_ports == 0 && !options->RendConfigLines)
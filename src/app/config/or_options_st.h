@@ -77,6 +77,13 @@ struct or_options_t {
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
   char *SyslogIdentityTag; /**< Identity tag to add for syslog logging. */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our
+                     * file logs? */
+  uint64_t AsyncLoggingBufferSize; /**< How many bytes of file log messages
+                                    * may wait for the log writer thread? */
+  int AsyncLoggingDropWhenFull; /**< Boolean: Should we drop file log
+                                 * messages, rather than wait, when the
+                                 * AsyncLogging buffer is full? */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
   char *DataDirectory_option; /**< Where to store long-term data, as
@@ -985,6 +992,10 @@ struct or_options_t {
    * should guess a suitable value. */
   int SSLKeyLifetime;
 
+  /** Boolean: if we're a public relay, should we issue TLS session tickets,
+   * and resume TLS sessions with the other relays that we connect to? */
+  int TLSSessionResumption;
+
   /** How long (seconds) do we keep a guard before picking a new one? */
   int GuardLifetime;
 
@@ -0,0 +1,135 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file log_writer.c
+ * @brief Thread that writes asynchronously queued log messages.
+ *
+ * When AsyncLogging is set, the log module queues file log messages in a
+ * ring buffer instead of writing them from whichever thread logged them.
+ * The log module can't start threads of its own, so this module owns the
+ * thread that empties that buffer: the log module calls our wakeup function
+ * when there is something new, and we call logs_async_write_pending() to
+ * write it all in as few writev() calls as we can.
+ **/
+
+#include "orconfig.h"
+#include "app/main/log_writer.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/thread/threads.h"
+
+/** Protects the variables below, and goes with writer_cond. */
+static tor_mutex_t writer_mutex;
+/** Signaled when there is new work for the writer thread, or when the
+ * writer thread has exited. */
+static tor_cond_t writer_cond;
+/** True iff we have initialized writer_mutex and writer_cond. */
+static int writer_initialized = 0;
+/** True iff the log module has queued something since the writer thread
+ * last looked. */
+static int writer_has_work = 0;
+/** True iff the writer thread exists. */
+static int writer_running = 0;
+/** True iff the writer thread should exit. */
+static int writer_should_exit = 0;
+
+/** Wakeup function for the log module: tell the writer thread that there
+ * are messages to write.  Called with the log lock held. */
+static void
+log_writer_wakeup(void)
+{
+  tor_mutex_acquire(&writer_mutex);
+  writer_has_work = 1;
+  tor_cond_signal_one(&writer_cond);
+  tor_mutex_release(&writer_mutex);
+}
+
+/** Main function for the writer thread. */
+static void
+log_writer_main(void *arg)
+{
+  (void) arg;
+
+  tor_mutex_acquire(&writer_mutex);
+  while (!writer_should_exit) {
+    if (!writer_has_work) {
+      tor_cond_wait(&writer_cond, &writer_mutex, NULL);
+      continue;
+    }
+    writer_has_work = 0;
+    tor_mutex_release(&writer_mutex);
+
+    /* Anything logged while we were writing gets picked up by the next
+     * pass, as one more batch. */
+    while (logs_async_write_pending() > 0)
+      ;
+
+    tor_mutex_acquire(&writer_mutex);
+  }
+  writer_running = 0;
+  tor_cond_signal_all(&writer_cond);
+  tor_mutex_release(&writer_mutex);
+}
+
+/** Make file logging asynchronous, with a buffer of <b>bufsize</b> bytes
+ * and the full-buffer behavior <b>policy</b>, starting the writer thread if
+ * it is not already running.  Return 0 on success, -1 on failure. */
+int
+log_writer_start(size_t bufsize, log_async_policy_t policy)
+{
+  if (!writer_initialized) {
+    tor_mutex_init_nonrecursive(&writer_mutex);
+    if (tor_cond_init(&writer_cond) < 0) {
+      tor_mutex_uninit(&writer_mutex);
+      return -1;
+    }
+    writer_initialized = 1;
+  }
+
+  tor_mutex_acquire(&writer_mutex);
+  writer_should_exit = 0;
+  if (!writer_running) {
+    writer_has_work = 0;
+    writer_running = 1;
+    if (spawn_func(log_writer_main, NULL) < 0) {
+      writer_running = 0;
+      tor_mutex_release(&writer_mutex);
+      return -1;
+    }
+  }
+  tor_mutex_release(&writer_mutex);
+
+  logs_set_async(bufsize, policy, log_writer_wakeup);
+  return 0;
+}
+
+/** Make file logging synchronous again, after writing everything that was
+ * queued, and wait for the writer thread to exit. */
+void
+log_writer_stop(void)
+{
+  if (!writer_initialized)
+    return;
+
+  logs_set_sync();
+
+  tor_mutex_acquire(&writer_mutex);
+  writer_should_exit = 1;
+  tor_cond_signal_all(&writer_cond);
+  while (writer_running)
+    tor_cond_wait(&writer_cond, &writer_mutex, NULL);
+  tor_mutex_release(&writer_mutex);
+}
+
+/** Return true iff the writer thread is running. */
+int
+log_writer_is_running(void)
+{
+  int r;
+  if (!writer_initialized)
+    return 0;
+  tor_mutex_acquire(&writer_mutex);
+  r = writer_running;
+  tor_mutex_release(&writer_mutex);
+  return r;
+}
@@ -0,0 +1,18 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file log_writer.h
+ * @brief Header for log_writer.c
+ **/
+
+#ifndef TOR_LOG_WRITER_H
+#define TOR_LOG_WRITER_H
+
+#include "lib/log/log.h"
+
+int log_writer_start(size_t bufsize, log_async_policy_t policy);
+void log_writer_stop(void);
+int log_writer_is_running(void);
+
+#endif /* !defined(TOR_LOG_WRITER_H) */
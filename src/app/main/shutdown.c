@@ -14,6 +14,7 @@
 
 #include "app/config/config.h"
 #include "app/config/statefile.h"
+#include "app/main/log_writer.h"
 #include "app/main/main.h"
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
@@ -45,6 +46,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/torcert.h"
 #include "feature/relay/ext_orport.h"
 #include "feature/relay/relay_config.h"
 #include "feature/stats/bwhist.h"
@@ -135,6 +137,7 @@ tor_free_all(int postfork)
   scheduler_free_all();
   nodelist_free_all();
   microdesc_free_all();
+  or_handshake_certs_cache_free_all();
   routerparse_free_all();
   control_free_all();
   bridges_free_all();
@@ -161,6 +164,8 @@ tor_free_all(int postfork)
 
   if (!postfork) {
     release_lockfile();
+    /* Write out any queued log messages before the logs go away. */
+    log_writer_stop();
   }
 
   subsystems_shutdown();
@@ -105,6 +105,7 @@
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/dns.h"
 #include "feature/relay/ext_orport.h"
+#include "feature/relay/relay_metrics.h"
 #include "feature/relay/routermode.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/connstats.h"
@@ -4512,11 +4513,17 @@ connection_handle_write_impl(connection_t *conn, int force)
 
     /* else open, or closing */
     initial_size = buf_datalen(conn->outbuf);
+    const uint32_t outbuf_age =
+      buf_get_oldest_chunk_timestamp(conn->outbuf,
+                                     monotime_coarse_get_stamp());
     result = buf_flush_to_tls(conn->outbuf, or_conn->tls,
                               max_to_write);
 
     if (result >= 0)
       update_send_buffer_size(conn->s);
+    /* Note how long the oldest data we just handed to the kernel waited. */
+    if (result > 0 && initial_size > 0)
+      relay_metrics_note_latency(RELAY_LATENCY_OUTBUF, outbuf_age);
 
     /* If we just flushed the last bytes, tell the channel on the
      * or_conn to check if it needs to geoip_change_dirreq_state() */
@@ -4840,6 +4847,35 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
   connection_write_to_buf_commit(conn);
 }
 
+/**
+ * Add the <b>len</b> bytes at <b>string</b> to <b>conn</b>'s outbuf without
+ * copying them, and ask it to start writing.  The bytes must stay unchanged
+ * until <b>release_fn</b>(<b>release_arg</b>) is called, which happens once
+ * the outbuf is done with them -- or right away, if we can't queue them.
+ */
+void
+connection_buf_add_external(const char *string, size_t len,
+                            connection_t *conn,
+                            void (*release_fn)(void *), void *release_arg)
+{
+  int r;
+  tor_assert(conn);
+
+  if (!connection_may_write_to_buf(conn)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  CONN_LOG_PROTECT(conn, r = buf_add_external(conn->outbuf, string, len,
+                                              release_fn, release_arg));
+  if (r < 0) {
+    release_fn(release_arg);
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn);
+}
+
 #define CONN_GET_ALL_TEMPLATE(var, test) \
   STMT_BEGIN \
     smartlist_t *conns = get_connection_array();   \
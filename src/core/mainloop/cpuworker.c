@@ -152,8 +152,8 @@ cpuworker_free_all(void)
 }
 
 /** Return the number of threads configured for our CPU worker. */
-unsigned int
-cpuworker_get_n_threads(void)
+MOCK_IMPL(unsigned int,
+cpuworker_get_n_threads,(void))
 {
   if (!threadpool) {
     return 0;
@@ -37,7 +37,7 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
-unsigned int cpuworker_get_n_threads(void);
+MOCK_DECL(unsigned int, cpuworker_get_n_threads, (void));
 
 #endif /* !defined(TOR_CPUWORKER_H) */
 
@@ -947,6 +947,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_clear_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -1018,6 +1020,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_clear_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -409,6 +409,15 @@ struct channel_t {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** This channel's circuit ID entries, in an open-addressed table indexed
+   * by circuit ID, so that looking up the circuit for an incoming cell only
+   * touches memory that belongs to this channel.  See circuitlist.c. */
+  struct chan_circid_slot_t *circid_slots;
+  /** Number of slots in circid_slots: zero or a power of two. */
+  unsigned int circid_slots_cap;
+  /** Number of used slots in circid_slots. */
+  unsigned int circid_slots_len;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -48,6 +48,7 @@
 #include "app/config/config.h"
 #include "app/config/resolve_addr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/connection_or.h"
 #include "feature/relay/relay_handshake.h"
 #include "feature/control/control.h"
@@ -77,6 +78,7 @@
 #include "core/or/var_cell_st.h"
 #include "feature/relay/relay_find_addr.h"
 
+#include "lib/evloop/workqueue.h"
 #include "lib/tls/tortls.h"
 #include "lib/tls/x509.h"
 
@@ -145,6 +147,12 @@ static int enter_v3_handshake_with_cell(var_cell_t *cell,
                                         channel_tls_t *tlschan);
 static void channel_tls_process_padding_negotiate_cell(cell_t *cell,
                                                        channel_tls_t *chan);
+static void channel_tls_finish_certs_cell(
+                              channel_tls_t *chan,
+                              const ed25519_public_key_t *checked_ed_id,
+                              const common_digests_t *checked_rsa_id);
+static void channel_tls_finish_authenticate_cell(channel_tls_t *chan,
+                                                 int authtype);
 
 /**
  * Do parts of channel_tls_t initialization common to channel_tls_connect()
@@ -2001,6 +2009,217 @@ certs_cell_typenum_to_cert_type(int typenum)
   }
 }
 
+/** Largest number of CERTS and AUTHENTICATE cells that we'll have waiting
+ * for a worker thread at once.  Past this, we check them right away. */
+#define MAX_QUEUED_LINK_AUTH_CHECKS 1024
+
+/** Number of CERTS and AUTHENTICATE cells that are waiting for a worker
+ * thread. */
+static int n_queued_link_auth_checks = 0;
+
+/**
+ * The expensive part of processing a CERTS or AUTHENTICATE cell, to be done
+ * on a worker thread.
+ */
+typedef struct link_auth_job_t {
+  /** The global identifier of the connection that got the cell. */
+  uint64_t conn_id;
+  /** CELL_CERTS or CELL_AUTHENTICATE. */
+  uint8_t command;
+
+  /* For CELL_CERTS: */
+  /** The certificates from the cell.  The job owns these while it is with
+   * a worker thread, and gives them back to the connection afterwards. */
+  or_handshake_certs_t *certs;
+  /** Log severity for problems with the certificates. */
+  int severity;
+  /** The time at which to check the certificates. */
+  time_t now;
+  /** The identities that the certificates proved, if any.  These point
+   * into <b>certs</b>. */
+  const ed25519_public_key_t *checked_ed_id;
+  const common_digests_t *checked_rsa_id;
+
+  /* For CELL_AUTHENTICATE: */
+  /** The authentication type of the cell. */
+  int authtype;
+  /** The signed part of the cell body. */
+  uint8_t *signed_body;
+  size_t signed_len;
+  /** The signature on <b>signed_body</b>, and the key that should have made
+   * it. */
+  ed25519_signature_t sig;
+  ed25519_public_key_t authkey;
+  /** True iff the signature was good. */
+  bool sig_ok;
+} link_auth_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+link_auth_job_free(link_auth_job_t *job)
+{
+  if (!job)
+    return;
+  or_handshake_certs_free(job->certs);
+  tor_free(job->signed_body);
+  tor_free(job);
+}
+
+/** Worker thread function: check the certificates or signature in a
+ * link_auth_job_t. */
+static workqueue_reply_t
+link_auth_job_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  link_auth_job_t *job = work_;
+
+  if (job->command == CELL_CERTS) {
+    or_handshake_certs_check_both(job->severity, job->certs, NULL, job->now,
+                                  &job->checked_ed_id, &job->checked_rsa_id);
+  } else {
+    job->sig_ok = ed25519_checksig(&job->sig, job->signed_body,
+                                   job->signed_len, &job->authkey) == 0;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: called in the main thread once a worker has finished a
+ * link_auth_job_t.  Finish processing the cell if its connection is still
+ * open, then go on to any cells that arrived in the meantime. */
+static void
+link_auth_job_replyfn(void *work_)
+{
+  link_auth_job_t *job = work_;
+  connection_t *conn;
+  or_connection_t *orconn;
+  channel_tls_t *chan;
+
+  --n_queued_link_auth_checks;
+
+  conn = connection_get_by_global_id(job->conn_id);
+  if (!conn || conn->type != CONN_TYPE_OR || conn->marked_for_close)
+    goto done;
+  orconn = TO_OR_CONN(conn);
+  chan = orconn->chan;
+  if (!chan || !orconn->handshake_state ||
+      BUG(!orconn->handshake_state->link_auth_pending))
+    goto done;
+  orconn->handshake_state->link_auth_pending = 0;
+
+  if (job->command == CELL_CERTS) {
+    /* Put the certificates back where the rest of the handshake expects
+     * them. */
+    or_handshake_certs_free(orconn->handshake_state->certs);
+    orconn->handshake_state->certs = job->certs;
+    job->certs = NULL;
+    channel_tls_finish_certs_cell(chan, job->checked_ed_id,
+                                  job->checked_rsa_id);
+  } else if (!job->sig_ok) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a bad AUTHENTICATE cell on %s: %s",
+           connection_describe(conn),
+           "Ed25519 signature wasn't valid.");
+    connection_or_close_for_error(orconn, 0);
+  } else {
+    channel_tls_finish_authenticate_cell(chan, job->authtype);
+  }
+
+  if (!conn->marked_for_close)
+    connection_or_process_inbuf(orconn);
+
+ done:
+  link_auth_job_free(job);
+}
+
+/** Try to hand <b>job</b>, for the connection on <b>chan</b>, to a worker
+ * thread.  Return 0 on success, and -1 if we should do the work right away
+ * instead. */
+static int
+link_auth_job_queue(channel_tls_t *chan, link_auth_job_t *job)
+{
+  if (cpuworker_get_n_threads() == 0)
+    return -1;
+  if (n_queued_link_auth_checks >= MAX_QUEUED_LINK_AUTH_CHECKS) {
+    log_info(LD_OR, "Too many link handshake checks queued; handling the "
+             "one from %s right away.",
+             connection_describe(TO_CONN(chan->conn)));
+    return -1;
+  }
+
+  job->conn_id = TO_CONN(chan->conn)->global_identifier;
+  if (!cpuworker_queue_work(WQ_PRI_HIGH, link_auth_job_threadfn,
+                            link_auth_job_replyfn, job)) {
+    log_warn(LD_BUG, "Couldn't queue link handshake check on a worker "
+             "thread.");
+    return -1;
+  }
+  ++n_queued_link_auth_checks;
+  chan->conn->handshake_state->link_auth_pending = 1;
+  return 0;
+}
+
+/** Try to check the certificates from the CERTS cell that we just got on
+ * <b>chan</b> on a worker thread, warning at <b>severity</b> if they are
+ * bad.  Return 0 if we queued the check: in that case we'll call
+ * channel_tls_finish_certs_cell() later, if the connection is still open.
+ * Return -1 if the caller should check them right away. */
+static int
+channel_tls_queue_certs_check(channel_tls_t *chan, int severity)
+{
+  or_handshake_state_t *hs = chan->conn->handshake_state;
+  link_auth_job_t *job = tor_malloc_zero(sizeof(*job));
+
+  job->command = CELL_CERTS;
+  job->severity = severity;
+  job->now = time(NULL);
+  job->certs = hs->certs;
+  /* The worker can't look at our TLS object, so fetch the peer certificate
+   * for it now. */
+  if (job->certs->started_here && !job->certs->tls_peer_cert)
+    job->certs->tls_peer_cert = tor_tls_get_peer_cert(chan->conn->tls);
+  hs->certs = or_handshake_certs_new();
+  hs->certs->started_here = job->certs->started_here;
+
+  if (link_auth_job_queue(chan, job) < 0) {
+    or_handshake_certs_free(hs->certs);
+    hs->certs = job->certs;
+    job->certs = NULL;
+    link_auth_job_free(job);
+    return -1;
+  }
+  return 0;
+}
+
+/** Try to check the Ed25519 signature <b>sig</b> on the <b>signed_len</b>
+ * bytes at <b>signed_body</b>, from an AUTHENTICATE cell of type
+ * <b>authtype</b> on <b>chan</b>, on a worker thread.  Return 0 if we queued
+ * the check: in that case we'll call channel_tls_finish_authenticate_cell()
+ * later, if the signature is good and the connection is still open.  Return
+ * -1 if the caller should check it right away. */
+static int
+channel_tls_queue_authenticate_check(channel_tls_t *chan,
+                                     const ed25519_signature_t *sig,
+                                     const uint8_t *signed_body,
+                                     size_t signed_len,
+                                     const ed25519_public_key_t *authkey,
+                                     int authtype)
+{
+  link_auth_job_t *job = tor_malloc_zero(sizeof(*job));
+
+  job->command = CELL_AUTHENTICATE;
+  job->authtype = authtype;
+  job->signed_body = tor_memdup(signed_body, signed_len);
+  job->signed_len = signed_len;
+  memcpy(&job->sig, sig, sizeof(job->sig));
+  memcpy(&job->authkey, authkey, sizeof(job->authkey));
+
+  if (link_auth_job_queue(chan, job) < 0) {
+    link_auth_job_free(job);
+    return -1;
+  }
+  return 0;
+}
+
 /**
  * Process a CERTS cell from a channel.
  *
@@ -2030,7 +2249,7 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
   int n_certs, i;
   certs_cell_t *cc = NULL;
 
-  int send_netinfo = 0, started_here = 0;
+  int started_here = 0;
 
   memset(x509_certs, 0, sizeof(x509_certs));
   memset(ed_certs, 0, sizeof(ed_certs));
@@ -2170,14 +2389,60 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
   else
     severity = LOG_PROTOCOL_WARN;
 
-  const ed25519_public_key_t *checked_ed_id = NULL;
-  const common_digests_t *checked_rsa_id = NULL;
-  or_handshake_certs_check_both(severity,
-                                chan->conn->handshake_state->certs,
-                                chan->conn->tls,
-                                time(NULL),
-                                &checked_ed_id,
-                                &checked_rsa_id);
+  /* Checking the signatures is the expensive part: hand it to a worker
+   * thread if we can, and pick up in channel_tls_finish_certs_cell(). */
+  if (! (chan->conn->handshake_state->certs->ed_id_sign &&
+         channel_tls_queue_certs_check(chan, severity) == 0)) {
+    const ed25519_public_key_t *checked_ed_id = NULL;
+    const common_digests_t *checked_rsa_id = NULL;
+    or_handshake_certs_check_both(severity,
+                                  chan->conn->handshake_state->certs,
+                                  chan->conn->tls,
+                                  time(NULL),
+                                  &checked_ed_id,
+                                  &checked_rsa_id);
+    channel_tls_finish_certs_cell(chan, checked_ed_id, checked_rsa_id);
+  }
+
+ err:
+  for (unsigned u = 0; u < ARRAY_LENGTH(x509_certs); ++u) {
+    tor_x509_cert_free(x509_certs[u]);
+  }
+  for (unsigned u = 0; u < ARRAY_LENGTH(ed_certs); ++u) {
+    tor_cert_free(ed_certs[u]);
+  }
+  tor_free(rsa_ed_cc_cert);
+  certs_cell_free(cc);
+#undef ERR
+}
+
+/**
+ * Finish processing a CERTS cell on <b>chan</b>, once we have checked the
+ * certificates in its handshake state: <b>checked_ed_id</b> and
+ * <b>checked_rsa_id</b> are the identities that they proved, or NULL.
+ *
+ * If this is the client side of the connection, authenticate the server or
+ * mark the connection.  If it's the server side, wait for an AUTHENTICATE
+ * cell.
+ */
+static void
+channel_tls_finish_certs_cell(channel_tls_t *chan,
+                              const ed25519_public_key_t *checked_ed_id,
+                              const common_digests_t *checked_rsa_id)
+{
+  const int started_here = chan->conn->handshake_state->started_here;
+  tor_x509_cert_t *id_cert = chan->conn->handshake_state->certs->id_cert;
+  int send_netinfo = 0;
+
+#define ERR(s)                                                  \
+  do {                                                          \
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,                      \
+           "Received a bad CERTS cell on %s: %s",               \
+           connection_describe(TO_CONN(chan->conn)),            \
+           (s));                                                \
+    connection_or_close_for_error(chan->conn, 0);               \
+    return;                                                     \
+  } while (0)
 
   if (!checked_rsa_id)
     ERR("Invalid certificate chain!");
@@ -2246,19 +2511,8 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
     if (connection_or_send_netinfo(chan->conn) < 0) {
       log_warn(LD_OR, "Couldn't send netinfo cell");
       connection_or_close_for_error(chan->conn, 0);
-      goto err;
     }
   }
-
- err:
-  for (unsigned u = 0; u < ARRAY_LENGTH(x509_certs); ++u) {
-    tor_x509_cert_free(x509_certs[u]);
-  }
-  for (unsigned u = 0; u < ARRAY_LENGTH(ed_certs); ++u) {
-    tor_cert_free(ed_certs[u]);
-  }
-  tor_free(rsa_ed_cc_cert);
-  certs_cell_free(cc);
 #undef ERR
 }
 
@@ -2473,11 +2727,32 @@ channel_tls_process_authenticate_cell(var_cell_t *cell, channel_tls_t *chan)
     ed25519_signature_t sig;
     tor_assert(authlen > ED25519_SIG_LEN);
     memcpy(&sig.sig, auth + authlen - ED25519_SIG_LEN, ED25519_SIG_LEN);
+    /* As with CERTS cells, check the signature on a worker thread if we
+     * can, and pick up in channel_tls_finish_authenticate_cell(). */
+    if (channel_tls_queue_authenticate_check(chan, &sig, auth,
+                                             authlen - ED25519_SIG_LEN,
+                                             authkey, authtype) == 0) {
+      var_cell_free(expected_cell);
+      return;
+    }
     if (ed25519_checksig(&sig, auth, authlen - ED25519_SIG_LEN, authkey)<0) {
       ERR("Ed25519 signature wasn't valid.");
     }
   }
 
+  var_cell_free(expected_cell);
+  channel_tls_finish_authenticate_cell(chan, authtype);
+#undef ERR
+}
+
+/**
+ * Finish processing an AUTHENTICATE cell of type <b>authtype</b> on
+ * <b>chan</b>, once we have checked its signature: mark the connection as
+ * authenticated.
+ */
+static void
+channel_tls_finish_authenticate_cell(channel_tls_t *chan, int authtype)
+{
   /* Okay, we are authenticated. */
   chan->conn->handshake_state->received_authenticate = 1;
   chan->conn->handshake_state->authenticated = 1;
@@ -2527,8 +2802,4 @@ channel_tls_process_authenticate_cell(var_cell_t *cell, channel_tls_t *chan)
               connection_describe(TO_CONN(chan->conn)),
               authtype);
   }
-
-  var_cell_free(expected_cell);
-
-#undef ERR
 }
@@ -15,6 +15,7 @@
 #include "core/or/or.h"
 
 #include "lib/container/handles.h"
+#include "lib/container/ringbuf.h"
 
 #include "core/or/cell_queue_st.h"
 #include "ext/ht.h"
@@ -137,18 +138,19 @@ struct circuit_t {
    * 1000/100 = 10 outstanding SENDME cells worth of data. Meaning that this
    * list can not contain more than 10 digests of DIGEST_LEN bytes (20).
    *
-   * At position i in the list, the digest corresponds to the
+   * At position i in the queue, the digest corresponds to the
    * (CIRCWINDOW_INCREMENT * i)-nth cell received since we expect a SENDME to
    * be received containing that cell digest.
    *
    * For example, position 2 (starting at 0) means that we've received 300
    * cells so the 300th cell digest is kept at index 2.
    *
-   * At maximum, this list contains 200 bytes plus the smartlist overhead. */
-  smartlist_t *sendme_last_digests;
-
-  /** Temporary field used during circuits_handle_oom. */
-  uint32_t age_tmp;
+   * With congestion control, there can be up to one digest per sendme_inc
+   * cells of the congestion window instead.
+   *
+   * The digests are stored by value, DIGEST_LEN bytes each. The queue is
+   * set up when we record the first digest. */
+  ringbuf_t sendme_last_digests;
 
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
@@ -462,6 +462,7 @@ origin_circuit_init(uint8_t purpose, int flags)
   circ->build_state->need_conflux =
     ((flags & CIRCLAUNCH_NEED_CONFLUX) ? 1 : 0);
   circ->base_.purpose = purpose;
+  circuit_origin_index_update(circ);
   return circ;
 }
 
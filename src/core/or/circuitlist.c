@@ -104,14 +104,13 @@
 #include "lib/compress/compress_zlib.h"
 #include "lib/compress/compress_zstd.h"
 #include "lib/buf/buffers.h"
+#include "lib/evloop/compat_libevent.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_st.h"
 #include "lib/math/stats.h"
 
 #include "core/or/ocirc_event.h"
 
-#include "ht.h"
-
 #include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_reference_st.h"
 #include "feature/dircommon/dir_connection_st.h"
@@ -142,6 +141,24 @@ static smartlist_t *circuits_pending_other_guards = NULL;
  * circuit_mark_for_close and which are waiting for circuit_about_to_free. */
 static smartlist_t *circuits_pending_close = NULL;
 
+/** Event to call circuits_handle_oom() again, when a call stopped after
+ * OOM_MAX_VICTIMS_PER_PASS victims without recovering enough memory. */
+static mainloop_event_t *oom_continue_ev = NULL;
+
+/** Number of buckets in the origin circuit index: one for each combination
+ * of purpose, whether the circuit is open, whether it is internal, and
+ * whether it has isolation values set. */
+#define ORIGIN_INDEX_N_BUCKETS ((CIRCUIT_PURPOSE_MAX_ + 1) * 8)
+
+/** The origin circuit index: every origin circuit that has a build state, in
+ * the bucket for its purpose, state, internal-ness, and isolation. Lists are
+ * created on demand, and unordered. */
+static smartlist_t *origin_index_buckets[ORIGIN_INDEX_N_BUCKETS];
+
+/** Map from isolation key to a smartlist of the origin circuits with that
+ * key. See origin_circuit_get_isolation_key(). */
+static digestmap_t *origin_index_by_isolation = NULL;
+
 static void circuit_about_to_free_atexit(circuit_t *circ);
 static void circuit_about_to_free(circuit_t *circ);
 
@@ -194,10 +211,11 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+/** An entry in the circuit ID table of a channel: the circuit that uses a
+ * given circuit ID on that channel, or a placeholder that keeps the ID from
+ * being reused.  (Lookup performance is very important here, since we need
+ * to do it every time a cell arrives.) */
 typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
   channel_t *chan;
   circid_t circ_id;
   circuit_t *circuit;
@@ -205,47 +223,169 @@ typedef struct chan_circid_circuit_map_t {
   time_t made_placeholder_at;
 } chan_circid_circuit_map_t;
 
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
-static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
-{
-  return a->chan == b->chan && a->circ_id == b->circ_id;
-}
-
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
-{
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_);
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_);
-
 /** The most recently returned entry from circuit_get_by_circid_chan;
  * used to improve performance when many cells arrive in a row from the
  * same circuit.
  */
 static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
 
+/** One slot in a channel's table of its circuit ID entries.
+ *
+ * Each entry lives only in the table of its channel, which owns it: nothing
+ * needs to look up circuit IDs across channels, so there is no global map
+ * to keep in step with the tables. */
+typedef struct chan_circid_slot_t {
+  /** The map entry in this slot, or NULL if the slot is empty. */
+  chan_circid_circuit_map_t *ent;
+  /** Copy of ent-\>circ_id, so that probing for an ID only touches the
+   * entry that matches. */
+  circid_t circ_id;
+} chan_circid_slot_t;
+
+/** Smallest number of slots that we allocate for a channel's table. */
+#define CHAN_CIRCID_SLOTS_MIN 8
+
+/** Secret odd multiplier that we hash circuit IDs with.  The other side of
+ * a channel picks many of the circuit IDs on it, so we don't want it to
+ * know which IDs collide. */
+static uint64_t chan_circid_slot_key = 0;
+
+/** Return the slot where we start looking for circuit ID <b>id</b> in a
+ * table of <b>cap</b> slots. */
+static inline unsigned int
+chan_circid_slot_home(circid_t id, unsigned int cap)
+{
+  return (unsigned int) (((uint64_t) id * chan_circid_slot_key) >> 32) &
+    (cap - 1);
+}
+
+/** Return the slot for circuit ID <b>id</b> in the table of <b>chan</b>, or
+ * NULL if there is none. */
+static inline chan_circid_slot_t *
+chan_circid_slot_find(channel_t *chan, circid_t id)
+{
+  chan_circid_slot_t *slots;
+  unsigned int mask, i;
+
+  if (!chan->circid_slots_cap)
+    return NULL;
+
+  slots = chan->circid_slots;
+  mask = chan->circid_slots_cap - 1;
+  for (i = chan_circid_slot_home(id, chan->circid_slots_cap);
+       slots[i].ent;
+       i = (i + 1) & mask) {
+    if (slots[i].circ_id == id)
+      return &slots[i];
+  }
+  return NULL;
+}
+
+/** Return the first empty slot for circuit ID <b>id</b> in <b>slots</b>, a
+ * table of <b>cap</b> slots that has at least one empty slot. */
+static chan_circid_slot_t *
+chan_circid_slot_find_empty(chan_circid_slot_t *slots, unsigned int cap,
+                            circid_t id)
+{
+  unsigned int i;
+  for (i = chan_circid_slot_home(id, cap);
+       slots[i].ent;
+       i = (i + 1) & (cap - 1))
+    ;
+  return &slots[i];
+}
+
+/** Make the table of <b>chan</b> twice as big, or give it one. */
+static void
+chan_circid_slots_grow(channel_t *chan)
+{
+  const unsigned int old_cap = chan->circid_slots_cap;
+  const unsigned int new_cap = old_cap ? old_cap * 2 : CHAN_CIRCID_SLOTS_MIN;
+  chan_circid_slot_t *new_slots;
+
+  if (!chan_circid_slot_key) {
+    crypto_rand((char *) &chan_circid_slot_key, sizeof(chan_circid_slot_key));
+    chan_circid_slot_key |= 1;
+  }
+
+  new_slots = tor_calloc(new_cap, sizeof(chan_circid_slot_t));
+  for (unsigned int i = 0; i < old_cap; ++i) {
+    const chan_circid_slot_t *slot = &chan->circid_slots[i];
+    if (slot->ent)
+      *chan_circid_slot_find_empty(new_slots, new_cap, slot->circ_id) = *slot;
+  }
+  tor_free(chan->circid_slots);
+  chan->circid_slots = new_slots;
+  chan->circid_slots_cap = new_cap;
+}
+
+/** Add <b>ent</b> to the table of its channel, or update its slot there if
+ * it already has one. */
+static void
+chan_circid_slot_set(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan = ent->chan;
+  chan_circid_slot_t *slot = chan_circid_slot_find(chan, ent->circ_id);
+
+  if (!slot) {
+    /* Keep the table at most half full, so that probes stay short. */
+    if ((chan->circid_slots_len + 1) * 2 > chan->circid_slots_cap)
+      chan_circid_slots_grow(chan);
+    slot = chan_circid_slot_find_empty(chan->circid_slots,
+                                       chan->circid_slots_cap, ent->circ_id);
+    ++chan->circid_slots_len;
+  }
+  slot->ent = ent;
+  slot->circ_id = ent->circ_id;
+}
+
+/** Empty <b>slot</b>, a used slot in the table of <b>chan</b>.  The caller
+ * keeps the entry that was in it. */
+static void
+chan_circid_slot_remove(channel_t *chan, chan_circid_slot_t *slot)
+{
+  chan_circid_slot_t *slots;
+  unsigned int mask, hole, i;
+
+  slots = chan->circid_slots;
+  mask = chan->circid_slots_cap - 1;
+  hole = (unsigned int) (slot - slots);
+  memset(slot, 0, sizeof(*slot));
+  --chan->circid_slots_len;
+
+  /* Shift back any later entries in this run that could live in the hole,
+   * so that lookups never stop early at it. */
+  for (i = (hole + 1) & mask; slots[i].ent; i = (i + 1) & mask) {
+    const unsigned int home =
+      chan_circid_slot_home(slots[i].circ_id, chan->circid_slots_cap);
+    /* Leave the entry alone if its home is cyclically in (hole, i]. */
+    if (hole <= i ? (hole < home && home <= i)
+                  : (hole < home || home <= i))
+      continue;
+    slots[hole] = slots[i];
+    memset(&slots[i], 0, sizeof(slots[i]));
+    hole = i;
+  }
+}
+
+/** Forget every circuit ID entry for <b>chan</b>, which is about to be
+ * freed.  (A circuit that still names <b>chan</b> will find no entry to
+ * remove when it lets go of the ID, which is fine.) */
+void
+channel_clear_circid_map(channel_t *chan)
+{
+  for (unsigned int i = 0; i < chan->circid_slots_cap; ++i) {
+    chan_circid_circuit_map_t *ent = chan->circid_slots[i].ent;
+    if (!ent)
+      continue;
+    if (_last_circid_chan_ent == ent)
+      _last_circid_chan_ent = NULL;
+    tor_free(ent);
+  }
+  tor_free(chan->circid_slots);
+  chan->circid_slots_cap = chan->circid_slots_len = 0;
+}
+
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
  * to <b>chan, id</b>.  Adjust the chan,circid map as appropriate, removing
@@ -255,8 +395,8 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
+  chan_circid_slot_t *slot;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -299,10 +439,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-    if (found) {
+    slot = chan_circid_slot_find(old_chan, old_id);
+    if (slot) {
+      found = slot->ent;
+      chan_circid_slot_remove(old_chan, slot);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -323,10 +463,9 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
+  slot = chan_circid_slot_find(chan, id);
+  if (slot) {
+    found = slot->ent;
     found->circuit = circ;
     found->made_placeholder_at = 0;
   } else {
@@ -334,8 +473,8 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circ_id = id;
     found->chan = chan;
     found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
   }
+  chan_circid_slot_set(found);
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -371,14 +510,12 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
+  chan_circid_slot_t *slot;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  slot = chan_circid_slot_find(chan, id);
+  ent = slot ? slot->ent : NULL;
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -394,7 +531,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     ent->circ_id = id;
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_slot_set(ent);
   }
 }
 
@@ -404,14 +541,15 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_slot_t *slot;
+  chan_circid_circuit_map_t *ent = NULL;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  slot = chan_circid_slot_find(chan, id);
+  if (slot) {
+    ent = slot->ent;
+    chan_circid_slot_remove(chan, slot);
+  }
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
@@ -587,8 +725,10 @@ circuit_set_state(circuit_t *circ, uint8_t state)
 
   tor_trace(TR_SUBSYS(circuit), TR_EV(change_state), circ, circ->state, state);
   circ->state = state;
-  if (CIRCUIT_IS_ORIGIN(circ))
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    circuit_origin_index_update(TO_ORIGIN_CIRCUIT(circ));
     circuit_state_publish(circ);
+  }
 }
 
 /** Append to <b>out</b> all circuits in state CHAN_WAIT waiting for
@@ -661,6 +801,7 @@ circuit_remove_from_origin_circuit_list(origin_circuit_t *origin_circ)
     replacement->global_origin_circuit_list_idx = origin_idx;
   }
   origin_circ->global_origin_circuit_list_idx = -1;
+  circuit_origin_index_update(origin_circ);
 }
 
 /** Add <b>origin_circ</b> to the global list of origin circuits. Called
@@ -726,6 +867,124 @@ circuit_get_global_origin_circuit_list(void)
   return global_origin_circuit_list;
 }
 
+/** Return the origin circuit index bucket for circuits with the given
+ * <b>purpose</b>, and with the given state, internal-ness and isolation. */
+static inline int
+origin_index_bucket(uint8_t purpose, bool is_open, bool is_internal,
+                    bool is_isolated)
+{
+  tor_assert(purpose <= CIRCUIT_PURPOSE_MAX_);
+  return (((purpose * 2) + is_open) * 2 + is_internal) * 2 + is_isolated;
+}
+
+/** Remove the element at <b>idx</b> from <b>sl</b>, a list of origin
+ * circuits whose positions are kept in the int at <b>idx_offset</b> in each
+ * circuit, and fix the position of the element that takes its place. */
+static void
+origin_index_list_del(smartlist_t *sl, int idx, size_t idx_offset)
+{
+  smartlist_del(sl, idx);
+  if (idx < smartlist_len(sl)) {
+    char *replacement = smartlist_get(sl, idx);
+    *(int *)(replacement + idx_offset) = idx;
+  }
+}
+
+/**
+ * Make sure that <b>circ</b> is listed in the right places in the origin
+ * circuit index, and only there.
+ *
+ * Call this whenever anything that the index depends on changes: the
+ * circuit's purpose, state or isolation values, or its membership in the
+ * global origin circuit list.
+ */
+void
+circuit_origin_index_update(origin_circuit_t *circ)
+{
+  const circuit_t *c = TO_CIRCUIT(circ);
+  int bucket = -1;
+  bool has_key = false;
+  uint8_t key[DIGEST_LEN];
+
+  if (circ->global_origin_circuit_list_idx >= 0 && circ->build_state &&
+      c->purpose <= CIRCUIT_PURPOSE_MAX_) {
+    bucket = origin_index_bucket(c->purpose,
+                                 c->state == CIRCUIT_STATE_OPEN,
+                                 circ->build_state->is_internal,
+                                 circ->isolation_values_set);
+    has_key = origin_circuit_get_isolation_key(circ, key) == 0;
+  }
+
+  if (bucket != circ->origin_index_bucket) {
+    if (circ->origin_index_bucket >= 0) {
+      smartlist_t *sl = origin_index_buckets[circ->origin_index_bucket];
+      tor_assert(smartlist_get(sl, circ->origin_index_bucket_idx) == circ);
+      origin_index_list_del(sl, circ->origin_index_bucket_idx,
+                       offsetof(origin_circuit_t, origin_index_bucket_idx));
+    }
+    if (bucket >= 0) {
+      if (!origin_index_buckets[bucket])
+        origin_index_buckets[bucket] = smartlist_new();
+      smartlist_add(origin_index_buckets[bucket], circ);
+      circ->origin_index_bucket_idx =
+        smartlist_len(origin_index_buckets[bucket]) - 1;
+    }
+    circ->origin_index_bucket = bucket;
+  }
+
+  if (has_key != circ->origin_index_has_isolation_key ||
+      (has_key && tor_memneq(key, circ->origin_index_isolation_key,
+                             DIGEST_LEN))) {
+    smartlist_t *sl;
+    if (circ->origin_index_has_isolation_key) {
+      sl = digestmap_get(origin_index_by_isolation,
+                         (const char *) circ->origin_index_isolation_key);
+      tor_assert(smartlist_get(sl, circ->origin_index_isolation_idx) == circ);
+      origin_index_list_del(sl, circ->origin_index_isolation_idx,
+                    offsetof(origin_circuit_t, origin_index_isolation_idx));
+      if (smartlist_len(sl) == 0) {
+        digestmap_remove(origin_index_by_isolation,
+                         (const char *) circ->origin_index_isolation_key);
+        smartlist_free(sl);
+      }
+    }
+    if (has_key) {
+      if (!origin_index_by_isolation)
+        origin_index_by_isolation = digestmap_new();
+      sl = digestmap_get(origin_index_by_isolation, (const char *) key);
+      if (!sl) {
+        sl = smartlist_new();
+        digestmap_set(origin_index_by_isolation, (const char *) key, sl);
+      }
+      smartlist_add(sl, circ);
+      circ->origin_index_isolation_idx = smartlist_len(sl) - 1;
+      memcpy(circ->origin_index_isolation_key, key, DIGEST_LEN);
+    }
+    circ->origin_index_has_isolation_key = has_key;
+  }
+}
+
+/** Return the origin circuits with purpose <b>purpose</b> and with the given
+ * state, internal-ness and isolation, or NULL if there are none. The
+ * list is in no particular order. */
+const smartlist_t *
+circuit_origin_index_get_bucket(uint8_t purpose, bool is_open,
+                                bool is_internal, bool is_isolated)
+{
+  return origin_index_buckets[origin_index_bucket(purpose, is_open,
+                                                  is_internal, is_isolated)];
+}
+
+/** Return the origin circuits whose isolation key is <b>key</b>, or NULL if
+ * there are none. The list is in no particular order. */
+const smartlist_t *
+circuit_origin_index_get_by_isolation(const uint8_t *key)
+{
+  if (!origin_index_by_isolation)
+    return NULL;
+  return digestmap_get(origin_index_by_isolation, (const char *) key);
+}
+
 /**
  * Return true if we have any opened general-purpose 3 hop
  * origin circuits.
@@ -1066,6 +1325,7 @@ origin_circuit_new(void)
 
   /* Add to origin-list. */
   circ->global_origin_circuit_list_idx = -1;
+  circ->origin_index_bucket = -1;
   circuit_add_to_origin_circuit_list(circ);
 
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
@@ -1273,10 +1533,7 @@ circuit_free_(circuit_t *circ)
   cell_queue_clear(&circ->n_chan_cells);
 
   /* Cleanup possible SENDME state. */
-  if (circ->sendme_last_digests) {
-    SMARTLIST_FOREACH(circ->sendme_last_digests, uint8_t *, d, tor_free(d));
-    smartlist_free(circ->sendme_last_digests);
-  }
+  ringbuf_clear(&circ->sendme_last_digests);
 
   log_info(LD_CIRC, "Circuit %u (id: %" PRIu32 ") has been freed.",
            n_circ_id,
@@ -1366,22 +1623,20 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_close);
   circuits_pending_close = NULL;
 
+  mainloop_event_free(oom_continue_ev);
+
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
+  for (int i = 0; i < ORIGIN_INDEX_N_BUCKETS; ++i)
+    smartlist_free(origin_index_buckets[i]);
+  digestmap_free(origin_index_by_isolation, NULL);
+  origin_index_by_isolation = NULL;
 
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
+  /* Freeing the circuits took their circuit ID entries out of their
+   * channels' tables.  Any placeholders left there belong to the channels,
+   * and channel_free_all() frees them. */
+  _last_circid_chan_ent = NULL;
 }
 
 /** A helper function for circuit_dump_by_conn() below. Log a bunch
@@ -1477,7 +1732,6 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
   if (_last_circid_chan_ent &&
@@ -1485,9 +1739,8 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
       chan == _last_circid_chan_ent->chan) {
     found = _last_circid_chan_ent;
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+    chan_circid_slot_t *slot = chan_circid_slot_find(chan, circ_id);
+    found = slot ? slot->ent : NULL;
     _last_circid_chan_ent = found;
   }
   if (found && found->circuit) {
@@ -1586,14 +1839,8 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  chan_circid_slot_t *slot = chan_circid_slot_find(chan, circ_id);
+  chan_circid_circuit_map_t *found = slot ? slot->ent : NULL;
 
   if (! found || found->circuit)
     return 0;
@@ -2596,63 +2843,214 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
     return data_age;
 }
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
+/** Return the age bucket for an item whose oldest queued data is <b>age</b>
+ * timestamp units old.  Older items get higher buckets.  Ages under 8 each
+ * get their own bucket; after that, each power of two is split into 8
+ * buckets. */
+STATIC int
+oom_age_bucket(uint32_t age)
+{
+  int msb;
+
+  if (age < 8)
+    return (int) age;
+  msb = tor_log2(age);
+  return (msb - 2) * 8 + (int) ((age >> (msb - 3)) & 7);
+}
+
+/** Helper to sort an array of oom_victim_t by age, in descending order. */
 static int
-circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
+oom_victims_compare_by_age_(const void *a_, const void *b_)
 {
-  const circuit_t *a = *a_;
-  const circuit_t *b = *b_;
-  uint32_t age_a = a->age_tmp;
-  uint32_t age_b = b->age_tmp;
+  const oom_victim_t *a = a_;
+  const oom_victim_t *b = b_;
 
-  if (age_a < age_b)
+  if (a->age < b->age)
     return 1;
-  else if (age_a == age_b)
+  else if (a->age == b->age)
     return 0;
   else
     return -1;
 }
 
-static uint32_t now_ts_for_buf_cmp;
+/** Set up <b>q</b> to hand out the <b>n</b> items in <b>victims</b>, oldest
+ * first.  Does not take ownership of <b>victims</b>. */
+STATIC void
+oom_age_queue_init(oom_age_queue_t *q, const oom_victim_t *victims, int n)
+{
+  int next[OOM_AGE_N_BUCKETS];
+  int i, b, pos = 0;
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-conns_compare_by_buffer_age_(const void **a_, const void **b_)
+  memset(q, 0, sizeof(*q));
+  memset(next, 0, sizeof(next));
+
+  for (i = 0; i < n; ++i)
+    ++next[oom_age_bucket(victims[i].age)];
+  /* Lay out the buckets from oldest to youngest. */
+  for (b = OOM_AGE_N_BUCKETS - 1; b >= 0; --b) {
+    int count = next[b];
+    next[b] = pos;
+    pos += count;
+    q->bucket_end[OOM_AGE_N_BUCKETS - 1 - b] = pos;
+  }
+
+  q->victims = tor_malloc(sizeof(oom_victim_t) * (n ? n : 1));
+  for (i = 0; i < n; ++i)
+    q->victims[next[oom_age_bucket(victims[i].age)]++] = victims[i];
+  q->n = n;
+}
+
+/** Release the storage held by <b>q</b>. */
+STATIC void
+oom_age_queue_clear(oom_age_queue_t *q)
 {
-  const connection_t *a = *a_;
-  const connection_t *b = *b_;
-  time_t age_a = conn_get_buffer_age(a, now_ts_for_buf_cmp);
-  time_t age_b = conn_get_buffer_age(b, now_ts_for_buf_cmp);
+  tor_free(q->victims);
+  memset(q, 0, sizeof(*q));
+}
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+/** Return the oldest item in <b>q</b> that we haven't yet removed with
+ * oom_age_queue_pop(), or NULL if there is none. */
+STATIC const oom_victim_t *
+oom_age_queue_peek(oom_age_queue_t *q)
+{
+  if (q->pos >= q->n)
+    return NULL;
+
+  /* Sort the buckets as we reach them. */
+  while (q->pos >= q->sorted_end) {
+    int end = q->bucket_end[q->next_bucket++];
+    if (end - q->sorted_end > 1) {
+      qsort(q->victims + q->sorted_end, end - q->sorted_end,
+            sizeof(oom_victim_t), oom_victims_compare_by_age_);
+    }
+    q->sorted_end = end;
+  }
+  return &q->victims[q->pos];
+}
+
+/** Remove and return the oldest item in <b>q</b>, or NULL if there is
+ * none. */
+STATIC const oom_victim_t *
+oom_age_queue_pop(oom_age_queue_t *q)
+{
+  const oom_victim_t *v = oom_age_queue_peek(q);
+  if (v)
+    ++q->pos;
+  return v;
+}
+
+/** Set up <b>q</b> to hand out every circuit, starting with the one with the
+ * oldest queued cell or stream data as of <b>now_ts</b>. */
+static void
+oom_age_queue_init_circuits(oom_age_queue_t *q, uint32_t now_ts)
+{
+  smartlist_t *circlist = circuit_get_global_list();
+  oom_victim_t *victims =
+    tor_malloc(sizeof(oom_victim_t) * (smartlist_len(circlist) + 1));
+  int n = 0;
+
+  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    victims[n].item = circ;
+    victims[n].age = circuit_max_queued_item_age(circ, now_ts);
+    ++n;
+  } SMARTLIST_FOREACH_END(circ);
+
+  oom_age_queue_init(q, victims, n);
+  tor_free(victims);
+}
+
+/** Set up <b>q</b> to hand out every connection that the OOM handler may
+ * kill, starting with the one with the oldest buffered data as of
+ * <b>now_ts</b>. */
+static void
+oom_age_queue_init_conns(oom_age_queue_t *q, uint32_t now_ts)
+{
+  smartlist_t *connection_array = get_connection_array();
+  oom_victim_t *victims =
+    tor_malloc(sizeof(oom_victim_t) * (smartlist_len(connection_array) + 1));
+  int n = 0;
+
+  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
+    /* Only non-linked directory connections and edge connections: we
+     * consider the latter so we don't accumulate bytes on the outbuf due to
+     * a malicious destination holding off the read on us. */
+    if ((conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) ||
+        CONN_IS_EDGE(conn)) {
+      victims[n].item = conn;
+      victims[n].age = conn_get_buffer_age(conn, now_ts);
+      ++n;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  oom_age_queue_init(q, victims, n);
+  tor_free(victims);
+}
+
+/** Mark <b>circ</b> for close because we are out of memory, and free what we
+ * can of its storage right away.  Return the number of bytes recovered. */
+static size_t
+oom_kill_circuit(circuit_t *circ)
+{
+  size_t n = n_cells_in_circ_queues(circ);
+  size_t recovered = circuit_alloc_in_half_streams(circ);
+
+  if (! circ->marked_for_close) {
+    circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+  }
+  marked_circuit_free_cells(circ);
+  recovered += marked_circuit_free_stream_bytes(circ);
+  recovered += n * packed_cell_mem_cost();
+  recovered += conflux_get_circ_bytes_allocation(circ);
+  return recovered;
+}
+
+/** Callback for oom_continue_ev. */
+static void
+oom_continue_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+  oom_stats_n_bytes_removed_cell +=
+    circuits_handle_oom(cell_queues_get_oom_allocation());
 }
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
+/** The most circuits and connections that one call to circuits_handle_oom()
+ * will kill.  If that isn't enough, we go on in the next main loop
+ * iteration, so that we don't stall everything else for too long. */
+#define OOM_MAX_VICTIMS_PER_PASS 512
+
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
  * bytes' worth.  Kill the 'worst' circuits until we're under
  * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage.
  *
+ * The worst circuits and connections are the ones whose oldest queued data
+ * is oldest.  We find them without sorting everything (see
+ * oom_age_queue_t); after OOM_MAX_VICTIMS_PER_PASS of them, we stop and
+ * schedule another call.
+ *
  * Return the number of bytes removed. */
 size_t
 circuits_handle_oom(size_t current_allocation)
 {
-  smartlist_t *circlist;
-  smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  oom_age_queue_t circ_q, conn_q;
+  const oom_victim_t *cv, *connv;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
   int n_dirconns_killed=0;
   int n_edgeconns_killed = 0;
   uint32_t now_ts;
+
+  {
+    size_t mem_target = (size_t)(get_options()->MaxMemInQueues *
+                                 FRACTION_OF_DATA_TO_RETAIN_ON_OOM);
+    if (current_allocation <= mem_target)
+      return 0;
+    mem_to_recover = current_allocation - mem_target;
+  }
+
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
              " %"TOR_PRIuSZ" buffer total alloc: %" TOR_PRIuSZ ","
              " tor compress total alloc: %" TOR_PRIuSZ
@@ -2668,95 +3066,54 @@ circuits_handle_oom(size_t current_allocation)
              tor_zstd_get_total_allocation(),
              tor_lzma_get_total_allocation(),
              hs_cache_get_total_allocation());
-  {
-    size_t mem_target = (size_t)(get_options()->MaxMemInQueues *
-                                 FRACTION_OF_DATA_TO_RETAIN_ON_OOM);
-    if (current_allocation <= mem_target)
-      return 0;
-    mem_to_recover = current_allocation - mem_target;
-  }
 
   now_ts = monotime_coarse_get_stamp();
-
-  circlist = circuit_get_global_list();
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->age_tmp = circuit_max_queued_item_age(circ, now_ts);
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* Now sort the connection array ... */
-  now_ts_for_buf_cmp = now_ts;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
-  now_ts_for_buf_cmp = 0;
-
-  /* Fix up the connection array to its new order. */
-  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
-  } SMARTLIST_FOREACH_END(conn);
-
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
-  conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
-
-    /* Free storage in any non-linked directory connections that have buffered
-     * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
-      if (conn_age < circ->age_tmp) {
-        break;
+  oom_age_queue_init_circuits(&circ_q, now_ts);
+  oom_age_queue_init_conns(&conn_q, now_ts);
+
+  /* Now take the worst circuits and connections, oldest first. Let's mark
+   * them, and reclaim their storage aggressively. */
+  while ((cv = oom_age_queue_pop(&circ_q))) {
+    /* Free storage in any connections that have buffered data at least as
+     * old as this circuit's. */
+    while ((connv = oom_age_queue_peek(&conn_q)) && connv->age >= cv->age) {
+      connection_t *conn = connv->item;
+      oom_age_queue_pop(&conn_q);
+
+      if (!conn->marked_for_close)
+        connection_mark_for_close(conn);
+      mem_recovered += single_conn_free_bytes(conn);
+
+      if (conn->type == CONN_TYPE_DIR) {
+        ++n_dirconns_killed;
+      } else {
+        ++n_edgeconns_killed;
       }
-      /* Also consider edge connections so we don't accumulate bytes on the
-       * outbuf due to a malicious destination holding off the read on us. */
-      if ((conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) ||
-          CONN_IS_EDGE(conn)) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
-
-        if (conn->type == CONN_TYPE_DIR) {
-          ++n_dirconns_killed;
-        } else {
-          ++n_edgeconns_killed;
-        }
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
-      }
-      ++conn_idx;
+      if (mem_recovered >= mem_to_recover)
+        goto done_recovering_mem;
+      if (n_circuits_killed + n_dirconns_killed + n_edgeconns_killed >=
+          OOM_MAX_VICTIMS_PER_PASS)
+        goto out_of_time;
     }
 
     /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
-    const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
-    if (! circ->marked_for_close) {
-      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    }
-    marked_circuit_free_cells(circ);
-    freed = marked_circuit_free_stream_bytes(circ);
-
+    mem_recovered += oom_kill_circuit(cv->item);
     ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
-    mem_recovered += half_stream_alloc;
-    mem_recovered += freed;
-    mem_recovered += conflux_get_circ_bytes_allocation(circ);
-
     if (mem_recovered >= mem_to_recover)
       goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+    if (n_circuits_killed + n_dirconns_killed + n_edgeconns_killed >=
+        OOM_MAX_VICTIMS_PER_PASS)
+      goto out_of_time;
+  }
+  goto done_recovering_mem;
+
+ out_of_time:
+  /* Let the main loop run, and then carry on. */
+  if (!oom_continue_ev)
+    oom_continue_ev = mainloop_event_new(oom_continue_cb, NULL);
+  mainloop_event_activate(oom_continue_ev);
 
  done_recovering_mem:
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
@@ -2764,10 +3121,12 @@ circuits_handle_oom(size_t current_allocation)
              "connections. Killed %d edge connections",
              mem_recovered,
              n_circuits_killed,
-             smartlist_len(circlist) - n_circuits_killed,
+             smartlist_len(circuit_get_global_list()) - n_circuits_killed,
              n_dirconns_killed,
              n_edgeconns_killed);
 
+  oom_age_queue_clear(&circ_q);
+  oom_age_queue_clear(&conn_q);
   return mem_recovered;
 }
 
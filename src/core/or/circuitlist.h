@@ -185,6 +185,12 @@ const origin_circuit_t *CONST_TO_ORIGIN_CIRCUIT(const circuit_t *);
 
 MOCK_DECL(smartlist_t *, circuit_get_global_list, (void));
 smartlist_t *circuit_get_global_origin_circuit_list(void);
+void circuit_origin_index_update(origin_circuit_t *circ);
+const smartlist_t *circuit_origin_index_get_bucket(uint8_t purpose,
+                                                   bool is_open,
+                                                   bool is_internal,
+                                                   bool is_isolated);
+const smartlist_t *circuit_origin_index_get_by_isolation(const uint8_t *key);
 int circuit_any_opened_circuits(void);
 int circuit_any_opened_circuits_cached(void);
 void circuit_cache_opened_circuit_state(int circuits_are_opened);
@@ -200,6 +206,7 @@ void circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
                                channel_t *chan);
 void channel_mark_circid_unusable(channel_t *chan, circid_t id);
 void channel_mark_circid_usable(channel_t *chan, circid_t id);
+void channel_clear_circid_map(channel_t *chan);
 time_t circuit_id_when_marked_unusable_on_channel(circid_t circ_id,
                                                   channel_t *chan);
 int circuit_event_status(origin_circuit_t *circ, circuit_status_event_t tp,
@@ -269,6 +276,45 @@ STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
+
+/** Number of age buckets in an oom_age_queue_t: enough for any uint32_t
+ * age. */
+#define OOM_AGE_N_BUCKETS 240
+
+/** A circuit or connection that the OOM handler might kill, along with the
+ * age of its oldest queued data. */
+typedef struct oom_victim_t {
+  void *item;
+  uint32_t age;
+} oom_victim_t;
+
+/** A set of oom_victim_t, handed out oldest first.
+ *
+ * We put the victims into buckets by age in one pass (see
+ * oom_age_bucket()), and only sort each bucket once we get to it.  Handing
+ * out the k oldest of n victims costs O(n) plus the cost of sorting the
+ * buckets that they come from, rather than O(n log n). */
+typedef struct oom_age_queue_t {
+  /** The victims, grouped by bucket, oldest bucket first. */
+  oom_victim_t *victims;
+  /** Number of entries in <b>victims</b>. */
+  int n;
+  /** Index of the next victim to hand out. */
+  int pos;
+  /** The victims before this index are sorted. */
+  int sorted_end;
+  /** Index in <b>bucket_end</b> of the next bucket to sort. */
+  int next_bucket;
+  /** For each bucket, oldest first, the index just past its last victim. */
+  int bucket_end[OOM_AGE_N_BUCKETS];
+} oom_age_queue_t;
+
+STATIC int oom_age_bucket(uint32_t age);
+STATIC void oom_age_queue_init(oom_age_queue_t *q,
+                               const oom_victim_t *victims, int n);
+STATIC void oom_age_queue_clear(oom_age_queue_t *q);
+STATIC const oom_victim_t *oom_age_queue_peek(oom_age_queue_t *q);
+STATIC const oom_victim_t *oom_age_queue_pop(oom_age_queue_t *q);
 #endif /* defined(CIRCUITLIST_PRIVATE) */
 
 #endif /* !defined(TOR_CIRCUITLIST_H) */
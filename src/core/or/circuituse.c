@@ -315,6 +315,82 @@ circuit_is_better(const origin_circuit_t *oa, const origin_circuit_t *ob,
   return 0;
 }
 
+/** Add to <b>out</b> every origin circuit that circuit_is_acceptable() might
+ * accept for <b>conn</b> with the given <b>must_be_open</b>, <b>purpose</b>
+ * and <b>need_internal</b> arguments, looking only at the buckets of the
+ * origin circuit index that could hold such a circuit.
+ *
+ * The result may contain circuits that are not acceptable, but every
+ * acceptable circuit is in it exactly once.
+ *
+ * We don't index circuits by what their exits can reach: that depends on
+ * the stream's address and port, and on exit policies that change whenever
+ * we get new descriptors, so the index would need rebuilding all the time.
+ * Instead, circuit_is_acceptable() checks the exit of each candidate,
+ * and the buckets and isolation keys keep the candidates few. */
+static void
+circuit_get_best_candidates(smartlist_t *out,
+                            const entry_connection_t *conn,
+                            int must_be_open, uint8_t purpose,
+                            int need_internal)
+{
+  uint8_t purposes[4];
+  int n_purposes = 0;
+  uint8_t iso_key[DIGEST_LEN];
+  const bool use_iso_key =
+    connection_edge_get_isolation_key(conn, iso_key) == 0;
+
+  /* Keep this in sync with the purpose checks in circuit_is_acceptable(). */
+  if (purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_JOINED;
+  } else if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+             !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_INTRODUCING;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT;
+  } else {
+    purposes[n_purposes++] = purpose;
+  }
+
+  for (int i = 0; i < n_purposes; ++i) {
+    for (int is_open = must_be_open ? 1 : 0; is_open <= 1; ++is_open) {
+      /* If conn has an isolation key, every isolated circuit it can use has
+       * the same key: we find those below. */
+      for (int is_isolated = 0; is_isolated <= !use_iso_key; ++is_isolated) {
+        const smartlist_t *bucket =
+          circuit_origin_index_get_bucket(purposes[i], is_open,
+                                          need_internal, is_isolated);
+        if (bucket)
+          smartlist_add_all(out, bucket);
+      }
+    }
+  }
+
+  if (use_iso_key) {
+    const smartlist_t *same_key =
+      circuit_origin_index_get_by_isolation(iso_key);
+    if (same_key)
+      smartlist_add_all(out, same_key);
+  }
+}
+
+/** Helper for sorting origin circuits by their position in the global
+ * circuit list. */
+static int
+compare_origin_circuits_by_global_idx_(const void **a_, const void **b_)
+{
+  const circuit_t *a = TO_CIRCUIT((origin_circuit_t *) *a_);
+  const circuit_t *b = TO_CIRCUIT((origin_circuit_t *) *b_);
+  if (a->global_circuitlist_idx < b->global_circuitlist_idx)
+    return -1;
+  else if (a->global_circuitlist_idx > b->global_circuitlist_idx)
+    return 1;
+  else
+    return 0;
+}
+
 /** Find the best circ that conn can use, preferably one which is
  * dirty. Circ must not be too old.
  *
@@ -331,12 +407,13 @@ circuit_is_better(const origin_circuit_t *oa, const origin_circuit_t *ob,
  * If it's INTRODUCE_ACK_WAIT and must_be_open==0, then return the
  * closest introduce-purposed circuit that you can find.
  */
-static origin_circuit_t *
+origin_circuit_t *
 circuit_get_best(const entry_connection_t *conn,
                  int must_be_open, uint8_t purpose,
                  int need_uptime, int need_internal)
 {
   origin_circuit_t *best=NULL;
+  smartlist_t *candidates;
   struct timeval now;
   time_t now_sec;
 
@@ -359,24 +436,30 @@ circuit_get_best(const entry_connection_t *conn,
     return best;
   }
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    origin_circuit_t *origin_circ;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    origin_circ = TO_ORIGIN_CIRCUIT(circ);
+  candidates = smartlist_new();
+  circuit_get_best_candidates(candidates, conn, must_be_open, purpose,
+                              need_internal);
 
+  SMARTLIST_FOREACH_BEGIN(candidates, origin_circuit_t *, origin_circ) {
     if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
                                need_uptime,need_internal, now_sec))
-      continue;
+      SMARTLIST_DEL_CURRENT(candidates, origin_circ);
+  } SMARTLIST_FOREACH_END(origin_circ);
+
+  /* Consider the acceptable circuits in the order of the global circuit
+   * list, so that ties between them are broken as they always have been. */
+  smartlist_sort(candidates, compare_origin_circuits_by_global_idx_);
 
+  SMARTLIST_FOREACH_BEGIN(candidates, origin_circuit_t *, origin_circ) {
     /* now this is an acceptable circ to hand back. but that doesn't
      * mean it's the *best* circ to hand back. try to decide.
      */
     if (!best || circuit_is_better(origin_circ,best,conn))
       best = origin_circ;
   }
-  SMARTLIST_FOREACH_END(circ);
+  SMARTLIST_FOREACH_END(origin_circ);
 
+  smartlist_free(candidates);
   return best;
 }
 
@@ -386,16 +469,19 @@ count_pending_general_client_circuits(void)
 {
   int count = 0;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close ||
-        circ->state == CIRCUIT_STATE_OPEN ||
-        !CIRCUIT_PURPOSE_COUNTS_TOWARDS_MAXPENDING(circ->purpose) ||
-        !CIRCUIT_IS_ORIGIN(circ))
+  for (int purpose = 0; purpose <= CIRCUIT_PURPOSE_MAX_; ++purpose) {
+    if (!CIRCUIT_PURPOSE_COUNTS_TOWARDS_MAXPENDING(purpose))
       continue;
-
-    ++count;
+    for (int bits = 0; bits < 4; ++bits) {
+      const smartlist_t *bucket =
+        circuit_origin_index_get_bucket(purpose, false /* open */,
+                                        bits & 1, bits & 2);
+      if (!bucket)
+        continue;
+      SMARTLIST_FOREACH(bucket, const origin_circuit_t *, circ,
+                        count += !circ->base_.marked_for_close);
+    }
   }
-  SMARTLIST_FOREACH_END(circ);
 
   return count;
 }
@@ -3140,6 +3226,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
             new_purpose);
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
+    circuit_origin_index_update(TO_ORIGIN_CIRCUIT(circ));
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
                                           old_purpose);
 
@@ -81,6 +81,9 @@ int circuit_is_acceptable(const origin_circuit_t *origin_circ,
                           int must_be_open, uint8_t purpose,
                           int need_uptime, int need_internal,
                           time_t now);
+origin_circuit_t *circuit_get_best(const entry_connection_t *conn,
+                                   int must_be_open, uint8_t purpose,
+                                   int need_uptime, int need_internal);
 
 int circuit_should_use_vanguards(uint8_t);
 void circuit_sent_valid_data(origin_circuit_t *circ, uint16_t relay_body_len);
@@ -0,0 +1,569 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compiled_policy.c
+ * \brief Compiled address policies, for fast exit policy lookups.
+ *
+ * An address policy is an ordered list of accept/reject rules: the first
+ * rule whose address mask and port range both match decides the outcome.
+ * Evaluating it with compare_tor_addr_to_addr_policy() is linear in the
+ * length of the list, and we do that for every stream that reaches an exit
+ * and for every node when a client wonders whether anybody at all would
+ * accept a given address:port.
+ *
+ * Here we turn a policy into:
+ *   - A path-compressed binary trie over address prefixes, one per address
+ *     family.  Every rule hangs off the trie node for its prefix.  At each
+ *     node, the rules that hang there are flattened into a sorted list of
+ *     disjoint port ranges, each remembering the earliest rule that covers
+ *     it.  A lookup for a known address and port walks at most one root to
+ *     leaf path, binary-searching each node's port ranges, and keeps the
+ *     earliest matching rule.
+ *   - A sorted list of disjoint port ranges with precomputed answers for
+ *     the case where the address is unknown.
+ *
+ * The case where the address is known but the port is not is rare, and is
+ * answered by a scan over a compact copy of the rules.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/compiled_policy.h"
+#include "core/or/policies.h"
+
+#include "core/or/addr_policy_st.h"
+
+/** A run of ports whose first matching rule, among the rules attached to a
+ * single trie node, is the same. */
+typedef struct policy_port_range_t {
+  uint16_t prt_min;
+  uint16_t prt_max;
+  /** Index in the original policy of the first rule covering these ports */
+  int rule_idx;
+} policy_port_range_t;
+
+/** A run of ports for which an unknown address always gets the same
+ * answer. */
+typedef struct policy_port_result_t {
+  uint16_t prt_min;
+  uint16_t prt_max;
+  addr_policy_result_t result;
+} policy_port_result_t;
+
+/** One node in a path-compressed binary trie of address prefixes. */
+typedef struct policy_trie_node_t {
+  /** Children, selected by the bit at position <b>maskbits</b>. */
+  struct policy_trie_node_t *child[2];
+  /** The prefix for this node, in network order.  Bits past
+   * <b>maskbits</b> are zero. */
+  uint8_t prefix[16];
+  /** Number of significant bits in <b>prefix</b>. */
+  maskbits_t maskbits;
+  /** Smallest rule_idx in <b>ranges</b>, or INT_MAX if there are none. */
+  int min_rule_idx;
+  /** Number of entries in <b>ranges</b>. */
+  int n_ranges;
+  /** Sorted, disjoint port ranges for the rules whose prefix is exactly
+   * this node's prefix. */
+  policy_port_range_t *ranges;
+  /** While compiling only: indices of the rules attached to this node,
+   * in policy order. */
+  smartlist_t *pending;
+} policy_trie_node_t;
+
+/** A compact copy of one addr_policy_t. */
+typedef struct compiled_policy_rule_t {
+  tor_addr_t addr;
+  maskbits_t maskbits;
+  uint16_t prt_min;
+  uint16_t prt_max;
+  unsigned int is_accept:1;
+} compiled_policy_rule_t;
+
+/** Index into compiled_policy_t.roots for each address family we
+ * handle. */
+#define TRIE_IPV4 0
+#define TRIE_IPV6 1
+
+struct compiled_policy_t {
+  /** Number of rules in the policy we were compiled from. */
+  int n_rules;
+  /** A copy of every rule, in policy order. */
+  compiled_policy_rule_t *rules;
+  /** Trie roots for IPv4 and IPv6 rules. */
+  policy_trie_node_t *roots[2];
+  /** Total number of trie nodes. */
+  size_t n_nodes;
+  /** Number of entries in <b>unknown_addr</b>. */
+  int n_unknown_addr;
+  /** Answers for an unknown address, sorted by port; together they cover
+   * ports 1 through 65535. */
+  policy_port_result_t *unknown_addr;
+};
+
+/** Return bit number <b>bit</b> (counting from the most significant bit of
+ * the first byte) of <b>key</b>. */
+static inline int
+prefix_get_bit(const uint8_t *key, int bit)
+{
+  return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/** Return the number of leading bits, up to <b>max_bits</b>, that <b>a</b>
+ * and <b>b</b> have in common. */
+static int
+prefix_common_bits(const uint8_t *a, const uint8_t *b, int max_bits)
+{
+  int i;
+  for (i = 0; i < (max_bits >> 3); ++i) {
+    if (a[i] != b[i])
+      return i*8 + (7 - tor_log2(a[i] ^ b[i]));
+  }
+  if (max_bits & 7) {
+    uint8_t diff = (a[i] ^ b[i]) & (0xff << (8 - (max_bits & 7)));
+    if (diff)
+      return i*8 + (7 - tor_log2(diff));
+  }
+  return max_bits;
+}
+
+/** Return true iff the first <b>bits</b> bits of <b>a</b> and <b>b</b>
+ * are the same. */
+static inline int
+prefix_matches(const uint8_t *a, const uint8_t *b, int bits)
+{
+  const int bytes = bits >> 3;
+  const int leftover = bits & 7;
+  if (bytes && fast_memneq(a, b, bytes))
+    return 0;
+  if (leftover) {
+    uint8_t mask = (uint8_t)(0xff << (8 - leftover));
+    return ((a[bytes] ^ b[bytes]) & mask) == 0;
+  }
+  return 1;
+}
+
+/** Allocate a new trie node for the first <b>bits</b> bits of
+ * <b>key</b>. */
+static policy_trie_node_t *
+policy_trie_node_new(const uint8_t *key, int bits)
+{
+  policy_trie_node_t *node = tor_malloc_zero(sizeof(policy_trie_node_t));
+  memcpy(node->prefix, key, (bits + 7) >> 3);
+  if (bits & 7)
+    node->prefix[bits >> 3] &= (uint8_t)(0xff << (8 - (bits & 7)));
+  node->maskbits = bits;
+  node->min_rule_idx = INT_MAX;
+  return node;
+}
+
+/** Release all storage held by <b>node</b> and its children. */
+static void
+policy_trie_node_free(policy_trie_node_t *node)
+{
+  while (node) {
+    policy_trie_node_t *next = node->child[1];
+    policy_trie_node_free(node->child[0]);
+    tor_free(node->ranges);
+    smartlist_free(node->pending);
+    tor_free(node);
+    node = next;
+  }
+}
+
+/** Find or create the node in the trie at *<b>rootp</b> for the first
+ * <b>bits</b> bits of <b>key</b>.  Increment *<b>n_nodes_out</b> by the
+ * number of nodes we create. */
+static policy_trie_node_t *
+policy_trie_insert(policy_trie_node_t **rootp, const uint8_t *key, int bits,
+                   size_t *n_nodes_out)
+{
+  policy_trie_node_t **nodep = rootp;
+
+  while (1) {
+    policy_trie_node_t *node = *nodep;
+    if (!node) {
+      ++*n_nodes_out;
+      return (*nodep = policy_trie_node_new(key, bits));
+    }
+    int common = prefix_common_bits(node->prefix, key,
+                                    MIN(node->maskbits, bits));
+    if (common == node->maskbits) {
+      if (common == bits)
+        return node;
+      /* This node is a strict prefix of key: descend. */
+      nodep = &node->child[prefix_get_bit(key, node->maskbits)];
+      continue;
+    }
+    if (common == bits) {
+      /* Key is a strict prefix of this node: put it above. */
+      policy_trie_node_t *parent = policy_trie_node_new(key, bits);
+      parent->child[prefix_get_bit(node->prefix, bits)] = node;
+      ++*n_nodes_out;
+      return (*nodep = parent);
+    }
+    /* Key and this node diverge: add a branch node. */
+    policy_trie_node_t *branch = policy_trie_node_new(key, common);
+    policy_trie_node_t *leaf = policy_trie_node_new(key, bits);
+    branch->child[prefix_get_bit(node->prefix, common)] = node;
+    branch->child[prefix_get_bit(key, common)] = leaf;
+    *nodep = branch;
+    *n_nodes_out += 2;
+    return leaf;
+  }
+}
+
+/** Helper for sorting port boundaries. */
+static int
+compare_port_boundaries_(const void **a, const void **b)
+{
+  uintptr_t x = (uintptr_t) *a, y = (uintptr_t) *b;
+  return (x > y) - (x < y);
+}
+
+/** Return a sorted list, without duplicates, of every port at which the set
+ * of rules in <b>idxs</b> (indices into <b>rules</b>) that cover a port
+ * might change, starting with <b>first_port</b>.  Elements are
+ * uintptr_t. */
+static smartlist_t *
+port_boundaries_new(const compiled_policy_rule_t *rules,
+                    const smartlist_t *idxs, int n_rules, int first_port)
+{
+  smartlist_t *bounds = smartlist_new();
+  smartlist_add(bounds, (void*)(uintptr_t)first_port);
+  for (int i = 0; i < n_rules; ++i) {
+    const compiled_policy_rule_t *r =
+      &rules[idxs ? (int)(intptr_t)smartlist_get(idxs, i) : i];
+    if (r->prt_min > first_port)
+      smartlist_add(bounds, (void*)(uintptr_t)r->prt_min);
+    if (r->prt_max < 65535 && r->prt_max + 1 > first_port)
+      smartlist_add(bounds, (void*)(uintptr_t)(r->prt_max + 1));
+  }
+  smartlist_sort(bounds, compare_port_boundaries_);
+  smartlist_uniq(bounds, compare_port_boundaries_, NULL);
+  return bounds;
+}
+
+/** Turn the pending rule list at <b>node</b> into its port range table,
+ * and do the same for its children. */
+static void
+policy_trie_node_finish(policy_trie_node_t *node,
+                        const compiled_policy_rule_t *rules)
+{
+  for ( ; node; node = node->child[1]) {
+    policy_trie_node_finish(node->child[0], rules);
+    if (!node->pending)
+      continue;
+
+    const int n_pending = smartlist_len(node->pending);
+    smartlist_t *bounds = port_boundaries_new(rules, node->pending,
+                                              n_pending, 0);
+    const int n_bounds = smartlist_len(bounds);
+    node->ranges = tor_calloc(n_bounds, sizeof(policy_port_range_t));
+
+    for (int b = 0; b < n_bounds; ++b) {
+      const uintptr_t lo = (uintptr_t) smartlist_get(bounds, b);
+      const uintptr_t hi = (b+1 < n_bounds) ?
+        (uintptr_t) smartlist_get(bounds, b+1) - 1 : 65535;
+      int found = -1;
+      SMARTLIST_FOREACH_BEGIN(node->pending, void *, idxp) {
+        const int idx = (int)(intptr_t) idxp;
+        if (rules[idx].prt_min <= lo && lo <= rules[idx].prt_max) {
+          found = idx;
+          break;
+        }
+      } SMARTLIST_FOREACH_END(idxp);
+      if (found < 0)
+        continue;
+      policy_port_range_t *prev = node->n_ranges ?
+        &node->ranges[node->n_ranges - 1] : NULL;
+      if (prev && prev->rule_idx == found &&
+          (uintptr_t) prev->prt_max + 1 == lo) {
+        prev->prt_max = (uint16_t) hi;
+      } else {
+        policy_port_range_t *r = &node->ranges[node->n_ranges++];
+        r->prt_min = (uint16_t) lo;
+        r->prt_max = (uint16_t) hi;
+        r->rule_idx = found;
+      }
+      node->min_rule_idx = MIN(node->min_rule_idx, found);
+    }
+    smartlist_free(bounds);
+    smartlist_free(node->pending);
+  }
+}
+
+/** Return the index of the first rule in <b>node</b>'s port range table
+ * that covers <b>port</b>, or INT_MAX if there is none. */
+static inline int
+policy_trie_node_lookup_port(const policy_trie_node_t *node, uint16_t port)
+{
+  int lo = 0, hi = node->n_ranges - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi) / 2;
+    const policy_port_range_t *r = &node->ranges[mid];
+    if (port < r->prt_min)
+      hi = mid - 1;
+    else if (port > r->prt_max)
+      lo = mid + 1;
+    else
+      return r->rule_idx;
+  }
+  return INT_MAX;
+}
+
+/** Return the key for <b>addr</b> in *<b>key_out</b>, the number of bits in
+ * the key in *<b>bits_out</b>, and the index of the trie to use.  Return -1
+ * if <b>addr</b> is neither IPv4 nor IPv6. */
+static int
+addr_to_trie_key(const tor_addr_t *addr, const uint8_t **key_out,
+                 int *bits_out)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      *key_out = (const uint8_t *) &addr->addr.in_addr.s_addr;
+      *bits_out = 32;
+      return TRIE_IPV4;
+    case AF_INET6:
+      *key_out = tor_addr_to_in6_addr8(addr);
+      *bits_out = 128;
+      return TRIE_IPV6;
+    default:
+      return -1;
+  }
+}
+
+/** Evaluate <b>port</b> against the rules of <b>cp</b> for an unknown
+ * address, exactly as compare_tor_addr_to_addr_policy() does. */
+static addr_policy_result_t
+compiled_policy_eval_unknown_addr(const compiled_policy_t *cp, uint16_t port)
+{
+  int maybe_accept = 0, maybe_reject = 0;
+
+  for (int i = 0; i < cp->n_rules; ++i) {
+    const compiled_policy_rule_t *r = &cp->rules[i];
+    if (r->prt_min <= port && port <= r->prt_max) {
+      if (r->maskbits == 0) {
+        if (r->is_accept) {
+          return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+            ADDR_POLICY_ACCEPTED;
+        } else {
+          return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+            ADDR_POLICY_REJECTED;
+        }
+      } else if (r->is_accept) {
+        maybe_accept = 1;
+      } else {
+        maybe_reject = 1;
+      }
+    }
+  }
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Build the unknown-address answer table for <b>cp</b>. */
+static void
+compiled_policy_build_unknown_addr(compiled_policy_t *cp)
+{
+  smartlist_t *bounds = port_boundaries_new(cp->rules, NULL, cp->n_rules, 1);
+  const int n_bounds = smartlist_len(bounds);
+  cp->unknown_addr = tor_calloc(n_bounds, sizeof(policy_port_result_t));
+
+  for (int b = 0; b < n_bounds; ++b) {
+    const uintptr_t lo = (uintptr_t) smartlist_get(bounds, b);
+    const uintptr_t hi = (b+1 < n_bounds) ?
+      (uintptr_t) smartlist_get(bounds, b+1) - 1 : 65535;
+    addr_policy_result_t res =
+      compiled_policy_eval_unknown_addr(cp, (uint16_t) lo);
+    policy_port_result_t *prev = cp->n_unknown_addr ?
+      &cp->unknown_addr[cp->n_unknown_addr - 1] : NULL;
+    if (prev && prev->result == res) {
+      prev->prt_max = (uint16_t) hi;
+    } else {
+      policy_port_result_t *r = &cp->unknown_addr[cp->n_unknown_addr++];
+      r->prt_min = (uint16_t) lo;
+      r->prt_max = (uint16_t) hi;
+      r->result = res;
+    }
+  }
+  smartlist_free(bounds);
+}
+
+/** Compile the list of addr_policy_t in <b>policy</b>, and return a newly
+ * allocated compiled_policy_t.  Return NULL if <b>policy</b> is NULL. */
+compiled_policy_t *
+compiled_policy_new(const smartlist_t *policy)
+{
+  if (!policy)
+    return NULL;
+
+  compiled_policy_t *cp = tor_malloc_zero(sizeof(compiled_policy_t));
+  cp->n_rules = smartlist_len(policy);
+  cp->rules = tor_calloc(MAX(cp->n_rules, 1), sizeof(compiled_policy_rule_t));
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    compiled_policy_rule_t *r = &cp->rules[p_sl_idx];
+    tor_addr_copy(&r->addr, &p->addr);
+    r->maskbits = p->maskbits;
+    r->prt_min = p->prt_min;
+    r->prt_max = p->prt_max;
+    r->is_accept = (p->policy_type == ADDR_POLICY_ACCEPT);
+
+    const uint8_t *key;
+    int max_bits;
+    int trie = addr_to_trie_key(&p->addr, &key, &max_bits);
+    if (trie < 0) {
+      if (tor_addr_family(&p->addr) == AF_UNSPEC) {
+        log_warn(LD_BUG, "Policy contains an AF_UNSPEC address, which only "
+                 "matches other AF_UNSPEC addresses.");
+      }
+      continue;
+    }
+    policy_trie_node_t *node =
+      policy_trie_insert(&cp->roots[trie], key, MIN(p->maskbits, max_bits),
+                         &cp->n_nodes);
+    if (!node->pending)
+      node->pending = smartlist_new();
+    smartlist_add(node->pending, (void*)(intptr_t)p_sl_idx);
+  } SMARTLIST_FOREACH_END(p);
+
+  policy_trie_node_finish(cp->roots[TRIE_IPV4], cp->rules);
+  policy_trie_node_finish(cp->roots[TRIE_IPV6], cp->rules);
+  compiled_policy_build_unknown_addr(cp);
+
+  return cp;
+}
+
+/** Release all storage held by <b>cp</b>. */
+void
+compiled_policy_free_(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  policy_trie_node_free(cp->roots[TRIE_IPV4]);
+  policy_trie_node_free(cp->roots[TRIE_IPV6]);
+  tor_free(cp->rules);
+  tor_free(cp->unknown_addr);
+  tor_free(cp);
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where addr and port are both known. */
+static addr_policy_result_t
+compiled_policy_lookup_known(const compiled_policy_t *cp,
+                             const tor_addr_t *addr, uint16_t port)
+{
+  const uint8_t *key;
+  int bits;
+  int trie = addr_to_trie_key(addr, &key, &bits);
+  int best = INT_MAX;
+
+  if (trie < 0)
+    return ADDR_POLICY_ACCEPTED;
+
+  const policy_trie_node_t *node = cp->roots[trie];
+  while (node) {
+    if (!prefix_matches(node->prefix, key, node->maskbits))
+      break;
+    if (node->min_rule_idx < best) {
+      int idx = policy_trie_node_lookup_port(node, port);
+      if (idx < best)
+        best = idx;
+    }
+    if (node->maskbits >= bits)
+      break;
+    node = node->child[prefix_get_bit(key, node->maskbits)];
+  }
+
+  if (best == INT_MAX) {
+    /* accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+  return cp->rules[best].is_accept ?
+    ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where addr is known but port is not. */
+static addr_policy_result_t
+compiled_policy_lookup_noport(const compiled_policy_t *cp,
+                              const tor_addr_t *addr)
+{
+  int maybe_accept = 0, maybe_reject = 0;
+
+  for (int i = 0; i < cp->n_rules; ++i) {
+    const compiled_policy_rule_t *r = &cp->rules[i];
+    if (tor_addr_compare_masked(addr, &r->addr, r->maskbits, CMP_EXACT))
+      continue;
+    if (r->prt_min <= 1 && r->prt_max >= 65535) {
+      if (r->is_accept) {
+        return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+          ADDR_POLICY_ACCEPTED;
+      } else {
+        return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+          ADDR_POLICY_REJECTED;
+      }
+    } else if (r->is_accept) {
+      maybe_accept = 1;
+    } else {
+      maybe_reject = 1;
+    }
+  }
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where port is known but address is not. */
+static addr_policy_result_t
+compiled_policy_lookup_unknown_addr(const compiled_policy_t *cp,
+                                    uint16_t port)
+{
+  int lo = 0, hi = cp->n_unknown_addr - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi) / 2;
+    const policy_port_result_t *r = &cp->unknown_addr[mid];
+    if (port < r->prt_min)
+      hi = mid - 1;
+    else if (port > r->prt_max)
+      lo = mid + 1;
+    else
+      return r->result;
+  }
+  /* LCOV_EXCL_START -- the table covers every nonzero port. */
+  tor_fragile_assert();
+  return ADDR_POLICY_ACCEPTED;
+  /* LCOV_EXCL_STOP */
+}
+
+/** Decide whether a given addr:port is definitely accepted, definitely
+ * rejected, probably accepted, or probably rejected by the compiled policy
+ * <b>cp</b>.  Arguments and return values are as for
+ * compare_tor_addr_to_addr_policy() on the policy that <b>cp</b> was
+ * compiled from. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_policy_t *cp)
+{
+  if (!cp) {
+    /* no policy? accept all. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return compiled_policy_lookup_unknown_addr(cp, port);
+  } else if (port == 0) {
+    return compiled_policy_lookup_noport(cp, addr);
+  } else {
+    return compiled_policy_lookup_known(cp, addr, port);
+  }
+}
+
+/** Return the number of trie nodes in <b>cp</b>. */
+size_t
+compiled_policy_get_n_nodes(const compiled_policy_t *cp)
+{
+  return cp ? cp->n_nodes : 0;
+}
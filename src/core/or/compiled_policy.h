@@ -0,0 +1,35 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compiled_policy.h
+ * \brief Header file for compiled_policy.c.
+ **/
+
+#ifndef TOR_COMPILED_POLICY_H
+#define TOR_COMPILED_POLICY_H
+
+#include "core/or/policies.h"
+
+/**
+ * A compiled_policy_t is a read-only form of an address policy (a list of
+ * addr_policy_t), built once and then used to answer
+ * compare_tor_addr_to_addr_policy()-style questions without walking the
+ * whole list.  Its answers are always identical to those of the list it was
+ * compiled from.
+ */
+typedef struct compiled_policy_t compiled_policy_t;
+
+compiled_policy_t *compiled_policy_new(const smartlist_t *policy);
+void compiled_policy_free_(compiled_policy_t *cp);
+#define compiled_policy_free(cp) \
+  FREE_AND_NULL(compiled_policy_t, compiled_policy_free_, (cp))
+
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                                           const tor_addr_t *addr,
+                                           uint16_t port,
+                                           const compiled_policy_t *cp);
+
+size_t compiled_policy_get_n_nodes(const compiled_policy_t *cp);
+
+#endif /* !defined(TOR_COMPILED_POLICY_H) */
@@ -27,6 +27,7 @@
 #include "core/or/conflux_cell.h"
 #include "lib/time/compat_time.h"
 #include "app/config/config.h"
+#include "feature/relay/relay_metrics.h"
 
 /** One million microseconds in a second */
 #define USEC_PER_SEC 1000000
@@ -38,6 +39,16 @@ static inline uint64_t cwnd_sendable(const circuit_t *on_circ,
  * OOM handler to assess. */
 static uint64_t total_ooo_q_bytes = 0;
 
+/** Smallest number of slots that we allocate for a reorder ring. */
+#define CONFLUX_OOO_RING_MIN_SLOTS 32
+
+/** Largest number of freed conflux_msg_t that we keep around for reuse. */
+#define CONFLUX_MSG_FREELIST_MAX 256
+
+/** Freed conflux_msg_t objects, ready to hold the next out-of-order
+ * message.  NULL until we first free one. */
+static smartlist_t *conflux_msg_freelist = NULL;
+
 /**
  * Determine if we should multiplex a specific relay command or not.
  *
@@ -170,7 +181,8 @@ uint64_t
 conflux_get_circ_bytes_allocation(const circuit_t *circ)
 {
   if (circ->conflux) {
-    return smartlist_len(circ->conflux->ooo_q) * sizeof(conflux_msg_t);
+    return conflux_ooo_len(circ->conflux) * sizeof(conflux_msg_t) +
+      circ->conflux->ooo_ring_cap * sizeof(conflux_msg_t *);
   }
   return 0;
 }
@@ -696,6 +708,130 @@ conflux_queue_cmp(const void *a, const void *b)
   }
 }
 
+/** Return the number of out-of-order messages queued on <b>cfx</b>. */
+size_t
+conflux_ooo_len(const conflux_t *cfx)
+{
+  return cfx->ooo_ring_len + smartlist_len(cfx->ooo_q);
+}
+
+/**
+ * Return a conflux_msg_t holding a copy of <b>msg</b>, with absolute
+ * sequence number <b>seq</b>.  Reuse a freed one if we have any.
+ *
+ * We copy because we don't have ownership of the message. If we wanted to
+ * pull that off, we would need to change the whole calling stack and unit
+ * tests on either not touching it after this function indicates that it has
+ * taken it or never allocate it from the stack. This is simpler and less
+ * error prone. The Maze is serious. It needs to be respected.
+ */
+STATIC conflux_msg_t *
+conflux_msg_new(uint64_t seq, const relay_msg_t *msg)
+{
+  conflux_msg_t *c_msg;
+
+  tor_assert(msg->length <= RELAY_PAYLOAD_SIZE_MAX);
+
+  if (conflux_msg_freelist && smartlist_len(conflux_msg_freelist)) {
+    c_msg = smartlist_pop_last(conflux_msg_freelist);
+  } else {
+    c_msg = tor_malloc(sizeof(*c_msg));
+  }
+
+  c_msg->seq = seq;
+  c_msg->heap_idx = -1;
+  c_msg->queued_ts = monotime_coarse_get_stamp();
+  memcpy(&c_msg->msg_storage, msg, sizeof(*msg));
+  c_msg->msg_storage.body = c_msg->body;
+  memcpy(c_msg->body, msg->body, msg->length);
+  c_msg->msg = &c_msg->msg_storage;
+
+  return c_msg;
+}
+
+/** Make the reorder ring of <b>cfx</b> big enough to hold the message
+ * <b>n</b> places after the next one that we expect. */
+static void
+conflux_ooo_ring_grow(conflux_t *cfx, uint32_t n)
+{
+  uint32_t new_cap;
+  conflux_msg_t **new_ring;
+
+  tor_assert(n <= CONFLUX_OOO_RING_MAX_SLOTS);
+
+  new_cap = cfx->ooo_ring_cap ? cfx->ooo_ring_cap
+                              : CONFLUX_OOO_RING_MIN_SLOTS;
+  while (new_cap < n)
+    new_cap *= 2;
+  if (new_cap == cfx->ooo_ring_cap)
+    return;
+
+  /* Every queued message is less than the old capacity ahead of the next
+   * one we expect, so none of them collide in the new ring. */
+  new_ring = tor_calloc(new_cap, sizeof(conflux_msg_t *));
+  for (uint32_t i = 0; i < cfx->ooo_ring_cap; ++i) {
+    conflux_msg_t *c_msg = cfx->ooo_ring[i];
+    if (c_msg) {
+      new_ring[c_msg->seq & (new_cap - 1)] = c_msg;
+    }
+  }
+
+  total_ooo_q_bytes +=
+    (uint64_t) (new_cap - cfx->ooo_ring_cap) * sizeof(conflux_msg_t *);
+  tor_free(cfx->ooo_ring);
+  cfx->ooo_ring = new_ring;
+  cfx->ooo_ring_cap = new_cap;
+}
+
+/** Queue <b>c_msg</b>, which is not the next message to deliver on
+ * <b>cfx</b>, until its turn comes. */
+STATIC void
+conflux_ooo_add(conflux_t *cfx, conflux_msg_t *c_msg)
+{
+  tor_assert(c_msg->seq > cfx->last_seq_delivered + 1);
+
+  const uint64_t ahead = c_msg->seq - cfx->last_seq_delivered;
+
+  if (ahead <= CONFLUX_OOO_RING_MAX_SLOTS) {
+    if (ahead > cfx->ooo_ring_cap) {
+      conflux_ooo_ring_grow(cfx, (uint32_t) ahead);
+    }
+    conflux_msg_t **slot =
+      &cfx->ooo_ring[c_msg->seq & (cfx->ooo_ring_cap - 1)];
+    if (!*slot) {
+      *slot = c_msg;
+      cfx->ooo_ring_len++;
+      goto done;
+    }
+  }
+
+  smartlist_pqueue_add(cfx->ooo_q, conflux_queue_cmp,
+                       offsetof(conflux_msg_t, heap_idx), c_msg);
+
+ done:
+  total_ooo_q_bytes += sizeof(conflux_msg_t);
+  relay_metrics_note_conflux_ooo_depth((uint32_t) conflux_ooo_len(cfx));
+}
+
+/** Free every out-of-order message queued on <b>cfx</b>, along with its
+ * reorder ring. */
+void
+conflux_ooo_clear(conflux_t *cfx)
+{
+  for (uint32_t i = 0; i < cfx->ooo_ring_cap; ++i) {
+    conflux_relay_msg_free(cfx->ooo_ring[i]);
+  }
+  total_ooo_q_bytes -= (uint64_t) cfx->ooo_ring_len * sizeof(conflux_msg_t) +
+    (uint64_t) cfx->ooo_ring_cap * sizeof(conflux_msg_t *);
+  tor_free(cfx->ooo_ring);
+  cfx->ooo_ring_cap = cfx->ooo_ring_len = 0;
+
+  total_ooo_q_bytes -= smartlist_len(cfx->ooo_q) * sizeof(conflux_msg_t);
+  SMARTLIST_FOREACH(cfx->ooo_q, conflux_msg_t *, c_msg,
+                    conflux_relay_msg_free(c_msg));
+  smartlist_clear(cfx->ooo_q);
+}
+
 /**
  * Get the congestion control object for a conflux circuit.
  *
@@ -867,19 +1003,7 @@ conflux_process_relay_msg(conflux_t *cfx, circuit_t *in_circ,
     circuit_mark_for_close(in_circ, END_CIRC_REASON_INTERNAL);
     return false;
   } else {
-    conflux_msg_t *c_msg = tor_malloc_zero(sizeof(conflux_msg_t));
-    c_msg->seq = leg->last_seq_recv;
-    /* Notice the copy here. Reason is that we don't have ownership of the
-     * message. If we wanted to pull that off, we would need to change the
-     * whole calling stack and unit tests on either not touching it after this
-     * function indicates that it has taken it or never allocate it from the
-     * stack. This is simpler and less error prone but might show up in our
-     * profile (maybe?). The Maze is serious. It needs to be respected. */
-    c_msg->msg = relay_msg_copy(msg);
-
-    smartlist_pqueue_add(cfx->ooo_q, conflux_queue_cmp,
-                         offsetof(conflux_msg_t, heap_idx), c_msg);
-    total_ooo_q_bytes += sizeof(msg->length);
+    conflux_ooo_add(cfx, conflux_msg_new(leg->last_seq_recv, msg));
 
     /* This cell should not be processed yet, and the queue is not ready
      * to process because the next absolute seqnum has not yet arrived */
@@ -896,31 +1020,59 @@ conflux_process_relay_msg(conflux_t *cfx, circuit_t *in_circ,
 conflux_msg_t *
 conflux_dequeue_relay_msg(conflux_t *cfx)
 {
+  const uint64_t next_seq = cfx->last_seq_delivered + 1;
   conflux_msg_t *top = NULL;
-  if (smartlist_len(cfx->ooo_q) == 0)
-    return NULL;
 
-  top = smartlist_get(cfx->ooo_q, 0);
-
-  /* If the top cell is the next sequence number we need, then
-   * pop and return it. */
-  if (top->seq == cfx->last_seq_delivered+1) {
-    smartlist_pqueue_pop(cfx->ooo_q, conflux_queue_cmp,
-                         offsetof(conflux_msg_t, heap_idx));
-    total_ooo_q_bytes -= sizeof(top->msg->length);
-    cfx->last_seq_delivered++;
-    return top;
-  } else {
-    return NULL;
+  /* The next message is in its ring slot, unless it was too far ahead (or a
+   * duplicate) when it arrived, in which case it is at the top of ooo_q. */
+  if (cfx->ooo_ring_len) {
+    conflux_msg_t **slot = &cfx->ooo_ring[next_seq & (cfx->ooo_ring_cap - 1)];
+    if (*slot && (*slot)->seq == next_seq) {
+      top = *slot;
+      *slot = NULL;
+      cfx->ooo_ring_len--;
+    }
+  }
+  if (!top && smartlist_len(cfx->ooo_q)) {
+    conflux_msg_t *head = smartlist_get(cfx->ooo_q, 0);
+    if (head->seq == next_seq) {
+      top = smartlist_pqueue_pop(cfx->ooo_q, conflux_queue_cmp,
+                                 offsetof(conflux_msg_t, heap_idx));
+    }
   }
+  if (!top)
+    return NULL;
+
+  total_ooo_q_bytes -= sizeof(conflux_msg_t);
+  cfx->last_seq_delivered++;
+  relay_metrics_note_latency(RELAY_LATENCY_CONFLUX_REORDER,
+                             monotime_coarse_get_stamp() - top->queued_ts);
+  return top;
 }
 
-/** Free a given conflux msg object. */
+/** Free a given conflux msg object, or keep it for reuse. */
 void
 conflux_relay_msg_free_(conflux_msg_t *msg)
 {
-  if (msg) {
-    relay_msg_free(msg->msg);
+  if (!msg)
+    return;
+
+  if (!conflux_msg_freelist)
+    conflux_msg_freelist = smartlist_new();
+  if (smartlist_len(conflux_msg_freelist) < CONFLUX_MSG_FREELIST_MAX) {
+    smartlist_add(conflux_msg_freelist, msg);
+  } else {
     tor_free(msg);
   }
 }
+
+/** Release every conflux_msg_t that we were keeping for reuse. */
+void
+conflux_msg_pool_free_all(void)
+{
+  if (!conflux_msg_freelist)
+    return;
+  SMARTLIST_FOREACH(conflux_msg_freelist, conflux_msg_t *, c_msg,
+                    tor_free(c_msg));
+  smartlist_free(conflux_msg_freelist);
+}
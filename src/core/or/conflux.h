@@ -26,7 +26,7 @@ typedef struct conflux_leg_t conflux_leg_t;
 #define CONFLUX_NUM_LEGS(cfx) (smartlist_len(cfx->legs))
 
 /** A relay message for the out-of-order queue. */
-typedef struct {
+typedef struct conflux_msg_t {
   /**
    * Absolute sequence number of this cell, computed from the
    * relative sequence number of the conflux cell. */
@@ -37,9 +37,19 @@ typedef struct {
    */
   int heap_idx;
 
+  /** When we queued this message, in the units of
+   * monotime_coarse_get_stamp(). */
+  uint32_t queued_ts;
+
   /** The relay message here is always guaranteed to have removed its
-   * extra conflux sequence number, for ease of processing */
+   * extra conflux sequence number, for ease of processing.  It points to
+   * <b>msg_storage</b>. */
   relay_msg_t *msg;
+
+  /** Storage for <b>msg</b> and its body, so that a queued message takes a
+   * single allocation that we can recycle. */
+  relay_msg_t msg_storage;
+  uint8_t body[RELAY_PAYLOAD_SIZE_MAX];
 } conflux_msg_t;
 
 size_t conflux_handle_oom(size_t bytes_to_remove);
@@ -66,6 +76,9 @@ void conflux_note_cell_sent(conflux_t *cfx, circuit_t *circ,
 void conflux_relay_msg_free_(conflux_msg_t *msg);
 #define conflux_relay_msg_free(msg) \
   FREE_AND_NULL(conflux_msg_t, conflux_relay_msg_free_, (msg))
+size_t conflux_ooo_len(const conflux_t *cfx);
+void conflux_ooo_clear(conflux_t *cfx);
+void conflux_msg_pool_free_all(void);
 
 /* Private section starts. */
 #ifdef TOR_CONFLUX_PRIVATE
@@ -75,11 +88,19 @@ conflux_leg_t *conflux_get_leg(conflux_t *cfx, const circuit_t *circ);
 uint64_t conflux_get_max_seq_recv(const conflux_t *cfx);
 uint64_t conflux_get_max_seq_sent(const conflux_t *cfx);
 
+/** Largest number of slots that a conflux set's reorder ring can have.
+ * Messages that arrive further ahead of the next expected sequence number
+ * than this go to the ooo_q priority queue instead. */
+#define CONFLUX_OOO_RING_MAX_SLOTS 4096
+
 /*
  * Unit tests declaractions.
  */
 #ifdef TOR_UNIT_TESTS
 
+STATIC conflux_msg_t *conflux_msg_new(uint64_t seq, const relay_msg_t *msg);
+STATIC void conflux_ooo_add(conflux_t *cfx, conflux_msg_t *c_msg);
+
 #endif /* defined(TOR_UNIT_TESTS) */
 
 #endif /* defined(TOR_CONFLUX_PRIVATE) */
@@ -196,7 +196,7 @@ conflux_free_(conflux_t *cfx)
   } SMARTLIST_FOREACH_END(leg);
   smartlist_free(cfx->legs);
 
-  SMARTLIST_FOREACH(cfx->ooo_q, conflux_msg_t *, cell, tor_free(cell));
+  conflux_ooo_clear(cfx);
   smartlist_free(cfx->ooo_q);
 
   memwipe(cfx->nonce, 0, sizeof(cfx->nonce));
@@ -2193,4 +2193,5 @@ conflux_pool_free_all(void)
   digest256map_free(server_linked_pool, free_conflux_void_);
   digest256map_free(client_unlinked_pool, free_unlinked_void_);
   digest256map_free(server_unlinked_pool, free_unlinked_void_);
+  conflux_msg_pool_free_all();
 }
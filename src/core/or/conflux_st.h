@@ -93,18 +93,34 @@ struct conflux_t {
   smartlist_t *legs;
 
   /**
-   * Out-of-order priority queue of conflux_cell_t *, heapified
-   * on conflux_cell_t.seq number (lowest at top of heap).
+   * Reorder ring of out-of-order messages, indexed by sequence number: the
+   * message with absolute sequence number seq, if we have it, is in slot
+   * (seq & (ooo_ring_cap - 1)).  The ring only holds messages with
+   * last_seq_delivered < seq <= last_seq_delivered + ooo_ring_cap, so
+   * queueing a message and finding the next one to deliver are both a
+   * single array access.
    *
-   * XXX: We are most likely to insert cells at either the head or the tail.
-   * Verify that is fast-path wrt smartlist priority queues, and not a memmove
-   * nightmare. If so, we may need a real linked list, or a packed_cell_t list.
+   * NULL until we first get a message out of order.  ooo_ring_cap is zero or
+   * a power of two, no larger than CONFLUX_OOO_RING_MAX_SLOTS.
+   */
+  struct conflux_msg_t **ooo_ring;
+  uint32_t ooo_ring_cap;
+  /** Number of messages in ooo_ring. */
+  uint32_t ooo_ring_len;
+
+  /**
+   * Out-of-order priority queue of conflux_msg_t *, heapified
+   * on conflux_msg_t.seq number (lowest at top of heap).
+   *
+   * This only holds the messages that don't fit in ooo_ring: those too far
+   * ahead of last_seq_delivered, and any that repeat a sequence number that
+   * is already in the ring.
    */
   smartlist_t *ooo_q;
 
   /**
    * Absolute sequence number of cells delivered to streams since start.
-   * (ie: this is updated *after* dequeue from the ooo_q priority queue). */
+   * (ie: this is updated *after* dequeue from ooo_ring or ooo_q). */
   uint64_t last_seq_delivered;
 
   /**
@@ -399,11 +399,17 @@ congestion_control_init(congestion_control_t *cc,
                         const circuit_params_t *params,
                         cc_path_t path)
 {
-  cc->sendme_pending_timestamps = smartlist_new();
-
   cc->in_slow_start = 1;
   congestion_control_init_params(cc, params, path);
 
+  /* We expect at most one SENDME per sendme_inc cells in flight. Leave room
+   * for one more, since we record the timestamp before counting the cell. */
+  ringbuf_init(&cc->sendme_pending_timestamps, sizeof(uint64_t));
+  if (cc->sendme_inc) {
+    ringbuf_reserve(&cc->sendme_pending_timestamps,
+                    (uint32_t) (cc->cwnd / cc->sendme_inc) + 1);
+  }
+
   cc->next_cc_event = CWND_UPDATE_RATE(cc);
 }
 
@@ -429,8 +435,7 @@ congestion_control_free_(congestion_control_t *cc)
   if (!cc)
     return;
 
-  SMARTLIST_FOREACH(cc->sendme_pending_timestamps, uint64_t *, t, tor_free(t));
-  smartlist_free(cc->sendme_pending_timestamps);
+  ringbuf_clear(&cc->sendme_pending_timestamps);
 
   tor_free(cc);
 }
@@ -439,33 +444,26 @@ congestion_control_free_(congestion_control_t *cc)
  * Enqueue a u64 timestamp to the end of a queue of timestamps.
  */
 STATIC inline void
-enqueue_timestamp(smartlist_t *timestamps_u64, uint64_t timestamp_usec)
+enqueue_timestamp(ringbuf_t *timestamps_u64, uint64_t timestamp_usec)
 {
-  uint64_t *timestamp_ptr = tor_malloc(sizeof(uint64_t));
-  *timestamp_ptr = timestamp_usec;
-
-  smartlist_add(timestamps_u64, timestamp_ptr);
+  memcpy(ringbuf_push(timestamps_u64), &timestamp_usec,
+         sizeof(timestamp_usec));
 }
 
 /**
  * Dequeue a u64 monotime usec timestamp from the front of a
- * smartlist of pointers to 64.
+ * queue of timestamps.
  */
 static inline uint64_t
-dequeue_timestamp(smartlist_t *timestamps_u64_usecs)
+dequeue_timestamp(ringbuf_t *timestamps_u64_usecs)
 {
-  uint64_t *timestamp_ptr = smartlist_get(timestamps_u64_usecs, 0);
   uint64_t timestamp_u64;
 
-  if (BUG(!timestamp_ptr)) {
+  if (BUG(ringbuf_pop(timestamps_u64_usecs, &timestamp_u64) < 0)) {
     log_err(LD_CIRC, "Congestion control timestamp list became empty!");
     return 0;
   }
 
-  timestamp_u64 = *timestamp_ptr;
-  smartlist_del_keeporder(timestamps_u64_usecs, 0);
-  tor_free(timestamp_ptr);
-
   return timestamp_u64;
 }
 
@@ -646,7 +644,7 @@ congestion_control_note_cell_sent(congestion_control_t *cc,
   cc->inflight++;
 
   /* Record this cell time for RTT computation when SENDME arrives */
-  enqueue_timestamp(cc->sendme_pending_timestamps,
+  enqueue_timestamp(&cc->sendme_pending_timestamps,
                     monotime_absolute_usec());
 }
 
@@ -789,7 +787,7 @@ congestion_control_update_circuit_rtt(congestion_control_t *cc,
 
   /* Get the time that we sent the cell that resulted in the other
    * end sending this sendme. Use this to calculate RTT */
-  sent_at_timestamp = dequeue_timestamp(cc->sendme_pending_timestamps);
+  sent_at_timestamp = dequeue_timestamp(&cc->sendme_pending_timestamps);
 
   rtt = now_usec - sent_at_timestamp;
 
@@ -1090,6 +1088,7 @@ congestion_control_parse_ext_request(const uint8_t *msg, const size_t msg_len)
 
   /* Go over all fields. If any field is TRUNNEL_EXT_TYPE_CC_FIELD_REQUEST,
    * then congestion control is enabled. Ignore unknown fields. */
+  ret = 0;
   for (size_t f = 0; f < num_fields; f++) {
     const trn_extension_field_t *field = trn_extension_get_fields(ext, f);
     if (field == NULL) {
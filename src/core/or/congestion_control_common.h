@@ -179,8 +179,8 @@ STATIC uint64_t congestion_control_update_circuit_rtt(congestion_control_t *,
 STATIC bool time_delta_stalled_or_jumped(const congestion_control_t *cc,
                                   uint64_t old_delta, uint64_t new_delta);
 
-STATIC void enqueue_timestamp(smartlist_t *timestamps_u64,
-                                     uint64_t timestamp_usec);
+STATIC void enqueue_timestamp(struct ringbuf_t *timestamps_u64,
+                              uint64_t timestamp_usec);
 
 /*
  * Unit tests declaractions.
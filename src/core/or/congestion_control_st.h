@@ -11,6 +11,7 @@
 
 #include "core/or/crypt_path_st.h"
 #include "core/or/circuit_st.h"
+#include "lib/container/ringbuf.h"
 
 /** Signifies which sendme algorithm to use */
 typedef enum {
@@ -101,10 +102,10 @@ struct vegas_params_t {
 /** Fields common to all congestion control algorithms */
 struct congestion_control_t {
   /**
-   * Smartlist of uint64_t monotime usec timestamps of when we sent a data
-   * cell that is pending a sendme. FIFO queue that is managed similar to
+   * FIFO queue of uint64_t monotime usec timestamps of when we sent a data
+   * cell that is pending a sendme. It is managed similar to
    * sendme_last_digests. */
-  smartlist_t *sendme_pending_timestamps;
+  ringbuf_t sendme_pending_timestamps;
 
   /** RTT time data for congestion control. */
   uint64_t ewma_rtt_usec;
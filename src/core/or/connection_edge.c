@@ -4653,6 +4653,108 @@ memeq_opt(const char *a, size_t alen, const char *b, size_t blen)
   }
 }
 
+/** The isolation fields that make up an isolation key. */
+#define ISO_KEY_FIELDS \
+  (ISO_SOCKSAUTH|ISO_CLIENTADDR|ISO_SESSIONGRP|ISO_NYM_EPOCH)
+
+/** Add the (possibly NULL) <b>len</b>-byte chunk of memory at <b>a</b> to
+ * <b>d</b>, such that two chunks add the same bytes iff memeq_opt() would
+ * call them equal. */
+static void
+isolation_key_add_opt(crypto_digest_t *d, const char *a, size_t len)
+{
+  uint8_t hdr[9];
+  hdr[0] = (a != NULL);
+  set_uint64(hdr+1, tor_htonll(a ? len : 0));
+  crypto_digest_add_bytes(d, (const char *) hdr, sizeof(hdr));
+  if (a)
+    crypto_digest_add_bytes(d, a, len);
+}
+
+/** Set <b>key_out</b> to the isolation key for the given values of the
+ * ISO_KEY_FIELDS fields. */
+static void
+isolation_key_compute(uint8_t *key_out,
+                      const char *username, size_t usernamelen,
+                      const char *password, size_t passwordlen,
+                      const tor_addr_t *client_addr,
+                      int session_group, unsigned nym_epoch)
+{
+  crypto_digest_t *d = crypto_digest_new();
+  uint8_t buf[9];
+
+  isolation_key_add_opt(d, username, usernamelen);
+  isolation_key_add_opt(d, password, passwordlen);
+
+  /* As tor_addr_eq(), treat every AF_UNIX address (and every AF_UNSPEC
+   * address) as the same. */
+  buf[0] = (uint8_t) tor_addr_family(client_addr);
+  crypto_digest_add_bytes(d, (const char *) buf, 1);
+  if (tor_addr_family(client_addr) == AF_INET) {
+    set_uint32(buf, tor_addr_to_ipv4n(client_addr));
+    crypto_digest_add_bytes(d, (const char *) buf, 4);
+  } else if (tor_addr_family(client_addr) == AF_INET6) {
+    crypto_digest_add_bytes(d,
+                   (const char *) tor_addr_to_in6_addr8(client_addr), 16);
+  }
+
+  set_uint32(buf, htonl((uint32_t) session_group));
+  set_uint32(buf+4, htonl(nym_epoch));
+  crypto_digest_add_bytes(d, (const char *) buf, 8);
+
+  crypto_digest_get_digest(d, (char *) key_out, DIGEST_LEN);
+  crypto_digest_free(d);
+}
+
+/**
+ * If every stream associated with <b>circ</b> has had the same values for
+ * all the ISO_KEY_FIELDS fields, set <b>key_out</b> to a digest of those
+ * values and return 0.  Otherwise return -1.
+ *
+ * Any stream that is isolated on all those fields, and that may use
+ * <b>circ</b> according to connection_edge_compatible_with_circuit(), has
+ * the same key (see connection_edge_get_isolation_key()).  This lets us
+ * find the circuits that such a stream might use without looking at any
+ * others.
+ */
+int
+origin_circuit_get_isolation_key(const origin_circuit_t *circ,
+                                 uint8_t *key_out)
+{
+  if (!circ->isolation_values_set ||
+      (circ->isolation_flags_mixed & ISO_KEY_FIELDS) != 0)
+    return -1;
+
+  isolation_key_compute(key_out,
+                        circ->socks_username, circ->socks_username_len,
+                        circ->socks_password, circ->socks_password_len,
+                        &circ->client_addr,
+                        circ->session_group, circ->nym_epoch);
+  return 0;
+}
+
+/**
+ * If <b>conn</b> is isolated on all the ISO_KEY_FIELDS fields, set
+ * <b>key_out</b> to its isolation key and return 0.  Otherwise return -1.
+ * See origin_circuit_get_isolation_key().
+ */
+int
+connection_edge_get_isolation_key(const entry_connection_t *conn,
+                                  uint8_t *key_out)
+{
+  const socks_request_t *sr = conn->socks_request;
+
+  if ((conn->entry_cfg.isolation_flags & ISO_KEY_FIELDS) != ISO_KEY_FIELDS)
+    return -1;
+
+  isolation_key_compute(key_out,
+                        sr->username, sr->usernamelen,
+                        sr->password, sr->passwordlen,
+                        &ENTRY_TO_CONN(conn)->addr,
+                        conn->entry_cfg.session_group, conn->nym_epoch);
+  return 0;
+}
+
 /**
  * Return true iff none of the isolation flags and fields in <b>conn</b>
  * should prevent it from being attached to <b>circ</b>.
@@ -4760,6 +4862,7 @@ connection_edge_update_circuit_isolation(const entry_connection_t *conn,
     circ->socks_password_len = sr->passwordlen;
 
     circ->isolation_values_set = 1;
+    circuit_origin_index_update(circ);
     return 0;
   } else {
     uint8_t mixed = 0;
@@ -4790,6 +4893,7 @@ connection_edge_update_circuit_isolation(const entry_connection_t *conn,
                "isolation flags.");
     }
     circ->isolation_flags_mixed |= mixed;
+    circuit_origin_index_update(circ);
     return 0;
   }
 }
@@ -4837,6 +4941,7 @@ circuit_clear_isolation(origin_circuit_t *circ)
     tor_free(circ->socks_password);
   }
   circ->socks_username_len = circ->socks_password_len = 0;
+  circuit_origin_index_update(circ);
 }
 
 /** Send an END and mark for close the given edge connection conn using the
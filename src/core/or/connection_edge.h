@@ -183,6 +183,10 @@ int connection_edge_update_circuit_isolation(const entry_connection_t *conn,
                                              origin_circuit_t *circ,
                                              int dry_run);
 void circuit_clear_isolation(origin_circuit_t *circ);
+int origin_circuit_get_isolation_key(const origin_circuit_t *circ,
+                                     uint8_t *key_out);
+int connection_edge_get_isolation_key(const entry_connection_t *conn,
+                                      uint8_t *key_out);
 streamid_t get_unique_stream_id_by_circ(origin_circuit_t *circ);
 
 void connection_edge_free_all(void);
@@ -470,7 +470,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
 /** Unpack the network-order buffer <b>src</b> into a host-order
  * cell_t structure <b>dest</b>.
  */
-static void
+void
 cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
 {
   if (wide_circ_ids) {
@@ -1634,6 +1634,17 @@ connection_or_close_for_error,(or_connection_t *orconn, int flush))
   }
 }
 
+/** Return true iff we should resume TLS sessions with relays that we have
+ * connected to before. */
+static int
+connection_or_tls_resumption_enabled(const or_options_t *options)
+{
+  /* Only public relays resume sessions: they are the only ones that can't
+   * be linked across connections by doing so, since they authenticate
+   * anyway. */
+  return public_server_mode(options) && options->TLSSessionResumption;
+}
+
 /** Begin the tls handshake with <b>conn</b>. <b>receiving</b> is 0 if
  * we initiated the connection, else it's 1.
  *
@@ -1672,6 +1683,13 @@ connection_tls_start_handshake,(or_connection_t *conn, int receiving))
   tor_tls_set_logged_address(conn->tls,
                              connection_describe_peer(TO_CONN(conn)));
 
+  if (!receiving && !tor_digest_is_zero(conn->identity_digest) &&
+      connection_or_tls_resumption_enabled(get_options()) &&
+      tor_tls_resume_session(conn->tls, conn->identity_digest)) {
+    log_debug(LD_HANDSHAKE, "Offering to resume a TLS session with %s",
+              connection_describe(TO_CONN(conn)));
+  }
+
   connection_start_reading(TO_CONN(conn));
   log_debug(LD_HANDSHAKE,"starting TLS handshake on fd "TOR_SOCKET_T_FORMAT,
             conn->base_.s);
@@ -1706,6 +1724,10 @@ connection_tls_continue_handshake(or_connection_t *conn)
       return -1;
     case TOR_TLS_DONE:
       {
+        if (tor_tls_session_was_resumed(conn->tls)) {
+          log_info(LD_HANDSHAKE, "Resumed an earlier TLS session on %s",
+                   connection_describe(TO_CONN(conn)));
+        }
         if (!tor_tls_is_server(conn->tls)) {
           tor_assert(conn->base_.state == OR_CONN_STATE_TLS_HANDSHAKING);
           return connection_or_launch_v3_or_handshake(conn);
@@ -1927,6 +1949,12 @@ connection_or_client_learned_peer_id(or_connection_t *conn,
                             (const char*)rsa_peer_id, ed_peer_id);
   }
 
+  /* The peer is the relay we meant to reach: keep any TLS session it gives
+   * us, so that we can resume it next time. */
+  if (expected_rsa_key && conn->tls &&
+      connection_or_tls_resumption_enabled(options))
+    tor_tls_keep_sessions_for(conn->tls, (const char *)rsa_peer_id);
+
   return 0;
 }
 
@@ -2173,10 +2201,58 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** Largest number of fixed-length cells that we pull off an open
+ * connection's inbuf at once. */
+#define OR_CELL_BATCH_MAX 32
+
+/** Pull up to OR_CELL_BATCH_MAX fixed-length cells off the inbuf of the open
+ * connection <b>conn</b>, and hand them to channel_tls_handle_cell().
+ * Return the number of cells that we pulled off.
+ *
+ * We hand over the cells grouped by circuit ID, keeping the cells of each
+ * circuit in the order we received them.  (Cells on different circuits
+ * don't depend on each other's order.)  That way the circuit map's
+ * one-entry cache (see circuit_get_by_circid_channel_impl()) answers every
+ * circuit lookup but the first in each group. */
+static int
+connection_or_process_cell_batch(or_connection_t *conn)
+{
+  cell_t cells[OR_CELL_BATCH_MAX];
+  uint8_t order[OR_CELL_BATCH_MAX];
+  int n_cells, i, j;
+
+  n_cells = fetch_cells_from_buf(TO_CONN(conn)->inbuf, cells,
+                                 OR_CELL_BATCH_MAX, conn->link_proto);
+  if (n_cells == 0)
+    return 0;
+
+  /* Touch the channel's active timestamp if there is one */
+  if (conn->chan)
+    channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
+
+  circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+
+  /* Stable insertion sort of the cell indices by circuit ID. */
+  for (i = 0; i < n_cells; ++i) {
+    for (j = i; j > 0 && cells[order[j-1]].circ_id > cells[i].circ_id; --j)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    if (conn->base_.marked_for_close)
+      break;
+    channel_tls_handle_cell(&cells[order[i]], conn);
+  }
+
+  return n_cells;
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Once the connection is open, we
+ * pull off fixed-length cells a batch at a time.
  *
  * Always return 0.
  */
@@ -2199,6 +2275,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
    */
 
   while (1) {
+    /* If a worker is checking the link handshake, the cells after it have
+     * to wait until it's done. */
+    if (conn->handshake_state && conn->handshake_state->link_auth_pending)
+      return 0;
     log_debug(LD_OR,
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
               "(%d pending in tls object).",
@@ -2215,6 +2295,9 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
+    } else if (conn->base_.state == OR_CONN_STATE_OPEN) {
+      if (connection_or_process_cell_batch(conn) == 0)
+        return 0; /* not yet */
     } else {
       const int wide_circ_ids = conn->wide_circ_ids;
       size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
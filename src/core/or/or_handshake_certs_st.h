@@ -40,6 +40,10 @@ struct or_handshake_certs_t {
   uint8_t *ed_rsa_crosscert;
   /** The length of <b>ed_rsa_crosscert</b> in bytes */
   size_t ed_rsa_crosscert_len;
+  /** If set, the certificate that the peer presented in the TLS handshake.
+   * We check against this instead of asking the TLS connection, so that we
+   * can check these certificates away from the main thread. */
+  struct tor_x509_cert_t *tls_peer_cert;
 };
 
 #endif /* !defined(OR_HANDSHAKE_CERTS_ST) */
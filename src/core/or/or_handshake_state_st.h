@@ -57,6 +57,11 @@ struct or_handshake_state_t {
   unsigned int digest_received_data : 1;
   /**@}*/
 
+  /** True iff a worker thread is checking the certificates or the
+   * AUTHENTICATE cell that we received on this connection.  We don't
+   * process any more cells from the connection until it is done. */
+  unsigned int link_auth_pending : 1;
+
   /** Identity RSA digest that we have received and authenticated for our peer
    * on this connection. */
   uint8_t authenticated_rsa_peer_id[DIGEST_LEN];
@@ -148,6 +148,21 @@ struct origin_circuit_t {
    * present. */
   int global_origin_circuit_list_idx;
 
+  /** Bucket of the origin circuit index that holds this circuit, or -1 if
+   * it is not indexed. See circuit_origin_index_update(). */
+  int origin_index_bucket;
+  /** Position of this circuit within its origin circuit index bucket. */
+  int origin_index_bucket_idx;
+  /** True iff this circuit is listed in the origin circuit index under
+   * origin_index_isolation_key. */
+  unsigned int origin_index_has_isolation_key : 1;
+  /** Position of this circuit within the origin circuit index's list for
+   * origin_index_isolation_key. */
+  int origin_index_isolation_idx;
+  /** The isolation key (see origin_circuit_get_isolation_key()) under
+   * which this circuit is listed in the origin circuit index. */
+  uint8_t origin_index_isolation_key[DIGEST_LEN];
+
   /** How many more relay_early cells can we send on this circuit, according
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
@@ -20,6 +20,7 @@
 #include "core/or/or.h"
 #include "feature/client/bridges.h"
 #include "app/config/config.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/policies.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/microdesc.h"
@@ -2923,6 +2924,9 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
+    if (node->ri->compiled_exit_policy)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                                         node->ri->compiled_exit_policy);
     return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
@@ -69,6 +69,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/relay/dns.h"
 #include "feature/relay/circuitbuild_relay.h"
+#include "feature/relay/relay_metrics.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/hs/hs_cache.h"
 #include "core/mainloop/mainloop.h"
@@ -2856,6 +2857,20 @@ uint64_t oom_stats_n_bytes_removed_cell = 0;
 uint64_t oom_stats_n_bytes_removed_geoip = 0;
 uint64_t oom_stats_n_bytes_removed_hsdir = 0;
 
+/** Return the total number of bytes that count against MaxMemInQueues. */
+size_t
+cell_queues_get_oom_allocation(void)
+{
+  return cell_queues_get_total_allocation() +
+    half_streams_get_total_allocation() +
+    buf_get_total_allocation() +
+    tor_compress_get_total_allocation() +
+    hs_cache_get_total_allocation() +
+    geoip_client_cache_total_allocation() +
+    dns_cache_total_allocation() +
+    conflux_get_total_bytes_allocation();
+}
+
 /** Check whether we've got too much space used for cells.  If so,
  * call the OOM handler and return 1.  Otherwise, return 0. */
 STATIC int
@@ -2863,20 +2878,14 @@ cell_queues_check_size(void)
 {
   size_t removed = 0;
   time_t now = time(NULL);
-  size_t alloc = cell_queues_get_total_allocation();
-  alloc += half_streams_get_total_allocation();
-  alloc += buf_get_total_allocation();
-  alloc += tor_compress_get_total_allocation();
-  const size_t hs_cache_total = hs_cache_get_total_allocation();
-  alloc += hs_cache_total;
-  const size_t geoip_client_cache_total =
-    geoip_client_cache_total_allocation();
-  alloc += geoip_client_cache_total;
-  const size_t dns_cache_total = dns_cache_total_allocation();
-  alloc += dns_cache_total;
-  const size_t conflux_total = conflux_get_total_bytes_allocation();
-  alloc += conflux_total;
+  size_t alloc = cell_queues_get_oom_allocation();
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
+    const size_t hs_cache_total = hs_cache_get_total_allocation();
+    const size_t geoip_client_cache_total =
+      geoip_client_cache_total_allocation();
+    const size_t dns_cache_total = dns_cache_total_allocation();
+    const size_t conflux_total = conflux_get_total_bytes_allocation();
+
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
       /* Note this overload down */
@@ -3177,11 +3186,14 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    tor_assert(cell);
 
     /* Calculate the exact time that this cell has spent in the queue. */
+    uint32_t timestamp_now = monotime_coarse_get_stamp();
+    relay_metrics_note_latency(RELAY_LATENCY_CIRCUIT_QUEUE,
+                               timestamp_now - cell->inserted_timestamp);
     if (get_options()->CellStatistics ||
         get_options()->TestingEnableCellStatsEvent) {
-      uint32_t timestamp_now = monotime_coarse_get_stamp();
       uint32_t msec_waiting =
         (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
                          timestamp_now - cell->inserted_timestamp);
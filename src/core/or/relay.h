@@ -27,6 +27,7 @@ uint32_t relay_get_param_max_circuit_cell_queue_size(
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
 size_t cell_queues_get_total_allocation(void);
+size_t cell_queues_get_oom_allocation(void);
 
 #ifdef TOR_UNIT_TESTS
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -23,6 +23,7 @@
 #include "core/or/sendme.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_flow.h"
+#include "core/or/congestion_control_st.h"
 #include "feature/nodelist/networkstatus.h"
 #include "lib/ctime/di_ops.h"
 #include "trunnel/sendme_cell.h"
@@ -49,26 +50,16 @@ get_accept_min_version(void)
                                  SENDME_ACCEPT_MIN_VERSION_MAX);
 }
 
-/* Pop the first cell digset on the given circuit from the SENDME last digests
- * list. NULL is returned if the list is uninitialized or empty.
- *
- * The caller gets ownership of the returned digest thus is responsible for
- * freeing the memory. */
-static uint8_t *
-pop_first_cell_digest(const circuit_t *circ)
+/* Pop the first cell digest on the given circuit from the SENDME last
+ * digests queue into <b>digest_out</b>, which must hold DIGEST_LEN bytes.
+ * Return false if the queue is empty. */
+static bool
+pop_first_cell_digest(circuit_t *circ, uint8_t *digest_out)
 {
-  uint8_t *circ_digest;
-
   tor_assert(circ);
+  tor_assert(digest_out);
 
-  if (circ->sendme_last_digests == NULL ||
-      smartlist_len(circ->sendme_last_digests) == 0) {
-    return NULL;
-  }
-
-  circ_digest = smartlist_get(circ->sendme_last_digests, 0);
-  smartlist_del_keeporder(circ->sendme_last_digests, 0);
-  return circ_digest;
+  return ringbuf_pop(&circ->sendme_last_digests, digest_out) == 0;
 }
 
 /* Return true iff the given cell digest matches the first digest in the
@@ -157,11 +148,11 @@ cell_version_can_be_handled(uint8_t cell_version)
  * send/recv cells on a circuit. If the SENDME is invalid, the circuit should
  * be marked for close by the caller. */
 STATIC bool
-sendme_is_valid(const circuit_t *circ, const uint8_t *cell_payload,
+sendme_is_valid(circuit_t *circ, const uint8_t *cell_payload,
                 size_t cell_payload_len)
 {
   uint8_t cell_version;
-  uint8_t *circ_digest = NULL;
+  uint8_t circ_digest[DIGEST_LEN];
   sendme_cell_t *cell = NULL;
 
   tor_assert(circ);
@@ -189,8 +180,7 @@ sendme_is_valid(const circuit_t *circ, const uint8_t *cell_payload,
   /* Pop the first element that was added (FIFO). We do that regardless of the
    * version so we don't accumulate on the circuit if v0 is used by the other
    * end point. */
-  circ_digest = pop_first_cell_digest(circ);
-  if (circ_digest == NULL) {
+  if (!pop_first_cell_digest(circ, circ_digest)) {
     /* We shouldn't have received a SENDME if we have no digests. Log at
      * protocol warning because it can be tricked by sending many SENDMEs
      * without prior data cell. */
@@ -220,11 +210,9 @@ sendme_is_valid(const circuit_t *circ, const uint8_t *cell_payload,
 
   /* Valid cell. */
   sendme_cell_free(cell);
-  tor_free(circ_digest);
   return true;
  invalid:
   sendme_cell_free(cell);
-  tor_free(circ_digest);
   return false;
 }
 
@@ -307,19 +295,39 @@ send_circuit_level_sendme(circuit_t *circ, crypt_path_t *layer_hint,
   return 0;
 }
 
+/* Return how many SENDMEs we can be waiting for at once on the given
+ * circuit, at hop <b>cpath</b> if it is set. */
+static uint32_t
+max_expected_sendmes(const circuit_t *circ, const crypt_path_t *cpath)
+{
+  const congestion_control_t *cc = cpath ? cpath->ccontrol : circ->ccontrol;
+
+  if (cc && cc->sendme_inc) {
+    /* The window may grow past this later on, in which case the digest queue
+     * grows along with it. */
+    return (uint32_t) (cc->cwnd / cc->sendme_inc) + 1;
+  }
+  return CIRCWINDOW_START_MAX / CIRCWINDOW_INCREMENT;
+}
+
 /* Record the cell digest only if the next cell is expected to be a SENDME. */
 static void
-record_cell_digest_on_circ(circuit_t *circ, const uint8_t *sendme_digest)
+record_cell_digest_on_circ(circuit_t *circ, const crypt_path_t *cpath,
+                           const uint8_t *sendme_digest)
 {
   tor_assert(circ);
   tor_assert(sendme_digest);
 
-  /* Add the digest to the last seen list in the circuit. */
-  if (circ->sendme_last_digests == NULL) {
-    circ->sendme_last_digests = smartlist_new();
+  /* Add the digest to the last seen queue in the circuit. The first time, make
+   * room for as many digests as we can expect to have at once so that we
+   * don't allocate for each SENDME. */
+  if (circ->sendme_last_digests.elt_size == 0) {
+    ringbuf_init(&circ->sendme_last_digests, DIGEST_LEN);
+    ringbuf_reserve(&circ->sendme_last_digests,
+                    max_expected_sendmes(circ, cpath));
   }
-  smartlist_add(circ->sendme_last_digests,
-                tor_memdup(sendme_digest, DIGEST_LEN));
+  memcpy(ringbuf_push(&circ->sendme_last_digests), sendme_digest,
+         DIGEST_LEN);
 }
 
 /*
@@ -717,7 +725,7 @@ sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath)
       relay_crypto_get_sendme_digest(&TO_OR_CIRCUIT(circ)->crypto);
   }
 
-  record_cell_digest_on_circ(circ, sendme_digest);
+  record_cell_digest_on_circ(circ, cpath, sendme_digest);
 }
 
 /* Called once we decrypted a cell and recognized it. Record the cell digest
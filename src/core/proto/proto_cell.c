@@ -8,8 +8,9 @@
  * @file proto_cell.c
  * @brief Decodes Tor cells from buffers.
  **/
-/* Right now it only handles variable-length cells, but eventually
- * we should refactor other cell-reading code into here. */
+/* Right now it only handles variable-length cells and runs of
+ * fixed-length cells, but eventually we should refactor other cell-reading
+ * code into here. */
 
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
@@ -17,6 +18,7 @@
 
 #include "core/or/connection_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 /** True iff the cell command <b>command</b> is one that implies a
@@ -90,3 +92,36 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   *out = result;
   return 1;
 }
+
+/** Pull as many complete fixed-length cells as we can, up to
+ * <b>max_cells</b>, off the front of <b>buf</b> according to the rules of
+ * link protocol version <b>linkproto</b>, and unpack them into
+ * <b>cells_out</b>.  Stop early at the first variable-length cell, so that
+ * the caller can handle it in order.  Return the number of cells that we
+ * pulled off. */
+int
+fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max_cells,
+                     int linkproto)
+{
+  const int wide_circ_ids = linkproto >= MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS;
+  const int circ_id_len = get_circ_id_size(wide_circ_ids);
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  int n_cells = 0;
+
+  while (n_cells < max_cells && buf_datalen(buf) >= cell_network_size) {
+    const char *head;
+    size_t head_len;
+
+    /* Unpack straight out of the buffer's memory: this only moves data
+     * around when the cell straddles two chunks. */
+    buf_pullup(buf, cell_network_size, &head, &head_len);
+    tor_assert(head_len >= cell_network_size);
+    if (cell_command_is_var_length(get_uint8(head + circ_id_len), linkproto))
+      break;
+
+    cell_unpack(&cells_out[n_cells++], head, wide_circ_ids);
+    buf_drain(buf, cell_network_size);
+  }
+
+  return n_cells;
+}
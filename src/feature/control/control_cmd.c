@@ -1356,11 +1356,14 @@ handle_control_usefeature(control_connection_t *conn,
 {
   const smartlist_t *args = cmd_args->args;
   int bad = 0;
+  int compact_bw_events = 0;
   SMARTLIST_FOREACH_BEGIN(args, const char *, arg) {
       if (!strcasecmp(arg, "VERBOSE_NAMES"))
         ;
       else if (!strcasecmp(arg, "EXTENDED_EVENTS"))
         ;
+      else if (!strcasecmp(arg, "COMPACT_BW_EVENTS"))
+        compact_bw_events = 1;
       else {
         control_printf_endreply(conn, 552, "Unrecognized feature \"%s\"",
                                 arg);
@@ -1370,6 +1373,10 @@ handle_control_usefeature(control_connection_t *conn,
   } SMARTLIST_FOREACH_END(arg);
 
   if (!bad) {
+    if (compact_bw_events && !conn->use_compact_bw_events) {
+      conn->use_compact_bw_events = 1;
+      control_update_global_event_mask();
+    }
     send_control_done(conn);
   }
 
@@ -28,6 +28,9 @@ struct control_connection_t {
   /** True if we have received a takeownership command on this
    * connection. */
   unsigned int is_owning_control_connection:1;
+  /** True if this controller asked for the COMPACT_BW_EVENTS feature, and
+   * wants its once-per-second CIRC_BW and STREAM_BW events batched. */
+  unsigned int use_compact_bw_events:1;
 
   /** List of ephemeral onion services belonging to this connection. */
   smartlist_t *ephemeral_onion_services;
@@ -39,11 +39,13 @@
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/encoding/confline.h"
 
 static void flush_queued_events_cb(mainloop_event_t *event, void *arg);
 static void control_get_bytes_rw_last_sec(uint64_t *r, uint64_t *w);
+static void circ_bw_clear(origin_circuit_t *ocirc);
 
 /** Yield true iff <b>s</b> is the state of a control_connection_t that has
  * finished authentication and is accepting commands. */
@@ -53,6 +55,14 @@ static void control_get_bytes_rw_last_sec(uint64_t *r, uint64_t *w);
  * receiving. */
 static event_mask_t global_event_mask = 0;
 
+/** An event mask of all the events that some controller using the
+ * COMPACT_BW_EVENTS feature is interested in receiving. */
+static event_mask_t global_compact_event_mask = 0;
+
+/** An event mask of all the events that some controller <em>not</em> using
+ * the COMPACT_BW_EVENTS feature is interested in receiving. */
+static event_mask_t global_full_event_mask = 0;
+
 /** True iff we have disabled log messages from being sent to the controller */
 static int disable_log_messages = 0;
 
@@ -65,6 +75,16 @@ static int disable_log_messages = 0;
 #define ANY_EVENT_IS_INTERESTING(e) \
   (!! (global_event_mask & (e)))
 
+/** Macro: true if some controller wants events of type <b>e</b> in their
+ * ordinary one-line-per-event format. */
+#define EVENT_WANTS_FULL(e) \
+  (!! (global_full_event_mask & EVENT_MASK_(e)))
+
+/** Macro: true if some controller wants events of type <b>e</b> in the
+ * batched COMPACT_BW_EVENTS format. */
+#define EVENT_WANTS_COMPACT(e) \
+  (!! (global_compact_event_mask & EVENT_MASK_(e)))
+
 static void send_control_event_impl(uint16_t event,
                                     const char *format, va_list ap)
   CHECK_PRINTF(2,0);
@@ -131,16 +151,8 @@ log_severity_to_event(int severity)
 static void
 clear_circ_bw_fields(void)
 {
-  origin_circuit_t *ocirc;
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    ocirc = TO_ORIGIN_CIRCUIT(circ);
-    ocirc->n_written_circ_bw = ocirc->n_read_circ_bw = 0;
-    ocirc->n_overhead_written_circ_bw = ocirc->n_overhead_read_circ_bw = 0;
-    ocirc->n_delivered_written_circ_bw = ocirc->n_delivered_read_circ_bw = 0;
-  }
-  SMARTLIST_FOREACH_END(circ);
+  SMARTLIST_FOREACH(circuit_get_global_origin_circuit_list(),
+                    origin_circuit_t *, ocirc, circ_bw_clear(ocirc));
 }
 
 /* Helper to emit the BUILDTIMEOUT_SET circuit build time event */
@@ -212,12 +224,18 @@ control_update_global_event_mask(void)
   int any_old_per_sec_events = control_any_per_second_event_enabled();
 
   global_event_mask = 0;
+  global_compact_event_mask = 0;
+  global_full_event_mask = 0;
   SMARTLIST_FOREACH(conns, connection_t *, _conn,
   {
     if (_conn->type == CONN_TYPE_CONTROL &&
         STATE_IS_OPEN(_conn->state)) {
       control_connection_t *conn = TO_CONTROL_CONN(_conn);
       global_event_mask |= conn->event_mask;
+      if (conn->use_compact_bw_events)
+        global_compact_event_mask |= conn->event_mask;
+      else
+        global_full_event_mask |= conn->event_mask;
     }
   });
 
@@ -380,6 +398,9 @@ control_per_second_events(void)
  * controllers. */
 typedef struct queued_event_t {
   uint16_t event;
+  /** Which controllers should receive this event, depending on whether they
+   * use the COMPACT_BW_EVENTS feature. */
+  control_event_encoding_t encoding;
   char *msg;
 } queued_event_t;
 
@@ -434,8 +455,9 @@ get_block_event_queue(void)
   return val;
 }
 
-/** Helper: inserts an event on the list of events queued to be sent to
- * one or more controllers, and schedules the events to be flushed if needed.
+/** Helper: inserts an event on the list of events queued to be sent to the
+ * controllers that <b>encoding</b> selects, and schedules the events to be
+ * flushed if needed.  <b>msg</b> may hold several event lines at once.
  *
  * This function takes ownership of <b>msg</b>, and may free it.
  *
@@ -446,7 +468,9 @@ get_block_event_queue(void)
  * of Tor.
  */
 MOCK_IMPL(STATIC void,
-queue_control_event_string,(uint16_t event, char *msg))
+queue_control_event_string_encoded,(uint16_t event,
+                                    control_event_encoding_t encoding,
+                                    char *msg))
 {
   /* This is redundant with checks done elsewhere, but it's a last-ditch
    * attempt to avoid queueing something we shouldn't have to queue. */
@@ -463,6 +487,7 @@ queue_control_event_string,(uint16_t event, char *msg))
 
   queued_event_t *ev = tor_malloc(sizeof(*ev));
   ev->event = event;
+  ev->encoding = encoding;
   ev->msg = msg;
 
   /* No queueing an event while queueing an event */
@@ -492,6 +517,18 @@ queue_control_event_string,(uint16_t event, char *msg))
   }
 }
 
+/** Helper: inserts an event on the list of events queued to be sent to
+ * every controller that wants it, and schedules the events to be flushed if
+ * needed.
+ *
+ * This function takes ownership of <b>msg</b>, and may free it.
+ */
+MOCK_IMPL(STATIC void,
+queue_control_event_string,(uint16_t event, char *msg))
+{
+  queue_control_event_string_encoded(event, CONTROL_EVENT_ENC_ANY, msg);
+}
+
 #define queued_event_free(ev) \
   FREE_AND_NULL(queued_event_t, queued_event_free_, (ev))
 
@@ -544,18 +581,57 @@ queued_events_flush_all(int force)
     }
   } SMARTLIST_FOREACH_END(conn);
 
-  SMARTLIST_FOREACH_BEGIN(queued_events, queued_event_t *, ev) {
-    const event_mask_t bit = ((event_mask_t)1) << ev->event;
-    const size_t msg_len = strlen(ev->msg);
+  /* Runs of consecutive events of the same type usually come from a single
+   * burst (for example, the once-per-second bandwidth events), so we join
+   * each run into one buffer and hand it to every interested controller at
+   * once, rather than walking the controllers again for every event. */
+  const int n_events = smartlist_len(queued_events);
+  for (int run_start = 0; run_start < n_events; ) {
+    const queued_event_t *first = smartlist_get(queued_events, run_start);
+    const event_mask_t bit = ((event_mask_t)1) << first->event;
+    int run_end = run_start + 1;
+    size_t run_len = strlen(first->msg);
+    while (run_end < n_events) {
+      const queued_event_t *ev = smartlist_get(queued_events, run_end);
+      if (ev->event != first->event || ev->encoding != first->encoding)
+        break;
+      run_len += strlen(ev->msg);
+      ++run_end;
+    }
+
+    const char *run_msg = first->msg;
+    char *joined = NULL;
+    if (run_end - run_start > 1) {
+      char *cp = joined = tor_malloc(run_len + 1);
+      for (int i = run_start; i < run_end; ++i) {
+        const queued_event_t *ev = smartlist_get(queued_events, i);
+        size_t len = strlen(ev->msg);
+        memcpy(cp, ev->msg, len);
+        cp += len;
+      }
+      *cp = '\0';
+      run_msg = joined;
+    }
+
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
                             control_conn) {
-      if (control_conn->event_mask & bit) {
-        connection_buf_add(ev->msg, msg_len, TO_CONN(control_conn));
-      }
+      if (!(control_conn->event_mask & bit))
+        continue;
+      if (first->encoding == CONTROL_EVENT_ENC_FULL &&
+          control_conn->use_compact_bw_events)
+        continue;
+      if (first->encoding == CONTROL_EVENT_ENC_COMPACT &&
+          !control_conn->use_compact_bw_events)
+        continue;
+      connection_buf_add(run_msg, run_len, TO_CONN(control_conn));
     } SMARTLIST_FOREACH_END(control_conn);
 
-    queued_event_free(ev);
-  } SMARTLIST_FOREACH_END(ev);
+    tor_free(joined);
+    run_start = run_end;
+  }
+
+  SMARTLIST_FOREACH(queued_events, queued_event_t *, ev,
+                    queued_event_free(ev));
 
   if (force) {
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
@@ -968,6 +1044,119 @@ control_event_or_conn_status(or_connection_t *conn, or_conn_status_event_t tp,
   return 0;
 }
 
+/** Append the STREAM_BW line for <b>edge_conn</b> to <b>buf</b>, using
+ * <b>tbuf</b> as its timestamp.  If <b>compact</b> is true, append the line
+ * in the format that COMPACT_BW_EVENTS uses instead. */
+static void
+stream_bw_add_line(buf_t *buf, const edge_connection_t *edge_conn,
+                   const char *tbuf, bool compact)
+{
+  char line[128];
+  if (compact) {
+    tor_snprintf(line, sizeof(line), "%"PRIu64" %lu %lu\r\n",
+                 (edge_conn->base_.global_identifier),
+                 (unsigned long)edge_conn->n_read,
+                 (unsigned long)edge_conn->n_written);
+  } else {
+    tor_snprintf(line, sizeof(line),
+                 "650 STREAM_BW %"PRIu64" %lu %lu %s\r\n",
+                 (edge_conn->base_.global_identifier),
+                 (unsigned long)edge_conn->n_read,
+                 (unsigned long)edge_conn->n_written,
+                 tbuf);
+  }
+  buf_add_string(buf, line);
+}
+
+/** Append the CIRC_BW line for <b>ocirc</b> to <b>buf</b>, using
+ * <b>tbuf</b> as its timestamp.  If <b>compact</b> is true, append the line
+ * in the format that COMPACT_BW_EVENTS uses instead.  <b>ccontrol_fields</b>,
+ * if not NULL, holds the congestion control fields for the circuit. */
+static void
+circ_bw_add_line(buf_t *buf, const origin_circuit_t *ocirc,
+                 const char *tbuf, const char *ccontrol_fields,
+                 bool compact)
+{
+  char line[256];
+  if (compact) {
+    tor_snprintf(line, sizeof(line), "%d %lu %lu %lu %lu %lu %lu",
+                 ocirc->global_identifier,
+                 (unsigned long)ocirc->n_read_circ_bw,
+                 (unsigned long)ocirc->n_written_circ_bw,
+                 (unsigned long)ocirc->n_delivered_read_circ_bw,
+                 (unsigned long)ocirc->n_overhead_read_circ_bw,
+                 (unsigned long)ocirc->n_delivered_written_circ_bw,
+                 (unsigned long)ocirc->n_overhead_written_circ_bw);
+  } else {
+    tor_snprintf(line, sizeof(line),
+                 "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu TIME=%s "
+                 "DELIVERED_READ=%lu OVERHEAD_READ=%lu "
+                 "DELIVERED_WRITTEN=%lu OVERHEAD_WRITTEN=%lu",
+                 ocirc->global_identifier,
+                 (unsigned long)ocirc->n_read_circ_bw,
+                 (unsigned long)ocirc->n_written_circ_bw,
+                 tbuf,
+                 (unsigned long)ocirc->n_delivered_read_circ_bw,
+                 (unsigned long)ocirc->n_overhead_read_circ_bw,
+                 (unsigned long)ocirc->n_delivered_written_circ_bw,
+                 (unsigned long)ocirc->n_overhead_written_circ_bw);
+  }
+  buf_add_string(buf, line);
+  if (ccontrol_fields)
+    buf_add_string(buf, ccontrol_fields);
+  buf_add(buf, "\r\n", 2);
+}
+
+/** Reset the CIRC_BW counters on <b>ocirc</b> once they have been
+ * reported. */
+static void
+circ_bw_clear(origin_circuit_t *ocirc)
+{
+  ocirc->n_written_circ_bw = ocirc->n_read_circ_bw = 0;
+  ocirc->n_overhead_written_circ_bw = ocirc->n_overhead_read_circ_bw = 0;
+  ocirc->n_delivered_written_circ_bw = ocirc->n_delivered_read_circ_bw = 0;
+}
+
+/** Queue the once-per-second bandwidth events of type <b>event</b> (whose
+ * name is <b>name</b>) that we gathered for <b>n_entries</b> streams or
+ * circuits at time <b>tbuf</b>.
+ *
+ * <b>full</b>, if not NULL, holds one ordinary event line per entry; it is
+ * queued as a single message for controllers that don't use
+ * COMPACT_BW_EVENTS.  <b>compact</b>, if not NULL, holds the compact lines
+ * for the other controllers: they receive them as one multi-line event whose
+ * first line gives the number of entries and the length of the body in
+ * bytes, so that they can read the whole batch without scanning it.
+ *
+ * Frees <b>full</b> and <b>compact</b>. */
+static void
+queue_bw_event_batch(uint16_t event, const char *name, const char *tbuf,
+                     int n_entries, buf_t *full, buf_t *compact)
+{
+  if (n_entries == 0)
+    goto done;
+
+  if (full) {
+    queue_control_event_string_encoded(event, CONTROL_EVENT_ENC_FULL,
+                                       buf_extract(full, NULL));
+  }
+  if (compact) {
+    size_t body_len = 0;
+    char *body = buf_extract(compact, &body_len);
+    char *msg = NULL;
+    tor_asprintf(&msg, "650+%s_COMPACT TIME=%s COUNT=%d "
+                 "LENGTH=%"TOR_PRIuSZ"\r\n%s.\r\n650 OK\r\n",
+                 name, tbuf, n_entries, body_len, body);
+    tor_free(body);
+    queue_control_event_string_encoded(event, CONTROL_EVENT_ENC_COMPACT,
+                                       msg);
+  }
+
+ done:
+  buf_free(full);
+  buf_free(compact);
+}
+
 /**
  * Print out STREAM_BW event for a single conn
  */
@@ -982,12 +1171,18 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
 
     tor_gettimeofday(&now);
     format_iso_time_nospace_usec(tbuf, &now);
-    send_control_event(EVENT_STREAM_BANDWIDTH_USED,
-                       "650 STREAM_BW %"PRIu64" %lu %lu %s\r\n",
-                       (edge_conn->base_.global_identifier),
-                       (unsigned long)edge_conn->n_read,
-                       (unsigned long)edge_conn->n_written,
-                       tbuf);
+
+    buf_t *full = NULL, *compact = NULL;
+    if (EVENT_WANTS_FULL(EVENT_STREAM_BANDWIDTH_USED)) {
+      full = buf_new();
+      stream_bw_add_line(full, edge_conn, tbuf, false);
+    }
+    if (EVENT_WANTS_COMPACT(EVENT_STREAM_BANDWIDTH_USED)) {
+      compact = buf_new();
+      stream_bw_add_line(compact, edge_conn, tbuf, true);
+    }
+    queue_bw_event_batch(EVENT_STREAM_BANDWIDTH_USED, "STREAM_BW", tbuf,
+                         1, full, compact);
 
     edge_conn->n_written = edge_conn->n_read = 0;
   }
@@ -996,56 +1191,96 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
 }
 
 /** A second or more has elapsed: tell any interested control
- * connections how much bandwidth streams have used. */
+ * connections how much bandwidth streams have used.
+ *
+ * All the streams share one timestamp, and their lines are queued together
+ * as one message per format. */
 int
 control_event_stream_bandwidth_used(void)
 {
-  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
-    smartlist_t *conns = get_connection_array();
-    edge_connection_t *edge_conn;
-    struct timeval now;
-    char tbuf[ISO_TIME_USEC_LEN+1];
+  if (!EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED))
+    return 0;
 
-    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
-    {
-        if (conn->type != CONN_TYPE_AP)
-          continue;
-        edge_conn = TO_EDGE_CONN(conn);
-        if (!edge_conn->n_read && !edge_conn->n_written)
-          continue;
-
-        tor_gettimeofday(&now);
-        format_iso_time_nospace_usec(tbuf, &now);
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED,
-                           "650 STREAM_BW %"PRIu64" %lu %lu %s\r\n",
-                           (edge_conn->base_.global_identifier),
-                           (unsigned long)edge_conn->n_read,
-                           (unsigned long)edge_conn->n_written,
-                           tbuf);
+  smartlist_t *conns = get_connection_array();
+  buf_t *full = NULL, *compact = NULL;
+  struct timeval now;
+  char tbuf[ISO_TIME_USEC_LEN+1];
+  int n_entries = 0;
 
-        edge_conn->n_written = edge_conn->n_read = 0;
-    }
-    SMARTLIST_FOREACH_END(conn);
-  }
+  if (EVENT_WANTS_FULL(EVENT_STREAM_BANDWIDTH_USED))
+    full = buf_new();
+  if (EVENT_WANTS_COMPACT(EVENT_STREAM_BANDWIDTH_USED))
+    compact = buf_new();
+
+  tor_gettimeofday(&now);
+  format_iso_time_nospace_usec(tbuf, &now);
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    if (conn->type != CONN_TYPE_AP)
+      continue;
+    edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+    if (!edge_conn->n_read && !edge_conn->n_written)
+      continue;
+
+    if (full)
+      stream_bw_add_line(full, edge_conn, tbuf, false);
+    if (compact)
+      stream_bw_add_line(compact, edge_conn, tbuf, true);
+    ++n_entries;
+
+    edge_conn->n_written = edge_conn->n_read = 0;
+  } SMARTLIST_FOREACH_END(conn);
+
+  queue_bw_event_batch(EVENT_STREAM_BANDWIDTH_USED, "STREAM_BW", tbuf,
+                       n_entries, full, compact);
 
   return 0;
 }
 
 /** A second or more has elapsed: tell any interested control connections
- * how much bandwidth origin circuits have used. */
+ * how much bandwidth origin circuits have used.
+ *
+ * As with control_event_stream_bandwidth_used(), the circuits share one
+ * timestamp and are queued together. */
 int
 control_event_circ_bandwidth_used(void)
 {
   if (!EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
     return 0;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!CIRCUIT_IS_ORIGIN(circ))
+  buf_t *full = NULL, *compact = NULL;
+  struct timeval now;
+  char tbuf[ISO_TIME_USEC_LEN+1];
+  int n_entries = 0;
+
+  if (EVENT_WANTS_FULL(EVENT_CIRC_BANDWIDTH_USED))
+    full = buf_new();
+  if (EVENT_WANTS_COMPACT(EVENT_CIRC_BANDWIDTH_USED))
+    compact = buf_new();
+
+  tor_gettimeofday(&now);
+  format_iso_time_nospace_usec(tbuf, &now);
+
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, ocirc) {
+    /* See control_event_circ_bandwidth_used_for_circ() for why this check
+     * is sufficient. */
+    if (!ocirc->n_read_circ_bw && !ocirc->n_written_circ_bw)
       continue;
 
-    control_event_circ_bandwidth_used_for_circ(TO_ORIGIN_CIRCUIT(circ));
-  }
-  SMARTLIST_FOREACH_END(circ);
+    char *ccontrol_buf = congestion_control_get_control_port_fields(ocirc);
+    if (full)
+      circ_bw_add_line(full, ocirc, tbuf, ccontrol_buf, false);
+    if (compact)
+      circ_bw_add_line(compact, ocirc, tbuf, ccontrol_buf, true);
+    tor_free(ccontrol_buf);
+    ++n_entries;
+
+    circ_bw_clear(ocirc);
+  } SMARTLIST_FOREACH_END(ocirc);
+
+  queue_bw_event_batch(EVENT_CIRC_BANDWIDTH_USED, "CIRC_BW", tbuf,
+                       n_entries, full, compact);
 
   return 0;
 }
@@ -1081,27 +1316,23 @@ control_event_circ_bandwidth_used_for_circ(origin_circuit_t *ocirc)
   tor_gettimeofday(&now);
   format_iso_time_nospace_usec(tbuf, &now);
 
+  /* Each kind of controller gets this circuit in its own format, just as
+   * in control_event_circ_bandwidth_used(). */
   char *ccontrol_buf = congestion_control_get_control_port_fields(ocirc);
-  send_control_event(EVENT_CIRC_BANDWIDTH_USED,
-                     "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu TIME=%s "
-                     "DELIVERED_READ=%lu OVERHEAD_READ=%lu "
-                     "DELIVERED_WRITTEN=%lu OVERHEAD_WRITTEN=%lu%s\r\n",
-                     ocirc->global_identifier,
-                     (unsigned long)ocirc->n_read_circ_bw,
-                     (unsigned long)ocirc->n_written_circ_bw,
-                     tbuf,
-                     (unsigned long)ocirc->n_delivered_read_circ_bw,
-                     (unsigned long)ocirc->n_overhead_read_circ_bw,
-                     (unsigned long)ocirc->n_delivered_written_circ_bw,
-                     (unsigned long)ocirc->n_overhead_written_circ_bw,
-                     ccontrol_buf ? ccontrol_buf : "");
-
-  ocirc->n_written_circ_bw = ocirc->n_read_circ_bw = 0;
-  ocirc->n_overhead_written_circ_bw = ocirc->n_overhead_read_circ_bw = 0;
-  ocirc->n_delivered_written_circ_bw = ocirc->n_delivered_read_circ_bw = 0;
+  buf_t *full = NULL, *compact = NULL;
+  if (EVENT_WANTS_FULL(EVENT_CIRC_BANDWIDTH_USED)) {
+    full = buf_new();
+    circ_bw_add_line(full, ocirc, tbuf, ccontrol_buf, false);
+  }
+  if (EVENT_WANTS_COMPACT(EVENT_CIRC_BANDWIDTH_USED)) {
+    compact = buf_new();
+    circ_bw_add_line(compact, ocirc, tbuf, ccontrol_buf, true);
+  }
+  queue_bw_event_batch(EVENT_CIRC_BANDWIDTH_USED, "CIRC_BW", tbuf,
+                       1, full, compact);
+  tor_free(ccontrol_buf);
 
-  if (ccontrol_buf)
-    tor_free(ccontrol_buf);
+  circ_bw_clear(ocirc);
 
   return 0;
 }
@@ -2308,6 +2539,17 @@ control_events_free_all(void)
 void
 control_testing_set_global_event_mask(uint64_t mask)
 {
-  global_event_mask = mask;
+  control_testing_set_event_masks(mask, 0);
+}
+
+/** Pretend that controllers not using COMPACT_BW_EVENTS want the events in
+ * <b>full_mask</b>, and that controllers using it want the events in
+ * <b>compact_mask</b>. */
+void
+control_testing_set_event_masks(uint64_t full_mask, uint64_t compact_mask)
+{
+  global_full_event_mask = full_mask;
+  global_compact_event_mask = compact_mask;
+  global_event_mask = full_mask | compact_mask;
 }
 #endif /* defined(TOR_UNIT_TESTS) */
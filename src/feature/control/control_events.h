@@ -343,6 +343,16 @@ extern const struct control_event_t control_event_table[];
 
 void control_logmsg_strip_newlines(char *msg);
 
+/** Which controllers should receive a queued event. */
+typedef enum control_event_encoding_t {
+  /** Every controller that wants the event. */
+  CONTROL_EVENT_ENC_ANY = 0,
+  /** Only controllers not using the COMPACT_BW_EVENTS feature. */
+  CONTROL_EVENT_ENC_FULL,
+  /** Only controllers using the COMPACT_BW_EVENTS feature. */
+  CONTROL_EVENT_ENC_COMPACT,
+} control_event_encoding_t;
+
 #ifdef TOR_UNIT_TESTS
 MOCK_DECL(STATIC void,
           send_control_event_string,(uint16_t event, const char *msg));
@@ -350,7 +360,14 @@ MOCK_DECL(STATIC void,
 MOCK_DECL(STATIC void,
           queue_control_event_string,(uint16_t event, char *msg));
 
+MOCK_DECL(STATIC void,
+          queue_control_event_string_encoded,(uint16_t event,
+                                        control_event_encoding_t encoding,
+                                        char *msg));
+
 void control_testing_set_global_event_mask(uint64_t mask);
+void control_testing_set_event_masks(uint64_t full_mask,
+                                     uint64_t compact_mask);
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
@@ -128,7 +128,7 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
 
     smartlist_free(signal_names);
   } else if (!strcmp(question, "features/names")) {
-    *answer = tor_strdup("VERBOSE_NAMES EXTENDED_EVENTS");
+    *answer = tor_strdup("VERBOSE_NAMES EXTENDED_EVENTS COMPACT_BW_EVENTS");
   } else if (!strcmp(question, "address") || !strcmp(question, "address/v4")) {
     tor_addr_t addr;
     if (!relay_find_addr_to_publish(get_options(), AF_INET,
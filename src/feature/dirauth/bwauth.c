@@ -65,7 +65,47 @@ typedef struct mbw_cache_entry_t {
 
 /** Measured bandwidth cache - keys are identity_digests, values are
  * mbw_cache_entry_t *. */
-static digestmap_t *mbw_cache = NULL;
+static digestflatmap_t *mbw_cache = NULL;
+
+/** A bandwidth file that we have already parsed.  We read the bandwidth file
+ * twice for every vote we build, and it rarely changes in between, so we
+ * keep the result of parsing it around until the file changes. */
+typedef struct bw_file_cache_t {
+  /** The name of the file we parsed. */
+  char *fname;
+  /** The modification time of the file when we parsed it. */
+  time_t mtime;
+  /** The SHA256 digest of the whole file when we parsed it. */
+  uint8_t digest[DIGEST256_LEN];
+  /** The header lines that came after the timestamp, without their
+   * newlines.  We keep at most MAX_BW_FILE_HEADER_COUNT_IN_VOTE of them. */
+  smartlist_t *headers;
+  /** The relay lines that we could parse, in the order they appear in the
+   * file. */
+  measured_bw_line_t *lines;
+  /** The number of entries in <b>lines</b>. */
+  int n_lines;
+} bw_file_cache_t;
+
+/** The last bandwidth file that we parsed, or NULL if we have none. */
+static bw_file_cache_t *bw_file_cache = NULL;
+
+/** Release all storage held in <b>bwf</b>. */
+static void
+bw_file_cache_free_(bw_file_cache_t *bwf)
+{
+  if (!bwf)
+    return;
+  tor_free(bwf->fname);
+  if (bwf->headers) {
+    SMARTLIST_FOREACH(bwf->headers, char *, h, tor_free(h));
+    smartlist_free(bwf->headers);
+  }
+  tor_free(bwf->lines);
+  tor_free(bwf);
+}
+#define bw_file_cache_free(bwf) \
+  FREE_AND_NULL(bw_file_cache_t, bw_file_cache_free_, (bwf))
 
 /** Store a measured bandwidth cache entry when reading the measured
  * bandwidths file. */
@@ -78,10 +118,10 @@ dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
   tor_assert(parsed_line);
 
   /* Allocate a cache if we need */
-  if (!mbw_cache) mbw_cache = digestmap_new();
+  if (!mbw_cache) mbw_cache = digestflatmap_new();
 
   /* Check if we have an existing entry */
-  e = digestmap_get(mbw_cache, parsed_line->node_id);
+  e = digestflatmap_get(mbw_cache, parsed_line->node_id);
   /* If we do, we can re-use it */
   if (e) {
     /* Check that we really are newer, and update */
@@ -94,19 +134,21 @@ dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
     e = tor_malloc(sizeof(*e));
     e->mbw_kb = parsed_line->bw_kb;
     e->as_of = as_of;
-    digestmap_set(mbw_cache, parsed_line->node_id, e);
+    digestflatmap_set(mbw_cache, parsed_line->node_id, e);
   }
 }
 
-/** Clear and free the measured bandwidth cache */
+/** Clear and free the measured bandwidth cache, and forget the last
+ * bandwidth file that we parsed. */
 void
 dirserv_clear_measured_bw_cache(void)
 {
   if (mbw_cache) {
     /* Free the map and all entries */
-    digestmap_free(mbw_cache, tor_free_);
+    digestflatmap_free(mbw_cache, tor_free_);
     mbw_cache = NULL;
   }
+  bw_file_cache_free(bw_file_cache);
 }
 
 /** Scan the measured bandwidth cache and remove expired entries */
@@ -116,16 +158,16 @@ dirserv_expire_measured_bw_cache(time_t now)
 
   if (mbw_cache) {
     /* Iterate through the cache and check each entry */
-    DIGESTMAP_FOREACH_MODIFY(mbw_cache, k, mbw_cache_entry_t *, e) {
+    DIGESTFLATMAP_FOREACH_MODIFY(mbw_cache, k, mbw_cache_entry_t *, e) {
       if (now > e->as_of + MAX_MEASUREMENT_AGE) {
         tor_free(e);
         MAP_DEL_CURRENT(k);
       }
-    } DIGESTMAP_FOREACH_END;
+    } DIGESTFLATMAP_FOREACH_END;
 
     /* Check if we cleared the whole thing and free if so */
-    if (digestmap_size(mbw_cache) == 0) {
-      digestmap_free(mbw_cache, tor_free_);
+    if (digestflatmap_size(mbw_cache) == 0) {
+      digestflatmap_free(mbw_cache, tor_free_);
       mbw_cache = 0;
     }
   }
@@ -142,7 +184,7 @@ dirserv_query_measured_bw_cache_kb(const char *node_id, long *bw_kb_out,
   int rv = 0;
 
   if (mbw_cache && node_id) {
-    v = digestmap_get(mbw_cache, node_id);
+    v = digestflatmap_get(mbw_cache, node_id);
     if (v) {
       /* Found something */
       rv = 1;
@@ -165,7 +207,7 @@ dirserv_has_measured_bw(const char *node_id)
 int
 dirserv_get_measured_bw_cache_size(void)
 {
-  if (mbw_cache) return digestmap_size(mbw_cache);
+  if (mbw_cache) return digestflatmap_size(mbw_cache);
   else return 0;
 }
 
@@ -200,6 +242,260 @@ dirserv_get_credible_bandwidth_kb(const routerinfo_t *ri)
   return bw_kb;
 }
 
+/** Log <b>msg</b> at <b>severity</b>, followed by an escaped copy of the
+ * <b>len</b>-byte bandwidth file line at <b>line</b>. */
+#define LOG_BW_LINE(severity, msg, line, len) STMT_BEGIN                \
+    char *line_copy_ = tor_memdup_nulterm((line), (len));               \
+    log_fn((severity), LD_DIRSERV, msg ": %s", escaped(line_copy_));    \
+    tor_free(line_copy_);                                               \
+  STMT_END
+
+/** Return true iff the <b>len</b>-byte token at <b>tok</b> starts with the
+ * string literal <b>prefix</b>. */
+#define BW_TOKEN_STARTS_WITH(tok, len, prefix)                          \
+  ((len) >= strlen(prefix) && fast_memeq((tok), (prefix), strlen(prefix)))
+
+/** Parse the <b>len</b>-byte bandwidth value at <b>s</b> into *<b>out</b>.
+ * Return true on success, and false if it isn't a valid bandwidth. */
+static int
+measured_bw_parse_value(const char *s, size_t len, long *out)
+{
+  char buf[32];
+  char *str = buf;
+  char *endptr = NULL;
+  int ok = 0;
+  size_t i;
+
+  /* Almost every value is a short run of digits.  Nine of them fit in a
+   * long even where it is 32 bits; anything longer gets the range check
+   * below. */
+  if (len > 0 && len <= 9) {
+    long v = 0;
+    for (i = 0; i < len && TOR_ISDIGIT(s[i]); ++i)
+      v = v * 10 + (s[i] - '0');
+    if (i == len) {
+      *out = v;
+      return 1;
+    }
+  }
+
+  /* Otherwise, do whatever tor_parse_long() would. */
+  if (len < sizeof(buf)) {
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+  } else {
+    str = tor_memdup_nulterm(s, len);
+  }
+  *out = tor_parse_long(str, 10, 0, LONG_MAX, &ok, &endptr);
+  if (ok && *endptr && !TOR_ISSPACE(*endptr))
+    ok = 0;
+  if (str != buf)
+    tor_free(str);
+  return ok;
+}
+
+/** As measured_bw_line_parse(), but parse the <b>len</b>-byte line at
+ * <b>line</b>, which need not be NUL-terminated.  Scan the line in place,
+ * without copying it. */
+static int
+measured_bw_line_parse_buf(measured_bw_line_t *out, const char *line,
+                           size_t len, int line_is_after_headers)
+{
+  const char *cp = line, *eol = line + len;
+  int got_bw = 0;
+  int got_node_id = 0;
+
+  if (len == 0) {
+    log_warn(LD_DIRSERV, "Empty line in bandwidth file");
+    return -1;
+  }
+
+  /* Leave out the end of line character, so that is not part of a token */
+  if (eol[-1] == '\n')
+    --eol;
+
+  while (cp < eol && (*cp == ' ' || *cp == '\t'))
+    ++cp;
+  if (cp == eol) {
+    LOG_BW_LINE(LOG_WARN, "Invalid line in bandwidth file", line, len);
+    return -1;
+  }
+
+  if (line[len-1] != '\n') {
+    LOG_BW_LINE(LOG_WARN, "Incomplete line in bandwidth file", line, len);
+    return -1;
+  }
+
+  while (cp < eol) {
+    const char *tok = cp;
+    size_t tok_len;
+    while (cp < eol && *cp != ' ' && *cp != '\t')
+      ++cp;
+    tok_len = cp - tok;
+
+    // If the line contains vote=0, ignore it.
+    if (BW_TOKEN_STARTS_WITH(tok, tok_len, "vote=0")) {
+      LOG_BW_LINE(LOG_DEBUG, "Ignoring bandwidth file line that contains "
+                  "vote=0", line, len);
+      return -1;
+    } else if (BW_TOKEN_STARTS_WITH(tok, tok_len, "bw=")) {
+      if (got_bw) {
+        LOG_BW_LINE(LOG_WARN, "Double bw= in bandwidth file line",
+                    line, len);
+        return -1;
+      }
+      if (!measured_bw_parse_value(tok + strlen("bw="),
+                                   tok_len - strlen("bw="), &out->bw_kb)) {
+        LOG_BW_LINE(LOG_WARN, "Invalid bandwidth in bandwidth file line",
+                    line, len);
+        return -1;
+      }
+      got_bw=1;
+    // Allow node_id to start with or without the dollar sign.
+    } else if (BW_TOKEN_STARTS_WITH(tok, tok_len, "node_id=")) {
+      const char *hex = tok + strlen("node_id=");
+      size_t hex_len = tok_len - strlen("node_id=");
+      if (got_node_id) {
+        LOG_BW_LINE(LOG_WARN, "Double node_id= in bandwidth file line",
+                    line, len);
+        return -1;
+      }
+      if (hex_len && *hex == '$') {
+        ++hex;
+        --hex_len;
+      }
+      if (hex_len != HEX_DIGEST_LEN ||
+          base16_decode(out->node_id, DIGEST_LEN,
+                        hex, HEX_DIGEST_LEN) != DIGEST_LEN) {
+        LOG_BW_LINE(LOG_WARN, "Invalid node_id in bandwidth file line",
+                    line, len);
+        return -1;
+      }
+      memcpy(out->node_hex, hex, HEX_DIGEST_LEN);
+      out->node_hex[HEX_DIGEST_LEN] = '\0';
+      got_node_id=1;
+    }
+
+    while (cp < eol && (*cp == ' ' || *cp == '\t'))
+      ++cp;
+  }
+
+  if (got_bw && got_node_id) {
+    return 0;
+  } else if (line_is_after_headers == 0) {
+    /* There could be additional header lines, therefore do not give warnings
+     * but returns -1 since it's not a complete bw line. */
+    LOG_BW_LINE(LOG_DEBUG, "Missing bw or node_id in bandwidth file line",
+                line, len);
+    return -1;
+  } else {
+    LOG_BW_LINE(LOG_WARN, "Incomplete line in bandwidth file", line, len);
+    return -1;
+  }
+}
+
+/**
+ * Parse the <b>body_len</b>-byte <b>body</b> of a bandwidth file, which is
+ * everything after its timestamp line, and return a new bw_file_cache_t
+ * holding its header lines and relay lines.
+ */
+static bw_file_cache_t *
+bw_file_parse_body(const char *body, size_t body_len)
+{
+  bw_file_cache_t *bwf = tor_malloc_zero(sizeof(bw_file_cache_t));
+  const char *cp = body, *eos = body + body_len;
+  int lines_allocated = 0;
+  /* This flag will be 1 only when the first successful bw measurement line
+   * has been encountered, so that measured_bw_line_parse don't give warnings
+   * if there are additional header lines, as introduced in Bandwidth List spec
+   * version 1.1.0 */
+  int line_is_after_headers = 0;
+
+  bwf->headers = smartlist_new();
+
+  while (cp < eos) {
+    const char *eol = memchr(cp, '\n', eos - cp);
+    const char *next = eol ? eol + 1 : eos;
+    size_t len = next - cp;
+    /* A NUL ends the line, as it would have if we had read it as a
+     * string. */
+    const char *nul = memchr(cp, '\0', len);
+    measured_bw_line_t parsed_line;
+
+    if (nul)
+      len = nul - cp;
+
+    if (measured_bw_line_parse_buf(&parsed_line, cp, len,
+                                   line_is_after_headers) != -1) {
+      /* This condition will be true when the first complete valid bw line
+       * has been encountered, which means the end of the header lines. */
+      line_is_after_headers = 1;
+      if (bwf->n_lines == lines_allocated) {
+        lines_allocated = lines_allocated ? lines_allocated * 2 : 256;
+        bwf->lines = tor_reallocarray(bwf->lines, lines_allocated,
+                                      sizeof(measured_bw_line_t));
+      }
+      memcpy(&bwf->lines[bwf->n_lines++], &parsed_line, sizeof(parsed_line));
+    /* if the terminator is found, it is the end of header lines, set the
+     * flag but do not store anything */
+    } else if (len == strlen(BW_FILE_HEADERS_TERMINATOR) &&
+               fast_memeq(cp, BW_FILE_HEADERS_TERMINATOR, len)) {
+      line_is_after_headers = 1;
+    /* if the line was not a correct relay line nor the terminator and
+     * the end of the header lines has not been detected yet
+     * and it is key_value and we did not reach the maximum
+     * number of headers,
+     * then assume this line is a header and keep it */
+    } else if ((line_is_after_headers == 0) &&
+               !memchr(cp, ' ', len) &&
+               (smartlist_len(bwf->headers)
+                < MAX_BW_FILE_HEADER_COUNT_IN_VOTE)) {
+      char *line = tor_memdup_nulterm(cp, len);
+      if (string_is_key_value(LOG_DEBUG, line)) {
+        line[len-1] = '\0';
+        smartlist_add(bwf->headers, line);
+      } else {
+        tor_free(line);
+      }
+    }
+    cp = next;
+  }
+
+  return bwf;
+}
+
+/**
+ * Return the parsed header and relay lines of the bandwidth file
+ * <b>from_file</b>, whose contents are in <b>contents</b> and whose SHA256
+ * digest is <b>digest</b>.  <b>st</b> is the result of stat()ing the file,
+ * and <b>body</b> points to the line after its timestamp.
+ *
+ * If this is the same file that we parsed last time, and neither its
+ * modification time nor its digest have changed, return our cached copy
+ * instead of parsing it again.
+ */
+static const bw_file_cache_t *
+bw_file_get_parsed(const char *from_file, const struct stat *st,
+                   const uint8_t *digest,
+                   const char *contents, const char *body)
+{
+  if (bw_file_cache &&
+      !strcmp(bw_file_cache->fname, from_file) &&
+      bw_file_cache->mtime == st->st_mtime &&
+      tor_memeq(bw_file_cache->digest, digest, DIGEST256_LEN)) {
+    log_debug(LD_DIRSERV, "Bandwidth file unchanged; not parsing it again.");
+    return bw_file_cache;
+  }
+
+  bw_file_cache_free(bw_file_cache);
+  bw_file_cache = bw_file_parse_body(body,
+                                     (size_t)st->st_size - (body - contents));
+  bw_file_cache->fname = tor_strdup(from_file);
+  bw_file_cache->mtime = st->st_mtime;
+  memcpy(bw_file_cache->digest, digest, DIGEST256_LEN);
+  return bw_file_cache;
+}
+
 /**
  * Read the measured bandwidth list <b>from_file</b>:
  * - store all the headers in <b>bw_file_headers</b>,
@@ -224,9 +520,12 @@ dirserv_get_credible_bandwidth_kb(const routerinfo_t *ri)
  *   the error,
  * - if the timestamp is valid and recent, old entries in the  measured
  *   bandwidth cache are expired, and
- * - <b>digest_out</b> is the digest up to the first read error (if any).
- *   The digest is taken over all the readable file contents, even if the
+ * - <b>digest_out</b> is the digest of the whole file.
+ *   The digest is taken over all the file contents, even if the
  *   file is outdated or unparseable.
+ *
+ * We read the whole file in one go, and only parse its relay lines again if
+ * it has changed since the last time we were called.
  */
 int
 dirserv_read_measured_bandwidths(const char *from_file,
@@ -234,96 +533,80 @@ dirserv_read_measured_bandwidths(const char *from_file,
                                  smartlist_t *bw_file_headers,
                                  uint8_t *digest_out)
 {
-  FILE *fp = tor_fopen_cloexec(from_file, "r");
+  struct stat st;
+  char *contents = NULL, *first_line = NULL;
+  const char *body;
+  const bw_file_cache_t *bwf;
+  uint8_t digest[DIGEST256_LEN];
   int applied_lines = 0;
   time_t file_time, now;
   int ok;
-   /* This flag will be 1 only when the first successful bw measurement line
-   * has been encountered, so that measured_bw_line_parse don't give warnings
-   * if there are additional header lines, as introduced in Bandwidth List spec
-   * version 1.1.0 */
-  int line_is_after_headers = 0;
   int rv = -1;
-  char *line = NULL;
-  size_t n = 0;
-  crypto_digest_t *digest = crypto_digest256_new(DIGEST_SHA256);
 
-  if (fp == NULL) {
+  crypto_digest256((char *) digest, "", 0, DIGEST_SHA256);
+
+  contents = read_file_to_str(from_file, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (contents == NULL) {
     log_warn(LD_CONFIG, "Can't open bandwidth file at configured location: %s",
              from_file);
-    goto err;
+    goto done;
   }
 
-  if (tor_getline(&line,&n,fp) <= 0) {
+  if (st.st_size == 0) {
     log_warn(LD_DIRSERV, "Empty bandwidth file");
-    goto err;
+    goto done;
   }
-  /* If the line could be gotten, add it to the digest */
-  crypto_digest_add_bytes(digest, (const char *) line, strlen(line));
+  crypto_digest256((char *) digest, contents, (size_t)st.st_size,
+                   DIGEST_SHA256);
 
-  if (!strlen(line) || line[strlen(line)-1] != '\n') {
+  /* A NUL in the timestamp line ends it early, so we can treat it as a
+   * string. */
+  body = memchr(contents, '\n', (size_t)st.st_size);
+  if (!body || memchr(contents, '\0', body - contents)) {
     log_warn(LD_DIRSERV, "Long or truncated time in bandwidth file: %s",
-             escaped(line));
-    /* Continue adding lines to the digest. */
-    goto continue_digest;
+             escaped(contents));
+    goto done;
   }
+  ++body;
 
-  line[strlen(line)-1] = '\0';
-  file_time = (time_t)tor_parse_ulong(line, 10, 0, ULONG_MAX, &ok, NULL);
+  first_line = tor_strndup(contents, body - contents - 1);
+  file_time = (time_t)tor_parse_ulong(first_line, 10, 0, ULONG_MAX, &ok,
+                                      NULL);
   if (!ok) {
     log_warn(LD_DIRSERV, "Non-integer time in bandwidth file: %s",
-             escaped(line));
-    goto continue_digest;
+             escaped(first_line));
+    goto done;
   }
 
   now = approx_time();
   if ((now - file_time) > MAX_MEASUREMENT_AGE) {
     log_warn(LD_DIRSERV, "Bandwidth measurement file stale. Age: %u",
              (unsigned)(time(NULL) - file_time));
-    goto continue_digest;
+    goto done;
   }
 
+  bwf = bw_file_get_parsed(from_file, &st, digest, contents, body);
+
   /* If timestamp was correct and bw_file_headers is not NULL,
-   * add timestamp to bw_file_headers */
-  if (bw_file_headers)
+   * add timestamp and headers to bw_file_headers */
+  if (bw_file_headers) {
     smartlist_add_asprintf(bw_file_headers, "timestamp=%lu",
                            (unsigned long)file_time);
+    SMARTLIST_FOREACH_BEGIN(bwf->headers, const char *, h) {
+      if (smartlist_len(bw_file_headers) >= MAX_BW_FILE_HEADER_COUNT_IN_VOTE)
+        break;
+      smartlist_add_strdup(bw_file_headers, h);
+    } SMARTLIST_FOREACH_END(h);
+  }
 
   if (routerstatuses)
     smartlist_sort(routerstatuses, compare_vote_routerstatus_entries);
 
-  while (!feof(fp)) {
-    measured_bw_line_t parsed_line;
-    if (tor_getline(&line, &n, fp) >= 0) {
-      crypto_digest_add_bytes(digest, (const char *) line, strlen(line));
-      if (measured_bw_line_parse(&parsed_line, line,
-                                 line_is_after_headers) != -1) {
-        /* This condition will be true when the first complete valid bw line
-         * has been encountered, which means the end of the header lines. */
-        line_is_after_headers = 1;
-        /* Also cache the line for dirserv_get_bandwidth_for_router() */
-        dirserv_cache_measured_bw(&parsed_line, file_time);
-        if (measured_bw_line_apply(&parsed_line, routerstatuses) > 0)
-          applied_lines++;
-      /* if the terminator is found, it is the end of header lines, set the
-       * flag but do not store anything */
-      } else if (strcmp(line, BW_FILE_HEADERS_TERMINATOR) == 0) {
-        line_is_after_headers = 1;
-      /* if the line was not a correct relay line nor the terminator and
-       * the end of the header lines has not been detected yet
-       * and it is key_value and bw_file_headers did not reach the maximum
-       * number of headers,
-       * then assume this line is a header and add it to bw_file_headers */
-      } else if (bw_file_headers &&
-              (line_is_after_headers == 0) &&
-              string_is_key_value(LOG_DEBUG, line) &&
-              !strchr(line, ' ') &&
-              (smartlist_len(bw_file_headers)
-               < MAX_BW_FILE_HEADER_COUNT_IN_VOTE)) {
-        line[strlen(line)-1] = '\0';
-        smartlist_add_strdup(bw_file_headers, line);
-      };
-    }
+  for (int i = 0; i < bwf->n_lines; ++i) {
+    /* Also cache the line for dirserv_get_bandwidth_for_router() */
+    dirserv_cache_measured_bw(&bwf->lines[i], file_time);
+    if (measured_bw_line_apply(&bwf->lines[i], routerstatuses) > 0)
+      applied_lines++;
   }
 
   /* Now would be a nice time to clean the cache, too */
@@ -334,27 +617,15 @@ dirserv_read_measured_bandwidths(const char *from_file,
            "Applied %d measurements.", applied_lines);
   rv = 0;
 
- continue_digest:
-  /* Continue parsing lines to return the digest of the Bandwidth File. */
-  while (!feof(fp)) {
-    if (tor_getline(&line, &n, fp) >= 0) {
-      crypto_digest_add_bytes(digest, (const char *) line, strlen(line));
-    }
-  }
-
- err:
-  if (line) {
-    // we need to raw_free this buffer because we got it from tor_getdelim()
-    raw_free(line);
-  }
-  if (fp)
-    fclose(fp);
+ done:
+  tor_free(contents);
+  tor_free(first_line);
   if (digest_out)
-    crypto_digest_get_digest(digest, (char *) digest_out, DIGEST256_LEN);
-  crypto_digest_free(digest);
+    memcpy(digest_out, digest, DIGEST256_LEN);
   return rv;
 }
 
+#ifdef TOR_UNIT_TESTS
 /**
  * Helper function to parse out a line in the measured bandwidth file
  * into a measured_bw_line_t output structure.
@@ -372,111 +643,13 @@ dirserv_read_measured_bandwidths(const char *from_file,
  * line is ignored during voting.
  */
 STATIC int
-measured_bw_line_parse(measured_bw_line_t *out, const char *orig_line,
+measured_bw_line_parse(measured_bw_line_t *out, const char *line,
                        int line_is_after_headers)
 {
-  char *line = tor_strdup(orig_line);
-  char *cp = line;
-  int got_bw = 0;
-  int got_node_id = 0;
-  char *strtok_state; /* lame sauce d'jour */
-
-  if (strlen(line) == 0) {
-    log_warn(LD_DIRSERV, "Empty line in bandwidth file");
-    tor_free(line);
-    return -1;
-  }
-
-  /* Remove end of line character, so that is not part of the token */
-  if (line[strlen(line) - 1] == '\n') {
-    line[strlen(line) - 1] = '\0';
-  }
-
-  cp = tor_strtok_r(cp, " \t", &strtok_state);
-
-  if (!cp) {
-    log_warn(LD_DIRSERV, "Invalid line in bandwidth file: %s",
-             escaped(orig_line));
-    tor_free(line);
-    return -1;
-  }
-
-  if (orig_line[strlen(orig_line)-1] != '\n') {
-    log_warn(LD_DIRSERV, "Incomplete line in bandwidth file: %s",
-             escaped(orig_line));
-    tor_free(line);
-    return -1;
-  }
-
-  do {
-    // If the line contains vote=0, ignore it.
-    if (strcmpstart(cp, "vote=0") == 0) {
-      log_debug(LD_DIRSERV, "Ignoring bandwidth file line that contains "
-                "vote=0: %s",escaped(orig_line));
-      tor_free(line);
-      return -1;
-    } else if (strcmpstart(cp, "bw=") == 0) {
-      int parse_ok = 0;
-      char *endptr;
-      if (got_bw) {
-        log_warn(LD_DIRSERV, "Double bw= in bandwidth file line: %s",
-                 escaped(orig_line));
-        tor_free(line);
-        return -1;
-      }
-      cp+=strlen("bw=");
-
-      out->bw_kb = tor_parse_long(cp, 10, 0, LONG_MAX, &parse_ok, &endptr);
-      if (!parse_ok || (*endptr && !TOR_ISSPACE(*endptr))) {
-        log_warn(LD_DIRSERV, "Invalid bandwidth in bandwidth file line: %s",
-                 escaped(orig_line));
-        tor_free(line);
-        return -1;
-      }
-      got_bw=1;
-    // Allow node_id to start with or without the dollar sign.
-    } else if (strcmpstart(cp, "node_id=") == 0) {
-      if (got_node_id) {
-        log_warn(LD_DIRSERV, "Double node_id= in bandwidth file line: %s",
-                 escaped(orig_line));
-        tor_free(line);
-        return -1;
-      }
-      if (strcmpstart(cp, "node_id=$") == 0) {
-        cp+=strlen("node_id=$");
-      } else if (strcmpstart(cp, "node_id=") == 0) {
-        cp+=strlen("node_id=");
-      }
-      if (strlen(cp) != HEX_DIGEST_LEN ||
-          base16_decode(out->node_id, DIGEST_LEN,
-                        cp, HEX_DIGEST_LEN) != DIGEST_LEN) {
-        log_warn(LD_DIRSERV, "Invalid node_id in bandwidth file line: %s",
-                 escaped(orig_line));
-        tor_free(line);
-        return -1;
-      }
-      strlcpy(out->node_hex, cp, sizeof(out->node_hex));
-      got_node_id=1;
-    }
-  } while ((cp = tor_strtok_r(NULL, " \t", &strtok_state)));
-
-  if (got_bw && got_node_id) {
-    tor_free(line);
-    return 0;
-  } else if (line_is_after_headers == 0) {
-    /* There could be additional header lines, therefore do not give warnings
-     * but returns -1 since it's not a complete bw line. */
-    log_debug(LD_DIRSERV, "Missing bw or node_id in bandwidth file line: %s",
-             escaped(orig_line));
-    tor_free(line);
-    return -1;
-  } else {
-    log_warn(LD_DIRSERV, "Incomplete line in bandwidth file: %s",
-             escaped(orig_line));
-    tor_free(line);
-    return -1;
-  }
+  return measured_bw_line_parse_buf(out, line, strlen(line),
+                                    line_is_after_headers);
 }
+#endif /* defined(TOR_UNIT_TESTS) */
 
 /**
  * Helper function to apply a parsed measurement line to a list
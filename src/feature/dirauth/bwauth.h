@@ -44,8 +44,10 @@ typedef struct measured_bw_line_t {
 /* Put the MAX_MEASUREMENT_AGE #define here so unit tests can see it */
 #define MAX_MEASUREMENT_AGE (3*24*60*60) /* 3 days */
 
+#ifdef TOR_UNIT_TESTS
 STATIC int measured_bw_line_parse(measured_bw_line_t *out, const char *line,
                                   int line_is_after_headers);
+#endif /* defined(TOR_UNIT_TESTS) */
 
 STATIC int measured_bw_line_apply(measured_bw_line_t *parsed_line,
                            smartlist_t *routerstatuses);
@@ -37,6 +37,7 @@ static void
 subsys_dirauth_shutdown(void)
 {
   dirserv_free_fingerprint_list();
+  dirserv_free_queued_descriptor_uploads();
   dirvote_free_all();
   dirserv_clear_measured_bw_cache();
   keypin_close_journal();
@@ -64,6 +64,7 @@
 #include "lib/container/order.h"
 #include "lib/encoding/confline.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/thread/threads.h"
 
 /* Algorithm to use for the bandwidth file digest. */
 #define DIGEST_ALG_BW_FILE DIGEST_SHA256
@@ -735,10 +736,15 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      char addr_buf[TOR_ADDR_BUF_LEN];
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      /* Not fmt_addrport(): we may be running on several threads. */
+      if (!tor_addr_to_str(addr_buf, &most_alt_orport->addr,
+                           sizeof(addr_buf), 1))
+        strlcpy(addr_buf, "???", sizeof(addr_buf));
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
+                most->status.nickname, addr_buf,
+                (unsigned) most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -1495,6 +1501,651 @@ remove_flag(smartlist_t *sl, const char *flag)
     smartlist_del_keeporder(sl, idx);
 }
 
+/** Everything that we need to know about a set of votes as a whole in order
+ * to compute the consensus entry for one router.  Shared, read-only, by every
+ * thread that computes entries. */
+typedef struct consensus_entry_ctx_t {
+  const smartlist_t *votes;
+  /** Every flag that any vote knows about, sorted. */
+  const smartlist_t *flags;
+  int total_authorities;
+  int consensus_method;
+  consensus_flavor_t flavor;
+  routerstatus_format_type_t rs_format;
+  /** The collated votes, in order of router identity. */
+  dircollator_t *collator;
+  /** n_voter_flags[j] is the number of flags that votes[j] knows about. */
+  const int *n_voter_flags;
+  /** n_flag_voters[f] is the number of votes that care about flags[f]. */
+  const int *n_flag_voters;
+  /** flag_map[j][b] is the index in flags of votes[j]->known_flags[b]. */
+  int **flag_map;
+  /** Index of the flag "Named" for votes[j], or -1. */
+  const int *named_flag;
+  /** Map from lowercased nickname to the identity that it is bound to. */
+  const strmap_t *name_to_id_map;
+  int n_authorities_measuring_bandwidth;
+  uint32_t max_unmeasured_bw_kb;
+  /** True if anybody is voting on the BadExit flag. */
+  bool badexit_flag_is_listed;
+} consensus_entry_ctx_t;
+
+/** A contiguous range of the collated routers, and the part of the
+ * consensus that we computed from it. */
+typedef struct consensus_entry_range_t {
+  /** The routers in this range are lo up to but not including hi. */
+  int lo, hi;
+  /** The consensus entries for this range, as strings to be concatenated. */
+  smartlist_t *chunks;
+  /** This range's contribution to the bandwidth weight totals. */
+  int64_t G, M, E, D, T;
+} consensus_entry_range_t;
+
+/** Compute the consensus entries for the routers in <b>range</b>: append
+ * them to range-\>chunks, and add their bandwidths to range-\>G and so on.
+ *
+ * This function only reads <b>ctx</b> and the votes, so it is safe to call
+ * it from several threads at once on different ranges.
+ */
+static void
+compute_consensus_entry_range(const consensus_entry_ctx_t *ctx,
+                              consensus_entry_range_t *range)
+{
+  const smartlist_t *votes = ctx->votes;
+  const smartlist_t *flags = ctx->flags;
+  const int total_authorities = ctx->total_authorities;
+  const int consensus_method = ctx->consensus_method;
+  const consensus_flavor_t flavor = ctx->flavor;
+  const routerstatus_format_type_t rs_format = ctx->rs_format;
+  dircollator_t *collator = ctx->collator;
+  const int *n_voter_flags = ctx->n_voter_flags;
+  const int *n_flag_voters = ctx->n_flag_voters;
+  int **flag_map = ctx->flag_map;
+  const int *named_flag = ctx->named_flag;
+  const strmap_t *name_to_id_map = ctx->name_to_id_map;
+  const int n_authorities_measuring_bandwidth =
+    ctx->n_authorities_measuring_bandwidth;
+  const uint32_t max_unmeasured_bw_kb = ctx->max_unmeasured_bw_kb;
+  const bool badexit_flag_is_listed = ctx->badexit_flag_is_listed;
+  smartlist_t *chunks = range->chunks;
+
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  smartlist_t *matching_descs = smartlist_new();
+  smartlist_t *chosen_flags = smartlist_new();
+  smartlist_t *versions = smartlist_new();
+  smartlist_t *protocols = smartlist_new();
+  smartlist_t *exitsummaries = smartlist_new();
+  uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
+                                       sizeof(uint32_t));
+  uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
+                                         sizeof(uint32_t));
+  uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
+                                                sizeof(uint32_t));
+  int num_bandwidths;
+  int num_mbws;
+  int num_guardfraction_inputs;
+
+  flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
+  for (int i = range->lo; i < range->hi; ++i) {
+    vote_routerstatus_t **vrs_lst =
+      dircollator_get_votes_for_router(collator, i);
+
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *current_rsa_id = NULL;
+    const char *chosen_version;
+    const char *chosen_protocol_list;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0, is_middle_only = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    char microdesc_digest[DIGEST256_LEN];
+    tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions);
+    smartlist_clear(protocols);
+    num_bandwidths = 0;
+    num_mbws = 0;
+    num_guardfraction_inputs = 0;
+    int ed_consensus = 0;
+    const uint8_t *ed_consensus_val = NULL;
+
+    /* Okay, go through all the entries for this digest. */
+    for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
+      if (vrs_lst[voter_idx] == NULL)
+        continue; /* This voter had nothing to say about this entry. */
+      rs = vrs_lst[voter_idx];
+      ++n_listing;
+
+      current_rsa_id = rs->status.identity_digest;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions, rs->version);
+
+      if (rs->protocols) {
+        /* We include this one even if it's empty: voting for an
+         * empty protocol list actually is meaningful. */
+        smartlist_add(protocols, rs->protocols);
+      }
+
+      /* Tally up all the flags. */
+      for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
+        if (rs->flags & (UINT64_C(1) << flag))
+          ++flag_counts[flag_map[voter_idx][flag]];
+      }
+      if (named_flag[voter_idx] >= 0 &&
+          (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                     chosen_name, rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* Count guardfraction votes and note down the values. */
+      if (rs->status.has_guardfraction) {
+        measured_guardfraction[num_guardfraction_inputs++] =
+          rs->status.guardfraction_percentage;
+      }
+
+      /* count bandwidths */
+      if (rs->has_measured_bw)
+        measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
+
+      if (rs->status.has_bandwidth)
+        bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
+
+      /* Count number for which ed25519 is canonical. */
+      if (rs->ed25519_reflects_consensus) {
+        ++ed_consensus;
+        if (ed_consensus_val) {
+          tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
+                                ED25519_PUBKEY_LEN));
+        } else {
+          ed_consensus_val = rs->ed25519_id;
+        }
+      }
+    }
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= total_authorities/2)
+      continue;
+
+    if (ed_consensus > 0) {
+      if (ed_consensus <= total_authorities / 2) {
+        log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
+                 "can we have a consensus of %d?", ed_consensus);
+      }
+    }
+
+    /* The clangalyzer can't figure out that this will never be NULL
+     * if n_listing is at least 1 */
+    tor_assert(current_rsa_id);
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                        microdesc_digest, &alt_orport);
+    /* Copy bits of that into rs_out. */
+    memset(&rs_out, 0, sizeof(rs_out));
+    tor_assert(fast_memeq(current_rsa_id,
+                          rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    tor_addr_copy(&rs_out.ipv4_addr, &rs->status.ipv4_addr);
+    rs_out.ipv4_dirport = rs->status.ipv4_dirport;
+    rs_out.ipv4_orport = rs->status.ipv4_orport;
+    tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
+    rs_out.ipv6_orport = alt_orport.port;
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    time_t published_on = rs->published_on;
+
+    /* Starting with this consensus method, we no longer include a
+       meaningful published_on time for microdescriptor consensuses.  This
+       makes their diffs smaller and more compressible.
+
+       We need to keep including a meaningful published_on time for NS
+       consensuses, however, until 035 relays are all obsolete. (They use
+       it for a purpose similar to the current StaleDesc flag.)
+    */
+    if (consensus_method >= MIN_METHOD_TO_SUPPRESS_MD_PUBLISHED &&
+        flavor == FLAV_MICRODESC) {
+      published_on = -1;
+    }
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    {
+      const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed")) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "NoEdConsensus")) {
+        if (ed_consensus <= total_authorities/2)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+          else if (!strcmp(fl, "MiddleOnly"))
+            is_middle_only = 1;
+          else if (!strcmp(fl, "Valid"))
+            is_valid = 1;
+        }
+      }
+    } SMARTLIST_FOREACH_END(fl);
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (!is_running)
+      continue;
+
+    /* Starting with consensus method 24, we don't list servers
+     * that are not valid in a consensus.  See Proposal 272 */
+    if (!is_valid)
+      continue;
+
+    /* Starting with consensus method 32, we handle the middle-only
+     * flag specially: when it is present, we clear some flags, and
+     * set others. */
+    if (is_middle_only) {
+      remove_flag(chosen_flags, "Exit");
+      remove_flag(chosen_flags, "V2Dir");
+      remove_flag(chosen_flags, "Guard");
+      remove_flag(chosen_flags, "HSDir");
+      is_exit = is_guard = 0;
+      if (! is_bad_exit && badexit_flag_is_listed) {
+        is_bad_exit = 1;
+        smartlist_add(chosen_flags, (char *)"BadExit");
+        smartlist_sort_strings(chosen_flags); // restore order.
+      }
+    }
+
+    /* Pick the version. */
+    if (smartlist_len(versions)) {
+      sort_version_list(versions, 0);
+      chosen_version = get_most_frequent_member(versions);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* Pick the protocol list */
+    if (smartlist_len(protocols)) {
+      smartlist_sort_strings(protocols);
+      chosen_protocol_list = get_most_frequent_member(protocols);
+    } else {
+      chosen_protocol_list = NULL;
+    }
+
+    /* If it's a guard and we have enough guardfraction votes,
+       calculate its consensus guardfraction value. */
+    if (is_guard && num_guardfraction_inputs > 2) {
+      rs_out.has_guardfraction = 1;
+      rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
+                                                   num_guardfraction_inputs);
+      /* final value should be an integer percentage! */
+      tor_assert(rs_out.guardfraction_percentage <= 100);
+    }
+
+    /* Pick a bandwidth */
+    if (num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 0;
+      rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
+    } else if (num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 1;
+      rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
+      if (n_authorities_measuring_bandwidth > 2) {
+        /* Cap non-measured bandwidths. */
+        if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
+          rs_out.bandwidth_kb = max_unmeasured_bw_kb;
+        }
+      }
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    is_exit = is_exit && !is_bad_exit;
+
+    /* Update total bandwidth weights with the bandwidths of this router. */
+    {
+      update_total_bandwidth_weights(&rs_out,
+                                     is_exit, is_guard,
+                                     &range->G, &range->M, &range->E,
+                                     &range->D, &range->T);
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code)).
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      } SMARTLIST_FOREACH_END(vsr);
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+                 " for router %s with descriptor %s.  This really shouldn't"
+                 " have happened.", id, dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "Not one of the voters that made us select"
+                 "descriptor %s for router %s had an exit policy"
+                 "summary", dd, id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                   "policy summary for %s.  Wow.", id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    if (flavor == FLAV_MICRODESC &&
+        tor_digest256_is_zero(microdesc_digest)) {
+      /* With no microdescriptor digest, we omit the entry entirely. */
+      continue;
+    }
+
+    {
+      char *buf;
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      buf = routerstatus_format_entry(&rs_out, NULL, NULL,
+                                      rs_format, NULL, published_on);
+      if (buf)
+        smartlist_add(chunks, buf);
+    }
+    /*     Now an m line, if applicable. */
+    if (flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      char m[BASE64_DIGEST256_LEN+1];
+      digest256_to_base64(m, microdesc_digest);
+      smartlist_add_asprintf(chunks, "m %s\n", m);
+    }
+    /*     Next line is all flags.  The "\n" is missing. */
+    smartlist_add_asprintf(chunks, "s%s",
+                           smartlist_len(chosen_flags)?" ":"");
+    smartlist_add(chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add_strdup(chunks, "\nv ");
+      smartlist_add_strdup(chunks, chosen_version);
+    }
+    smartlist_add_strdup(chunks, "\n");
+    if (chosen_protocol_list) {
+      smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
+    }
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      char *guardfraction_str = NULL;
+      int unmeasured = rs_out.bw_is_unmeasured;
+
+      /* If we have guardfraction info, include it in the 'w' line. */
+      if (rs_out.has_guardfraction) {
+        tor_asprintf(&guardfraction_str,
+                     " GuardFraction=%u", rs_out.guardfraction_percentage);
+      }
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
+                             rs_out.bandwidth_kb,
+                             unmeasured?" Unmeasured=1":"",
+                             guardfraction_str ? guardfraction_str : "");
+
+      tor_free(guardfraction_str);
+    }
+
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+      smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+    }
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions);
+  smartlist_free(protocols);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths_kb);
+  tor_free(measured_bws_kb);
+  tor_free(measured_guardfraction);
+}
+
+/** Shared state for the threads that compute consensus entries. */
+typedef struct consensus_entry_job_t {
+  const consensus_entry_ctx_t *ctx;
+  consensus_entry_range_t *ranges;
+  /** Protects n_pending. */
+  tor_mutex_t lock;
+  /** Signalled when n_pending drops to zero. */
+  tor_cond_t cond;
+  /** The number of ranges that other threads haven't finished yet. */
+  int n_pending;
+} consensus_entry_job_t;
+
+/** A range of a consensus_entry_job_t, as handed to one thread. */
+typedef struct consensus_entry_work_t {
+  consensus_entry_job_t *job;
+  consensus_entry_range_t *range;
+} consensus_entry_work_t;
+
+/** Thread body: compute the range in <b>arg</b>, a consensus_entry_work_t,
+ * then tell the thread that is waiting for it. */
+static void
+compute_consensus_entry_range_threadfn(void *arg)
+{
+  consensus_entry_work_t *work = arg;
+  consensus_entry_job_t *job = work->job;
+
+  compute_consensus_entry_range(job->ctx, work->range);
+  tor_free(work);
+
+  tor_mutex_acquire(&job->lock);
+  if (--job->n_pending == 0)
+    tor_cond_signal_all(&job->cond);
+  tor_mutex_release(&job->lock);
+}
+
+/** Compute the consensus entries for every router in ctx-\>collator, and
+ * append them to <b>chunks</b> in order of router identity.  Add their
+ * bandwidths to *<b>G</b> and so on.
+ *
+ * If <b>n_threads</b> is more than 1, split the routers into up to that
+ * many ranges, and compute all but the first one on new threads.  Since we
+ * put the ranges back together in order, and the bandwidth totals are sums
+ * of integers, the result is the same for any number of threads.
+ */
+static void
+compute_consensus_entries(const consensus_entry_ctx_t *ctx, int n_threads,
+                          smartlist_t *chunks,
+                          int64_t *G, int64_t *M, int64_t *E, int64_t *D,
+                          int64_t *T)
+{
+  const int n_routers = dircollator_n_routers(ctx->collator);
+  consensus_entry_job_t job;
+  int n_ranges;
+
+  n_ranges = MIN(n_threads, n_routers);
+  if (n_ranges < 1)
+    n_ranges = 1;
+
+  memset(&job, 0, sizeof(job));
+  job.ctx = ctx;
+  job.ranges = tor_calloc(n_ranges, sizeof(consensus_entry_range_t));
+  for (int r = 0; r < n_ranges; ++r) {
+    job.ranges[r].lo = (int) (((int64_t)n_routers * r) / n_ranges);
+    job.ranges[r].hi = (int) (((int64_t)n_routers * (r+1)) / n_ranges);
+    job.ranges[r].chunks = smartlist_new();
+  }
+
+  if (n_ranges > 1) {
+    tor_mutex_init_for_cond(&job.lock);
+    tor_cond_init(&job.cond);
+    job.n_pending = n_ranges - 1;
+    for (int r = 1; r < n_ranges; ++r) {
+      consensus_entry_work_t *work = tor_malloc_zero(sizeof(*work));
+      work->job = &job;
+      work->range = &job.ranges[r];
+      if (spawn_func(compute_consensus_entry_range_threadfn, work) < 0) {
+        log_warn(LD_GENERAL, "Couldn't start a thread to compute consensus "
+                 "entries; computing them on this one instead.");
+        compute_consensus_entry_range_threadfn(work);
+      }
+    }
+  }
+
+  compute_consensus_entry_range(ctx, &job.ranges[0]);
+
+  if (n_ranges > 1) {
+    tor_mutex_acquire(&job.lock);
+    while (job.n_pending > 0)
+      tor_cond_wait(&job.cond, &job.lock, NULL);
+    tor_mutex_release(&job.lock);
+    tor_cond_uninit(&job.cond);
+    tor_mutex_uninit(&job.lock);
+  }
+
+  for (int r = 0; r < n_ranges; ++r) {
+    consensus_entry_range_t *range = &job.ranges[r];
+    smartlist_add_all(chunks, range->chunks);
+    smartlist_free(range->chunks);
+    *G += range->G;
+    *M += range->M;
+    *E += range->E;
+    *D += range->D;
+    *T += range->T;
+  }
+  tor_free(job.ranges);
+}
+
+/** Return the number of threads that we should use to compute the entries
+ * of a consensus, as configured by AuthDirConsensusThreads. */
+static int
+dirvote_get_n_consensus_threads(void)
+{
+  int n_threads = dirauth_get_options()->AuthDirConsensusThreads;
+  if (n_threads == 0)
+    n_threads = get_num_cpus(get_options());
+  return MAX(n_threads, 1);
+}
+
+/** As networkstatus_compute_consensus_impl(), but use the configured number
+ * of threads. */
+STATIC char *
+networkstatus_compute_consensus(smartlist_t *votes,
+                                int total_authorities,
+                                crypto_pk_t *identity_key,
+                                crypto_pk_t *signing_key,
+                                const char *legacy_id_key_digest,
+                                crypto_pk_t *legacy_signing_key,
+                                consensus_flavor_t flavor)
+{
+  return networkstatus_compute_consensus_impl(
+                              votes, total_authorities,
+                              identity_key, signing_key,
+                              legacy_id_key_digest, legacy_signing_key,
+                              flavor, dirvote_get_n_consensus_threads());
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1513,15 +2164,19 @@ remove_flag(smartlist_t *sl, const char *flag)
  * here, you should allocate a new "consensus_method" for the new
  * behavior, and make the new behavior conditional on a new-enough
  * consensus_method.
+ *
+ * Compute the routers' entries on up to <b>n_threads</b> threads.  The
+ * result doesn't depend on the number of threads.
  **/
-STATIC char *
-networkstatus_compute_consensus(smartlist_t *votes,
-                                int total_authorities,
-                                crypto_pk_t *identity_key,
-                                crypto_pk_t *signing_key,
-                                const char *legacy_id_key_digest,
-                                crypto_pk_t *legacy_signing_key,
-                                consensus_flavor_t flavor)
+char *
+networkstatus_compute_consensus_impl(smartlist_t *votes,
+                                     int total_authorities,
+                                     crypto_pk_t *identity_key,
+                                     crypto_pk_t *signing_key,
+                                     const char *legacy_id_key_digest,
+                                     crypto_pk_t *legacy_signing_key,
+                                     consensus_flavor_t flavor,
+                                     int n_threads)
 {
   smartlist_t *chunks;
   char *result = NULL;
@@ -1789,23 +2444,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
   /* Add the actual router entries. */
   {
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
     int i;
-    smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
-    smartlist_t *versions = smartlist_new();
-    smartlist_t *protocols = smartlist_new();
-    smartlist_t *exitsummaries = smartlist_new();
-    uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
-                                         sizeof(uint32_t));
-    uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
-                                           sizeof(uint32_t));
-    uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
-                                                  sizeof(uint32_t));
-    int num_bandwidths;
-    int num_mbws;
-    int num_guardfraction_inputs;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1927,418 +2566,28 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     dircollator_collate(collator, consensus_method);
 
-    /* Now go through all the votes */
-    flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
-    const int num_routers = dircollator_n_routers(collator);
-    for (i = 0; i < num_routers; ++i) {
-      vote_routerstatus_t **vrs_lst =
-        dircollator_get_votes_for_router(collator, i);
-
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *current_rsa_id = NULL;
-      const char *chosen_version;
-      const char *chosen_protocol_list;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0, is_middle_only = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      char microdesc_digest[DIGEST256_LEN];
-      tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      smartlist_clear(protocols);
-      num_bandwidths = 0;
-      num_mbws = 0;
-      num_guardfraction_inputs = 0;
-      int ed_consensus = 0;
-      const uint8_t *ed_consensus_val = NULL;
-
-      /* Okay, go through all the entries for this digest. */
-      for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
-        if (vrs_lst[voter_idx] == NULL)
-          continue; /* This voter had nothing to say about this entry. */
-        rs = vrs_lst[voter_idx];
-        ++n_listing;
-
-        current_rsa_id = rs->status.identity_digest;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        if (rs->protocols) {
-          /* We include this one even if it's empty: voting for an
-           * empty protocol list actually is meaningful. */
-          smartlist_add(protocols, rs->protocols);
-        }
-
-        /* Tally up all the flags. */
-        for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
-          if (rs->flags & (UINT64_C(1) << flag))
-            ++flag_counts[flag_map[voter_idx][flag]];
-        }
-        if (named_flag[voter_idx] >= 0 &&
-            (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* Count guardfraction votes and note down the values. */
-        if (rs->status.has_guardfraction) {
-          measured_guardfraction[num_guardfraction_inputs++] =
-            rs->status.guardfraction_percentage;
-        }
-
-        /* count bandwidths */
-        if (rs->has_measured_bw)
-          measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
-
-        if (rs->status.has_bandwidth)
-          bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
-
-        /* Count number for which ed25519 is canonical. */
-        if (rs->ed25519_reflects_consensus) {
-          ++ed_consensus;
-          if (ed_consensus_val) {
-            tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
-                                  ED25519_PUBKEY_LEN));
-          } else {
-            ed_consensus_val = rs->ed25519_id;
-          }
-        }
-      }
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      if (ed_consensus > 0) {
-        if (ed_consensus <= total_authorities / 2) {
-          log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
-                   "can we have a consensus of %d?", ed_consensus);
-        }
-      }
-
-      /* The clangalyzer can't figure out that this will never be NULL
-       * if n_listing is at least 1 */
-      tor_assert(current_rsa_id);
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest, &alt_orport);
-      /* Copy bits of that into rs_out. */
-      memset(&rs_out, 0, sizeof(rs_out));
-      tor_assert(fast_memeq(current_rsa_id,
-                            rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      tor_addr_copy(&rs_out.ipv4_addr, &rs->status.ipv4_addr);
-      rs_out.ipv4_dirport = rs->status.ipv4_dirport;
-      rs_out.ipv4_orport = rs->status.ipv4_orport;
-      tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
-      rs_out.ipv6_orport = alt_orport.port;
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      time_t published_on = rs->published_on;
-
-      /* Starting with this consensus method, we no longer include a
-         meaningful published_on time for microdescriptor consensuses.  This
-         makes their diffs smaller and more compressible.
-
-         We need to keep including a meaningful published_on time for NS
-         consensuses, however, until 035 relays are all obsolete. (They use
-         it for a purpose similar to the current StaleDesc flag.)
-      */
-      if (consensus_method >= MIN_METHOD_TO_SUPPRESS_MD_PUBLISHED &&
-          flavor == FLAV_MICRODESC) {
-        published_on = -1;
-      }
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed")) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "NoEdConsensus")) {
-          if (ed_consensus <= total_authorities/2)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-            else if (!strcmp(fl, "MiddleOnly"))
-              is_middle_only = 1;
-            else if (!strcmp(fl, "Valid"))
-              is_valid = 1;
-          }
-        }
-      } SMARTLIST_FOREACH_END(fl);
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (!is_running)
-        continue;
-
-      /* Starting with consensus method 24, we don't list servers
-       * that are not valid in a consensus.  See Proposal 272 */
-      if (!is_valid)
-        continue;
-
-      /* Starting with consensus method 32, we handle the middle-only
-       * flag specially: when it is present, we clear some flags, and
-       * set others. */
-      if (is_middle_only) {
-        remove_flag(chosen_flags, "Exit");
-        remove_flag(chosen_flags, "V2Dir");
-        remove_flag(chosen_flags, "Guard");
-        remove_flag(chosen_flags, "HSDir");
-        is_exit = is_guard = 0;
-        if (! is_bad_exit && badexit_flag_is_listed) {
-          is_bad_exit = 1;
-          smartlist_add(chosen_flags, (char *)"BadExit");
-          smartlist_sort_strings(chosen_flags); // restore order.
-        }
-      }
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* Pick the protocol list */
-      if (smartlist_len(protocols)) {
-        smartlist_sort_strings(protocols);
-        chosen_protocol_list = get_most_frequent_member(protocols);
-      } else {
-        chosen_protocol_list = NULL;
-      }
-
-      /* If it's a guard and we have enough guardfraction votes,
-         calculate its consensus guardfraction value. */
-      if (is_guard && num_guardfraction_inputs > 2) {
-        rs_out.has_guardfraction = 1;
-        rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
-                                                     num_guardfraction_inputs);
-        /* final value should be an integer percentage! */
-        tor_assert(rs_out.guardfraction_percentage <= 100);
-      }
-
-      /* Pick a bandwidth */
-      if (num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 0;
-        rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
-      } else if (num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 1;
-        rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
-        if (n_authorities_measuring_bandwidth > 2) {
-          /* Cap non-measured bandwidths. */
-          if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
-            rs_out.bandwidth_kb = max_unmeasured_bw_kb;
-          }
-        }
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      is_exit = is_exit && !is_bad_exit;
-
-      /* Update total bandwidth weights with the bandwidths of this router. */
-      {
-        update_total_bandwidth_weights(&rs_out,
-                                       is_exit, is_guard,
-                                       &G, &M, &E, &D, &T);
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code)).
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        } SMARTLIST_FOREACH_END(vsr);
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      if (flavor == FLAV_MICRODESC &&
-          tor_digest256_is_zero(microdesc_digest)) {
-        /* With no microdescriptor digest, we omit the entry entirely. */
-        continue;
-      }
-
-      {
-        char *buf;
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        buf = routerstatus_format_entry(&rs_out, NULL, NULL,
-                                        rs_format, NULL, published_on);
-        if (buf)
-          smartlist_add(chunks, buf);
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1];
-        digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add_asprintf(chunks, "s%s",
-                             smartlist_len(chosen_flags)?" ":"");
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add_strdup(chunks, "\nv ");
-        smartlist_add_strdup(chunks, chosen_version);
-      }
-      smartlist_add_strdup(chunks, "\n");
-      if (chosen_protocol_list) {
-        smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
-      }
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *guardfraction_str = NULL;
-        int unmeasured = rs_out.bw_is_unmeasured;
-
-        /* If we have guardfraction info, include it in the 'w' line. */
-        if (rs_out.has_guardfraction) {
-          tor_asprintf(&guardfraction_str,
-                       " GuardFraction=%u", rs_out.guardfraction_percentage);
-        }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
-
-        tor_free(guardfraction_str);
-      }
-
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
-      }
-
-      /* And the loop is over and we move on to the next router */
+    /* Now go through all the routers. */
+    {
+      consensus_entry_ctx_t ctx = {
+        .votes = votes,
+        .flags = flags,
+        .total_authorities = total_authorities,
+        .consensus_method = consensus_method,
+        .flavor = flavor,
+        .rs_format = rs_format,
+        .collator = collator,
+        .n_voter_flags = n_voter_flags,
+        .n_flag_voters = n_flag_voters,
+        .flag_map = flag_map,
+        .named_flag = named_flag,
+        .name_to_id_map = name_to_id_map,
+        .n_authorities_measuring_bandwidth =
+          n_authorities_measuring_bandwidth,
+        .max_unmeasured_bw_kb = max_unmeasured_bw_kb,
+        .badexit_flag_is_listed = badexit_flag_is_listed,
+      };
+      compute_consensus_entries(&ctx, n_threads, chunks,
+                                &G, &M, &E, &D, &T);
     }
 
     tor_free(size);
@@ -2347,18 +2596,9 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(protocols);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths_kb);
-    tor_free(measured_bws_kb);
-    tor_free(measured_guardfraction);
   }
 
   /* Mark the directory footer region */
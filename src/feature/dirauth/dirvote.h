@@ -212,6 +212,15 @@ vote_microdesc_hash_t *dirvote_format_all_microdesc_vote_lines(
                                         time_t now,
                                         smartlist_t *microdescriptors_out);
 
+char *networkstatus_compute_consensus_impl(smartlist_t *votes,
+                                      int total_authorities,
+                                      crypto_pk_t *identity_key,
+                                      crypto_pk_t *signing_key,
+                                      const char *legacy_identity_key_digest,
+                                      crypto_pk_t *legacy_signing_key,
+                                      consensus_flavor_t flavor,
+                                      int n_threads);
+
 /*
  * Exposed functions for unit tests.
  */
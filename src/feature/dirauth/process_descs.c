@@ -18,6 +18,8 @@
 #include "feature/dirauth/process_descs.h"
 
 #include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "core/or/versions.h"
 #include "feature/dirauth/dirauth_sys.h"
@@ -28,15 +30,19 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/relay/relay_metrics.h"
 #include "feature/relay/router.h"
 
+#include "core/or/connection_st.h"
 #include "core/or/tor_version_st.h"
 #include "feature/dirauth/dirauth_options_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/extrainfo_st.h"
 #include "feature/nodelist/node_st.h"
 #include "feature/nodelist/microdesc_st.h"
@@ -45,6 +51,8 @@
 #include "feature/nodelist/vote_routerstatus_st.h"
 
 #include "lib/encoding/confline.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/crypt_ops/crypto_format.h"
 
 /** How far in the future do we allow a router to get? (seconds) */
@@ -636,6 +644,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
   node->strip_guard = (authstatus & RTR_STRIPGUARD) ? 1 : 0;
   node->strip_hsdir = (authstatus & RTR_STRIPHSDIR) ? 1 : 0;
   node->strip_v2dir = (authstatus & RTR_STRIPV2DIR) ? 1 : 0;
+  node_select_index_invalidate();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -729,6 +738,205 @@ dirserv_add_multiple_descriptors(const char *desc, size_t desclen,
   return r;
 }
 
+/** How many uploads may wait in the worker threads or for their turn on the
+ * main thread before we go back to handling new ones right away. */
+#define MAX_QUEUED_DESC_UPLOADS 256
+/** How many uploads we add to the routerlist at most on each pass through
+ * the main loop. */
+#define DESC_UPLOAD_BATCH_SIZE 16
+
+/** A POST full of descriptors that is waiting for a worker thread to check
+ * its signatures, or for the main thread to add it to the routerlist. */
+typedef struct desc_upload_t {
+  /** The global identifier of the directory connection it came from. */
+  uint64_t conn_id;
+  /** The address it came from, for log messages. */
+  char *source;
+  /** The descriptors, as uploaded. */
+  char *body;
+  size_t body_len;
+  /** The purpose to give the descriptors. */
+  uint8_t purpose;
+  /** Function to call with the outcome, if the connection is still open. */
+  desc_upload_done_fn_t done_fn;
+  /** Keys for the signatures that the worker found to be good; see
+   * router_precheck_signatures_from_string(). */
+  smartlist_t *prechecked;
+  /** When we queued this upload, in monotime_coarse_get_stamp() units. */
+  uint32_t queued_at;
+  /** The work entry for this upload, while it is with a worker thread. */
+  struct workqueue_entry_t *work;
+} desc_upload_t;
+
+/** Uploads that a worker is looking at, or that are ready for the main
+ * thread, in the order we got them. */
+static smartlist_t *queued_desc_uploads = NULL;
+/** Uploads that are ready for the main thread, in the order they became
+ * ready. */
+static smartlist_t *ready_desc_uploads = NULL;
+/** Event to add ready uploads to the routerlist. */
+static mainloop_event_t *desc_upload_commit_ev = NULL;
+
+/** Release all storage held by <b>up</b>. */
+static void
+desc_upload_free(desc_upload_t *up)
+{
+  if (!up)
+    return;
+  tor_free(up->source);
+  tor_free(up->body);
+  SMARTLIST_FOREACH(up->prechecked, uint8_t *, key, tor_free(key));
+  smartlist_free(up->prechecked);
+  tor_free(up);
+}
+
+/** Worker thread function: check the signatures on the descriptors in an
+ * upload. */
+static workqueue_reply_t
+desc_upload_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  desc_upload_t *up = work_;
+  router_precheck_signatures_from_string(up->body, up->body + up->body_len,
+                                         up->prechecked);
+  return WQ_RPL_REPLY;
+}
+
+/** Add the descriptors in <b>up</b> to the routerlist, tell the uploader
+ * what happened if they are still connected, and free <b>up</b>. */
+static void
+desc_upload_commit(desc_upload_t *up)
+{
+  const char *msg = NULL;
+  was_router_added_t r;
+  connection_t *conn;
+
+  router_note_prechecked_signatures(up->prechecked);
+  r = dirserv_add_multiple_descriptors(up->body, up->body_len, up->purpose,
+                                       up->source, &msg);
+  router_forget_prechecked_signatures();
+  relay_metrics_note_latency(RELAY_LATENCY_DESC_UPLOAD,
+                             monotime_coarse_get_stamp() - up->queued_at);
+
+  conn = connection_get_by_global_id(up->conn_id);
+  if (conn && conn->type == CONN_TYPE_DIR && !conn->marked_for_close) {
+    up->done_fn(TO_DIR_CONN(conn), r, msg);
+  } else {
+    log_info(LD_DIRSERV, "Descriptor upload from %s finished after its "
+             "connection closed: %s", up->source, msg);
+  }
+  desc_upload_free(up);
+}
+
+/** Main loop callback: add up to DESC_UPLOAD_BATCH_SIZE ready uploads to the
+ * routerlist, and come back later for the rest. */
+STATIC void
+desc_upload_commit_cb(mainloop_event_t *ev, void *arg)
+{
+  (void)arg;
+  int n = 0;
+
+  while (smartlist_len(ready_desc_uploads) && n++ < DESC_UPLOAD_BATCH_SIZE) {
+    desc_upload_t *up = smartlist_get(ready_desc_uploads, 0);
+    smartlist_del_keeporder(ready_desc_uploads, 0);
+    smartlist_remove_keeporder(queued_desc_uploads, up);
+    desc_upload_commit(up);
+  }
+  if (smartlist_len(ready_desc_uploads))
+    mainloop_event_activate(ev);
+}
+
+/** Reply function: called in the main thread once a worker has checked the
+ * signatures on an upload. */
+static void
+desc_upload_replyfn(void *work_)
+{
+  desc_upload_t *up = work_;
+  up->work = NULL;
+  smartlist_add(ready_desc_uploads, up);
+  mainloop_event_activate(desc_upload_commit_ev);
+}
+
+/** As dirserv_add_multiple_descriptors(), but check the signatures on a
+ * worker thread first, and let the main thread add the results to the
+ * routerlist in batches.
+ *
+ * Return 0 if we queued the upload: in that case, we will call
+ * <b>done_fn</b> with <b>conn</b> and the outcome later, if <b>conn</b> is
+ * still open.  Return -1 if we can't queue it right now; the caller should
+ * call dirserv_add_multiple_descriptors() itself. */
+int
+dirserv_queue_descriptor_upload(dir_connection_t *conn,
+                                const char *desc, size_t desclen,
+                                uint8_t purpose,
+                                desc_upload_done_fn_t done_fn)
+{
+  desc_upload_t *up;
+
+  tor_assert(conn);
+  tor_assert(done_fn);
+
+  if (cpuworker_get_n_threads() == 0)
+    return -1;
+  if (queued_desc_uploads &&
+      smartlist_len(queued_desc_uploads) >= MAX_QUEUED_DESC_UPLOADS) {
+    log_info(LD_DIRSERV, "Too many descriptor uploads queued; handling the "
+             "one from %s right away.",
+             connection_describe_peer(TO_CONN(conn)));
+    return -1;
+  }
+
+  if (!queued_desc_uploads) {
+    queued_desc_uploads = smartlist_new();
+    ready_desc_uploads = smartlist_new();
+    desc_upload_commit_ev =
+      mainloop_event_postloop_new(desc_upload_commit_cb, NULL);
+  }
+
+  up = tor_malloc_zero(sizeof(*up));
+  up->conn_id = TO_CONN(conn)->global_identifier;
+  up->source = tor_strdup(TO_CONN(conn)->address);
+  up->body = tor_memdup_nulterm(desc, desclen);
+  up->body_len = desclen;
+  up->purpose = purpose;
+  up->done_fn = done_fn;
+  up->prechecked = smartlist_new();
+  up->queued_at = monotime_coarse_get_stamp();
+
+  up->work = cpuworker_queue_work(WQ_PRI_MED, desc_upload_threadfn,
+                                  desc_upload_replyfn, up);
+  if (!up->work) {
+    log_warn(LD_BUG, "Couldn't queue descriptor upload on a worker thread.");
+    desc_upload_free(up);
+    return -1;
+  }
+  smartlist_add(queued_desc_uploads, up);
+  return 0;
+}
+
+/** Return the number of descriptor uploads that are waiting for a worker
+ * thread or for the main thread. */
+int
+dirserv_get_n_queued_descriptor_uploads(void)
+{
+  return queued_desc_uploads ? smartlist_len(queued_desc_uploads) : 0;
+}
+
+/** Release all storage held for queued descriptor uploads.  Uploads that are
+ * still with a worker thread are leaked, since the worker may be using
+ * them. */
+void
+dirserv_free_queued_descriptor_uploads(void)
+{
+  if (!queued_desc_uploads)
+    return;
+  SMARTLIST_FOREACH(ready_desc_uploads, desc_upload_t *, up,
+                    desc_upload_free(up));
+  smartlist_free(queued_desc_uploads);
+  smartlist_free(ready_desc_uploads);
+  mainloop_event_free(desc_upload_commit_ev);
+}
+
 /** Examine the parsed server descriptor in <b>ri</b> and maybe insert it into
  * the list of server descriptors. Set *<b>msg</b> to a message that should be
  * passed back to the origin of this descriptor, or NULL if there is no such
@@ -1000,6 +1208,7 @@ directory_remove_invalid(void)
       node->strip_v2dir = (r&RTR_STRIPV2DIR) ? 1: 0;
     }
   } SMARTLIST_FOREACH_END(node);
+  node_select_index_invalidate();
 
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
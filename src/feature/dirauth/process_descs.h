@@ -63,6 +63,12 @@ authdir_config_t *authdir_return_fingerprint_list(void);
 
 void dirserv_free_fingerprint_list(void);
 
+/** Function to call with the outcome of a descriptor upload that we
+ * handled with dirserv_queue_descriptor_upload(). */
+typedef void (*desc_upload_done_fn_t)(dir_connection_t *conn,
+                                      enum was_router_added_t r,
+                                      const char *msg);
+
 #ifdef HAVE_MODULE_DIRAUTH
 int dirserv_load_fingerprint_file(void);
 enum was_router_added_t dirserv_add_multiple_descriptors(
@@ -73,6 +79,12 @@ enum was_router_added_t dirserv_add_multiple_descriptors(
 enum was_router_added_t dirserv_add_descriptor(routerinfo_t *ri,
                                                const char **msg,
                                                const char *source);
+int dirserv_queue_descriptor_upload(dir_connection_t *conn,
+                                    const char *desc, size_t desclen,
+                                    uint8_t purpose,
+                                    desc_upload_done_fn_t done_fn);
+int dirserv_get_n_queued_descriptor_uploads(void);
+void dirserv_free_queued_descriptor_uploads(void);
 
 int dirserv_would_reject_router(const routerstatus_t *rs,
                                 const vote_routerstatus_t *vrs);
@@ -105,6 +117,28 @@ dirserv_add_multiple_descriptors(const char *desc, size_t desclen,
   *msg = "No directory authority support";
   return (enum was_router_added_t)0;
 }
+static inline int
+dirserv_queue_descriptor_upload(dir_connection_t *conn,
+                                const char *desc, size_t desclen,
+                                uint8_t purpose,
+                                desc_upload_done_fn_t done_fn)
+{
+  (void)conn;
+  (void)desc;
+  (void)desclen;
+  (void)purpose;
+  (void)done_fn;
+  return -1;
+}
+static inline int
+dirserv_get_n_queued_descriptor_uploads(void)
+{
+  return 0;
+}
+static inline void
+dirserv_free_queued_descriptor_uploads(void)
+{
+}
 static inline enum was_router_added_t
 dirserv_add_descriptor(routerinfo_t *ri,
                        const char **msg,
@@ -165,6 +199,8 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 STATIC int dirserv_router_has_valid_address(routerinfo_t *ri);
 STATIC bool dirserv_rejects_tor_version(const char *platform,
                                         const char **msg);
+struct mainloop_event_t;
+STATIC void desc_upload_commit_cb(struct mainloop_event_t *ev, void *arg);
 #endif /* defined(TOR_UNIT_TESTS) */
 
 #endif /* !defined(TOR_RECV_UPLOADS_H) */
@@ -22,6 +22,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -280,6 +281,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       ++n_active;
     }
   } SMARTLIST_FOREACH_END(node);
+  /* We may have changed some nodes' Exit flags. */
+  node_select_index_invalidate();
 
   /* Now, compute thresholds. */
   if (n_active) {
@@ -527,6 +530,7 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
   }
 
   node->is_running = answer;
+  node_select_index_invalidate();
 }
 
 /* Check <b>node</b> and <b>ri</b> on whether or not we should publish a
@@ -1570,6 +1570,30 @@ handle_post_hs_descriptor(const char *url, const char *body)
   return 400;
 }
 
+/** Tell the relay that uploaded descriptors on <b>conn</b> that the most
+ * severe outcome for any of them was <b>r</b>, with the explanation
+ * <b>msg</b>. */
+static void
+write_descriptor_upload_response(dir_connection_t *conn,
+                                 was_router_added_t r, const char *msg)
+{
+  tor_assert(msg);
+
+  if (r == ROUTER_ADDED_SUCCESSFULLY) {
+    write_short_http_response(conn, 200, msg);
+  } else if (WRA_WAS_OUTDATED(r)) {
+    write_http_response_header_impl(conn, -1, NULL, NULL,
+                                    "X-Descriptor-Not-New: Yes\r\n", -1);
+  } else {
+    log_info(LD_DIRSERV,
+             "Rejected router descriptor or extra-info from %s "
+             "(\"%s\").",
+             connection_describe_peer(TO_CONN(conn)),
+             msg);
+    write_short_http_response(conn, 400, msg);
+  }
+}
+
 /** Helper function: called when a dirserver gets a complete HTTP POST
  * request.  Look for an uploaded server descriptor or rendezvous
  * service descriptor.  On finding one, process it and write a
@@ -1644,22 +1668,11 @@ directory_handle_command_post,(dir_connection_t *conn, const char *headers,
       tor_free(genreason);
     }
 
-    was_router_added_t r = dirserv_add_multiple_descriptors(body, body_len,
+    if (dirserv_queue_descriptor_upload(conn, body, body_len, purpose,
+                                    write_descriptor_upload_response) < 0) {
+      was_router_added_t r = dirserv_add_multiple_descriptors(body, body_len,
                                            purpose, conn->base_.address, &msg);
-    tor_assert(msg);
-
-    if (r == ROUTER_ADDED_SUCCESSFULLY) {
-      write_short_http_response(conn, 200, msg);
-    } else if (WRA_WAS_OUTDATED(r)) {
-      write_http_response_header_impl(conn, -1, NULL, NULL,
-                                      "X-Descriptor-Not-New: Yes\r\n", -1);
-    } else {
-      log_info(LD_DIRSERV,
-               "Rejected router descriptor or extra-info from %s "
-               "(\"%s\").",
-               connection_describe_peer(TO_CONN(conn)),
-               msg);
-      write_short_http_response(conn, 400, msg);
+      write_descriptor_upload_response(conn, r, msg);
     }
     goto done;
   }
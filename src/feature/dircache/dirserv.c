@@ -361,6 +361,14 @@ spooled_resource_new_from_cache_entry(consensus_cache_entry_t *entry)
   }
 }
 
+/** Helper: drop the reference to a consensus cache entry that an outbuf
+ * held while it was sending part of the entry's body. */
+static void
+spooled_resource_release_cce(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
+
 /** Release all storage held by <b>spooled</b>. */
 void
 spooled_resource_free_(spooled_resource_t *spooled)
@@ -509,8 +517,18 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
       return SRFS_ERR;
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
 
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    if (cce && conn->compress_state == NULL) {
+      /* The body is mapped from the cache, and stays mapped for as long as
+       * we hold a reference to its entry: let the outbuf refer to it there
+       * rather than copying it. */
+      consensus_cache_entry_incref(cce);
+      connection_buf_add_external(ptr + spooled->cached_dir_offset, bytes,
+                                  TO_CONN(conn),
+                                  spooled_resource_release_cce, cce);
+    } else {
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
@@ -54,6 +54,7 @@
 #define ROUTERPARSE_PRIVATE
 
 #include "core/or/or.h"
+#include "core/or/compiled_policy.h"
 #include "app/config/config.h"
 #include "core/or/policies.h"
 #include "core/or/versions.h"
@@ -338,6 +339,262 @@ router_parse_list_from_string(const char **s, const char *eos,
   return 0;
 }
 
+/** A set of keys, as made by prechecked_sig_key_ed25519() and
+ * prechecked_sig_key_rsa(), for signatures that a worker thread has already
+ * found to be good, or NULL if there are none.  When we find a signature in
+ * this set, router_parse_entry_from_string() does not check it again. */
+static digest256map_t *prechecked_signatures = NULL;
+
+/** Set <b>out</b> to a key that identifies the ed25519 signature check
+ * <b>c</b>: two checks have the same key only if they have the same public
+ * key, signature and message. */
+static void
+prechecked_sig_key_ed25519(uint8_t *out, const ed25519_checkable_t *c)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, "ed25519", strlen("ed25519")+1);
+  crypto_digest_add_bytes(d, (const char *)c->pubkey->pubkey,
+                          ED25519_PUBKEY_LEN);
+  crypto_digest_add_bytes(d, (const char *)c->signature.sig,
+                          ED25519_SIG_LEN);
+  crypto_digest_add_bytes(d, (const char *)c->msg, c->len);
+  crypto_digest_get_digest(d, (char *)out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Set <b>out</b> to a key that identifies the check of the RSA signature
+ * object in <b>tok</b> on the SHA1 <b>digest</b> with <b>pkey</b>.  Return
+ * 0 on success, -1 on failure. */
+static int
+prechecked_sig_key_rsa(uint8_t *out, const crypto_pk_t *pkey,
+                       const char *digest, const directory_token_t *tok)
+{
+  char der[1024];
+  int der_len = crypto_pk_asn1_encode(pkey, der, sizeof(der));
+  if (der_len < 0)
+    return -1;
+
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, "rsa", strlen("rsa")+1);
+  crypto_digest_add_bytes(d, der, der_len);
+  crypto_digest_add_bytes(d, digest, DIGEST_LEN);
+  crypto_digest_add_bytes(d, tok->object_type, strlen(tok->object_type)+1);
+  crypto_digest_add_bytes(d, tok->object_body, tok->object_size);
+  crypto_digest_get_digest(d, (char *)out, DIGEST256_LEN);
+  crypto_digest_free(d);
+  return 0;
+}
+
+/** Return true iff a worker thread has already found all <b>n</b> ed25519
+ * signatures in <b>checkables</b> to be good. */
+static int
+ed25519_sigs_were_prechecked(const ed25519_checkable_t *checkables, int n)
+{
+  uint8_t key[DIGEST256_LEN];
+  if (!prechecked_signatures)
+    return 0;
+  for (int i = 0; i < n; ++i) {
+    prechecked_sig_key_ed25519(key, &checkables[i]);
+    if (!digest256map_get(prechecked_signatures, key))
+      return 0;
+  }
+  return 1;
+}
+
+/** Return true iff a worker thread has already found the RSA signature in
+ * <b>tok</b> on <b>digest</b> to be good for <b>pkey</b>. */
+static int
+rsa_sig_was_prechecked(const crypto_pk_t *pkey, const char *digest,
+                       const directory_token_t *tok)
+{
+  uint8_t key[DIGEST256_LEN];
+  if (!prechecked_signatures)
+    return 0;
+  if (prechecked_sig_key_rsa(key, pkey, digest, tok) < 0)
+    return 0;
+  return digest256map_get(prechecked_signatures, key) != NULL;
+}
+
+/** Helper for router_precheck_entry_signatures(): check the ed25519
+ * signatures on the router descriptor from <b>s</b> up to <b>end</b>, whose
+ * tokens are in <b>tokens</b>.  If they are all good, add a key for each
+ * one to <b>keys_out</b>. */
+static void
+router_precheck_entry_ed25519_sigs(smartlist_t *tokens,
+                                   const char *s, const char *end,
+                                   smartlist_t *keys_out)
+{
+  directory_token_t *ed_sig_tok, *ed_cert_tok, *cc_ntor_tok, *ntor_tok;
+  tor_cert_t *cert = NULL, *ntor_cc_cert = NULL;
+  curve25519_public_key_t ntor_pk;
+  ed25519_public_key_t ntor_cc_pk;
+  const char *signed_start, *signed_end;
+  uint8_t d256[DIGEST256_LEN];
+  ed25519_checkable_t check[3];
+  int check_ok[3];
+  time_t expires = TIME_MAX;
+
+  ed_sig_tok = find_by_keyword(tokens, K_ROUTER_SIG_ED25519);
+  ed_cert_tok = find_by_keyword(tokens, K_IDENTITY_ED25519);
+  cc_ntor_tok = find_by_keyword(tokens, K_NTOR_ONION_KEY_CROSSCERT);
+  ntor_tok = find_by_keyword(tokens, K_ONION_KEY_NTOR);
+  if (strcmp(cc_ntor_tok->args[0], "0") && strcmp(cc_ntor_tok->args[0], "1"))
+    return;
+
+  cert = tor_cert_parse((const uint8_t*)ed_cert_tok->object_body,
+                        ed_cert_tok->object_size);
+  ntor_cc_cert = tor_cert_parse((const uint8_t*)cc_ntor_tok->object_body,
+                                cc_ntor_tok->object_size);
+  if (!cert || !ntor_cc_cert || !cert->signing_key_included)
+    goto done;
+  if (curve25519_public_from_base64(&ntor_pk, ntor_tok->args[0]) < 0 ||
+      ed25519_public_key_from_curve25519_public_key(&ntor_cc_pk, &ntor_pk,
+                                !strcmp(cc_ntor_tok->args[0], "1")) < 0)
+    goto done;
+
+  if (router_get_hash_impl_helper(s, end-s, "router ",
+                                  "\nrouter-sig-ed25519",
+                                  ' ', LOG_INFO,
+                                  &signed_start, &signed_end) < 0)
+    goto done;
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, ED_DESC_SIGNATURE_PREFIX,
+                          strlen(ED_DESC_SIGNATURE_PREFIX));
+  crypto_digest_add_bytes(d, signed_start, signed_end-signed_start);
+  crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
+  crypto_digest_free(d);
+
+  if (tor_cert_get_checkable_sig(&check[0], cert, NULL, &expires) < 0 ||
+      tor_cert_get_checkable_sig(&check[1], ntor_cc_cert, &ntor_cc_pk,
+                                 &expires) < 0 ||
+      ed25519_signature_from_base64(&check[2].signature,
+                                    ed_sig_tok->args[0]) < 0)
+    goto done;
+  check[2].pubkey = &cert->signed_key;
+  check[2].msg = d256;
+  check[2].len = DIGEST256_LEN;
+
+  if (ed25519_checksig_batch(check_ok, check, 3) < 0)
+    goto done;
+  for (int i = 0; i < 3; ++i) {
+    uint8_t *key = tor_malloc(DIGEST256_LEN);
+    prechecked_sig_key_ed25519(key, &check[i]);
+    smartlist_add(keys_out, key);
+  }
+
+ done:
+  tor_cert_free(cert);
+  tor_cert_free(ntor_cc_cert);
+}
+
+/** Helper for router_precheck_signatures_from_string(): check the RSA and
+ * ed25519 signatures on the router descriptor from <b>s</b> up to
+ * <b>end</b>, and add a key to <b>keys_out</b> for each good one.
+ *
+ * We parse only as much as we need to find the signatures, and we don't
+ * complain about anything: router_parse_entry_from_string() will do both
+ * properly when it sees the descriptor. */
+static void
+router_precheck_entry_signatures(const char *s, const char *end,
+                                 smartlist_t *keys_out)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  directory_token_t *key_tok, *sig_tok;
+  char digest[DIGEST_LEN];
+  const char *cp;
+
+  while (end > s+2 && *(end-1) == '\n' && *(end-2) == '\n')
+    --end;
+  cp = tor_memstr(s, end-s, "\nrouter ");
+  if (cp)
+    s = cp+1;
+  else if (strcmpstart(s, "router "))
+    goto done;
+
+  if (router_get_router_hash(s, end - s, digest) < 0)
+    goto done;
+  if (tokenize_string(area, s, end, tokens, routerdesc_token_table, 0))
+    goto done;
+
+  key_tok = find_by_keyword(tokens, K_SIGNING_KEY);
+  sig_tok = find_by_keyword(tokens, K_ROUTER_SIGNATURE);
+  if (!strcmp(sig_tok->object_type, "SIGNATURE")) {
+    size_t keysize = crypto_pk_keysize(key_tok->key);
+    char *signed_digest = tor_malloc(keysize);
+    uint8_t key[DIGEST256_LEN];
+    if (crypto_pk_public_checksig(key_tok->key, signed_digest, keysize,
+                                  sig_tok->object_body,
+                                  sig_tok->object_size) >= DIGEST_LEN &&
+        tor_memeq(digest, signed_digest, DIGEST_LEN) &&
+        prechecked_sig_key_rsa(key, key_tok->key, digest, sig_tok) == 0) {
+      smartlist_add(keys_out, tor_memdup(key, DIGEST256_LEN));
+    }
+    tor_free(signed_digest);
+  }
+
+  router_precheck_entry_ed25519_sigs(tokens, s, end, keys_out);
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Check the signatures on every router descriptor in the string from
+ * <b>s</b> up to <b>eos</b>, and add a DIGEST256_LEN-byte key to
+ * <b>keys_out</b> for each good signature that we find.  Extra-info
+ * documents are skipped, since we need the routerlist to check them.
+ *
+ * This function touches no global state, so it is safe to call from a
+ * worker thread.  Once the keys have been passed to
+ * router_note_prechecked_signatures(), router_parse_entry_from_string()
+ * will not spend time checking those signatures again. */
+void
+router_precheck_signatures_from_string(const char *s, const char *eos,
+                                       smartlist_t *keys_out)
+{
+  const char *end;
+  int is_extrainfo;
+
+  tor_assert(s);
+  tor_assert(eos >= s);
+  tor_assert(keys_out);
+
+  while (!find_start_of_next_router_or_extrainfo(&s, eos, &is_extrainfo)) {
+    end = tor_memstr(s, eos-s, "\nrouter-signature");
+    if (end)
+      end = tor_memstr(end, eos-end, "\n-----END SIGNATURE-----\n");
+    if (!end)
+      break;
+    end += strlen("\n-----END SIGNATURE-----\n");
+
+    if (!is_extrainfo)
+      router_precheck_entry_signatures(s, end, keys_out);
+    s = end;
+  }
+}
+
+/** Remember the signatures in <b>keys</b>, as made by
+ * router_precheck_signatures_from_string(), as good until the next call to
+ * router_forget_prechecked_signatures(). */
+void
+router_note_prechecked_signatures(const smartlist_t *keys)
+{
+  if (!prechecked_signatures)
+    prechecked_signatures = digest256map_new();
+  SMARTLIST_FOREACH(keys, const uint8_t *, key,
+                    digest256map_set(prechecked_signatures, key, (void*)1));
+}
+
+/** Forget every signature we were told about in
+ * router_note_prechecked_signatures(). */
+void
+router_forget_prechecked_signatures(void)
+{
+  digest256map_free(prechecked_signatures, NULL);
+}
+
 /** Try to find an IPv6 OR port in <b>list</b> of directory_token_t's
  * with at least one argument (use GE(1) in setup). If found, store
  * address and port number to <b>addr_out</b> and
@@ -801,7 +1058,8 @@ router_parse_entry_from_string(const char *s, const char *end,
       check[2].msg = d256;
       check[2].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
+      if (!ed25519_sigs_were_prechecked(check, 3) &&
+          ed25519_checksig_batch(check_ok, check, 3) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -886,6 +1144,7 @@ router_parse_entry_from_string(const char *s, const char *end,
       (!router->ipv6_exit_policy ||
        short_policy_is_reject_star(router->ipv6_exit_policy)))
     router->policy_is_reject_star = 1;
+  router->compiled_exit_policy = compiled_policy_new(router->exit_policy);
 
   if ((tok = find_opt_by_keyword(tokens, K_FAMILY)) && tok->n_args) {
     int i;
@@ -961,7 +1220,8 @@ router_parse_entry_from_string(const char *s, const char *end,
 
   /* We've checked everything that's covered by the hash. */
   can_dl_again = 1;
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
+  if (!rsa_sig_was_prechecked(router->identity_pkey, digest, tok) &&
+      check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
                             "router descriptor") < 0)
     goto err;
 
@@ -1402,4 +1662,5 @@ void
 routerparse_free_all(void)
 {
   dump_desc_fifo_cleanup();
+  router_forget_prechecked_signatures();
 }
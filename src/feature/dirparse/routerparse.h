@@ -35,6 +35,11 @@ extrainfo_t *extrainfo_parse_entry_from_string(const char *s, const char *end,
                              int cache_copy, struct digest_ri_map_t *routermap,
                              int *can_dl_again_out);
 
+void router_precheck_signatures_from_string(const char *s, const char *eos,
+                                            smartlist_t *keys_out);
+void router_note_prechecked_signatures(const smartlist_t *keys);
+void router_forget_prechecked_signatures(void);
+
 int find_single_ipv6_orport(const smartlist_t *list,
                             tor_addr_t *addr_out,
                             uint16_t *port_out);
@@ -29,6 +29,10 @@ struct desc_store_t {
   const char *description;
 
   tor_mmap_t *mmap; /**< A mmap for the main file in the store. */
+  /** A mmap for the journal, if we have one.  Descriptors that are
+   * SAVED_IN_JOURNAL and have no signed_descriptor_body of their own are
+   * read from here. */
+  tor_mmap_t *journal_mmap;
 
   store_type_t type; /**< What's stored in this store? */
 
@@ -56,6 +56,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char addr_buf[TOR_ADDR_BUF_LEN];
   smartlist_t *chunks = smartlist_new();
 
   if (declared_publish_time >= 0) {
@@ -66,7 +67,12 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
     strlcpy(published, "2038-01-01 00:00:00", sizeof(published));
   }
 
-  const char *ip_str = fmt_addr(&rs->ipv4_addr);
+  /* Not fmt_addr(): we may be formatting consensus entries on several
+   * threads at once. */
+  const char *ip_str = tor_addr_to_str(addr_buf, &rs->ipv4_addr,
+                                       sizeof(addr_buf), 0);
+  if (!ip_str)
+    ip_str = "???";
   if (ip_str[0] == '\0')
     goto err;
 
@@ -91,8 +97,10 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    if (!tor_addr_to_str(addr_buf, &rs->ipv6_addr, sizeof(addr_buf), 1))
+      strlcpy(addr_buf, "???", sizeof(addr_buf));
+    smartlist_add_asprintf(chunks, "a %s:%u\n", addr_buf,
+                           (unsigned) rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS || format == NS_V3_CONSENSUS_MICRODESC)
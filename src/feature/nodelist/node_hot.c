@@ -0,0 +1,385 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file node_hot.c
+ * \brief Dense, per-node copies of the fields that nodelist-wide scans read.
+ *
+ * Code that walks every node in the nodelist (choosing a path, weighting
+ * nodes by bandwidth, deciding whether we have enough directory information
+ * to build circuits) usually only wants a handful of flags and numbers from
+ * each node.  Fetching them from each node_t, and from the routerstatus_t,
+ * routerinfo_t, or microdesc_t behind it, touches several cache lines per
+ * node.  The node_hot_view_t in this module keeps those values in parallel
+ * arrays indexed by nodelist_idx, so that such a scan reads contiguous
+ * memory instead.
+ **/
+
+#include "core/or/or.h"
+
+#include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_hot.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/routerset.h"
+#include "lib/container/map.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+/** The current hot node view, or NULL if we need to rebuild it. */
+static node_hot_view_t *the_node_hot_view = NULL;
+
+/** Release the consensus mapping held in <b>hv</b>. */
+static void
+node_hot_view_clear_consensus(node_hot_view_t *hv)
+{
+  hv->consensus = NULL;
+  hv->n_rs = 0;
+  tor_free(hv->rs_node_idx);
+  tor_free(hv->rs_flags);
+}
+
+/** Release all storage held by <b>hv</b>. */
+static void
+node_hot_view_free_(node_hot_view_t *hv)
+{
+  if (!hv)
+    return;
+  node_hot_view_clear_consensus(hv);
+  tor_free(hv->flags);
+  tor_free(hv->bw_kb);
+  tor_free(hv->family_id_start);
+  tor_free(hv->family_ids);
+  tor_free(hv->family_member_start);
+  tor_free(hv->family_members);
+  tor_free(hv);
+}
+#define node_hot_view_free(hv) \
+  FREE_AND_NULL(node_hot_view_t, node_hot_view_free_, (hv))
+
+/** Return the NODE_HOT_* bits that describe <b>node</b> right now. */
+uint32_t
+node_hot_flags_from_node(const node_t *node)
+{
+  const routerstatus_t *rs = node->rs;
+  const routerinfo_t *ri = node->ri;
+  uint32_t flags = 0;
+
+#define SET_IF(cond, bit) STMT_BEGIN if (cond) flags |= (bit); STMT_END
+  SET_IF(node->is_running, NODE_HOT_RUNNING);
+  SET_IF(node->is_valid, NODE_HOT_VALID);
+  SET_IF(node->is_fast, NODE_HOT_FAST);
+  SET_IF(node->is_stable, NODE_HOT_STABLE);
+  SET_IF(node->is_possible_guard, NODE_HOT_GUARD);
+  SET_IF(node->is_exit, NODE_HOT_EXIT);
+  SET_IF(node->is_bad_exit, NODE_HOT_BAD_EXIT);
+  SET_IF(node->is_middle_only, NODE_HOT_MIDDLE_ONLY);
+  SET_IF(node_is_dir(node), NODE_HOT_DIR);
+  SET_IF(rs, NODE_HOT_HAS_RS);
+  SET_IF(ri, NODE_HOT_HAS_RI);
+  SET_IF(node->md, NODE_HOT_HAS_MD);
+  SET_IF(rs && rs->has_bandwidth, NODE_HOT_HAS_BW);
+  SET_IF(rs && rs->has_guardfraction, NODE_HOT_HAS_GUARDFRACTION);
+  /* Keep this in sync with router_can_choose_node(). */
+  SET_IF(!(ri && ri->purpose != ROUTER_PURPOSE_GENERAL) &&
+         !(rs && !routerstatus_version_supports_extend2_cells(rs, 1)) &&
+         !((ri || node->md) && !node_has_curve25519_onion_key(node)) &&
+         !node_allows_single_hop_exits(node),
+         NODE_HOT_EXTENDABLE);
+  SET_IF(node_supports_conflux(node), NODE_HOT_CONFLUX);
+  SET_IF(node_supports_initiating_ipv6_extends(node), NODE_HOT_IPV6_EXTEND);
+#undef SET_IF
+
+  return flags;
+}
+
+/** Fill in the family ID arrays of <b>hv</b>: give each distinct verified
+ * family ID listed by any node a small integer, and record which nodes list
+ * which IDs. */
+static void
+node_hot_view_index_family_ids(node_hot_view_t *hv)
+{
+  strmap_t *id_map = strmap_new();
+  int n_ids_total = 0, pos = 0;
+  int *n_members;
+
+  SMARTLIST_FOREACH_BEGIN(hv->nodelist, const node_t *, node) {
+    const smartlist_t *node_ids = node_get_family_ids(node);
+    if (node_ids)
+      n_ids_total += smartlist_len(node_ids);
+  } SMARTLIST_FOREACH_END(node);
+
+  hv->family_id_start = tor_calloc(hv->n_nodes + 1, sizeof(int));
+  hv->family_ids = tor_calloc(MAX(n_ids_total, 1), sizeof(uint32_t));
+  SMARTLIST_FOREACH_BEGIN(hv->nodelist, const node_t *, node) {
+    const smartlist_t *node_ids = node_get_family_ids(node);
+    const int start = pos;
+    if (node_ids) {
+      SMARTLIST_FOREACH_BEGIN(node_ids, const char *, id) {
+        /* We store f+1 in the map, so that we can tell 0 from "absent". */
+        void *found = strmap_get(id_map, id);
+        uintptr_t v = (uintptr_t) found;
+        bool dup = false;
+        if (!v) {
+          v = ++hv->n_family_ids;
+          strmap_set(id_map, id, (void *) v);
+        }
+        for (int i = start; i < pos; ++i)
+          dup = dup || hv->family_ids[i] == v - 1;
+        if (!dup)
+          hv->family_ids[pos++] = (uint32_t) (v - 1);
+      } SMARTLIST_FOREACH_END(id);
+    }
+    hv->family_id_start[node_sl_idx + 1] = pos;
+  } SMARTLIST_FOREACH_END(node);
+
+  /* Now invert the mapping.  We add nodes in order of increasing index, so
+   * every member list comes out sorted. */
+  n_members = tor_calloc(hv->n_family_ids + 1, sizeof(int));
+  hv->family_member_start = tor_calloc(hv->n_family_ids + 1, sizeof(int));
+  hv->family_members = tor_calloc(MAX(pos, 1), sizeof(int));
+  for (int i = 0; i < pos; ++i)
+    ++n_members[hv->family_ids[i]];
+  for (int f = 0; f < hv->n_family_ids; ++f)
+    hv->family_member_start[f+1] = hv->family_member_start[f] + n_members[f];
+  memset(n_members, 0, (hv->n_family_ids + 1) * sizeof(int));
+  for (int i = 0; i < hv->n_nodes; ++i) {
+    for (int j = hv->family_id_start[i]; j < hv->family_id_start[i+1]; ++j) {
+      const uint32_t f = hv->family_ids[j];
+      hv->family_members[hv->family_member_start[f] + n_members[f]++] = i;
+    }
+  }
+
+  tor_free(n_members);
+  strmap_free(id_map, NULL);
+}
+
+/** Build and return a new node_hot_view_t for the current nodelist. */
+static node_hot_view_t *
+node_hot_view_new(void)
+{
+  node_hot_view_t *hv = tor_malloc_zero(sizeof(node_hot_view_t));
+  const smartlist_t *nodelist = nodelist_get_list();
+  const int n = smartlist_len(nodelist);
+
+  hv->nodelist = nodelist;
+  hv->n_nodes = n;
+  hv->flags = tor_calloc(MAX(n, 1), sizeof(uint32_t));
+  hv->bw_kb = tor_calloc(MAX(n, 1), sizeof(uint32_t));
+
+  SMARTLIST_FOREACH_BEGIN(nodelist, const node_t *, node) {
+    hv->flags[node_sl_idx] = node_hot_flags_from_node(node);
+    hv->bw_kb[node_sl_idx] = node->rs ? node->rs->bandwidth_kb : 0;
+  } SMARTLIST_FOREACH_END(node);
+
+  return hv;
+}
+
+/** Return a usable hot node view for the current nodelist, building it if
+ * necessary. */
+node_hot_view_t *
+node_hot_view_get(void)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  node_hot_view_t *hv = the_node_hot_view;
+
+  if (hv && (hv->nodelist != nodelist ||
+             hv->n_nodes != smartlist_len(nodelist))) {
+    node_hot_view_free(the_node_hot_view);
+    hv = NULL;
+  }
+  if (!hv)
+    hv = the_node_hot_view = node_hot_view_new();
+  return hv;
+}
+
+/** Forget our hot node view, because the nodelist, or something about the
+ * nodes in it, has changed. */
+void
+node_hot_view_invalidate(void)
+{
+  node_hot_view_free(the_node_hot_view);
+}
+
+/** Release all storage held by the hot node view. */
+void
+node_hot_free_all(void)
+{
+  node_hot_view_free(the_node_hot_view);
+}
+
+/** Return the index of <b>node</b> in the arrays of <b>hv</b>, or -1 if
+ * <b>node</b> is not one of the nodes that <b>hv</b> describes. */
+int
+node_hot_view_node_idx(const node_hot_view_t *hv, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  if (idx < 0 || idx >= hv->n_nodes ||
+      smartlist_get(hv->nodelist, idx) != node)
+    return -1;
+  return idx;
+}
+
+/** Map each entry in <b>consensus</b> onto the nodes of <b>hv</b>, unless we
+ * have already done so.  Return 0 on success, or -1 if some entry has a node
+ * that <b>hv</b> doesn't describe. */
+static int
+node_hot_view_map_consensus(node_hot_view_t *hv,
+                            const networkstatus_t *consensus)
+{
+  const int md = (consensus->flavor == FLAV_MICRODESC);
+  const int n_rs = smartlist_len(consensus->routerstatus_list);
+
+  if (hv->consensus == consensus && hv->n_rs == n_rs)
+    return 0;
+
+  node_hot_view_clear_consensus(hv);
+  hv->rs_node_idx = tor_calloc(MAX(n_rs, 1), sizeof(int));
+  hv->rs_flags = tor_calloc(MAX(n_rs, 1), sizeof(uint8_t));
+
+  SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list,
+                          const routerstatus_t *, rs) {
+    const node_t *node = node_get_by_id(rs->identity_digest);
+    const char * const digest = rs->descriptor_digest;
+    uint8_t flags = 0;
+    int present;
+
+    if (!node) {
+      hv->rs_node_idx[rs_sl_idx] = -1;
+      continue;
+    }
+    if ((hv->rs_node_idx[rs_sl_idx] = node_hot_view_node_idx(hv, node)) < 0) {
+      node_hot_view_clear_consensus(hv);
+      return -1;
+    }
+
+    if (md)
+      present = NULL != microdesc_cache_lookup_by_digest256(NULL, digest);
+    else
+      present = NULL != router_get_by_descriptor_digest(digest);
+
+    /* client_would_use_router() doesn't look at the time, so we can
+     * remember its answer until the consensus changes. */
+    if (client_would_use_router(rs, approx_time()))
+      flags |= NODE_HOT_RS_USABLE;
+    if (rs->is_exit)
+      flags |= NODE_HOT_RS_EXIT;
+    if (present)
+      flags |= NODE_HOT_RS_PRESENT;
+    hv->rs_flags[rs_sl_idx] = flags;
+  } SMARTLIST_FOREACH_END(rs);
+
+  hv->consensus = consensus;
+  hv->n_rs = n_rs;
+  return 0;
+}
+
+/** Do the work of count_usable_descriptors() using <b>hv</b>: count the
+ * entries in <b>consensus</b> that we would use, and how many of those we
+ * have descriptors for.
+ *
+ * If <b>in_set</b> is non-NULL, only consider entries in <b>in_set</b>.  If
+ * <b>need_exit_flag</b>, only consider entries with the Exit flag.  If
+ * <b>need_exit_policy</b>, only count a descriptor as present if its exit
+ * policy accepts something.  If <b>descs_out</b> is non-NULL, add the node
+ * for each usable entry to it, in consensus order.
+ *
+ * Return 0 on success, or -1 (having counted nothing) if <b>hv</b> can't
+ * answer for <b>consensus</b>. */
+int
+node_hot_view_count_usable(node_hot_view_t *hv,
+                           const networkstatus_t *consensus,
+                           const routerset_t *in_set,
+                           bool need_exit_flag,
+                           bool need_exit_policy,
+                           int *num_present_out,
+                           int *num_usable_out,
+                           smartlist_t *descs_out)
+{
+  int num_present = 0, num_usable = 0;
+
+  if (node_hot_view_map_consensus(hv, consensus) < 0)
+    return -1;
+
+  for (int i = 0; i < hv->n_rs; ++i) {
+    const uint8_t flags = hv->rs_flags[i];
+    const node_t *node;
+    if (hv->rs_node_idx[i] < 0)
+      continue;
+    if (need_exit_flag && !(flags & NODE_HOT_RS_EXIT))
+      continue;
+    if (!(flags & NODE_HOT_RS_USABLE))
+      continue;
+    if (in_set &&
+        !routerset_contains_routerstatus(
+                  in_set, smartlist_get(consensus->routerstatus_list, i), -1))
+      continue;
+    node = smartlist_get(hv->nodelist, hv->rs_node_idx[i]);
+    ++num_usable;
+    if (flags & NODE_HOT_RS_PRESENT) {
+      /* Do the policy check last, as count_usable_descriptors() does: it
+       * needs the node's descriptor, and the node can learn that its policy
+       * rejects everything without the nodelist changing.  A present node
+       * whose policy rejects everything is neither present nor listed. */
+      if (need_exit_policy && node_exit_policy_rejects_all(node))
+        continue;
+      ++num_present;
+    }
+    if (descs_out)
+      smartlist_add(descs_out, (node_t *) node);
+  }
+
+  *num_present_out = num_present;
+  *num_usable_out = num_usable;
+  return 0;
+}
+
+/** Return true iff the nodes at <b>a</b> and <b>b</b> in <b>hv</b> list any
+ * verified family ID in common. */
+static bool
+node_hot_view_share_family_id(const node_hot_view_t *hv, int a, int b)
+{
+  for (int i = hv->family_id_start[a]; i < hv->family_id_start[a+1]; ++i) {
+    for (int j = hv->family_id_start[b]; j < hv->family_id_start[b+1]; ++j) {
+      if (hv->family_ids[i] == hv->family_ids[j])
+        return true;
+    }
+  }
+  return false;
+}
+
+/** Add to <b>sl</b> every node in <b>hv</b> that has a verified family ID in
+ * common with <b>node</b>, in nodelist order, and return 0.  Return -1
+ * (having added nothing) if <b>node</b> is not in <b>hv</b>. */
+int
+node_hot_view_add_family_id_members(node_hot_view_t *hv,
+                                    smartlist_t *sl,
+                                    const node_t *node)
+{
+  const int idx = node_hot_view_node_idx(hv, node);
+  if (idx < 0)
+    return -1;
+  if (!hv->family_id_start)
+    node_hot_view_index_family_ids(hv);
+
+  if (hv->family_id_start[idx+1] - hv->family_id_start[idx] == 1) {
+    /* The usual case: the node's family is exactly the nodes that list its
+     * one family ID. */
+    const uint32_t f = hv->family_ids[hv->family_id_start[idx]];
+    for (int i = hv->family_member_start[f];
+         i < hv->family_member_start[f+1]; ++i) {
+      smartlist_add(sl, smartlist_get(hv->nodelist, hv->family_members[i]));
+    }
+    return 0;
+  }
+
+  for (int i = 0; i < hv->n_nodes; ++i) {
+    if (node_hot_view_share_family_id(hv, idx, i))
+      smartlist_add(sl, smartlist_get(hv->nodelist, i));
+  }
+  return 0;
+}
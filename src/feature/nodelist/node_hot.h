@@ -0,0 +1,130 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file node_hot.h
+ * \brief Header file for node_hot.c
+ **/
+
+#ifndef TOR_NODE_HOT_H
+#define TOR_NODE_HOT_H
+
+struct routerset_t;
+
+/* Bits in node_hot_view_t.flags: one set of these per node. */
+/** The node is believed to be running. */
+#define NODE_HOT_RUNNING          (1u<<0)
+/** The node is believed to be valid. */
+#define NODE_HOT_VALID            (1u<<1)
+/** The node has the Fast flag. */
+#define NODE_HOT_FAST             (1u<<2)
+/** The node has the Stable flag. */
+#define NODE_HOT_STABLE           (1u<<3)
+/** The node has the Guard flag. */
+#define NODE_HOT_GUARD            (1u<<4)
+/** The node has the Exit flag. */
+#define NODE_HOT_EXIT             (1u<<5)
+/** The node has the BadExit flag. */
+#define NODE_HOT_BAD_EXIT         (1u<<6)
+/** The node has the MiddleOnly flag. */
+#define NODE_HOT_MIDDLE_ONLY      (1u<<7)
+/** node_is_dir() is true for the node. */
+#define NODE_HOT_DIR              (1u<<8)
+/** The node has a routerstatus. */
+#define NODE_HOT_HAS_RS           (1u<<9)
+/** The node has a routerinfo. */
+#define NODE_HOT_HAS_RI           (1u<<10)
+/** The node has a microdescriptor. */
+#define NODE_HOT_HAS_MD           (1u<<11)
+/** The node's routerstatus lists a bandwidth. */
+#define NODE_HOT_HAS_BW           (1u<<12)
+/** The node's routerstatus lists a guardfraction. */
+#define NODE_HOT_HAS_GUARDFRACTION (1u<<13)
+/** The node is a general-purpose relay that we know how to extend to: it
+ * supports EXTEND2 cells and ntor, and doesn't allow single-hop exits. */
+#define NODE_HOT_EXTENDABLE       (1u<<14)
+/** The node supports conflux. */
+#define NODE_HOT_CONFLUX          (1u<<15)
+/** The node can initiate IPv6 extends. */
+#define NODE_HOT_IPV6_EXTEND      (1u<<16)
+
+/* Bits in node_hot_view_t.rs_flags: one set of these per entry in the
+ * consensus that the view has been mapped to. */
+/** client_would_use_router() is true for the routerstatus. */
+#define NODE_HOT_RS_USABLE        (1u<<0)
+/** The routerstatus has the Exit flag. */
+#define NODE_HOT_RS_EXIT          (1u<<1)
+/** We have the descriptor that the routerstatus lists. */
+#define NODE_HOT_RS_PRESENT       (1u<<2)
+
+/**
+ * A struct-of-arrays copy of the node_t fields that our nodelist-wide scans
+ * read, indexed by nodelist_idx.
+ *
+ * Path selection, bandwidth weighting and the "do we have enough directory
+ * information" checks each walk the whole nodelist; reading a few flags from
+ * every node_t (and from the routerstatus_t, routerinfo_t or microdesc_t
+ * behind it) costs several cache misses per node.  The view packs what those
+ * loops need into a few dense arrays instead.
+ *
+ * The view is built on demand, and thrown away along with the node selection
+ * index whenever the nodelist or anything about its nodes changes (see
+ * node_select_index_invalidate()).
+ */
+typedef struct node_hot_view_t {
+  /** The nodelist that this view was built from. */
+  const smartlist_t *nodelist;
+  /** Number of nodes in <b>nodelist</b> when we built this view. */
+  int n_nodes;
+  /** For each node, a set of NODE_HOT_* bits. */
+  uint32_t *flags;
+  /** For each node, the bandwidth in kilobytes listed in its routerstatus,
+   * or 0 if it has none. */
+  uint32_t *bw_kb;
+
+  /* The family ID arrays are NULL until we first need them. */
+  /** Number of distinct verified family IDs listed by any node. */
+  int n_family_ids;
+  /** For each node i, the small integers for its family IDs are
+   * <b>family_ids</b>[<b>family_id_start</b>[i]] up to (but not including)
+   * <b>family_ids</b>[<b>family_id_start</b>[i+1]]. */
+  int *family_id_start;
+  uint32_t *family_ids;
+  /** For each family ID f, the indices of the nodes that list it, in
+   * ascending order, are <b>family_members</b>[<b>family_member_start</b>[f]]
+   * up to (but not including)
+   * <b>family_members</b>[<b>family_member_start</b>[f+1]]. */
+  int *family_member_start;
+  int *family_members;
+
+  /** The consensus whose routerstatus_list we have mapped onto the nodelist,
+   * or NULL if we haven't done so yet. */
+  const networkstatus_t *consensus;
+  /** Number of entries in <b>consensus</b>. */
+  int n_rs;
+  /** For each consensus entry, the index of its node, or -1 if it has
+   * none. */
+  int *rs_node_idx;
+  /** For each consensus entry, a set of NODE_HOT_RS_* bits. */
+  uint8_t *rs_flags;
+} node_hot_view_t;
+
+node_hot_view_t *node_hot_view_get(void);
+void node_hot_view_invalidate(void);
+void node_hot_free_all(void);
+
+uint32_t node_hot_flags_from_node(const node_t *node);
+int node_hot_view_node_idx(const node_hot_view_t *hv, const node_t *node);
+int node_hot_view_count_usable(node_hot_view_t *hv,
+                               const networkstatus_t *consensus,
+                               const struct routerset_t *in_set,
+                               bool need_exit_flag,
+                               bool need_exit_policy,
+                               int *num_present_out,
+                               int *num_usable_out,
+                               smartlist_t *descs_out);
+int node_hot_view_add_family_id_members(node_hot_view_t *hv,
+                                        smartlist_t *sl,
+                                        const node_t *node);
+
+#endif /* !defined(TOR_NODE_HOT_H) */
@@ -18,6 +18,7 @@
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "feature/client/entrynodes.h"
+#include "feature/dirauth/authmode.h"
 #include "feature/dirclient/dirclient.h"
 #include "feature/dirclient/dirclient_modes.h"
 #include "feature/dircommon/directory.h"
@@ -25,6 +26,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_hot.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
@@ -51,6 +53,10 @@ static const routerstatus_t *router_pick_trusteddirserver_impl(
 static const routerstatus_t *router_pick_dirserver_generic(
                               smartlist_t *sourcelist,
                               dirinfo_type_t type, int flags);
+static const node_t *node_sl_choose_by_cached_bandwidth(
+                              const smartlist_t *sl,
+                              bandwidth_weight_rule_t rule,
+                              bool *failed_out);
 
 /** Try to find a running dirserver that supports operations of <b>type</b>.
  *
@@ -509,6 +515,14 @@ smartlist_choose_node_by_bandwidth_weights(const smartlist_t *sl,
   double *bandwidths_dbl=NULL;
   uint64_t *bandwidths_u64=NULL;
 
+  {
+    bool failed = false;
+    const node_t *choice = node_sl_choose_by_cached_bandwidth(sl, rule,
+                                                              &failed);
+    if (!failed)
+      return choice;
+  }
+
   if (compute_weighted_bandwidths(sl, rule, &bandwidths_dbl, NULL) < 0)
     return NULL;
 
@@ -612,6 +626,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   guardfraction_bandwidth_t guardfraction_bw;
   double *bandwidths = NULL;
   double total_bandwidth = 0.0;
+  const node_hot_view_t *hv;
 
   tor_assert(sl);
   tor_assert(bandwidths_out);
@@ -704,6 +719,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   Wdb /= weight_scale;
 
   bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
+  hv = node_hot_view_get();
 
   // Cycle through smartlist and total the bandwidth.
   static int warned_missing_bw = 0;
@@ -712,11 +728,17 @@ compute_weighted_bandwidths(const smartlist_t *sl,
     double weight = 1;
     double weight_without_guard_flag = 0; /* Used for guardfraction */
     double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
+    /* Take what we need from the hot node view if we can, so that we don't
+     * have to look at the node (or its routerstatus) at all. */
+    const int hot_idx = (sl == hv->nodelist) ?
+      node_sl_idx : node_hot_view_node_idx(hv, node);
+    const uint32_t flags = (hot_idx >= 0) ?
+      hv->flags[hot_idx] : node_hot_flags_from_node(node);
+    is_exit = (flags & NODE_HOT_EXIT) && !(flags & NODE_HOT_BAD_EXIT);
+    is_guard = (flags & NODE_HOT_GUARD) != 0;
+    is_dir = (flags & NODE_HOT_DIR) != 0;
+    if (flags & NODE_HOT_HAS_RS) {
+      if (!(flags & NODE_HOT_HAS_BW)) {
         /* This should never happen, unless all the authorities downgrade
          * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
         if (! warned_missing_bw) {
@@ -727,9 +749,10 @@ compute_weighted_bandwidths(const smartlist_t *sl,
         }
         this_bw = 30000; /* Chosen arbitrarily */
       } else {
-        this_bw = kb_to_bytes(node->rs->bandwidth_kb);
+        this_bw = kb_to_bytes(hot_idx >= 0 ?
+                              hv->bw_kb[hot_idx] : node->rs->bandwidth_kb);
       }
-    } else if (node->ri) {
+    } else if (flags & NODE_HOT_HAS_RI) {
       /* bridge or other descriptor not in our consensus */
       this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
     } else {
@@ -768,7 +791,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
      *    N for position p proportionally to Wpf*B or Wpn*B, clients should
      *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
      */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
+    if ((flags & NODE_HOT_HAS_GUARDFRACTION) && rule != WEIGHT_FOR_GUARD) {
       /* We should only have guardfraction set if the node has the Guard
          flag. */
       if (! node->rs->is_possible_guard) {
@@ -881,13 +904,12 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
 }
 
 /**
- * Remove every node_t that appears in <b>excluded</b> from <b>sl</b>.
- *
- * Behaves like smartlist_subtract, but uses nodelist_idx values to deliver
- * linear performance when smartlist_subtract would be quadratic.
+ * Return a newly allocated bitarray with a bit set for the nodelist_idx of
+ * every node_t in <b>excluded</b>, or NULL if some node's nodelist_idx is
+ * wrong.
  **/
-static void
-nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
+static bitarray_t *
+nodelist_idx_bitarray_new(const smartlist_t *excluded)
 {
   const smartlist_t *nodelist = nodelist_get_list();
   const int nodelist_len = smartlist_len(nodelist);
@@ -895,20 +917,38 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
 
   /* We haven't used nodelist_idx in this way previously, so I'm going to be
    * paranoid in this code, and check that nodelist_idx is correct for every
-   * node before we use it.  If we fail, we fall back to smartlist_subtract().
-   */
-
-  /* Set the excluded_idx bit corresponding to every excluded node...
+   * node before we use it.  If we fail, our callers fall back to slower
+   * methods.
    */
   SMARTLIST_FOREACH_BEGIN(excluded, const node_t *, node) {
     const int idx = node->nodelist_idx;
     if (BUG(idx < 0) || BUG(idx >= nodelist_len) ||
         BUG(node != smartlist_get(nodelist, idx))) {
-      goto internal_error;
+      bitarray_free(excluded_idx);
+      return NULL;
     }
     bitarray_set(excluded_idx, idx);
   } SMARTLIST_FOREACH_END(node);
 
+  return excluded_idx;
+}
+
+/**
+ * Remove every node_t that appears in <b>excluded</b> from <b>sl</b>.
+ *
+ * Behaves like smartlist_subtract, but uses nodelist_idx values to deliver
+ * linear performance when smartlist_subtract would be quadratic.
+ **/
+static void
+nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  const int nodelist_len = smartlist_len(nodelist);
+  bitarray_t *excluded_idx = nodelist_idx_bitarray_new(excluded);
+
+  if (!excluded_idx)
+    goto internal_error;
+
   /* Then remove them from sl.
    */
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
@@ -932,6 +972,338 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** Bitmaps in a node_select_index_t.  Each one has a bit set for every node,
+ * by nodelist_idx, that has the given property. */
+typedef enum node_select_bitmap_t {
+  /** Running, valid, general-purpose, known to handle EXTEND2 and ntor, and
+   * not allowing single-hop exits: everything router_can_choose_node()
+   * requires of a node regardless of its flags argument, except for the
+   * checks that only apply to direct connections. */
+  NSB_USABLE,
+  /** Has the Fast flag (for CRN_NEED_CAPACITY). */
+  NSB_FAST,
+  /** Has the Stable flag (for CRN_NEED_UPTIME). */
+  NSB_STABLE,
+  /** Has the Guard flag (for CRN_NEED_GUARD). */
+  NSB_GUARD,
+  /** Supports conflux (for CRN_CONFLUX). */
+  NSB_CONFLUX,
+  /** Can initiate IPv6 extends (for CRN_INITIATE_IPV6_EXTEND). */
+  NSB_IPV6_EXTEND,
+  /** Does not have the MiddleOnly flag (for CRN_FOR_HS). */
+  NSB_NOT_MIDDLE_ONLY,
+  /** Has a routerinfo (for CRN_NEED_DESC when not using microdescs). */
+  NSB_HAS_RI,
+  /** Has a routerstatus and a microdesc (for CRN_NEED_DESC otherwise). */
+  NSB_HAS_MD,
+  NSB_N_BITMAPS
+} node_select_bitmap_t;
+
+/** Number of bandwidth_weight_rule_t values. */
+#define N_WEIGHT_RULES (WEIGHT_FOR_DIR + 1)
+
+/**
+ * Precomputed state for choosing nodes from the nodelist: one bitmap per
+ * node property that router_can_choose_node() checks, and for each weighting
+ * rule, a prefix sum over the nodelist of the weighted bandwidths that
+ * compute_weighted_bandwidths() would give each node.
+ *
+ * With these, router_choose_random_node() finds its candidates by
+ * intersecting bitmaps and picks one by binary search, instead of building
+ * a smartlist of nodes and recomputing every node's weight for every hop.
+ *
+ * The index is built on demand, and thrown away whenever the nodelist or the
+ * consensus changes (see node_select_index_invalidate()).
+ */
+typedef struct node_select_index_t {
+  /** The nodelist that this index was built from. */
+  const smartlist_t *nodelist;
+  /** Number of nodes in <b>nodelist</b> when we built this index. */
+  int n_nodes;
+  /** Number of unsigned ints in each bitmap. */
+  int n_words;
+  /** The bitmaps, indexed by node_select_bitmap_t. */
+  bitarray_t *bitmaps[NSB_N_BITMAPS];
+  /** For each weighting rule: NULL if not yet computed, or an array of
+   * n_nodes+1 elements whose i'th element is the total weight of the nodes
+   * with nodelist_idx less than i. */
+  uint64_t *cumulative_bw[N_WEIGHT_RULES];
+  /** Scratch space for node_select_index_choose(): n_nodes elements each. */
+  int *scratch_idx;
+  uint64_t *scratch_cumulative;
+} node_select_index_t;
+
+/** The current node selection index, or NULL if we need to rebuild it. */
+static node_select_index_t *the_node_select_index = NULL;
+
+/** Release all storage held by <b>nsi</b>. */
+static void
+node_select_index_free_(node_select_index_t *nsi)
+{
+  if (!nsi)
+    return;
+  for (int i = 0; i < NSB_N_BITMAPS; ++i)
+    bitarray_free(nsi->bitmaps[i]);
+  for (int i = 0; i < N_WEIGHT_RULES; ++i)
+    tor_free(nsi->cumulative_bw[i]);
+  tor_free(nsi->scratch_idx);
+  tor_free(nsi->scratch_cumulative);
+  tor_free(nsi);
+}
+#define node_select_index_free(nsi) \
+  FREE_AND_NULL(node_select_index_t, node_select_index_free_, (nsi))
+
+/** Build and return a new node_select_index_t for the current nodelist. */
+static node_select_index_t *
+node_select_index_new(void)
+{
+  node_select_index_t *nsi = tor_malloc_zero(sizeof(node_select_index_t));
+  const smartlist_t *nodelist = nodelist_get_list();
+  const node_hot_view_t *hv = node_hot_view_get();
+
+  nsi->nodelist = nodelist;
+  nsi->n_nodes = smartlist_len(nodelist);
+  nsi->n_words = (nsi->n_nodes + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  for (int i = 0; i < NSB_N_BITMAPS; ++i)
+    nsi->bitmaps[i] = bitarray_init_zero(nsi->n_nodes);
+  nsi->scratch_idx = tor_calloc(MAX(nsi->n_nodes, 1), sizeof(int));
+  nsi->scratch_cumulative = tor_calloc(MAX(nsi->n_nodes, 1),
+                                       sizeof(uint64_t));
+
+  for (int idx = 0; idx < nsi->n_nodes; ++idx) {
+    const uint32_t flags = hv->flags[idx];
+    const int usable =
+      (flags & NODE_HOT_RUNNING) && (flags & NODE_HOT_VALID) &&
+      (flags & NODE_HOT_EXTENDABLE);
+    const int bits[NSB_N_BITMAPS] = {
+      [NSB_USABLE] = usable,
+      [NSB_FAST] = (flags & NODE_HOT_FAST) != 0,
+      [NSB_STABLE] = (flags & NODE_HOT_STABLE) != 0,
+      [NSB_GUARD] = (flags & NODE_HOT_GUARD) != 0,
+      [NSB_CONFLUX] = (flags & NODE_HOT_CONFLUX) != 0,
+      [NSB_IPV6_EXTEND] = (flags & NODE_HOT_IPV6_EXTEND) != 0,
+      [NSB_NOT_MIDDLE_ONLY] = !(flags & NODE_HOT_MIDDLE_ONLY),
+      [NSB_HAS_RI] = (flags & NODE_HOT_HAS_RI) != 0,
+      [NSB_HAS_MD] = (flags & NODE_HOT_HAS_RS) && (flags & NODE_HOT_HAS_MD),
+    };
+    for (int i = 0; i < NSB_N_BITMAPS; ++i) {
+      if (bits[i])
+        bitarray_set(nsi->bitmaps[i], idx);
+    }
+  }
+
+  return nsi;
+}
+
+/** Return the prefix-summed weights for <b>rule</b> in <b>nsi</b>, computing
+ * them if we have not already done so.  Return NULL on failure. */
+static const uint64_t *
+node_select_index_get_cumulative_bw(node_select_index_t *nsi,
+                                    bandwidth_weight_rule_t rule)
+{
+  double *bandwidths_dbl = NULL;
+  uint64_t *bandwidths_u64 = NULL;
+  uint64_t *cumulative;
+
+  if (nsi->cumulative_bw[rule])
+    return nsi->cumulative_bw[rule];
+
+  if (compute_weighted_bandwidths(nsi->nodelist, rule,
+                                  &bandwidths_dbl, NULL) < 0)
+    return NULL;
+
+  /* Scaling to the total of the whole nodelist, rather than of the nodes we
+   * end up choosing among, keeps every partial sum below INT64_MAX/4. */
+  bandwidths_u64 = tor_calloc(nsi->n_nodes, sizeof(uint64_t));
+  scale_array_elements_to_u64(bandwidths_u64, bandwidths_dbl,
+                              nsi->n_nodes, NULL);
+
+  cumulative = tor_calloc(nsi->n_nodes + 1, sizeof(uint64_t));
+  for (int i = 0; i < nsi->n_nodes; ++i)
+    cumulative[i+1] = cumulative[i] + bandwidths_u64[i];
+
+  tor_free(bandwidths_dbl);
+  tor_free(bandwidths_u64);
+  return (nsi->cumulative_bw[rule] = cumulative);
+}
+
+/** Return a usable node selection index for the current nodelist, building
+ * it if necessary. */
+static node_select_index_t *
+node_select_index_get(void)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  node_select_index_t *nsi = the_node_select_index;
+
+  if (nsi && (nsi->nodelist != nodelist ||
+              nsi->n_nodes != smartlist_len(nodelist))) {
+    node_select_index_free(the_node_select_index);
+    nsi = NULL;
+  }
+  if (!nsi)
+    nsi = the_node_select_index = node_select_index_new();
+  return nsi;
+}
+
+/** Forget our precomputed node selection state, and the hot node view that
+ * it is built from, because the nodelist, or something about the nodes in
+ * it, has changed. */
+void
+node_select_index_invalidate(void)
+{
+  node_select_index_free(the_node_select_index);
+  node_hot_view_invalidate();
+}
+
+/** Release all storage held for node selection. */
+void
+node_select_free_all(void)
+{
+  node_select_index_free(the_node_select_index);
+}
+
+/** Choose a random node using <b>nsi</b>, as
+ * router_choose_random_node_helper() would: among the nodes that
+ * router_can_choose_node() allows with <b>flags</b>, excluding the nodes
+ * whose bits are set in <b>excluded_idx</b> and the nodes in
+ * <b>excludedset</b>, weighted by <b>rule</b>.  <b>flags</b> must not
+ * include CRN_DIRECT_CONN.
+ *
+ * Return NULL if there is no such node.  Set *<b>failed_out</b> to true if we
+ * couldn't use the index at all. */
+static const node_t *
+node_select_index_choose(node_select_index_t *nsi,
+                         const bitarray_t *excluded_idx,
+                         const routerset_t *excludedset,
+                         router_crn_flags_t flags,
+                         bandwidth_weight_rule_t rule,
+                         bool *failed_out)
+{
+  const bitarray_t *want[NSB_N_BITMAPS];
+  int n_want = 0, n_candidates = 0, chosen;
+  uint64_t total = 0;
+  const uint64_t *cumulative_bw = NULL;
+
+  tor_assert_nonfatal(!(flags & CRN_DIRECT_CONN));
+  *failed_out = false;
+
+  want[n_want++] = nsi->bitmaps[NSB_USABLE];
+  if (flags & CRN_NEED_UPTIME)
+    want[n_want++] = nsi->bitmaps[NSB_STABLE];
+  if (flags & CRN_NEED_CAPACITY)
+    want[n_want++] = nsi->bitmaps[NSB_FAST];
+  if (flags & CRN_NEED_GUARD)
+    want[n_want++] = nsi->bitmaps[NSB_GUARD];
+  if (flags & CRN_NEED_DESC) {
+    /* As node_has_preferred_descriptor(node, 0). */
+    if (we_use_microdescriptors_for_circuits(get_options()))
+      want[n_want++] = nsi->bitmaps[NSB_HAS_MD];
+    else
+      want[n_want++] = nsi->bitmaps[NSB_HAS_RI];
+  }
+  if (flags & CRN_CONFLUX)
+    want[n_want++] = nsi->bitmaps[NSB_CONFLUX];
+  if (flags & CRN_INITIATE_IPV6_EXTEND)
+    want[n_want++] = nsi->bitmaps[NSB_IPV6_EXTEND];
+  if (flags & CRN_FOR_HS)
+    want[n_want++] = nsi->bitmaps[NSB_NOT_MIDDLE_ONLY];
+
+  for (int w = 0; w < nsi->n_words; ++w) {
+    unsigned int word = ~excluded_idx[w];
+    for (int i = 0; i < n_want; ++i)
+      word &= want[i][w];
+    if (!word)
+      continue;
+    if (n_candidates == 0) {
+      /* Don't compute weights until we know we have some candidates. */
+      cumulative_bw = node_select_index_get_cumulative_bw(nsi, rule);
+      if (!cumulative_bw) {
+        *failed_out = true;
+        return NULL;
+      }
+    }
+    for (int b = 0; word; ++b, word >>= 1) {
+      if (!(word & 1))
+        continue;
+      const int idx = (w << BITARRAY_SHIFT) + b;
+      if (excludedset &&
+          routerset_contains_node(excludedset,
+                                  smartlist_get(nsi->nodelist, idx)))
+        continue;
+      total += cumulative_bw[idx+1] - cumulative_bw[idx];
+      nsi->scratch_idx[n_candidates] = idx;
+      nsi->scratch_cumulative[n_candidates] = total;
+      ++n_candidates;
+    }
+  }
+
+  log_debug(LD_CIRC, "Found %d candidate nodes using the node selection "
+            "index.", n_candidates);
+  if (n_candidates == 0)
+    return NULL;
+
+  if (total == 0) {
+    chosen = crypto_rand_int(n_candidates);
+  } else {
+    chosen = select_array_member_by_cumulative_timei(
+                                    nsi->scratch_cumulative, n_candidates,
+                                    crypto_rand_uint64(total));
+  }
+  return smartlist_get(nsi->nodelist, nsi->scratch_idx[chosen]);
+}
+
+/** Choose a random element of <b>sl</b>, as
+ * smartlist_choose_node_by_bandwidth_weights() would, but using the weights
+ * cached in the node selection index rather than recomputing them.
+ *
+ * Set *<b>failed_out</b> to true, and return NULL, if we couldn't use the
+ * cached weights: the caller must then compute them itself. */
+static const node_t *
+node_sl_choose_by_cached_bandwidth(const smartlist_t *sl,
+                                   bandwidth_weight_rule_t rule,
+                                   bool *failed_out)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  node_select_index_t *nsi;
+  const uint64_t *cumulative_bw;
+  uint64_t total = 0;
+  const int n = smartlist_len(sl);
+
+  *failed_out = true;
+
+  /* Authorities change node flags as they vote, so they can't trust the
+   * index; and if the list is empty, compute_weighted_bandwidths() knows
+   * how to complain about it. */
+  if (authdir_mode(get_options()) || n == 0)
+    return NULL;
+
+  nsi = node_select_index_get();
+  if (n > nsi->n_nodes)
+    return NULL;
+  cumulative_bw = node_select_index_get_cumulative_bw(nsi, rule);
+  if (!cumulative_bw)
+    return NULL;
+
+  /* Every node in the nodelist shares a single scale factor, so the
+   * weights of any subset of it stay in proportion, and their sum stays
+   * below INT64_MAX/4. */
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    const int idx = node->nodelist_idx;
+    if (idx < 0 || idx >= nsi->n_nodes ||
+        node != smartlist_get(nodelist, idx))
+      return NULL;
+    total += cumulative_bw[idx+1] - cumulative_bw[idx];
+    nsi->scratch_cumulative[node_sl_idx] = total;
+  } SMARTLIST_FOREACH_END(node);
+
+  *failed_out = false;
+  if (total == 0)
+    return smartlist_get(sl, crypto_rand_int(n));
+  return smartlist_get(sl, select_array_member_by_cumulative_timei(
+                                   nsi->scratch_cumulative, n,
+                                   crypto_rand_uint64(total)));
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1315,31 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
+  smartlist_t *sl;
   const node_t *choice = NULL;
 
+  /* Direct connections depend on our firewall and bridge configuration,
+   * and authorities change node flags as they vote: neither can use the
+   * index. */
+  if (!(flags & CRN_DIRECT_CONN) && !authdir_mode(get_options())) {
+    bitarray_t *excluded_idx = nodelist_idx_bitarray_new(excludednodes);
+    if (excluded_idx) {
+      bool failed = false;
+      choice = node_select_index_choose(node_select_index_get(),
+                                        excluded_idx, excludedset,
+                                        flags, rule, &failed);
+      bitarray_free(excluded_idx);
+      if (BUG(choice && !router_can_choose_node(choice, flags))) {
+        /* Our index is stale; somebody forgot to invalidate it. */
+        node_select_index_invalidate();
+      } else if (!failed) {
+        return choice;
+      }
+      choice = NULL;
+    }
+  }
+
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -90,6 +90,8 @@ const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
 
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
+void node_select_index_invalidate(void);
+void node_select_free_all(void);
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
@@ -58,6 +58,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_hot.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
@@ -601,6 +602,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  node_select_index_invalidate();
 
   node_add_to_ed25519_map(node);
 
@@ -657,6 +659,7 @@ nodelist_add_microdesc(microdesc_t *md)
 
   node->md = md;
   md->held_by_nodes++;
+  node_select_index_invalidate();
   /* Setting the HSDir index requires the ed25519 identity key which can
    * only be found either in the ri or md. This is why this is called here.
    * Only nodes supporting HSDir=2 protocol version needs this index. */
@@ -721,6 +724,8 @@ nodelist_set_consensus(const networkstatus_t *ns)
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
+  node_select_index_invalidate();
+
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
@@ -846,6 +851,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    node_select_index_invalidate();
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
@@ -859,6 +865,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    node_select_index_invalidate();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -889,6 +896,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  node_select_index_invalidate();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -959,6 +967,9 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  node_select_free_all();
+  node_hot_free_all();
+
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -2097,6 +2108,7 @@ nodelist_refresh_countries(void)
   const smartlist_t *nodes = nodelist_get_list();
   SMARTLIST_FOREACH(nodes, node_t *, node,
                     node_set_country(node));
+  node_select_index_invalidate();
 }
 
 /** Return true iff router1 and router2 have similar enough network addresses
@@ -2180,7 +2192,7 @@ node_has_declared_family_list(const node_t *node)
 /**
  * Return the listed family IDs of `a`, if it has any.
  */
-static const smartlist_t *
+const smartlist_t *
 node_get_family_ids(const node_t *node)
 {
   if (node->ri && node->ri->family_ids) {
@@ -2343,11 +2355,14 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
   /* Now add all the nodes that share a verified family ID with this node. */
   if (use_family_ids &&
       node_get_family_ids(node)) {
-    SMARTLIST_FOREACH(all_nodes, const node_t *, node2, {
-        if (nodes_have_common_family_id(node, node2)) {
-          smartlist_add(sl, (void *)node2);
-        }
-      });
+    if (node_hot_view_add_family_id_members(node_hot_view_get(), sl,
+                                            node) < 0) {
+      SMARTLIST_FOREACH(all_nodes, const node_t *, node2, {
+          if (nodes_have_common_family_id(node, node2)) {
+            smartlist_add(sl, (void *)node2);
+          }
+        });
+    }
   }
 
   /* If the user declared any families locally, honor those too. */
@@ -2456,8 +2471,10 @@ router_set_status(const char *digest, int up)
       log_warn(LD_NET, "We just marked ourself as down. Are your external "
                "addresses reachable?");
 
-    if (bool_neq(node->is_running, up))
+    if (bool_neq(node->is_running, up)) {
       router_dir_info_changed();
+      node_select_index_invalidate();
+    }
 
     node->is_running = up;
   }
@@ -2570,6 +2587,12 @@ count_usable_descriptors(int *num_present, int *num_usable,
   const int md = (consensus->flavor == FLAV_MICRODESC);
   *num_present = 0, *num_usable = 0;
 
+  if (node_hot_view_count_usable(node_hot_view_get(), consensus, in_set,
+                                 exit_only & USABLE_DESCRIPTOR_EXIT_FLAG,
+                                 exit_only & USABLE_DESCRIPTOR_EXIT_POLICY,
+                                 num_present, num_usable, descs_out) == 0)
+    goto done;
+
   SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list, routerstatus_t *, rs)
     {
        const node_t *node = node_get_by_id(rs->identity_digest);
@@ -2605,6 +2628,7 @@ count_usable_descriptors(int *num_present, int *num_usable,
      }
   SMARTLIST_FOREACH_END(rs);
 
+ done:
   log_debug(LD_DIR, "%d usable, %d present (%s%s%s%s%s).",
             *num_usable, *num_present,
             md ? "microdesc" : "desc",
@@ -118,6 +118,7 @@ void node_get_addr(const node_t *node, tor_addr_t *addr_out);
 void nodelist_refresh_countries(void);
 void node_set_country(node_t *node);
 void nodelist_add_node_and_family(smartlist_t *nodes, const node_t *node);
+const smartlist_t *node_get_family_ids(const node_t *node);
 int nodes_in_same_family(const node_t *node1, const node_t *node2);
 
 const node_t *router_find_exact_exit_enclave(const char *address,
@@ -62,6 +62,10 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** A compiled copy of <b>exit_policy</b>, used for fast lookups.  Built
+   * once when the descriptor is parsed or generated; may be NULL, in which
+   * case we fall back to <b>exit_policy</b>. */
+  struct compiled_policy_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -67,6 +67,7 @@
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/extendinfo.h"
 #include "core/or/policies.h"
 #include "feature/client/bridges.h"
@@ -226,6 +227,114 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
+/** Return a new smartlist of every signed_descriptor_t that belongs in
+ * <b>store</b>. */
+static smartlist_t *
+desc_store_list_descriptors(const desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+  return signed_descriptors;
+}
+
+/* Do we keep the journal of each store mapped, and read journaled descriptor
+ * bodies from it rather than keeping a copy of each on the heap?  Not on
+ * Windows, where we couldn't append to the journal while it was mapped. */
+#ifdef _WIN32
+#define MAP_STORE_JOURNAL 0
+#else
+#define MAP_STORE_JOURNAL 1
+#endif
+
+/** If <b>store</b> has journaled anything that its journal mapping doesn't
+ * cover yet, remap the journal, and free the heap copy of every journaled
+ * descriptor body that we can read from the mapping instead. */
+static void
+router_store_map_journal(desc_store_t *store)
+{
+  char *fname;
+  tor_mmap_t *map;
+  smartlist_t *signed_descriptors;
+
+  if (!MAP_STORE_JOURNAL || !routerlist || !store->journal_len)
+    return;
+  if (store->journal_mmap && store->journal_mmap->size >= store->journal_len)
+    return;
+
+  fname = get_cachedir_fname_suffix(store->fname_base, ".new");
+  map = tor_mmap_file(fname);
+  tor_free(fname);
+  if (!map)
+    return;
+  /* The journal is append-only, so anything that we were reading from the
+   * old mapping is at the same offset in the new one. */
+  if (tor_munmap_file(store->journal_mmap) != 0) {
+    log_warn(LD_FS, "Unable to munmap %s journal", store->description);
+  }
+  store->journal_mmap = map;
+
+  signed_descriptors = desc_store_list_descriptors(store);
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    size_t len = sd->signed_descriptor_len + sd->annotations_len;
+    if (sd->saved_location != SAVED_IN_JOURNAL ||
+        !sd->signed_descriptor_body || sd->do_not_cache)
+      continue;
+    if (sd->saved_offset < 0 || (size_t)sd->saved_offset + len > map->size)
+      continue;
+    /* Only trust the file if it says what we wrote. */
+    if (fast_memneq(map->data + sd->saved_offset,
+                    sd->signed_descriptor_body, len))
+      continue;
+    tor_free(sd->signed_descriptor_body);
+  } SMARTLIST_FOREACH_END(sd);
+  smartlist_free(signed_descriptors);
+}
+
+/** Called after loading the journal of <b>store</b>.  Return true iff the
+ * journal ends with a descriptor that we kept, so that we know it doesn't
+ * end with a partially written one. */
+static int
+router_store_journal_is_clean(const desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = desc_store_list_descriptors(store);
+  size_t end = 0;
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    if (sd->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    end = MAX(end, (size_t)sd->saved_offset +
+              sd->signed_descriptor_len + sd->annotations_len);
+  } SMARTLIST_FOREACH_END(sd);
+  smartlist_free(signed_descriptors);
+
+  return end == store->journal_len;
+}
+
+/** Release the journal mapping for <b>store</b>, if there is one. */
+static void
+router_store_unmap_journal(desc_store_t *store)
+{
+  if (tor_munmap_file(store->journal_mmap) != 0) {
+    log_warn(LD_FS, "Unable to munmap %s journal", store->description);
+  }
+  store->journal_mmap = NULL;
+}
+
 #define RRS_FORCE 1
 #define RRS_DONT_REMOVE_OLD 2
 
@@ -248,6 +357,7 @@ router_rebuild_store(int flags, desc_store_t *store)
   int force = flags & RRS_FORCE;
 
   if (!force && !router_should_rebuild_store(store)) {
+    router_store_map_journal(store);
     r = 0;
     goto done;
   }
@@ -274,24 +384,7 @@ router_rebuild_store(int flags, desc_store_t *store)
   chunk_list = smartlist_new();
 
   /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
-
+  signed_descriptors = desc_store_list_descriptors(store);
   smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
 
   /* Now, add the appropriate members to chunk_list */
@@ -355,6 +448,14 @@ router_rebuild_store(int flags, desc_store_t *store)
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
       if (sd->do_not_cache)
         continue;
+      if (!store->mmap && sd->saved_location == SAVED_IN_JOURNAL &&
+          !sd->signed_descriptor_body) {
+        /* We're about to lose the journal mapping, and we have no store
+         * mapping to read this from instead: copy it. */
+        sd->signed_descriptor_body =
+          tor_memdup(signed_descriptor_get_body_impl(sd, 1),
+                     sd->signed_descriptor_len + sd->annotations_len);
+      }
       sd->saved_location = SAVED_IN_CACHE;
       if (store->mmap) {
         tor_free(sd->signed_descriptor_body); // sets it to null
@@ -364,6 +465,8 @@ router_rebuild_store(int flags, desc_store_t *store)
       signed_descriptor_get_body(sd); /* reconstruct and assert */
   } SMARTLIST_FOREACH_END(sd);
 
+  /* Nothing we kept is in the journal any more. */
+  router_store_unmap_journal(store);
   tor_free(fname);
   fname = get_cachedir_fname_suffix(store->fname_base, ".new");
   write_str_to_file(fname, "", 1);
@@ -390,10 +493,11 @@ router_rebuild_store(int flags, desc_store_t *store)
 static int
 router_reload_router_list_impl(desc_store_t *store)
 {
-  char *fname = NULL, *contents = NULL;
-  struct stat st;
+  char *fname = NULL;
+  tor_mmap_t *journal = NULL;
   int extrainfo = (store->type == EXTRAINFO_STORE);
   store->journal_len = store->store_len = 0;
+  router_store_unmap_journal(store);
 
   fname = get_cachedir_fname(store->fname_base);
 
@@ -425,27 +529,36 @@ router_reload_router_list_impl(desc_store_t *store)
   fname = get_cachedir_fname_suffix(store->fname_base, ".new");
   /* don't load empty files - we wouldn't get any data, even if we tried */
   if (file_status(fname) == FN_FILE)
-    contents = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
-  if (contents) {
+    journal = tor_mmap_file(fname);
+  if (journal) {
     if (extrainfo)
-      router_load_extrainfo_from_string(contents, NULL,SAVED_IN_JOURNAL,
-                                        NULL, 0);
+      router_load_extrainfo_from_string(journal->data,
+                                        journal->data+journal->size,
+                                        SAVED_IN_JOURNAL, NULL, 0);
     else
-      router_load_routers_from_string(contents, NULL, SAVED_IN_JOURNAL,
-                                      NULL, 0, NULL);
-    store->journal_len = (size_t) st.st_size;
-    tor_free(contents);
+      router_load_routers_from_string(journal->data,
+                                      journal->data+journal->size,
+                                      SAVED_IN_JOURNAL, NULL, 0, NULL);
+    store->journal_len = journal->size;
+    if (tor_munmap_file(journal) != 0) {
+      log_warn(LD_FS, "Failed to munmap %s", fname);
+    }
   }
 
   tor_free(fname);
 
-  if (store->journal_len) {
-    /* Always clear the journal on startup.*/
+  if (store->journal_len && !router_store_journal_is_clean(store)) {
+    /* The journal might end with a partially written descriptor: don't
+     * append anything after it. */
     router_rebuild_store(RRS_FORCE, store);
-  } else if (!extrainfo) {
+  } else {
     /* Don't cache expired routers. (This is in an else because
      * router_rebuild_store() also calls remove_old_routers().) */
-    routerlist_remove_old_routers();
+    if (!extrainfo)
+      routerlist_remove_old_routers();
+    /* Rebuild the store if the journal is long enough to need it; otherwise,
+     * keep using the journal, and read what we loaded from it in place. */
+    router_rebuild_store(RRS_DONT_REMOVE_OLD, store);
   }
 
   return 0;
@@ -854,6 +967,13 @@ signed_descriptor_get_body_impl(const signed_descriptor_t *desc,
       exit(1); // XXXX bad exit: should recover.
     }
   }
+  if (!r && desc->saved_location == SAVED_IN_JOURNAL &&
+      !desc->signed_descriptor_body && routerlist) {
+    desc_store_t *store = desc_get_store(router_get_routerlist(), desc);
+    tor_assert(store && store->journal_mmap);
+    tor_assert(desc->saved_offset + len <= store->journal_mmap->size);
+    r = store->journal_mmap->data + offset;
+  }
   if (!r) /* no mmap, or not in cache. */
     r = desc->signed_descriptor_body +
       (with_annotations ? 0 : desc->annotations_len);
@@ -944,6 +1064,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->family_ids);
   }
   addr_policy_list_free(router->exit_policy);
+  compiled_policy_free(router->compiled_exit_policy);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -1057,6 +1178,8 @@ routerlist_free_(routerlist_t *rl)
       log_warn(LD_FS, "Failed to munmap routerlist->extrainfo_store.mmap");
     }
   }
+  router_store_unmap_journal(&rl->desc_store);
+  router_store_unmap_journal(&rl->extrainfo_store);
   tor_free(rl);
 }
 
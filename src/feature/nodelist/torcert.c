@@ -28,6 +28,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/lock/compat_mutex.h"
 #include "feature/nodelist/torcert.h"
 #include "trunnel/ed25519_cert.h"
 #include "lib/log/log.h"
@@ -466,10 +467,201 @@ rsa_ed25519_crosscert_check, (const uint8_t *crosscert,
   return rv;
 }
 
+/**
+ * A cache of the certificate chains from CERTS cells that we have already
+ * verified.
+ *
+ * Relays that talk to each other see the same identity, signing and
+ * crosscert certificates on every connection, and the same link or
+ * authentication certificate until the peer rotates its keys.  Once we have
+ * checked a chain's signatures, we remember it here, so that we only need
+ * to check the certificates' lifetimes the next time we see it.
+ *
+ * The cache is direct-mapped: each chain has exactly one slot, and evicts
+ * whatever was there before.  Chains are checked on cpuworker threads as
+ * well as on the main thread, so the cache is protected by a mutex.
+ */
+typedef struct link_cert_cache_ent_t {
+  /** Digest of the certificates in the chain; see link_cert_chain_digest().
+   * All-zero for an empty slot. */
+  uint8_t chain_digest[DIGEST256_LEN];
+  /** The time after which the chain's Ed25519 certificates or crosscert
+   * expire.  (We check the X.509 certificates' lifetimes separately.) */
+  time_t expires;
+} link_cert_cache_ent_t;
+
+/** Number of slots in the link certificate cache.  Must be a power of two.
+ * This is comfortably more than the number of relays in the network. */
+#define LINK_CERT_CACHE_SLOTS 16384
+
+/** The slots of the link certificate cache, or NULL if it isn't set up. */
+static link_cert_cache_ent_t *link_cert_cache = NULL;
+/** Lock for link_cert_cache and link_cert_cache_stats. */
+static tor_mutex_t link_cert_cache_lock;
+/** True iff we have initialized link_cert_cache_lock. */
+static bool link_cert_cache_lock_initialized = false;
+/** Number of times that we have looked up each kind of result. */
+static uint64_t link_cert_cache_stats[LINK_CERT_CACHE_STAT_N_];
+
+/** Compute into <b>digest_out</b> a digest of the certificates in
+ * <b>certs</b> that we'd check with or_handshake_certs_rsa_ok() (if
+ * <b>is_ed</b> is false) or or_handshake_certs_ed25519_ok() (if it's true).
+ * Return 0 on success, or -1 if some certificate we'd need is missing. */
+static int
+link_cert_chain_digest(const or_handshake_certs_t *certs, bool is_ed,
+                       uint8_t *digest_out)
+{
+  const tor_x509_cert_t *x509_secondary =
+    certs->started_here ? certs->link_cert : certs->auth_cert;
+  const tor_cert_t *ed_secondary =
+    certs->started_here ? certs->ed_sign_link : certs->ed_sign_auth;
+  const uint8_t flags[2] = { is_ed, certs->started_here };
+  crypto_digest_t *d;
+
+  if (!certs->id_cert)
+    return -1;
+  if (is_ed ? !(certs->ed_id_sign && ed_secondary && certs->ed_rsa_crosscert)
+      : !x509_secondary)
+    return -1;
+
+#define ADD(ptr, len) do {                                     \
+    uint8_t len_buf[4];                                         \
+    set_uint32(len_buf, htonl((uint32_t)(len)));                \
+    crypto_digest_add_bytes(d, (const char *)len_buf, 4);       \
+    crypto_digest_add_bytes(d, (const char *)(ptr), (len));     \
+  } while (0)
+
+  d = crypto_digest256_new(DIGEST_SHA256);
+  ADD(flags, sizeof(flags));
+  ADD(tor_x509_cert_get_cert_digests(certs->id_cert)->d[DIGEST_SHA256],
+      DIGEST256_LEN);
+  if (is_ed) {
+    ADD(certs->ed_id_sign->encoded, certs->ed_id_sign->encoded_len);
+    ADD(ed_secondary->encoded, ed_secondary->encoded_len);
+    ADD(certs->ed_rsa_crosscert, certs->ed_rsa_crosscert_len);
+  } else {
+    ADD(tor_x509_cert_get_cert_digests(x509_secondary)->d[DIGEST_SHA256],
+        DIGEST256_LEN);
+  }
+  crypto_digest_get_digest(d, (char *)digest_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+#undef ADD
+  return 0;
+}
+
+/** Return the slot in the link certificate cache for <b>chain_digest</b>.
+ * The caller must hold link_cert_cache_lock, and the cache must exist. */
+static link_cert_cache_ent_t *
+link_cert_cache_slot(const uint8_t *chain_digest)
+{
+  return &link_cert_cache[get_uint32(chain_digest) &
+                          (LINK_CERT_CACHE_SLOTS - 1)];
+}
+
+/** Return true iff we have verified the chain with digest
+ * <b>chain_digest</b>, and its Ed25519 parts haven't expired as of
+ * <b>now</b>.  Count the lookup as a hit or a miss. */
+static bool
+link_cert_cache_lookup(const uint8_t *chain_digest, time_t now)
+{
+  bool found = false;
+
+  if (!link_cert_cache_lock_initialized)
+    return false;
+
+  tor_mutex_acquire(&link_cert_cache_lock);
+  if (link_cert_cache) {
+    const link_cert_cache_ent_t *ent = link_cert_cache_slot(chain_digest);
+    found = tor_memeq(ent->chain_digest, chain_digest, DIGEST256_LEN) &&
+      now <= ent->expires;
+    ++link_cert_cache_stats[found ? LINK_CERT_CACHE_STAT_HIT :
+                            LINK_CERT_CACHE_STAT_MISS];
+  }
+  tor_mutex_release(&link_cert_cache_lock);
+  return found;
+}
+
+/** Remember that we have verified the chain with digest
+ * <b>chain_digest</b>, whose Ed25519 parts (if any) expire at
+ * <b>expires</b>. */
+static void
+link_cert_cache_add(const uint8_t *chain_digest, time_t expires)
+{
+  if (!link_cert_cache_lock_initialized)
+    return;
+
+  tor_mutex_acquire(&link_cert_cache_lock);
+  if (link_cert_cache) {
+    link_cert_cache_ent_t *ent = link_cert_cache_slot(chain_digest);
+    memcpy(ent->chain_digest, chain_digest, DIGEST256_LEN);
+    ent->expires = expires;
+  }
+  tor_mutex_release(&link_cert_cache_lock);
+}
+
+/** Return the number of link certificate cache lookups that had the result
+ * <b>stat</b>. */
+uint64_t
+or_handshake_certs_cache_get_stat(link_cert_cache_stat_t stat)
+{
+  uint64_t r;
+  tor_assert(stat < LINK_CERT_CACHE_STAT_N_);
+
+  if (!link_cert_cache_lock_initialized)
+    return 0;
+  tor_mutex_acquire(&link_cert_cache_lock);
+  r = link_cert_cache_stats[stat];
+  tor_mutex_release(&link_cert_cache_lock);
+  return r;
+}
+
+/** Release all storage held by the link certificate cache.  The lock stays
+ * around, in case a worker thread is still checking a chain. */
+void
+or_handshake_certs_cache_free_all(void)
+{
+  if (!link_cert_cache_lock_initialized)
+    return;
+  tor_mutex_acquire(&link_cert_cache_lock);
+  tor_free(link_cert_cache);
+  memset(link_cert_cache_stats, 0, sizeof(link_cert_cache_stats));
+  tor_mutex_release(&link_cert_cache_lock);
+}
+
+/** Return the expiration time of the RSA->Ed25519 crosscert in the
+ * <b>crosscert_len</b> bytes at <b>crosscert</b>, or 0 if it doesn't
+ * parse. */
+static time_t
+rsa_ed25519_crosscert_get_expiration(const uint8_t *crosscert,
+                                     size_t crosscert_len)
+{
+  rsa_ed_crosscert_t *cc = NULL;
+  time_t expiration = 0;
+  if (rsa_ed_crosscert_parse(&cc, crosscert, crosscert_len) >= 0) {
+    /* Clamp, in case time_t is 32 bits. */
+    expiration = (time_t) MIN((uint64_t)rsa_ed_crosscert_get_expiration(cc)
+                              * 3600, (uint64_t)TIME_MAX);
+  }
+  rsa_ed_crosscert_free(cc);
+  return expiration;
+}
+
 /** Construct and return a new empty or_handshake_certs object */
 or_handshake_certs_t *
 or_handshake_certs_new(void)
 {
+  /* We always make one of these, on the main thread, before we check any
+   * certificates: so this is a safe place to set up the cache. */
+  if (!link_cert_cache_lock_initialized) {
+    tor_mutex_init_nonrecursive(&link_cert_cache_lock);
+    link_cert_cache_lock_initialized = true;
+  }
+  if (!link_cert_cache) {
+    tor_mutex_acquire(&link_cert_cache_lock);
+    link_cert_cache = tor_calloc(LINK_CERT_CACHE_SLOTS,
+                                 sizeof(link_cert_cache_ent_t));
+    tor_mutex_release(&link_cert_cache_lock);
+  }
   return tor_malloc_zero(sizeof(or_handshake_certs_t));
 }
 
@@ -488,6 +680,7 @@ or_handshake_certs_free_(or_handshake_certs_t *certs)
   tor_cert_free(certs->ed_sign_link);
   tor_cert_free(certs->ed_sign_auth);
   tor_free(certs->ed_rsa_crosscert);
+  tor_x509_cert_free(certs->tls_peer_cert);
 
   memwipe(certs, 0xBD, sizeof(*certs));
   tor_free(certs);
@@ -511,12 +704,24 @@ or_handshake_certs_rsa_ok(int severity,
   tor_x509_cert_t *link_cert = certs->link_cert;
   tor_x509_cert_t *auth_cert = certs->auth_cert;
   tor_x509_cert_t *id_cert = certs->id_cert;
+  uint8_t chain_digest[DIGEST256_LEN];
+  bool cached = false;
+
+  if (link_cert_chain_digest(certs, false, chain_digest) == 0)
+    cached = link_cert_cache_lookup(chain_digest, now);
 
   if (certs->started_here) {
     if (! (id_cert && link_cert))
       ERR("The certs we wanted (ID, Link) were missing");
     if (! tor_tls_cert_matches_key(tls, link_cert))
       ERR("The link certificate didn't match the TLS public key");
+    if (cached) {
+      if (tor_x509_check_cert_lifetime(severity, link_cert, now) < 0)
+        ERR("The link certificate was not valid");
+      if (tor_x509_check_cert_lifetime(severity, id_cert, now) < 0)
+        ERR("The ID certificate was not valid");
+      return 1;
+    }
     if (! tor_tls_cert_is_valid(severity, link_cert, id_cert, now, 0))
       ERR("The link certificate was not valid");
     if (! tor_tls_cert_is_valid(severity, id_cert, id_cert, now, 1))
@@ -524,17 +729,26 @@ or_handshake_certs_rsa_ok(int severity,
   } else {
     if (! (id_cert && auth_cert))
       ERR("The certs we wanted (ID, Auth) were missing");
+    if (cached) {
+      if (tor_x509_check_cert_lifetime(LOG_PROTOCOL_WARN, auth_cert, now) < 0)
+        ERR("The authentication certificate was not valid");
+      if (tor_x509_check_cert_lifetime(LOG_PROTOCOL_WARN, id_cert, now) < 0)
+        ERR("The ID certificate was not valid");
+      return 1;
+    }
     if (! tor_tls_cert_is_valid(LOG_PROTOCOL_WARN, auth_cert, id_cert, now, 1))
       ERR("The authentication certificate was not valid");
     if (! tor_tls_cert_is_valid(LOG_PROTOCOL_WARN, id_cert, id_cert, now, 1))
       ERR("The ID certificate was not valid");
   }
 
+  link_cert_cache_add(chain_digest, TIME_MAX);
   return 1;
 }
 
 /** Check all the ed25519 certificates in <b>certs</b> against each other, and
- * against the peer certificate in <b>tls</b> if appropriate.  On success,
+ * against the peer certificate in <b>tls</b> (or in
+ * <b>certs</b>-\>tls_peer_cert, if that is set) if appropriate.  On success,
  * return 0; on failure, return a negative value and warn at level
  * <b>severity</b> */
 int
@@ -565,7 +779,8 @@ or_handshake_certs_ed25519_ok(int severity,
       ERR("No Ed25519 link key");
     {
       /* check for a match with the TLS cert. */
-      tor_x509_cert_t *peer_cert = tor_tls_get_peer_cert(tls);
+      tor_x509_cert_t *peer_cert = certs->tls_peer_cert ?
+        tor_x509_cert_dup(certs->tls_peer_cert) : tor_tls_get_peer_cert(tls);
       if (BUG(!peer_cert)) {
         /* This is a bug, because if we got to this point, we are a connection
          * that was initiated here, and we completed a TLS handshake. The
@@ -605,6 +820,19 @@ or_handshake_certs_ed25519_ok(int severity,
   if (!rsa_id_cert) {
     ERR("Missing legacy RSA ID certificate");
   }
+
+  /* If we've checked all these signatures before, we only need to make sure
+   * that nothing has expired since. */
+  uint8_t chain_digest[DIGEST256_LEN];
+  const bool have_digest =
+    link_cert_chain_digest(certs, true, chain_digest) == 0;
+  if (have_digest && link_cert_cache_lookup(chain_digest, now)) {
+    if (tor_x509_check_cert_lifetime(severity, rsa_id_cert, now) < 0) {
+      ERR("The legacy RSA ID certificate was not valid");
+    }
+    return 1;
+  }
+
   if (! tor_tls_cert_is_valid(severity, rsa_id_cert, rsa_id_cert, now, 1)) {
     ERR("The legacy RSA ID certificate was not valid");
   }
@@ -636,6 +864,12 @@ or_handshake_certs_ed25519_ok(int severity,
     ERR("At least one Ed25519 certificate was badly signed");
   }
 
+  if (have_digest) {
+    time_t cc_expiration = rsa_ed25519_crosscert_get_expiration(
+                                         certs->ed_rsa_crosscert,
+                                         certs->ed_rsa_crosscert_len);
+    link_cert_cache_add(chain_digest, MIN(expiration, cc_expiration));
+  }
   return 1;
 }
 
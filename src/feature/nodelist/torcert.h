@@ -100,6 +100,20 @@ rsa_ed25519_crosscert_check, (const uint8_t *crosscert,
                               const ed25519_public_key_t *master_key,
                               const time_t reject_if_expired_before));
 
+/** Results of looking up a CERTS cell's certificate chain in the cache of
+ * chains we've verified, for or_handshake_certs_cache_get_stat(). */
+typedef enum link_cert_cache_stat_t {
+  /** We had verified the chain before, and skipped its signatures. */
+  LINK_CERT_CACHE_STAT_HIT,
+  /** We had to check the chain's signatures. */
+  LINK_CERT_CACHE_STAT_MISS,
+  /** Number of link_cert_cache_stat_t values. */
+  LINK_CERT_CACHE_STAT_N_,
+} link_cert_cache_stat_t;
+
+uint64_t or_handshake_certs_cache_get_stat(link_cert_cache_stat_t stat);
+void or_handshake_certs_cache_free_all(void);
+
 or_handshake_certs_t *or_handshake_certs_new(void);
 void or_handshake_certs_free_(or_handshake_certs_t *certs);
 #define or_handshake_certs_free(certs) \
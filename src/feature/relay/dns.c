@@ -86,6 +86,17 @@
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
+/** How long, in seconds, will we remember a transient failure (like
+ * SERVFAIL, or a timeout) for an address? */
+#define DNS_TRANSIENT_ERROR_TTL 30
+
+/** How many streams must use a cached answer before we refresh it ahead of
+ * its expiry? */
+#define DNS_PREFETCH_MIN_HITS 2
+/** How many seconds before a popular cached answer expires do we refresh
+ * it? */
+#define DNS_PREFETCH_WINDOW 30
+
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
@@ -101,17 +112,14 @@ static char *resolv_conf_fname = NULL;
 static time_t resolv_conf_mtime = 0;
 
 static void purge_expired_resolves(time_t now);
-static void dns_found_answer(const char *address, uint8_t query_type,
-                             int dns_answer,
-                             const tor_addr_t *addr,
-                             const char *hostname,
-                             uint32_t ttl);
 static void add_wildcarded_test_address(const char *address);
 static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
 static void make_pending_resolve_cached(cached_resolve_t *cached);
+static void maybe_refresh_cached_resolve(cached_resolve_t *resolve,
+                                         time_t now);
 static void configure_libevent_options(void);
 
 #ifdef DEBUG_DNS_CACHE
@@ -276,6 +284,41 @@ has_dns_init_failed(void)
   return nameserver_config_failed;
 }
 
+/** Total number of bytes allocated for cached_resolve_t objects, including
+ * the space for their addresses. */
+static size_t cached_resolve_bytes = 0;
+
+/** How many times has each dns_cache_stat_t event happened? */
+static uint64_t dns_cache_stats[DNS_CACHE_STAT_N_];
+
+/** Return the number of bytes allocated for <b>resolve</b>. */
+static inline size_t
+cached_resolve_size(const cached_resolve_t *resolve)
+{
+  return offsetof(cached_resolve_t, address_buf) +
+    strlen(resolve->address_buf) + 1;
+}
+
+/** Return a new pending cached_resolve_t for <b>address</b>, which must be
+ * shorter than MAX_ADDRESSLEN.  The address is stored inline, so that
+ * entries for short names take up little memory. */
+STATIC cached_resolve_t *
+cached_resolve_new(const char *address)
+{
+  const size_t len = strlen(address);
+  cached_resolve_t *resolve;
+
+  tor_assert(len < MAX_ADDRESSLEN);
+  resolve = tor_malloc_zero(offsetof(cached_resolve_t, address_buf) + len + 1);
+  memcpy(resolve->address_buf, address, len + 1);
+  resolve->address = resolve->address_buf;
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_PENDING;
+  resolve->minheap_idx = -1;
+  cached_resolve_bytes += cached_resolve_size(resolve);
+  return resolve;
+}
+
 /** Helper: free storage held by an entry in the DNS cache. */
 static void
 free_cached_resolve_(cached_resolve_t *r)
@@ -289,6 +332,7 @@ free_cached_resolve_(cached_resolve_t *r)
   }
   if (r->res_status_hostname == RES_STATUS_DONE_OK)
     tor_free(r->result_ptr.hostname);
+  cached_resolve_bytes -= cached_resolve_size(r);
   r->magic = 0xFF00FF00;
   tor_free(r);
 }
@@ -320,6 +364,11 @@ cached_resolve_add_answer(cached_resolve_t *resolve,
                           const char *answer_hostname,
                           uint32_t ttl)
 {
+  /* Don't remember a transient failure for long: the nameserver may well
+   * have an answer for us next time. */
+  if (dns_result != DNS_ERR_NONE && evdns_err_is_transient(dns_result))
+    ttl = MIN(ttl, DNS_TRANSIENT_ERROR_TTL);
+
   if (query_type == DNS_PTR) {
     if (resolve->res_status_hostname != RES_STATUS_INFLIGHT)
       return;
@@ -387,6 +436,45 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Change the expiry time of a cached_resolve_t that is already in the expiry
+ * priority queue. */
+static void
+reset_expiry(cached_resolve_t *resolve, time_t expires)
+{
+  tor_assert(resolve && resolve->minheap_idx >= 0);
+  smartlist_pqueue_remove(cached_resolve_pqueue,
+                          compare_cached_resolves_by_expiry_,
+                          offsetof(cached_resolve_t, minheap_idx),
+                          resolve);
+  resolve->expire = 0;
+  set_expiry(resolve, expires);
+}
+
+/** Return the lowest TTL among the answers in <b>resolve</b>, or UINT32_MAX
+ * if it has no answers. */
+static uint32_t
+cached_resolve_get_ttl(const cached_resolve_t *resolve)
+{
+  uint32_t ttl = UINT32_MAX;
+
+  if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv4 < ttl)
+    ttl = resolve->ttl_ipv4;
+
+  if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv6 < ttl)
+    ttl = resolve->ttl_ipv6;
+
+  if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
+       resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_hostname < ttl)
+    ttl = resolve->ttl_hostname;
+
+  return ttl;
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -483,10 +571,7 @@ purge_expired_resolves(time_t now)
       cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
       tor_assert(tmp != resolve);
     }
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      tor_free(resolve->result_ptr.hostname);
-    resolve->magic = 0xF0BBF0BB;
-    tor_free(resolve);
+    free_cached_resolve_(resolve);
   }
 
   assert_cache_ok();
@@ -760,6 +845,12 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
     return -1;
   }
 
+  if (strlen(exitconn->base_.address) >= MAX_ADDRESSLEN) {
+    log_info(LD_EXIT, "Rejecting overlong destination address %s",
+             escaped_safe_str(exitconn->base_.address));
+    return -1;
+  }
+
   /* then take this opportunity to see if there are any expired
    * resolves in the hash table. */
   purge_expired_resolves(now);
@@ -797,7 +888,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   exitconn->is_reverse_dns_lookup = is_reverse;
 
   /* now check the hash table to see if 'address' is already there. */
-  strlcpy(search.address, exitconn->base_.address, sizeof(search.address));
+  search.address = exitconn->base_.address;
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
@@ -809,6 +900,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
         pending_connection->next = resolve->pending_connections;
         resolve->pending_connections = pending_connection;
         *made_connection_pending_out = 1;
+        ++dns_cache_stats[DNS_CACHE_STAT_JOINED];
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
@@ -820,8 +912,14 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
-
-        return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
+        if (resolve->n_hits < UINT16_MAX)
+          ++resolve->n_hits;
+        maybe_refresh_cached_resolve(resolve, now);
+
+        r = set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
+        ++dns_cache_stats[r < 0 ? DNS_CACHE_STAT_NEGATIVE_HIT :
+                          DNS_CACHE_STAT_HIT];
+        return r;
       case CACHE_STATE_DONE:
         log_err(LD_BUG, "Found a 'DONE' dns resolve still in the cache.");
         tor_fragile_assert();
@@ -830,11 +928,8 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
-  resolve = tor_malloc_zero(sizeof(cached_resolve_t));
-  resolve->magic = CACHED_RESOLVE_MAGIC;
-  resolve->state = CACHE_STATE_PENDING;
-  resolve->minheap_idx = -1;
-  strlcpy(resolve->address, exitconn->base_.address, sizeof(resolve->address));
+  resolve = cached_resolve_new(exitconn->base_.address);
+  ++dns_cache_stats[DNS_CACHE_STAT_MISS];
 
   /* add this connection to the pending list */
   pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
@@ -974,7 +1069,7 @@ assert_connection_edge_not_dns_pending(edge_connection_t *conn)
 
 #if 1
   cached_resolve_t *resolve;
-  strlcpy(search.address, conn->base_.address, sizeof(search.address));
+  search.address = conn->base_.address;
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve)
     return;
@@ -1003,7 +1098,7 @@ connection_dns_remove(edge_connection_t *conn)
   tor_assert(conn->base_.type == CONN_TYPE_EXIT);
   tor_assert(conn->base_.state == EXIT_CONN_STATE_RESOLVING);
 
-  strlcpy(search.address, conn->base_.address, sizeof(search.address));
+  search.address = conn->base_.address;
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve) {
@@ -1057,7 +1152,7 @@ dns_cancel_pending_resolve,(const char *address))
   edge_connection_t *pendconn;
   circuit_t *circ;
 
-  strlcpy(search.address, address, sizeof(search.address));
+  search.address = address;
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve)
@@ -1129,6 +1224,102 @@ is_test_address(const char *address)
     smartlist_contains_string_case(options->ServerDNSTestAddresses, address);
 }
 
+/** Return true iff we should refresh popular cached answers before they
+ * expire. */
+static int
+dns_prefetch_enabled(void)
+{
+#define EXIT_DNS_PREFETCH_DEFAULT (1)
+#define EXIT_DNS_PREFETCH_MIN (0)
+#define EXIT_DNS_PREFETCH_MAX (1)
+  return networkstatus_get_param(NULL, "exit_dns_prefetch",
+                                 EXIT_DNS_PREFETCH_DEFAULT,
+                                 EXIT_DNS_PREFETCH_MIN,
+                                 EXIT_DNS_PREFETCH_MAX);
+}
+
+/** If <b>resolve</b> is a cached answer that several streams have used, and
+ * it is about to expire, launch its lookups again now.  That way, the next
+ * stream for the same address will find a fresh answer in the cache rather
+ * than having to wait for one.
+ *
+ * We only refresh successful forward lookups. */
+static void
+maybe_refresh_cached_resolve(cached_resolve_t *resolve, time_t now)
+{
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+
+  if (resolve->refresh_ipv4 || resolve->refresh_ipv6)
+    return;
+  if (resolve->n_hits < DNS_PREFETCH_MIN_HITS ||
+      resolve->expire - now > DNS_PREFETCH_WINDOW)
+    return;
+  if (resolve->res_status_ipv4 != RES_STATUS_DONE_OK &&
+      resolve->res_status_ipv6 != RES_STATUS_DONE_OK)
+    return;
+  if (net_is_disabled() || !dns_prefetch_enabled())
+    return;
+
+  log_debug(LD_EXIT, "Refreshing cached resolve of %s before it expires.",
+            escaped_safe_str(resolve->address));
+  if (launch_one_resolve(resolve->address, DNS_IPv4_A, NULL) == 0)
+    resolve->refresh_ipv4 = 1;
+  if (get_options()->IPv6Exit &&
+      launch_one_resolve(resolve->address, DNS_IPv6_AAAA, NULL) == 0)
+    resolve->refresh_ipv6 = 1;
+  if (resolve->refresh_ipv4 || resolve->refresh_ipv6)
+    ++dns_cache_stats[DNS_CACHE_STAT_PREFETCH];
+}
+
+/** Called when we get the answer to one of the lookups that
+ * maybe_refresh_cached_resolve() launched for <b>resolve</b>.  Replace the
+ * cached answer, unless the lookup failed for some transient reason.  Once
+ * all the answers are in, and if none of them failed that way, give
+ * <b>resolve</b> a new expiry time. */
+static void
+cached_resolve_add_refreshed_answer(cached_resolve_t *resolve,
+                                    uint8_t query_type, int dns_answer,
+                                    const tor_addr_t *addr, uint32_t ttl)
+{
+  if (query_type == DNS_IPv4_A && resolve->refresh_ipv4) {
+    resolve->refresh_ipv4 = 0;
+  } else if (query_type == DNS_IPv6_AAAA && resolve->refresh_ipv6) {
+    resolve->refresh_ipv6 = 0;
+  } else {
+    return;
+  }
+
+  if (evdns_err_is_transient(dns_answer)) {
+    /* Keep the answer we have, and let it expire when it was going to. */
+    resolve->refresh_failed = 1;
+  } else {
+    if (query_type == DNS_IPv4_A)
+      resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+    else
+      resolve->res_status_ipv6 = RES_STATUS_INFLIGHT;
+    cached_resolve_add_answer(resolve, query_type, dns_answer,
+                              addr, NULL, ttl);
+  }
+
+  if (resolve->refresh_ipv4 || resolve->refresh_ipv6)
+    return;
+
+  if (!resolve->refresh_failed) {
+    reset_expiry(resolve, time(NULL) + cached_resolve_get_ttl(resolve));
+    resolve->n_hits = 0;
+  }
+  resolve->refresh_failed = 0;
+}
+
+/** Return the number of times that <b>stat</b> has happened in our DNS
+ * cache. */
+uint64_t
+dns_cache_get_stat(dns_cache_stat_t stat)
+{
+  tor_assert(stat < DNS_CACHE_STAT_N_);
+  return dns_cache_stats[stat];
+}
+
 /** Called on the OR side when the eventdns library tells us the outcome of a
  * single DNS resolve: remember the answer, and tell all pending connections
  * about the result of the lookup if the lookup is now done.  (<b>address</b>
@@ -1138,7 +1329,7 @@ is_test_address(const char *address)
  * got one; <b>hostname</b> is a hostname fora PTR request if we got one, and
  * <b>ttl</b> is the time-to-live of this answer, in seconds.)
  */
-static void
+STATIC void
 dns_found_answer(const char *address, uint8_t query_type,
                  int dns_answer,
                  const tor_addr_t *addr,
@@ -1149,7 +1340,7 @@ dns_found_answer(const char *address, uint8_t query_type,
 
   assert_cache_ok();
 
-  strlcpy(search.address, address, sizeof(search.address));
+  search.address = address;
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve) {
@@ -1161,6 +1352,13 @@ dns_found_answer(const char *address, uint8_t query_type,
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state == CACHE_STATE_CACHED &&
+      (resolve->refresh_ipv4 || resolve->refresh_ipv6)) {
+    cached_resolve_add_refreshed_answer(resolve, query_type, dns_answer,
+                                        addr, ttl);
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1270,63 +1468,21 @@ inform_pending_connections(cached_resolve_t *resolve)
   }
 }
 
-/** Remove a pending cached_resolve_t from the hashtable, and add a
- * corresponding cached cached_resolve_t.
- *
- * This function is only necessary because of the perversity of our
- * cache timeout code; see inline comment for ideas on eliminating it.
+/** Turn a pending cached_resolve_t that we just finished resolving into a
+ * cached one, and make it expire when the lowest TTL among its answers runs
+ * out.
  **/
 static void
 make_pending_resolve_cached(cached_resolve_t *resolve)
 {
-  cached_resolve_t *removed;
-
-  resolve->state = CACHE_STATE_DONE;
-  removed = HT_REMOVE(cache_map, &cache_root, resolve);
-  if (removed != resolve) {
-    log_err(LD_BUG, "The pending resolve we found wasn't removable from"
-            " the cache. Tried to purge %s (%p); instead got %s (%p).",
-            resolve->address, (void*)resolve,
-            removed ? removed->address : "NULL", (void*)removed);
-  }
-  assert_resolve_ok(resolve);
-  assert_cache_ok();
-  /* The resolve will eventually just hit the time-out in the expiry queue and
-  * expire. See fd0bafb0dedc7e2 for a brief explanation of how this got that
-  * way.  XXXXX we could do better!*/
+  tor_assert(resolve->state == CACHE_STATE_PENDING);
+  tor_assert(!resolve->pending_connections);
 
-  {
-    cached_resolve_t *new_resolve = tor_memdup(resolve,
-                                               sizeof(cached_resolve_t));
-    uint32_t ttl = UINT32_MAX;
-    new_resolve->expire = 0; /* So that set_expiry won't croak. */
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      new_resolve->result_ptr.hostname =
-        tor_strdup(resolve->result_ptr.hostname);
-
-    new_resolve->state = CACHE_STATE_CACHED;
-
-    assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
-
-    if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv4 < ttl)
-      ttl = resolve->ttl_ipv4;
-
-    if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv6 < ttl)
-      ttl = resolve->ttl_ipv6;
-
-    if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
-         resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_hostname < ttl)
-      ttl = resolve->ttl_hostname;
-
-    set_expiry(new_resolve, time(NULL) + ttl);
-  }
+  resolve->state = CACHE_STATE_CACHED;
+  resolve->n_hits = 0;
+  reset_expiry(resolve, time(NULL) + cached_resolve_get_ttl(resolve));
 
+  assert_resolve_ok(resolve);
   assert_cache_ok();
 }
 
@@ -1751,9 +1907,9 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
 /** Start a single DNS resolve for <b>address</b> (if <b>query_type</b> is
  * DNS_IPv4_A or DNS_IPv6_AAAA) <b>ptr_address</b> (if <b>query_type</b> is
  * DNS_PTR). Return 0 if we launched the request, -1 otherwise. */
-static int
-launch_one_resolve(const char *address, uint8_t query_type,
-                   const tor_addr_t *ptr_address)
+MOCK_IMPL(STATIC int,
+launch_one_resolve,(const char *address, uint8_t query_type,
+                    const tor_addr_t *ptr_address))
 {
   const int options = get_options()->ServerDNSSearchDomains ? 0
     : DNS_QUERY_NO_SEARCH;
@@ -2220,8 +2376,7 @@ dns_cache_entry_count(void)
 size_t
 dns_cache_total_allocation(void)
 {
-  return sizeof(struct cached_resolve_t) * dns_cache_entry_count() +
-         HT_MEM_USAGE(&cache_root);
+  return cached_resolve_bytes + HT_MEM_USAGE(&cache_root);
 }
 
 /** Log memory information about our internal DNS cache at level 'severity'. */
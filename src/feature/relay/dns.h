@@ -12,6 +12,22 @@
 #ifndef TOR_DNS_H
 #define TOR_DNS_H
 
+/** Events in the exit DNS cache that we count, for dns_cache_get_stat(). */
+typedef enum dns_cache_stat_t {
+  /** A stream found a successful answer in the cache. */
+  DNS_CACHE_STAT_HIT,
+  /** A stream found a cached failure in the cache. */
+  DNS_CACHE_STAT_NEGATIVE_HIT,
+  /** A stream started waiting for a lookup that another stream launched. */
+  DNS_CACHE_STAT_JOINED,
+  /** A stream found nothing in the cache, and launched a lookup. */
+  DNS_CACHE_STAT_MISS,
+  /** We refreshed a popular cached answer before it expired. */
+  DNS_CACHE_STAT_PREFETCH,
+  /** Number of dns_cache_stat_t values. */
+  DNS_CACHE_STAT_N_,
+} dns_cache_stat_t;
+
 #ifdef HAVE_MODULE_RELAY
 
 int dns_init(void);
@@ -34,6 +50,7 @@ void dns_new_consensus_params(const networkstatus_t *ns);
  * need stubs. */
 void dns_free_all(void);
 void dns_launch_correctness_checks(void);
+uint64_t dns_cache_get_stat(dns_cache_stat_t stat);
 
 #else /* !defined(HAVE_MODULE_RELAY) */
 
@@ -97,6 +114,16 @@ const char *hostname));
 
 cached_resolve_t *dns_get_cache_entry(cached_resolve_t *query);
 void dns_insert_cache_entry(cached_resolve_t *new_entry);
+STATIC cached_resolve_t *cached_resolve_new(const char *address);
+STATIC void dns_found_answer(const char *address, uint8_t query_type,
+                             int dns_answer,
+                             const tor_addr_t *addr,
+                             const char *hostname,
+                             uint32_t ttl);
+
+MOCK_DECL(STATIC int,
+launch_one_resolve,(const char *address, uint8_t query_type,
+                    const tor_addr_t *ptr_address));
 
 MOCK_DECL(STATIC int,
 set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
@@ -36,12 +36,14 @@ typedef struct pending_connection_t {
  * know not to launch more requests for this addr, but rather to add more
  * connections to the pending list for the addr. */
 #define CACHE_STATE_PENDING 0
-/** This used to be a pending cached_resolve_t, and we got an answer for it.
+/** This used to be a pending cached_resolve_t, but we cancelled it.
  * Now we're waiting for this cached_resolve_t to expire.  This should
  * have no pending connections, and should not appear in the hash table. */
 #define CACHE_STATE_DONE 1
 /** We are caching an answer for this address. This should have no pending
- * connections, and should appear in the hash table. */
+ * connections, and should appear in the hash table.  A pending
+ * cached_resolve_t becomes a cached one in place once all its answers are
+ * in. */
 #define CACHE_STATE_CACHED 2
 
 /** @name status values for a single DNS request.
@@ -62,7 +64,10 @@ typedef struct pending_connection_t {
 typedef struct cached_resolve_t {
   HT_ENTRY(cached_resolve_t) node;
   uint32_t magic;  /**< Must be CACHED_RESOLVE_MAGIC */
-  char address[MAX_ADDRESSLEN]; /**< The hostname to be resolved. */
+  /** The hostname to be resolved.  For entries made with
+   * cached_resolve_new(), this points to <b>address_buf</b>; for structures
+   * used only to search the cache, it may point anywhere. */
+  const char *address;
 
   union {
     uint32_t addr_ipv4; /**< IPv4 addr for <b>address</b>, if successful.
@@ -88,7 +93,22 @@ typedef struct cached_resolve_t {
   unsigned int res_status_ipv6 : 2;
   unsigned int res_status_hostname : 2;
   /**@}*/
+  /** @name Refresh fields
+   *
+   * True if we have relaunched the corresponding lookup for this cached
+   * entry before it expires, and are still waiting for the answer.
+   *
+   * @{ */
+  unsigned int refresh_ipv4 : 1;
+  unsigned int refresh_ipv6 : 1;
+  /**@}*/
+  /** True if one of the lookups we relaunched for this cached entry failed
+   * for a transient reason. */
+  unsigned int refresh_failed : 1;
   uint8_t state; /**< Is this cached entry pending/done/informative? */
+  /** How many streams have used this cached entry since we cached it, or
+   * since we last refreshed it. */
+  uint16_t n_hits;
 
   time_t expire; /**< Remove items from cache after this time. */
   uint32_t ttl_ipv4; /**< What TTL did the nameserver tell us? */
@@ -98,6 +118,8 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** Storage for <b>address</b>, sized to fit it. */
+  char address_buf[FLEXIBLE_ARRAY_MEMBER];
 } cached_resolve_t;
 
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
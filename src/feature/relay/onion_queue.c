@@ -33,6 +33,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/relay/relay_metrics.h"
 #include "feature/stats/rephist.h"
 
 #include "core/or/or_circuit_st.h"
@@ -58,6 +59,8 @@ typedef struct onion_queue_t {
   uint16_t queue_idx;
   create_cell_t *onionskin;
   time_t when_added;
+  /** When we queued this onionskin, in monotime_coarse_get_stamp() units. */
+  uint32_t inserted_stamp;
 } onion_queue_t;
 
 TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t);
@@ -196,6 +199,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->queue_idx = queue_idx;
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  tmp->inserted_stamp = monotime_coarse_get_stamp();
 
   if (!have_room_for_onionskin(queue_idx)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -279,6 +283,9 @@ onion_next_task(create_cell_t **onionskin_out)
   circ = head->circ;
   if (head->onionskin)
     --ol_entries[head->queue_idx];
+  relay_metrics_note_latency(RELAY_LATENCY_ONIONSKIN_QUEUE,
+                             monotime_coarse_get_stamp() -
+                             head->inserted_stamp);
   log_info(LD_OR, "Processing create (%s). Queues now ntor=%d and tap=%d.",
     head->queue_idx == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
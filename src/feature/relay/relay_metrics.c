@@ -27,13 +27,18 @@
 #include "lib/log/util_bug.h"
 #include "lib/malloc/malloc.h"
 #include "lib/math/fp.h"
+#include "lib/metrics/metrics_registry.h"
 #include "lib/metrics/metrics_store.h"
+#include "lib/time/compat_time.h"
 
+#include "feature/dirauth/authmode.h"
+#include "feature/dirauth/process_descs.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/node_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/relay/dns.h"
 #include "feature/relay/relay_metrics.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routerkeys.h"
@@ -41,7 +46,8 @@
 
 #include <event2/dns.h>
 
-/** Declarations of each fill function for metrics defined in base_metrics. */
+/** Declarations of each fill or register function for metrics defined in
+ * base_metrics. */
 static void fill_cc_counters_values(void);
 static void fill_cc_gauges_values(void);
 static void fill_circuits_values(void);
@@ -58,15 +64,21 @@ static void fill_streams_values(void);
 static void fill_relay_circ_proto_violation(void);
 static void fill_relay_destroy_cell(void);
 static void fill_relay_drop_cell(void);
+static void register_latency_values(const relay_metrics_entry_t *);
+static void register_conflux_ooo_depth_values(
+                                       const relay_metrics_entry_t *);
+static void fill_desc_upload_queue_values(void);
+static void fill_dns_cache_values(void);
+static void fill_link_cert_cache_values(void);
 static void fill_relay_flags(void);
 static void fill_tcp_exhaustion_values(void);
 static void fill_traffic_values(void);
 static void fill_signing_cert_expiry(void);
 
-static void fill_est_intro_cells(void);
-static void fill_est_rend_cells(void);
-static void fill_intro1_cells(void);
-static void fill_rend1_cells(void);
+static void register_est_intro_cells(const relay_metrics_entry_t *);
+static void register_est_rend_cells(const relay_metrics_entry_t *);
+static void register_intro1_cells(const relay_metrics_entry_t *);
+static void register_rend1_cells(const relay_metrics_entry_t *);
 
 /** The base metrics that is a static array of metrics added to the metrics
  * store.
@@ -198,28 +210,28 @@ static const relay_metrics_entry_t base_metrics[] =
     .type = METRICS_TYPE_COUNTER,
     .name = METRICS_NAME(relay_est_rend_total),
     .help = "Total number of EST_REND cells we received",
-    .fill_fn = fill_est_rend_cells,
+    .register_fn = register_est_rend_cells,
   },
   {
     .key = RELAY_METRICS_NUM_EST_INTRO,
     .type = METRICS_TYPE_COUNTER,
     .name = METRICS_NAME(relay_est_intro_total),
     .help = "Total number of EST_INTRO cells we received",
-    .fill_fn = fill_est_intro_cells,
+    .register_fn = register_est_intro_cells,
   },
   {
     .key = RELAY_METRICS_NUM_INTRO1_CELLS,
     .type = METRICS_TYPE_COUNTER,
     .name = METRICS_NAME(relay_intro1_total),
     .help = "Total number of INTRO1 cells we received",
-    .fill_fn = fill_intro1_cells,
+    .register_fn = register_intro1_cells,
   },
   {
     .key = RELAY_METRICS_NUM_REND1_CELLS,
     .type = METRICS_TYPE_COUNTER,
     .name = METRICS_NAME(relay_rend1_total),
     .help = "Total number of REND1 cells we received",
-    .fill_fn = fill_rend1_cells,
+    .register_fn = register_rend1_cells,
   },
   {
     .key = RELAY_METRICS_CIRC_DESTROY_CELL,
@@ -242,12 +254,54 @@ static const relay_metrics_entry_t base_metrics[] =
     .help = "Total number of DROP cell we received",
     .fill_fn = fill_relay_drop_cell,
   },
+  {
+    .key = RELAY_METRICS_LATENCY,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_latency_msec),
+    .help = "Time spent waiting in relay queues, in milliseconds",
+    .register_fn = register_latency_values,
+  },
+  {
+    .key = RELAY_METRICS_DESC_UPLOAD_QUEUE,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_desc_upload_queue),
+    .help = "Number of descriptor uploads waiting to be processed",
+    .fill_fn = fill_desc_upload_queue_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_CACHE,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_exit_dns_cache_total),
+    .help = "Total number of exit DNS cache lookups, by result, and of "
+            "cached answers refreshed before they expired",
+    .fill_fn = fill_dns_cache_values,
+  },
+  {
+    .key = RELAY_METRICS_CONFLUX_OOO_DEPTH,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_conflux_ooo_depth),
+    .help = "Number of out-of-order messages queued on a conflux set, "
+            "each time one is queued",
+    .register_fn = register_conflux_ooo_depth_values,
+  },
+  {
+    .key = RELAY_METRICS_LINK_CERT_CACHE,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_link_cert_cache_total),
+    .help = "Total number of link handshake certificate chains looked up "
+            "in the cache of verified chains, by result",
+    .fill_fn = fill_link_cert_cache_values,
+  },
 };
 static const size_t num_base_metrics = ARRAY_LENGTH(base_metrics);
 
 /** The only and single store of all the relay metrics. */
 static metrics_store_t *the_store;
 
+/** The registry of the relay metrics that hot paths update directly. Its
+ * output is part of the one of the_store. */
+static metrics_registry_t *the_registry;
+
 /** Helper function to convert an handshake type into a string. */
 static inline const char *
 handshake_type_to_str(const uint16_t type)
@@ -1084,151 +1138,116 @@ fill_signing_cert_expiry(void)
   }
 }
 
-static uint64_t est_intro_actions[EST_INTRO_ACTION_COUNT] = {0};
+/** Add to the registry one counter of <b>counters</b> for each of the
+ * <b>n_names</b> actions in <b>names</b>, under the name of <b>rentry</b>,
+ * with the name of the action as a label. */
+static void
+register_action_counters(const relay_metrics_entry_t *rentry,
+                         metrics_reg_counter_t *counters,
+                         const char **names, size_t n_names)
+{
+  for (size_t i = 0; i < n_names; ++i) {
+    if (BUG(!names[i])) {
+      continue;
+    }
+    metrics_registry_add_counter(the_registry, &counters[i], rentry->name,
+                                 rentry->help,
+                                 metrics_format_label("action", names[i]));
+  }
+}
+
+static metrics_reg_counter_t est_intro_actions[EST_INTRO_ACTION_COUNT];
 
 void
 relay_increment_est_intro_action(est_intro_action_t action)
 {
-  est_intro_actions[action]++;
+  metrics_reg_counter_add(&est_intro_actions[action], 1);
 }
 
 static void
-fill_est_intro_cells(void)
+register_est_intro_cells(const relay_metrics_entry_t *rentry)
 {
-  metrics_store_entry_t *sentry;
-  const relay_metrics_entry_t *rentry =
-      &base_metrics[RELAY_METRICS_NUM_EST_INTRO];
-
-  static struct {
-    const char *name;
-    est_intro_action_t key;
-  } actions[] = {
-      {.name = "success", .key = EST_INTRO_SUCCESS},
-      {.name = "malformed", .key = EST_INTRO_MALFORMED},
-      {.name = "unsuitable_circuit", .key = EST_INTRO_UNSUITABLE_CIRCUIT},
-      {.name = "circuit_dead", .key = EST_INTRO_CIRCUIT_DEAD},
+  static const char *names[EST_INTRO_ACTION_COUNT] = {
+    [EST_INTRO_SUCCESS] = "success",
+    [EST_INTRO_MALFORMED] = "malformed",
+    [EST_INTRO_UNSUITABLE_CIRCUIT] = "unsuitable_circuit",
+    [EST_INTRO_CIRCUIT_DEAD] = "circuit_dead",
   };
-  static const size_t num_actions = ARRAY_LENGTH(actions);
 
-  for (size_t i = 0; i < num_actions; ++i) {
-    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
-                               rentry->help, 0, NULL);
-    metrics_store_entry_add_label(
-        sentry, metrics_format_label("action", actions[i].name));
-    metrics_store_entry_update(sentry,
-                               (long)est_intro_actions[actions[i].key]);
-  }
+  register_action_counters(rentry, est_intro_actions, names,
+                           ARRAY_LENGTH(names));
 }
 
-static uint64_t est_rend_actions[EST_REND_ACTION_COUNT] = {0};
+static metrics_reg_counter_t est_rend_actions[EST_REND_ACTION_COUNT];
 
 void
 relay_increment_est_rend_action(est_rend_action_t action)
 {
-  est_rend_actions[action]++;
+  metrics_reg_counter_add(&est_rend_actions[action], 1);
 }
 
 static void
-fill_est_rend_cells(void)
+register_est_rend_cells(const relay_metrics_entry_t *rentry)
 {
-  metrics_store_entry_t *sentry;
-  const relay_metrics_entry_t *rentry =
-      &base_metrics[RELAY_METRICS_NUM_EST_REND];
-
-  static struct {
-    const char *name;
-    est_rend_action_t key;
-  } actions[] = {
-      {.name = "success", .key = EST_REND_SUCCESS},
-      {.name = "unsuitable_circuit", .key = EST_REND_UNSUITABLE_CIRCUIT},
-      {.name = "single_hop", .key = EST_REND_SINGLE_HOP},
-      {.name = "malformed", .key = EST_REND_MALFORMED},
-      {.name = "duplicate_cookie", .key = EST_REND_DUPLICATE_COOKIE},
-      {.name = "circuit_dead", .key = EST_REND_CIRCUIT_DEAD},
+  static const char *names[EST_REND_ACTION_COUNT] = {
+    [EST_REND_SUCCESS] = "success",
+    [EST_REND_UNSUITABLE_CIRCUIT] = "unsuitable_circuit",
+    [EST_REND_SINGLE_HOP] = "single_hop",
+    [EST_REND_MALFORMED] = "malformed",
+    [EST_REND_DUPLICATE_COOKIE] = "duplicate_cookie",
+    [EST_REND_CIRCUIT_DEAD] = "circuit_dead",
   };
-  static const size_t num_actions = ARRAY_LENGTH(actions);
 
-  for (size_t i = 0; i < num_actions; ++i) {
-    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
-                               rentry->help, 0, NULL);
-    metrics_store_entry_add_label(
-        sentry, metrics_format_label("action", actions[i].name));
-    metrics_store_entry_update(sentry, (long)est_rend_actions[actions[i].key]);
-  }
+  register_action_counters(rentry, est_rend_actions, names,
+                           ARRAY_LENGTH(names));
 }
 
-static uint64_t intro1_actions[INTRO1_ACTION_COUNT] = {0};
+static metrics_reg_counter_t intro1_actions[INTRO1_ACTION_COUNT];
 
 void
 relay_increment_intro1_action(intro1_action_t action)
 {
-  intro1_actions[action]++;
+  metrics_reg_counter_add(&intro1_actions[action], 1);
 }
 
 static void
-fill_intro1_cells(void)
+register_intro1_cells(const relay_metrics_entry_t *rentry)
 {
-  metrics_store_entry_t *sentry;
-  const relay_metrics_entry_t *rentry =
-      &base_metrics[RELAY_METRICS_NUM_INTRO1_CELLS];
-
-  static struct {
-    const char *name;
-    intro1_action_t key;
-  } actions[] = {
-      {.name = "success", .key = INTRO1_SUCCESS},
-      {.name = "circuit_dead", .key = INTRO1_CIRCUIT_DEAD},
-      {.name = "malformed", .key = INTRO1_MALFORMED},
-      {.name = "unknown_service", .key = INTRO1_UNKNOWN_SERVICE},
-      {.name = "rate_limited", .key = INTRO1_RATE_LIMITED},
-      {.name = "circuit_reused", .key = INTRO1_CIRCUIT_REUSED},
-      {.name = "single_hop", .key = INTRO1_SINGLE_HOP},
+  static const char *names[INTRO1_ACTION_COUNT] = {
+    [INTRO1_SUCCESS] = "success",
+    [INTRO1_CIRCUIT_DEAD] = "circuit_dead",
+    [INTRO1_MALFORMED] = "malformed",
+    [INTRO1_UNKNOWN_SERVICE] = "unknown_service",
+    [INTRO1_RATE_LIMITED] = "rate_limited",
+    [INTRO1_CIRCUIT_REUSED] = "circuit_reused",
+    [INTRO1_SINGLE_HOP] = "single_hop",
   };
-  static const size_t num_actions = ARRAY_LENGTH(actions);
 
-  for (size_t i = 0; i < num_actions; ++i) {
-    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
-                               rentry->help, 0, NULL);
-    metrics_store_entry_add_label(
-        sentry, metrics_format_label("action", actions[i].name));
-    metrics_store_entry_update(sentry, (long)intro1_actions[actions[i].key]);
-  }
+  register_action_counters(rentry, intro1_actions, names,
+                           ARRAY_LENGTH(names));
 }
 
-static uint64_t rend1_actions[REND1_ACTION_COUNT] = {0};
+static metrics_reg_counter_t rend1_actions[REND1_ACTION_COUNT];
 
 void
 relay_increment_rend1_action(rend1_action_t action)
 {
-  rend1_actions[action]++;
+  metrics_reg_counter_add(&rend1_actions[action], 1);
 }
 
 static void
-fill_rend1_cells(void)
+register_rend1_cells(const relay_metrics_entry_t *rentry)
 {
-  metrics_store_entry_t *sentry;
-  const relay_metrics_entry_t *rentry =
-      &base_metrics[RELAY_METRICS_NUM_REND1_CELLS];
-
-  static struct {
-    const char *name;
-    rend1_action_t key;
-  } actions[] = {
-      {.name = "success", .key = REND1_SUCCESS},
-      {.name = "unsuitable_circuit", .key = REND1_UNSUITABLE_CIRCUIT},
-      {.name = "malformed", .key = REND1_MALFORMED},
-      {.name = "unknown_cookie", .key = REND1_UNKNOWN_COOKIE},
-      {.name = "circuit_dead", .key = REND1_CIRCUIT_DEAD},
+  static const char *names[REND1_ACTION_COUNT] = {
+    [REND1_SUCCESS] = "success",
+    [REND1_UNSUITABLE_CIRCUIT] = "unsuitable_circuit",
+    [REND1_MALFORMED] = "malformed",
+    [REND1_UNKNOWN_COOKIE] = "unknown_cookie",
+    [REND1_CIRCUIT_DEAD] = "circuit_dead",
   };
-  static const size_t num_actions = ARRAY_LENGTH(actions);
 
-  for (size_t i = 0; i < num_actions; ++i) {
-    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
-                               rentry->help, 0, NULL);
-    metrics_store_entry_add_label(
-        sentry, metrics_format_label("action", actions[i].name));
-    metrics_store_entry_update(sentry, (long)rend1_actions[actions[i].key]);
-  }
+  register_action_counters(rentry, rend1_actions, names,
+                           ARRAY_LENGTH(names));
 }
 
 /** Fill the metrics store for the RELAY_METRICS_CIRC_DESTROY_CELL counter. */
@@ -1271,20 +1290,151 @@ fill_relay_circ_proto_violation(void)
   metrics_store_entry_update(sentry, circ_n_proto_violation);
 }
 
+/** Time spent by cells and onionskins at each stage of
+ * relay_latency_stage_t, in milliseconds. */
+static metrics_reg_histogram_t latency_hist[RELAY_LATENCY_STAGE_COUNT];
+
+/** Note that something waited for <b>stamp_units</b>, in the units of
+ * monotime_coarse_get_stamp(), at the given <b>stage</b>. */
+void
+relay_metrics_note_latency(relay_latency_stage_t stage, uint32_t stamp_units)
+{
+  if (BUG(stage >= RELAY_LATENCY_STAGE_COUNT)) {
+    return;
+  }
+  const uint64_t msec =
+    monotime_coarse_stamp_units_to_approx_msec(stamp_units);
+  metrics_reg_histogram_record(&latency_hist[stage], msec);
+}
+
+/** Add the RELAY_METRICS_LATENCY histograms to the registry. The
+ * descriptor upload one stays empty unless we are a directory authority. */
+static void
+register_latency_values(const relay_metrics_entry_t *rentry)
+{
+  static const char *stages[RELAY_LATENCY_STAGE_COUNT] = {
+    [RELAY_LATENCY_CIRCUIT_QUEUE] = "circuit_queue",
+    [RELAY_LATENCY_OUTBUF] = "outbuf",
+    [RELAY_LATENCY_ONIONSKIN_QUEUE] = "onionskin_queue",
+    [RELAY_LATENCY_DESC_UPLOAD] = "desc_upload",
+    [RELAY_LATENCY_CONFLUX_REORDER] = "conflux_reorder",
+  };
+
+  for (int i = 0; i < RELAY_LATENCY_STAGE_COUNT; ++i) {
+    metrics_registry_add_histogram(the_registry, &latency_hist[i],
+                                   rentry->name, rentry->help,
+                                   metrics_format_label("stage", stages[i]));
+  }
+}
+
+/** Depth of conflux out-of-order queues, sampled each time a message is
+ * added to one. */
+static metrics_reg_histogram_t conflux_ooo_depth_hist;
+
+/** Note that a conflux set now has <b>depth</b> out-of-order messages
+ * queued. */
+void
+relay_metrics_note_conflux_ooo_depth(uint32_t depth)
+{
+  metrics_reg_histogram_record(&conflux_ooo_depth_hist, depth);
+}
+
+/** Add the RELAY_METRICS_CONFLUX_OOO_DEPTH histogram to the registry. */
+static void
+register_conflux_ooo_depth_values(const relay_metrics_entry_t *rentry)
+{
+  metrics_registry_add_histogram(the_registry, &conflux_ooo_depth_hist,
+                                 rentry->name, rentry->help, NULL);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_DESC_UPLOAD_QUEUE gauge. */
+static void
+fill_desc_upload_queue_values(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DESC_UPLOAD_QUEUE];
+
+  if (!authdir_mode(get_options()))
+    return;
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry,
+                             dirserv_get_n_queued_descriptor_uploads());
+}
+
+/** Fill the metrics store for the RELAY_METRICS_DNS_CACHE counters. */
+static void
+fill_dns_cache_values(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_CACHE];
+  static const struct {
+    const char *name;
+    dns_cache_stat_t stat;
+  } results[] = {
+    { .name = "hit",          .stat = DNS_CACHE_STAT_HIT          },
+    { .name = "negative_hit", .stat = DNS_CACHE_STAT_NEGATIVE_HIT },
+    { .name = "joined",       .stat = DNS_CACHE_STAT_JOINED       },
+    { .name = "miss",         .stat = DNS_CACHE_STAT_MISS         },
+    { .name = "prefetch",     .stat = DNS_CACHE_STAT_PREFETCH     },
+  };
+
+  for (size_t i = 0; i < ARRAY_LENGTH(results); ++i) {
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help, 0, NULL);
+    metrics_store_entry_add_label(sentry,
+                          metrics_format_label("result", results[i].name));
+    metrics_store_entry_update(sentry, dns_cache_get_stat(results[i].stat));
+  }
+}
+
+/** Fill the metrics store for the RELAY_METRICS_LINK_CERT_CACHE counters. */
+static void
+fill_link_cert_cache_values(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_LINK_CERT_CACHE];
+  static const struct {
+    const char *name;
+    link_cert_cache_stat_t stat;
+  } results[] = {
+    { .name = "hit",  .stat = LINK_CERT_CACHE_STAT_HIT  },
+    { .name = "miss", .stat = LINK_CERT_CACHE_STAT_MISS },
+  };
+
+  for (size_t i = 0; i < ARRAY_LENGTH(results); ++i) {
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help, 0, NULL);
+    metrics_store_entry_add_label(sentry,
+                          metrics_format_label("result", results[i].name));
+    metrics_store_entry_update(sentry,
+                          or_handshake_certs_cache_get_stat(results[i].stat));
+  }
+}
+
 /** Reset the global store and fill it with all the metrics from base_metrics
  * and their associated values.
  *
  * To pull this off, every metrics has a "fill" function that is called and in
  * charge of adding the metrics to the store, appropriate labels and finally
- * updating the value to report. */
+ * updating the value to report. The metrics of the_registry are not part of
+ * this: they were added to it once, at init, and are read in place. */
 static void
 fill_store(void)
 {
   /* Reset the current store, we are about to fill it with all the things. */
   metrics_store_reset(the_store);
 
-  /* Call the fill function for each metrics. */
+  /* Call the fill function for each metrics. The ones in the registry don't
+   * need one. */
   for (size_t i = 0; i < num_base_metrics; i++) {
+    if (base_metrics[i].register_fn) {
+      continue;
+    }
     if (BUG(!base_metrics[i].fill_fn)) {
       continue;
     }
@@ -1324,6 +1474,13 @@ relay_metrics_init(void)
     return;
   }
   the_store = metrics_store_new();
+  the_registry = metrics_registry_new();
+  for (size_t i = 0; i < num_base_metrics; i++) {
+    if (base_metrics[i].register_fn) {
+      base_metrics[i].register_fn(&base_metrics[i]);
+    }
+  }
+  metrics_store_set_registry(the_store, the_registry);
 }
 
 /** Free the relay metrics. */
@@ -1335,4 +1492,5 @@ relay_metrics_free(void)
   }
   /* NULL is set with this call. */
   metrics_store_free(the_store);
+  metrics_registry_free(the_registry);
 }
@@ -63,6 +63,16 @@ typedef enum {
   RELAY_METRICS_CIRC_PROTO_VIOLATION,
   /** Number of drop cell seen. */
   RELAY_METRICS_CIRC_DROP_CELL,
+  /** Time spent by cells and onionskins in our queues. */
+  RELAY_METRICS_LATENCY,
+  /** Number of descriptor uploads waiting to be processed. */
+  RELAY_METRICS_DESC_UPLOAD_QUEUE,
+  /** Exit DNS cache hits, misses and refreshes. */
+  RELAY_METRICS_DNS_CACHE,
+  /** Number of out-of-order messages queued on a conflux set. */
+  RELAY_METRICS_CONFLUX_OOO_DEPTH,
+  /** Link handshake certificate chain cache hits and misses. */
+  RELAY_METRICS_LINK_CERT_CACHE,
 } relay_metrics_key_t;
 
 /** The metadata of a relay metric. */
@@ -77,6 +87,10 @@ typedef struct relay_metrics_entry_t {
   const char *help;
   /* Update value function. */
   void (*fill_fn)(void);
+  /* Function adding the metric to the registry, for the metrics that are
+   * kept in static storage instead of being filled on each request. A metric
+   * has either this or fill_fn. */
+  void (*register_fn)(const struct relay_metrics_entry_t *);
 } relay_metrics_entry_t;
 
 /* Init. */
@@ -136,4 +150,24 @@ typedef enum {
 
 void relay_increment_rend1_action(rend1_action_t);
 
+/** Places where we measure how long work waits inside the relay. */
+typedef enum {
+  /** A cell waiting in its circuit queue until its channel picks it. */
+  RELAY_LATENCY_CIRCUIT_QUEUE,
+  /** Data waiting in an OR connection's outbuf until the kernel takes it. */
+  RELAY_LATENCY_OUTBUF,
+  /** An onionskin waiting in the onion queue for a cpuworker. */
+  RELAY_LATENCY_ONIONSKIN_QUEUE,
+  /** A descriptor upload waiting to be checked and added to the routerlist,
+   * on a directory authority. */
+  RELAY_LATENCY_DESC_UPLOAD,
+  /** An out-of-order conflux message waiting for the ones before it. */
+  RELAY_LATENCY_CONFLUX_REORDER,
+  RELAY_LATENCY_STAGE_COUNT
+} relay_latency_stage_t;
+
+void relay_metrics_note_latency(relay_latency_stage_t stage,
+                                uint32_t stamp_units);
+void relay_metrics_note_conflux_ooo_depth(uint32_t depth);
+
 #endif /* !defined(TOR_FEATURE_RELAY_RELAY_METRICS_H) */
@@ -44,3 +44,16 @@ relay_increment_rend1_action(rend1_action_t action)
 {
   (void)action;
 }
+
+void
+relay_metrics_note_latency(relay_latency_stage_t stage, uint32_t stamp_units)
+{
+  (void)stage;
+  (void)stamp_units;
+}
+
+void
+relay_metrics_note_conflux_ooo_depth(uint32_t depth)
+{
+  (void)depth;
+}
@@ -14,6 +14,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
 #include "feature/client/transports.h"
@@ -846,6 +847,8 @@ router_initialize_tls_context(void)
   int lifetime = options->SSLKeyLifetime;
   if (public_server_mode(options))
     flags |= TOR_TLS_CTX_IS_PUBLIC_SERVER;
+  if (public_server_mode(options) && options->TLSSessionResumption)
+    flags |= TOR_TLS_CTX_SESSION_RESUMPTION;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
@@ -1743,6 +1746,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
+    if (me->compiled_exit_policy)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                          me->compiled_exit_policy) != ADDR_POLICY_ACCEPTED;
     return compare_tor_addr_to_addr_policy(addr, port,
                                me->exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
@@ -2214,6 +2220,7 @@ router_build_fresh_unsigned_routerinfo,(routerinfo_t **ri_out))
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
+  ri->compiled_exit_policy = compiled_policy_new(ri->exit_policy);
 
   if (options->IPv6Exit) {
     char *p_tmp = policy_summarize(ri->exit_policy, AF_INET6);
@@ -68,6 +68,15 @@
  *
  * The major free Unix kernels have handled buffers like this since, like,
  * forever.
+ *
+ * Chunks can share storage, so that we can move data between buffers
+ * without copying it.  A "slice" is a chunk with no storage of its own, whose
+ * data lies in another chunk's storage; each chunk counts the references to
+ * its storage, and is freed only once no buffer and no slice refers to it.
+ * A chunk may also refer to memory that we don't own at all (see
+ * buf_add_external()).  Nobody ever writes to the data of a slice or of an
+ * external chunk, and nobody moves or resizes the storage of a chunk that
+ * has slices: they only append past the end of its data.
  */
 
 /* Chunk manipulation functions */
@@ -112,11 +121,21 @@
 #endif /* defined(DISABLE_MEMORY_SENTINELS) */
 #endif /* !defined(COCCI) */
 
+/** Return true iff something other than the buffer holding <b>chunk</b>
+ * refers to the memory that holds its data, so that we must not modify that
+ * memory in place. */
+static inline int
+chunk_is_shared(const chunk_t *chunk)
+{
+  return chunk->memlen == 0 || chunk->refcnt > 1;
+}
+
 /** Move all bytes stored in <b>chunk</b> to the front of <b>chunk</b>->mem,
  * to free up space at the end. */
 static inline void
 chunk_repack(chunk_t *chunk)
 {
+  tor_assert(!chunk_is_shared(chunk));
   if (chunk->datalen && chunk->data != &chunk->mem[0]) {
     memmove(chunk->mem, chunk->data, chunk->datalen);
   }
@@ -125,11 +144,17 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/** Drop a reference to the storage of <b>chunk</b>, and free it (releasing
+ * any external memory it refers to) if that was the last one. */
 static void
-buf_chunk_free_unchecked(chunk_t *chunk)
+chunk_decref(chunk_t *chunk)
 {
-  if (!chunk)
+  tor_assert(chunk->refcnt > 0);
+  if (--chunk->refcnt)
     return;
+  if (chunk->release_fn)
+    chunk->release_fn(chunk->release_arg);
 #ifdef DEBUG_CHUNK_ALLOC
   tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
 #endif
@@ -138,6 +163,20 @@ buf_chunk_free_unchecked(chunk_t *chunk)
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
   tor_free(chunk);
 }
+
+/** Release <b>chunk</b>, which a buffer is no longer holding.  Its storage
+ * lives on for as long as any slice still refers to it. */
+static void
+buf_chunk_free_unchecked(chunk_t *chunk)
+{
+  chunk_t *backing;
+  if (!chunk)
+    return;
+  backing = chunk->backing;
+  chunk_decref(chunk);
+  if (backing)
+    chunk_decref(backing);
+}
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
@@ -151,10 +190,33 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->backing = NULL;
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
+  ch->refcnt = 1;
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Return a new slice holding the first <b>n</b> bytes of data in
+ * <b>chunk</b>, sharing its storage. */
+static chunk_t *
+chunk_new_slice(const chunk_t *chunk, size_t n)
+{
+  /* Slices of slices refer to the original storage, so that no chain of
+   * references is ever more than one long. */
+  chunk_t *backing = chunk->backing ? chunk->backing : (chunk_t *)chunk;
+  chunk_t *slice = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  tor_assert(n <= chunk->datalen);
+  tor_assert(backing->refcnt < UINT32_MAX);
+  ++backing->refcnt;
+  slice->backing = backing;
+  slice->data = chunk->data;
+  slice->datalen = n;
+  slice->inserted_time = chunk->inserted_time;
+  return slice;
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -165,6 +227,7 @@ chunk_grow(chunk_t *chunk, size_t sz)
   const size_t orig_alloc = CHUNK_ALLOC_SIZE(memlen_orig);
   const size_t new_alloc = CHUNK_ALLOC_SIZE(sz);
   tor_assert(sz > chunk->memlen);
+  tor_assert(!chunk_is_shared(chunk));
   offset = chunk->data - chunk->mem;
   chunk = tor_realloc(chunk, new_alloc);
   chunk->memlen = sz;
@@ -229,7 +292,22 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
-  if (buf->head->memlen >= capacity) {
+  if (chunk_is_shared(buf->head)) {
+    /* We can only append to the first chunk in place: if that isn't enough,
+     * give the buffer a private copy of it to work with. */
+    if (CHUNK_REMAINING_CAPACITY(buf->head) < capacity - buf->head->datalen) {
+      chunk_t *old = buf->head, *newhead;
+      newhead = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+      memcpy(newhead->data, old->data, old->datalen);
+      newhead->datalen = old->datalen;
+      newhead->inserted_time = old->inserted_time;
+      newhead->next = old->next;
+      if (buf->tail == old)
+        buf->tail = newhead;
+      buf->head = newhead;
+      buf_chunk_free_unchecked(old);
+    }
+  } else if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
     if (CHUNK_REMAINING_CAPACITY(buf->head) < needed)
@@ -396,7 +474,15 @@ buf_datalen, (const buf_t *buf))
   return buf->datalen;
 }
 
-/** Return the total length of all chunks used in <b>buf</b>. */
+/** Return the total length of all chunks used in <b>buf</b>.
+ *
+ * Slices and external chunks have no storage of their own, so for them we
+ * count only the data that this buffer holds.  That undercounts what they
+ * keep in memory: a slice of a kilobyte or two can keep a whole chunk of up
+ * to MAX_CHUNK_ALLOC bytes alive after the buffer that allocated it has
+ * dropped it, and an external chunk keeps all of its owner's memory alive.
+ * We don't count the backing storage here, since several buffers may share
+ * it and each of them would count it in full. */
 size_t
 buf_allocation(const buf_t *buf)
 {
@@ -404,6 +490,8 @@ buf_allocation(const buf_t *buf)
   const chunk_t *chunk;
   for (chunk = buf->head; chunk; chunk = chunk->next) {
     total += CHUNK_ALLOC_SIZE(chunk->memlen);
+    if (!chunk->memlen)
+      total += chunk->datalen;
   }
   return total;
 }
@@ -435,12 +523,17 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (!in_chunk->memlen) {
+    /* Nobody writes to this chunk's data, so we can share it. */
+    return chunk_new_slice(in_chunk, in_chunk->datalen);
+  }
   chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
   newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #endif
   newch->next = NULL;
+  newch->refcnt = 1;
   if (in_chunk->data) {
     ptrdiff_t offset = in_chunk->data - in_chunk->mem;
     newch->data = newch->mem + offset;
@@ -555,6 +648,62 @@ buf_add(buf_t *buf, const char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Append <b>chunk</b>, and all the data on it, to the tail of <b>buf</b>.
+ * The caller must have checked that this won't make <b>buf</b> too long. */
+static void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  chunk->next = NULL;
+  if (buf->tail) {
+    tor_assert(buf->head);
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    tor_assert(!buf->head);
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += chunk->datalen;
+}
+
+/** Append the <b>len</b> bytes at <b>data</b> to the end of <b>buf</b>,
+ * without copying them.  The bytes must not change until <b>buf</b> is done
+ * with them, at which point it calls <b>release_fn</b>(<b>release_arg</b>).
+ * That may happen at any time after this function returns, or even before,
+ * if <b>len</b> is 0.
+ *
+ * Return the new length of the buffer on success.  On failure, return -1;
+ * in that case <b>release_fn</b> is not called, and the bytes are still the
+ * caller's responsibility.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t len,
+                 void (*release_fn)(void *), void *release_arg)
+{
+  chunk_t *chunk;
+  tor_assert(release_fn);
+
+  if (BUG(buf->datalen > BUF_MAX_LEN))
+    return -1;
+  if (BUG(buf->datalen > BUF_MAX_LEN - len))
+    return -1;
+  if (!len) {
+    release_fn(release_arg);
+    return (int)buf->datalen;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  /* We never write through this pointer: see CHUNK_REMAINING_CAPACITY(). */
+  chunk->data = (char *)data;
+  chunk->datalen = len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+  buf_append_chunk(buf, chunk);
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Add a nul-terminated <b>string</b> to <b>buf</b>, not including the
  * terminating NUL. */
 void
@@ -649,15 +798,23 @@ buf_get_bytes(buf_t *buf, char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** When moving data between buffers, we copy runs of fewer than this many
+ * bytes out of a chunk rather than making a slice of it: a copy that small
+ * costs less than a new chunk, and doesn't keep a larger chunk alive. */
+#define MIN_SHARE_LEN 1024
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
- * Return the number of bytes actually copied.
+ * Return the number of bytes actually moved.
+ *
+ * Whole chunks move from one buffer to the other as they are, and parts of
+ * chunks become slices that share their storage, so that we only copy bytes
+ * when there are too few of them to be worth sharing.  Slices made here
+ * can keep a larger chunk alive than buf_allocation() reports: see there.
  */
 int
 buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
 
   if (BUG(buf_out->datalen > BUF_MAX_LEN || *buf_flushlen > BUF_MAX_LEN))
@@ -672,12 +829,35 @@ buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp <= BUF_MAX_LEN);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    buf_get_bytes(buf_in, b, n);
-    buf_add(buf_out, b, n);
+    chunk_t *chunk = buf_in->head;
+    size_t n = len;
+    tor_assert(chunk);
+    if (!chunk->datalen) {
+      /* buf_move_all() can leave empty chunks behind; drop them. */
+      tor_assert(chunk != buf_in->tail);
+      buf_in->head = chunk->next;
+      buf_chunk_free_unchecked(chunk);
+      continue;
+    }
+    if (n > chunk->datalen)
+      n = chunk->datalen;
+
+    if (n < MIN_SHARE_LEN &&
+        (n < chunk->datalen || n <= buf_slack(buf_out))) {
+      /* A small run: copy it, unless it is a whole chunk that we'd have to
+       * copy into a new chunk anyway. */
+      buf_add(buf_out, chunk->data, n);
+      buf_drain(buf_in, n);
+    } else if (n == chunk->datalen) {
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      buf_in->datalen -= n;
+      buf_append_chunk(buf_out, chunk);
+    } else {
+      buf_append_chunk(buf_out, chunk_new_slice(chunk, n));
+      buf_drain(buf_in, n);
+    }
     len -= n;
   }
   *buf_flushlen -= cp;
@@ -717,113 +897,58 @@ buf_move_all(buf_t *buf_out, buf_t *buf_in)
   return n_bytes_moved;
 }
 
-/** Internal structure: represents a position in a buffer. */
-typedef struct buf_pos_t {
-  const chunk_t *chunk; /**< Which chunk are we pointing to? */
-  ptrdiff_t pos;/**< Which character inside the chunk's data are we pointing
-                 * to? */
-  size_t chunk_pos; /**< Total length of all previous chunks. */
-} buf_pos_t;
-
-/** Initialize <b>out</b> to point to the first character of <b>buf</b>.*/
-static void
-buf_pos_init(const buf_t *buf, buf_pos_t *out)
-{
-  out->chunk = buf->head;
-  out->pos = 0;
-  out->chunk_pos = 0;
-}
-
-/** Advance <b>out</b> to the first appearance of <b>ch</b> at the current
- * position of <b>out</b>, or later.  Return -1 if no instances are found;
- * otherwise returns the absolute position of the character. */
-static ptrdiff_t
-buf_find_pos_of_char(char ch, buf_pos_t *out)
-{
-  const chunk_t *chunk;
-  ptrdiff_t pos;
-  tor_assert(out);
-  if (out->chunk) {
-    if (out->chunk->datalen) {
-      tor_assert(out->pos < (ptrdiff_t)out->chunk->datalen);
-    } else {
-      tor_assert(out->pos == 0);
-    }
-  }
-  pos = out->pos;
-  for (chunk = out->chunk; chunk; chunk = chunk->next) {
-    char *cp = memchr(chunk->data+pos, ch, chunk->datalen - pos);
-    if (cp) {
-      out->chunk = chunk;
-      tor_assert(cp - chunk->data <= BUF_MAX_LEN);
-      out->pos = (int)(cp - chunk->data);
-      return out->chunk_pos + out->pos;
-    } else {
-      out->chunk_pos += chunk->datalen;
-      pos = 0;
-    }
-  }
-  return -1;
-}
-
-/** Advance <b>pos</b> by a single character, if there are any more characters
- * in the buffer.  Returns 0 on success, -1 on failure. */
-static inline int
-buf_pos_inc(buf_pos_t *pos)
-{
-  tor_assert(pos->pos < BUF_MAX_LEN);
-  ++pos->pos;
-  if (pos->pos == (ptrdiff_t)pos->chunk->datalen) {
-    if (!pos->chunk->next)
-      return -1;
-    pos->chunk_pos += pos->chunk->datalen;
-    pos->chunk = pos->chunk->next;
-    pos->pos = 0;
-  }
-  return 0;
-}
-
 /** Return true iff the <b>n</b>-character string in <b>s</b> appears
- * (verbatim) at <b>pos</b>. */
+ * (verbatim) at offset <b>off</b> of <b>chunk</b>, possibly continuing into
+ * later chunks. */
 static int
-buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
+buf_matches_at_pos(const chunk_t *chunk, size_t off, const char *s, size_t n)
 {
-  buf_pos_t p;
-  if (!n)
-    return 1;
-
-  memcpy(&p, pos, sizeof(p));
-
-  while (1) {
-    char ch = p.chunk->data[p.pos];
-    if (ch != *s)
+  /* Compare as much as we can with each chunk at once, rather than stepping
+   * through the buffer a character at a time. */
+  while (n) {
+    if (!chunk)
       return 0;
-    ++s;
-    /* If we're out of characters that don't match, we match.  Check this
-     * _before_ we test incrementing pos, in case we're at the end of the
-     * string. */
-    if (--n == 0)
-      return 1;
-    if (buf_pos_inc(&p)<0)
+    size_t k = chunk->datalen - off;
+    if (k > n)
+      k = n;
+    if (k && fast_memneq(chunk->data + off, s, k))
       return 0;
+    s += k;
+    n -= k;
+    chunk = chunk->next;
+    off = 0;
   }
+  return 1;
 }
 
 /** Return the first position in <b>buf</b> at which the <b>n</b>-character
- * string <b>s</b> occurs, or -1 if it does not occur. */
+ * string <b>s</b> occurs, or -1 if it does not occur.
+ *
+ * We let memchr() skip over each chunk to the next byte that could start a
+ * match, and only compare at those candidates.  (memmem() would be faster on
+ * long haystacks, but its per-call setup costs more than we save when the
+ * match is near the start, as it is for most protocol headers.) */
 int
 buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
 {
-  buf_pos_t pos;
-  buf_pos_init(buf, &pos);
-  while (buf_find_pos_of_char(*s, &pos) >= 0) {
-    if (buf_matches_at_pos(&pos, s, n)) {
-      tor_assert(pos.chunk_pos + pos.pos <= BUF_MAX_LEN);
-      return (int)(pos.chunk_pos + pos.pos);
-    } else {
-      if (buf_pos_inc(&pos)<0)
-        return -1;
+  const chunk_t *chunk;
+  size_t chunk_pos = 0;
+
+  if (BUG(n == 0))
+    return -1;
+
+  for (chunk = buf->head; chunk; chunk = chunk->next) {
+    const char *cp = chunk->data;
+    const char *end = chunk->data + chunk->datalen;
+    while ((cp = memchr(cp, s[0], end - cp))) {
+      size_t off = cp - chunk->data;
+      if (buf_matches_at_pos(chunk, off, s, n)) {
+        tor_assert(chunk_pos + off <= BUF_MAX_LEN);
+        return (int)(chunk_pos + off);
+      }
+      ++cp;
     }
+    chunk_pos += chunk->datalen;
   }
   return -1;
 }
@@ -920,12 +1045,27 @@ buf_assert_ok(buf_t *buf)
     size_t total = 0;
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
+      /* The chunk whose storage holds this chunk's data, if any. */
+      const chunk_t *st = ch->backing ? ch->backing : ch;
       total += ch->datalen;
-      tor_assert(ch->datalen <= ch->memlen);
+      tor_assert(ch->refcnt >= 1);
       tor_assert(ch->datalen <= BUF_MAX_LEN);
-      tor_assert(ch->data >= &ch->mem[0]);
-      tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
-      if (ch->data == &ch->mem[0]+ch->memlen) {
+      if (ch->backing) {
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->refcnt == 1);
+        tor_assert(ch->backing->refcnt >= 1);
+        tor_assert(! ch->backing->backing);
+      }
+      if (!st->memlen) {
+        /* External memory: we know nothing about its bounds. */
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
+      tor_assert(ch->datalen <= st->memlen);
+      tor_assert(ch->data >= &st->mem[0]);
+      tor_assert(ch->data <= &st->mem[0]+st->memlen);
+      if (ch->data == &st->mem[0]+st->memlen) {
         /* LCOV_EXCL_START */
         static int warned = 0;
         if (! warned) {
@@ -934,7 +1074,7 @@ buf_assert_ok(buf_t *buf)
         }
         /* LCOV_EXCL_STOP */
       }
-      tor_assert(ch->data+ch->datalen <= &ch->mem[0] + ch->memlen);
+      tor_assert(ch->data+ch->datalen <= &st->mem[0] + st->memlen);
       if (!ch->next)
         tor_assert(ch == buf->tail);
     }
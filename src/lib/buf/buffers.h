@@ -45,6 +45,8 @@ void buf_add_printf(buf_t *buf, const char *format, ...)
   CHECK_PRINTF(2, 3);
 void buf_add_vprintf(buf_t *buf, const char *format, va_list args)
   CHECK_PRINTF(2, 0);
+int buf_add_external(buf_t *buf, const char *data, size_t len,
+                     void (*release_fn)(void *), void *release_arg);
 int buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 size_t buf_move_all(buf_t *buf_out, buf_t *buf_in);
 void buf_peek(const buf_t *buf, char *string, size_t string_len);
@@ -80,7 +82,20 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in <b>backing</b>'s storage, or in external memory. */
+  /** If this chunk is a slice, the chunk whose storage holds its data.  A
+   * slice has no storage of its own: its memlen is 0. */
+  struct chunk_t *backing;
+  /** If this chunk refers to external memory (see buf_add_external()), a
+   * function to call with <b>release_arg</b> once nothing refers to that
+   * memory any longer.  Such a chunk also has a memlen of 0. */
+  void (*release_fn)(void *);
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
+  /** Number of references to this chunk's storage: one from the buffer that
+   * holds the chunk, if any, plus one from each slice of it.  We free the
+   * chunk once this drops to 0. */
+  uint32_t refcnt;
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
@@ -109,6 +124,9 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  /* Slices and external chunks have no storage that we may write to. */
+  if (!chunk->memlen)
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
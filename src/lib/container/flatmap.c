@@ -0,0 +1,478 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file flatmap.c
+ *
+ * \brief Open-addressed implementations of a digest-to-void* map and a
+ * digest256-to-void* map.
+ *
+ * These maps have the same interface as digestmap_t and digest256map_t in
+ * map.c, but store their keys and values inline in one flat array of
+ * slots, instead of allocating a separate chained entry for every key.
+ *
+ * The layout follows the "Swiss table" design: alongside the slots, we keep
+ * one control byte per slot.  A control byte is either CTRL_EMPTY,
+ * CTRL_DELETED, or (for a full slot) the low 7 bits of the key's hash.
+ * Slots are examined in aligned groups of FLATMAP_GROUP_WIDTH; for each
+ * group we compare all of its control bytes against the wanted hash bits at
+ * once (with SSE2 where we have it), and only look at the keys of the slots
+ * that match.  A lookup stops at the first group that contains an empty
+ * slot.
+ **/
+
+#include "lib/container/map.h"
+#include "lib/ctime/di_ops.h"
+#include "lib/defs/digest_sizes.h"
+#include "lib/malloc/malloc.h"
+
+#include "lib/log/util_bug.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** Number of slots whose control bytes we examine together. */
+#define FLATMAP_GROUP_WIDTH 16
+/** Control byte for a slot that has never held an entry since the last
+ * rehash. */
+#define CTRL_EMPTY ((uint8_t)0x80)
+/** Control byte for a slot whose entry was removed. */
+#define CTRL_DELETED ((uint8_t)0xfe)
+
+/** Return a bitmask with bit <b>i</b> set iff the <b>i</b>th control byte
+ * in the group at <b>ctrl</b> equals <b>b</b>. */
+static inline unsigned
+group_match(const uint8_t *ctrl, uint8_t b)
+{
+#ifdef __SSE2__
+  __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+  return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(g,
+                                                _mm_set1_epi8((char)b)));
+#else
+  unsigned m = 0;
+  for (int i = 0; i < FLATMAP_GROUP_WIDTH; ++i) {
+    if (ctrl[i] == b)
+      m |= 1u << i;
+  }
+  return m;
+#endif /* defined(__SSE2__) */
+}
+
+/** Return a bitmask of the slots in the group at <b>ctrl</b> that are
+ * empty or deleted: that is, whose control byte has its high bit set. */
+static inline unsigned
+group_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+  return (unsigned)_mm_movemask_epi8(
+                        _mm_loadu_si128((const __m128i *)ctrl));
+#else
+  unsigned m = 0;
+  for (int i = 0; i < FLATMAP_GROUP_WIDTH; ++i) {
+    if (ctrl[i] & 0x80)
+      m |= 1u << i;
+  }
+  return m;
+#endif /* defined(__SSE2__) */
+}
+
+/** Return the index of the lowest set bit in <b>m</b>, which must not be
+ * 0. */
+static inline unsigned
+lowest_bit(unsigned m)
+{
+#ifdef __GNUC__
+  return (unsigned)__builtin_ctz(m);
+#else
+  unsigned i = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    ++i;
+  }
+  return i;
+#endif /* defined(__GNUC__) */
+}
+
+/** Return the number of entries a table with <b>n_slots</b> slots may hold
+ * before we grow it: we keep the table at most 7/8 full. */
+static inline unsigned
+flatmap_capacity(unsigned n_slots)
+{
+  return n_slots - n_slots / 8;
+}
+
+/** Helper: Declare an entry type and a map type for an open-addressed map
+ * whose keys are <b>keylen</b>-byte arrays of <b>keyelt</b>.  All types
+ * associated with the map get prefixed with <b>prefix</b>. */
+#define DEFINE_FLATMAP_STRUCTS(maptype, keyelt, keylen, prefix) \
+  typedef struct prefix ## _entry_t {                           \
+    keyelt key[keylen];                                         \
+    void *val;                                                  \
+  } prefix ## _entry_t;                                         \
+  struct maptype {                                              \
+    /** One control byte for each slot. */                      \
+    uint8_t *ctrl;                                              \
+    /** The slots themselves. */                                \
+    prefix ## _entry_t *slots;                                  \
+    /** Number of slots: 0, or a power of two no smaller than   \
+     * FLATMAP_GROUP_WIDTH. */                                  \
+    unsigned n_slots;                                           \
+    /** Number of full slots. */                                \
+    unsigned size;                                              \
+    /** Number of empty slots we may still fill before we have  \
+     * to rehash. */                                            \
+    unsigned growth_left;                                       \
+  }
+
+DEFINE_FLATMAP_STRUCTS(digestflatmap_t, char, DIGEST_LEN, digestflatmap);
+DEFINE_FLATMAP_STRUCTS(digest256flatmap_t, uint8_t, DIGEST256_LEN,
+                       digest256flatmap);
+
+/**
+ * Macro: implement all the functions for an open-addressed map that are
+ * declared in map.h by the DECLARE_MAP_FNS() macro, along with
+ * prefix_get_memory_usage().  Keys are <b>keylen</b> bytes long.
+ */
+#define IMPLEMENT_FLATMAP_FNS(maptype, keytype, keylen, prefix)         \
+  /** Return the hash we use for <b>key</b>. */                         \
+  static inline uint64_t                                                \
+  prefix##_hash(keytype key)                                            \
+  {                                                                     \
+    return siphash24g(key, keylen);                                     \
+  }                                                                     \
+                                                                        \
+  /** Return the index of the slot holding <b>key</b>, whose hash is    \
+   * <b>hash</b>, or -1 if there is none. */                            \
+  static inline int                                                     \
+  prefix##_find(const maptype *map, keytype key, uint64_t hash)         \
+  {                                                                     \
+    const unsigned group_mask = map->n_slots / FLATMAP_GROUP_WIDTH - 1; \
+    const uint8_t h2 = (uint8_t)(hash & 0x7f);                          \
+    unsigned group = (unsigned)(hash >> 7) & group_mask;                \
+    unsigned step = 0;                                                  \
+    if (!map->n_slots)                                                  \
+      return -1;                                                        \
+    for (;;) {                                                          \
+      const uint8_t *ctrl = map->ctrl + group * FLATMAP_GROUP_WIDTH;    \
+      unsigned m = group_match(ctrl, h2);                               \
+      while (m) {                                                       \
+        unsigned idx = group * FLATMAP_GROUP_WIDTH + lowest_bit(m);     \
+        if (tor_memeq(map->slots[idx].key, key, keylen))                \
+          return (int)idx;                                              \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      if (group_match(ctrl, CTRL_EMPTY))                                \
+        return -1;                                                      \
+      /* Triangular probing visits every group once. */                 \
+      group = (group + ++step) & group_mask;                            \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  /** Return the index of the first empty or deleted slot on the probe  \
+   * sequence for <b>hash</b>.  The table must have a free slot. */     \
+  static inline unsigned                                                \
+  prefix##_find_free(const maptype *map, uint64_t hash)                 \
+  {                                                                     \
+    const unsigned group_mask = map->n_slots / FLATMAP_GROUP_WIDTH - 1; \
+    unsigned group = (unsigned)(hash >> 7) & group_mask;                \
+    unsigned step = 0;                                                  \
+    for (;;) {                                                          \
+      unsigned m =                                                      \
+        group_match_free(map->ctrl + group * FLATMAP_GROUP_WIDTH);      \
+      if (m)                                                            \
+        return group * FLATMAP_GROUP_WIDTH + lowest_bit(m);             \
+      group = (group + ++step) & group_mask;                            \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  /** Rebuild <b>map</b> with <b>n_slots</b> slots, dropping all        \
+   * deleted-slot markers. */                                           \
+  static void                                                           \
+  prefix##_rehash(maptype *map, unsigned n_slots)                       \
+  {                                                                     \
+    uint8_t *old_ctrl = map->ctrl;                                      \
+    prefix##_entry_t *old_slots = map->slots;                           \
+    const unsigned old_n_slots = map->n_slots;                          \
+    unsigned i;                                                         \
+    tor_assert(n_slots >= FLATMAP_GROUP_WIDTH);                         \
+    tor_assert((n_slots & (n_slots - 1)) == 0);                         \
+    tor_assert(flatmap_capacity(n_slots) >= map->size);                 \
+    map->ctrl = tor_malloc(n_slots);                                    \
+    memset(map->ctrl, CTRL_EMPTY, n_slots);                             \
+    map->slots = tor_calloc(n_slots, sizeof(prefix##_entry_t));         \
+    map->n_slots = n_slots;                                             \
+    map->growth_left = flatmap_capacity(n_slots) - map->size;           \
+    for (i = 0; i < old_n_slots; ++i) {                                 \
+      uint64_t hash;                                                    \
+      unsigned idx;                                                     \
+      if (old_ctrl[i] & 0x80)                                           \
+        continue;                                                       \
+      hash = prefix##_hash(old_slots[i].key);                           \
+      idx = prefix##_find_free(map, hash);                              \
+      map->ctrl[idx] = (uint8_t)(hash & 0x7f);                          \
+      map->slots[idx] = old_slots[i];                                   \
+    }                                                                   \
+    tor_free(old_ctrl);                                                 \
+    tor_free(old_slots);                                                \
+  }                                                                     \
+                                                                        \
+  /** Mark the slot at <b>idx</b> in <b>map</b> as no longer full. */   \
+  static inline void                                                    \
+  prefix##_erase(maptype *map, unsigned idx)                            \
+  {                                                                     \
+    const uint8_t *group_ctrl =                                         \
+      map->ctrl + (idx & ~(unsigned)(FLATMAP_GROUP_WIDTH - 1));         \
+    /* If this group still has an empty slot, no lookup ever probed     \
+     * past it, so this slot can become empty again too.  Otherwise     \
+     * some lookup may need to continue past it. */                     \
+    if (group_match(group_ctrl, CTRL_EMPTY)) {                          \
+      map->ctrl[idx] = CTRL_EMPTY;                                      \
+      ++map->growth_left;                                               \
+    } else {                                                            \
+      map->ctrl[idx] = CTRL_DELETED;                                    \
+    }                                                                   \
+    memset(&map->slots[idx], 0, sizeof(prefix##_entry_t));              \
+    --map->size;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Return the index of the first full slot in <b>map</b> at or after \
+   * <b>idx</b>, or -1 if there is none. */                             \
+  static inline int                                                     \
+  prefix##_next_full(const maptype *map, unsigned idx)                  \
+  {                                                                     \
+    for (; idx < map->n_slots; ++idx) {                                 \
+      if (!(map->ctrl[idx] & 0x80))                                     \
+        return (int)idx;                                                \
+    }                                                                   \
+    return -1;                                                          \
+  }                                                                     \
+                                                                        \
+  /** Return an iterator pointing at the first full slot in <b>map</b>  \
+   * at or after <b>idx</b>. */                                         \
+  static inline prefix##_iter_t *                                       \
+  prefix##_iter_at(maptype *map, unsigned idx)                          \
+  {                                                                     \
+    int next = prefix##_next_full(map, idx);                            \
+    if (next < 0)                                                       \
+      return NULL;                                                      \
+    /* Our iterators are really pointers to slots. */                   \
+    return (prefix##_iter_t *)(void *)&map->slots[next];                \
+  }                                                                     \
+                                                                        \
+  /** Create and return a new empty map. */                             \
+  MOCK_IMPL(maptype *,                                                  \
+  prefix##_new,(void))                                                  \
+  {                                                                     \
+    return tor_malloc_zero(sizeof(maptype));                            \
+  }                                                                     \
+                                                                        \
+  /** Return the item from <b>map</b> whose key matches <b>key</b>, or  \
+   * NULL if no such value exists. */                                   \
+  void *                                                                \
+  prefix##_get(const maptype *map, keytype key)                         \
+  {                                                                     \
+    int idx;                                                            \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    idx = prefix##_find(map, key, prefix##_hash(key));                  \
+    return idx < 0 ? NULL : map->slots[idx].val;                        \
+  }                                                                     \
+                                                                        \
+  /** Add an entry to <b>map</b> mapping <b>key</b> to <b>val</b>;      \
+   * return the previous value, or NULL if no such value existed. */    \
+  void *                                                                \
+  prefix##_set(maptype *map, keytype key, void *val)                    \
+  {                                                                     \
+    uint64_t hash;                                                      \
+    int found;                                                          \
+    unsigned idx;                                                       \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    tor_assert(val);                                                    \
+    hash = prefix##_hash(key);                                          \
+    found = prefix##_find(map, key, hash);                              \
+    if (found >= 0) {                                                   \
+      void *oldval = map->slots[found].val;                             \
+      map->slots[found].val = val;                                      \
+      return oldval;                                                    \
+    }                                                                   \
+    if (map->n_slots == 0) {                                            \
+      prefix##_rehash(map, FLATMAP_GROUP_WIDTH);                        \
+    }                                                                   \
+    idx = prefix##_find_free(map, hash);                                \
+    if (map->ctrl[idx] == CTRL_EMPTY && map->growth_left == 0) {        \
+      /* Grow if we're more than half full; otherwise there are enough  \
+       * deleted slots that rehashing in place is worthwhile. */        \
+      unsigned n_slots = map->n_slots;                                  \
+      if (map->size >= flatmap_capacity(n_slots) / 2)                   \
+        n_slots *= 2;                                                   \
+      prefix##_rehash(map, n_slots);                                    \
+      idx = prefix##_find_free(map, hash);                              \
+    }                                                                   \
+    if (map->ctrl[idx] == CTRL_EMPTY)                                   \
+      --map->growth_left;                                               \
+    map->ctrl[idx] = (uint8_t)(hash & 0x7f);                            \
+    memcpy(map->slots[idx].key, key, keylen);                           \
+    map->slots[idx].val = val;                                          \
+    ++map->size;                                                        \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Remove the value currently associated with <b>key</b> from the map. \
+   * Return the value if one was set, or NULL if there was no entry for \
+   * <b>key</b>.                                                        \
+   *                                                                    \
+   * Note: you must free any storage associated with the returned value. \
+   */                                                                   \
+  void *                                                                \
+  prefix##_remove(maptype *map, keytype key)                            \
+  {                                                                     \
+    int idx;                                                            \
+    void *oldval;                                                       \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    idx = prefix##_find(map, key, prefix##_hash(key));                  \
+    if (idx < 0)                                                        \
+      return NULL;                                                      \
+    oldval = map->slots[idx].val;                                       \
+    prefix##_erase(map, (unsigned)idx);                                 \
+    return oldval;                                                      \
+  }                                                                     \
+                                                                        \
+  /** Return the number of elements in <b>map</b>. */                   \
+  int                                                                   \
+  prefix##_size(const maptype *map)                                     \
+  {                                                                     \
+    return (int)map->size;                                              \
+  }                                                                     \
+                                                                        \
+  /** Return true iff <b>map</b> has no entries. */                     \
+  int                                                                   \
+  prefix##_isempty(const maptype *map)                                  \
+  {                                                                     \
+    return map->size == 0;                                              \
+  }                                                                     \
+                                                                        \
+  /** Assert that <b>map</b> is not corrupt. */                         \
+  void                                                                  \
+  prefix##_assert_ok(const maptype *map)                                \
+  {                                                                     \
+    unsigned i, n_full = 0, n_empty = 0;                                \
+    tor_assert(map);                                                    \
+    if (map->n_slots == 0) {                                            \
+      tor_assert(map->size == 0);                                       \
+      return;                                                           \
+    }                                                                   \
+    tor_assert((map->n_slots & (map->n_slots - 1)) == 0);               \
+    for (i = 0; i < map->n_slots; ++i) {                                \
+      if (map->ctrl[i] == CTRL_EMPTY) {                                 \
+        ++n_empty;                                                      \
+      } else if (map->ctrl[i] != CTRL_DELETED) {                        \
+        uint64_t hash = prefix##_hash(map->slots[i].key);               \
+        tor_assert(map->ctrl[i] == (uint8_t)(hash & 0x7f));             \
+        tor_assert(prefix##_find(map, map->slots[i].key, hash) ==       \
+                   (int)i);                                             \
+        ++n_full;                                                       \
+      }                                                                 \
+    }                                                                   \
+    tor_assert(n_full == map->size);                                    \
+    tor_assert(n_empty > 0);                                            \
+    tor_assert(map->n_slots - n_empty + map->growth_left ==             \
+               flatmap_capacity(map->n_slots));                         \
+  }                                                                     \
+                                                                        \
+  /** Remove all entries from <b>map</b>, and deallocate storage for    \
+   * those entries.  If free_val is provided, invoked it every value in \
+   * <b>map</b>. */                                                     \
+  MOCK_IMPL(void,                                                       \
+  prefix##_free_, (maptype *map, void (*free_val)(void*)))              \
+  {                                                                     \
+    unsigned i;                                                         \
+    if (!map)                                                           \
+      return;                                                           \
+    if (free_val) {                                                     \
+      for (i = 0; i < map->n_slots; ++i) {                              \
+        if (!(map->ctrl[i] & 0x80))                                     \
+          free_val(map->slots[i].val);                                  \
+      }                                                                 \
+    }                                                                   \
+    tor_free(map->ctrl);                                                \
+    tor_free(map->slots);                                               \
+    tor_free(map);                                                      \
+  }                                                                     \
+                                                                        \
+  /** Return an <b>iterator</b> pointer to the front of a map.  See     \
+   * strmap_iter_init() for an example of how to use iterators.  Adding \
+   * entries to the map invalidates all iterators. */                   \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_init(maptype *map)                                      \
+  {                                                                     \
+    tor_assert(map);                                                    \
+    return prefix##_iter_at(map, 0);                                    \
+  }                                                                     \
+                                                                        \
+  /** Advance <b>iter</b> a single step to the next entry, and return   \
+   * its new value. */                                                  \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next(maptype *map, prefix##_iter_t *iter)               \
+  {                                                                     \
+    const prefix##_entry_t *slot = (const void *)iter;                  \
+    tor_assert(map);                                                    \
+    tor_assert(iter);                                                   \
+    return prefix##_iter_at(map, (unsigned)(slot - map->slots) + 1);    \
+  }                                                                     \
+                                                                        \
+  /** Advance <b>iter</b> a single step to the next entry, removing the \
+   * current entry, and return its new value. */                        \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
+  {                                                                     \
+    const prefix##_entry_t *slot = (const void *)iter;                  \
+    unsigned idx;                                                       \
+    tor_assert(map);                                                    \
+    tor_assert(iter);                                                   \
+    idx = (unsigned)(slot - map->slots);                                \
+    tor_assert(idx < map->n_slots);                                     \
+    prefix##_erase(map, idx);                                           \
+    return prefix##_iter_at(map, idx + 1);                              \
+  }                                                                     \
+                                                                        \
+  /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
+   * to by iter. */                                                     \
+  void                                                                  \
+  prefix##_iter_get(prefix##_iter_t *iter, keytype *keyp,               \
+                    void **valp)                                        \
+  {                                                                     \
+    const prefix##_entry_t *slot = (const void *)iter;                  \
+    tor_assert(iter);                                                   \
+    tor_assert(keyp);                                                   \
+    tor_assert(valp);                                                   \
+    *keyp = slot->key;                                                  \
+    *valp = slot->val;                                                  \
+  }                                                                     \
+                                                                        \
+  /** Return true iff <b>iter</b> has advanced past the last entry of   \
+   * <b>map</b>. */                                                     \
+  int                                                                   \
+  prefix##_iter_done(prefix##_iter_t *iter)                             \
+  {                                                                     \
+    return iter == NULL;                                                \
+  }                                                                     \
+                                                                        \
+  /** Return the number of bytes that <b>map</b> uses, not counting     \
+   * allocator overhead or the values themselves. */                    \
+  size_t                                                                \
+  prefix##_get_memory_usage(const maptype *map)                         \
+  {                                                                     \
+    return sizeof(maptype) +                                            \
+      (size_t)map->n_slots * (1 + sizeof(prefix##_entry_t));            \
+  }
+
+IMPLEMENT_FLATMAP_FNS(digestflatmap_t, const char *, DIGEST_LEN,
+                      digestflatmap)
+IMPLEMENT_FLATMAP_FNS(digest256flatmap_t, const uint8_t *, DIGEST256_LEN,
+                      digest256flatmap)
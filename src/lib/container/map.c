@@ -374,6 +374,16 @@ IMPLEMENT_MAP_FNS(strmap_t, char *, strmap)
 IMPLEMENT_MAP_FNS(digestmap_t, char *, digestmap)
 IMPLEMENT_MAP_FNS(digest256map_t, uint8_t *, digest256map)
 
+/** Return the number of bytes that <b>map</b> uses, not counting allocator
+ * overhead or the values themselves. */
+size_t
+digestmap_get_memory_usage(const digestmap_t *map)
+{
+  return sizeof(digestmap_t) +
+    map->head.hth_table_length * sizeof(digestmap_entry_t *) +
+    HT_SIZE(&map->head) * sizeof(digestmap_entry_t);
+}
+
 /** Same as strmap_set, but first converts <b>key</b> to lowercase. */
 void *
 strmap_set_lc(strmap_t *map, const char *key, void *val)
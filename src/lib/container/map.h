@@ -42,6 +42,17 @@ DECLARE_MAP_FNS(digestmap_t, const char *, digestmap);
 /* Map from const uint8_t[DIGEST256_LEN] to void *. Implemented with a hash
  * table. */
 DECLARE_MAP_FNS(digest256map_t, const uint8_t *, digest256map);
+/* Map from const char[DIGEST_LEN] to void *.  Same interface as digestmap_t,
+ * but implemented with an open-addressed table that stores keys inline: it
+ * uses less memory and is faster to search. */
+DECLARE_MAP_FNS(digestflatmap_t, const char *, digestflatmap);
+/* Map from const uint8_t[DIGEST256_LEN] to void *.  Same interface as
+ * digest256map_t, implemented as for digestflatmap_t. */
+DECLARE_MAP_FNS(digest256flatmap_t, const uint8_t *, digest256flatmap);
+
+size_t digestmap_get_memory_usage(const digestmap_t *map);
+size_t digestflatmap_get_memory_usage(const digestflatmap_t *map);
+size_t digest256flatmap_get_memory_usage(const digest256flatmap_t *map);
 
 #define MAP_FREE_AND_NULL(mapname_t, map, fn)     \
   do {                                          \
@@ -52,6 +63,10 @@ DECLARE_MAP_FNS(digest256map_t, const uint8_t *, digest256map);
 #define strmap_free(map, fn) MAP_FREE_AND_NULL(strmap, (map), (fn))
 #define digestmap_free(map, fn) MAP_FREE_AND_NULL(digestmap, (map), (fn))
 #define digest256map_free(map, fn) MAP_FREE_AND_NULL(digest256map, (map), (fn))
+#define digestflatmap_free(map, fn) \
+  MAP_FREE_AND_NULL(digestflatmap, (map), (fn))
+#define digest256flatmap_free(map, fn) \
+  MAP_FREE_AND_NULL(digest256flatmap, (map), (fn))
 
 #undef DECLARE_MAP_FNS
 
@@ -174,6 +189,20 @@ DECLARE_MAP_FNS(digest256map_t, const uint8_t *, digest256map);
                      keyvar, valtype, valvar)
 #define DIGEST256MAP_FOREACH_END MAP_FOREACH_END
 
+#define DIGESTFLATMAP_FOREACH(map, keyvar, valtype, valvar)             \
+  MAP_FOREACH(digestflatmap, map, const char *, keyvar, valtype, valvar)
+#define DIGESTFLATMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)      \
+  MAP_FOREACH_MODIFY(digestflatmap, map, const char *,                 \
+                     keyvar, valtype, valvar)
+#define DIGESTFLATMAP_FOREACH_END MAP_FOREACH_END
+
+#define DIGEST256FLATMAP_FOREACH(map, keyvar, valtype, valvar)          \
+  MAP_FOREACH(digest256flatmap, map, const uint8_t *, keyvar, valtype, valvar)
+#define DIGEST256FLATMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)   \
+  MAP_FOREACH_MODIFY(digest256flatmap, map, const uint8_t *,           \
+                     keyvar, valtype, valvar)
+#define DIGEST256FLATMAP_FOREACH_END MAP_FOREACH_END
+
 #define STRMAP_FOREACH(map, keyvar, valtype, valvar)                 \
   MAP_FOREACH(strmap, map, const char *, keyvar, valtype, valvar)
 #define STRMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)          \
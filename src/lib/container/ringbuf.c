@@ -0,0 +1,124 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ringbuf.c
+ * \brief Implements a FIFO queue of fixed-size elements in a ring buffer.
+ **/
+
+#include <string.h>
+
+#include "lib/container/ringbuf.h"
+#include "lib/malloc/malloc.h"
+#include "lib/log/util_bug.h"
+
+/** Smallest capacity that we allocate. */
+#define RINGBUF_MIN_CAPACITY 4
+
+/** Return a pointer to the slot for the <b>idx</b>th element of
+ * <b>rb</b>, counting from the head. */
+static inline uint8_t *
+ringbuf_slot(const ringbuf_t *rb, uint32_t idx)
+{
+  return rb->elts + ((rb->head + idx) & (rb->capacity - 1)) * rb->elt_size;
+}
+
+/** Set up <b>rb</b> as an empty queue of <b>elt_size</b>-byte elements.
+ * Does not allocate. */
+void
+ringbuf_init(ringbuf_t *rb, size_t elt_size)
+{
+  tor_assert(rb);
+  tor_assert(elt_size > 0 && elt_size <= UINT16_MAX);
+  memset(rb, 0, sizeof(*rb));
+  rb->elt_size = (uint16_t) elt_size;
+}
+
+/** Remove every element from <b>rb</b> and release its storage.  The queue
+ * can still be used afterwards. */
+void
+ringbuf_clear(ringbuf_t *rb)
+{
+  tor_assert(rb);
+  tor_free(rb->elts);
+  rb->capacity = rb->head = rb->len = 0;
+}
+
+/** Make sure that <b>rb</b> can hold at least <b>n</b> elements without
+ * allocating again. */
+void
+ringbuf_reserve(ringbuf_t *rb, uint32_t n)
+{
+  uint32_t new_capacity;
+  uint8_t *new_elts;
+
+  tor_assert(rb);
+  tor_assert(rb->elt_size);
+
+  if (n <= rb->capacity)
+    return;
+  tor_assert(n <= UINT32_MAX / 2);
+
+  new_capacity = rb->capacity ? rb->capacity : RINGBUF_MIN_CAPACITY;
+  while (new_capacity < n)
+    new_capacity *= 2;
+
+  new_elts = tor_malloc_zero((size_t) new_capacity * rb->elt_size);
+  /* Copy the queue out in order, so that it starts at index 0. */
+  if (rb->len) {
+    uint32_t first = rb->capacity - rb->head;
+    if (first > rb->len)
+      first = rb->len;
+    memcpy(new_elts, ringbuf_slot(rb, 0), (size_t) first * rb->elt_size);
+    memcpy(new_elts + (size_t) first * rb->elt_size, rb->elts,
+           (size_t) (rb->len - first) * rb->elt_size);
+  }
+  tor_free(rb->elts);
+  rb->elts = new_elts;
+  rb->capacity = new_capacity;
+  rb->head = 0;
+}
+
+/** Add a new element to the back of <b>rb</b>, and return a pointer to it
+ * so that the caller can fill it in.  The pointer is only valid until the
+ * next change to <b>rb</b>. */
+void *
+ringbuf_push(ringbuf_t *rb)
+{
+  tor_assert(rb);
+
+  if (rb->len == rb->capacity)
+    ringbuf_reserve(rb, rb->len + 1);
+
+  return ringbuf_slot(rb, rb->len++);
+}
+
+/** Remove the element at the front of <b>rb</b>, copying it into
+ * <b>out</b> if <b>out</b> is not NULL.  Return 0 on success, or -1 if
+ * <b>rb</b> is empty. */
+int
+ringbuf_pop(ringbuf_t *rb, void *out)
+{
+  tor_assert(rb);
+
+  if (rb->len == 0)
+    return -1;
+
+  if (out)
+    memcpy(out, ringbuf_slot(rb, 0), rb->elt_size);
+  rb->head = (rb->head + 1) & (rb->capacity - 1);
+  --rb->len;
+  return 0;
+}
+
+/** Return a pointer to the <b>idx</b>th element of <b>rb</b>, counting from
+ * the front, or NULL if there is no such element. */
+const void *
+ringbuf_get(const ringbuf_t *rb, uint32_t idx)
+{
+  tor_assert(rb);
+
+  if (idx >= rb->len)
+    return NULL;
+  return ringbuf_slot(rb, idx);
+}
@@ -0,0 +1,56 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#ifndef TOR_RINGBUF_H
+#define TOR_RINGBUF_H
+
+/**
+ * \file ringbuf.h
+ *
+ * \brief Header for ringbuf.c
+ **/
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+
+/**
+ * A FIFO queue of fixed-size elements, stored by value in a single
+ * power-of-two sized array.
+ *
+ * A ringbuf_t is meant to be embedded in the structure that owns it.  Its
+ * storage is allocated by ringbuf_reserve() or by the first push, and only
+ * grows (by doubling) when more elements are queued than it can hold; pushes
+ * and pops never allocate otherwise.
+ *
+ * An all-zero ringbuf_t is an empty queue of zero-sized elements: call
+ * ringbuf_init() before using it.
+ */
+typedef struct ringbuf_t {
+  /** Storage for <b>capacity</b> elements of <b>elt_size</b> bytes. */
+  uint8_t *elts;
+  /** Size of each element, in bytes. */
+  uint16_t elt_size;
+  /** Number of elements that <b>elts</b> can hold: zero or a power of
+   * two. */
+  uint32_t capacity;
+  /** Index of the first element in the queue. */
+  uint32_t head;
+  /** Number of elements in the queue. */
+  uint32_t len;
+} ringbuf_t;
+
+void ringbuf_init(ringbuf_t *rb, size_t elt_size);
+void ringbuf_clear(ringbuf_t *rb);
+void ringbuf_reserve(ringbuf_t *rb, uint32_t n);
+void *ringbuf_push(ringbuf_t *rb);
+int ringbuf_pop(ringbuf_t *rb, void *out);
+const void *ringbuf_get(const ringbuf_t *rb, uint32_t idx);
+
+/** Return the number of elements in <b>rb</b>. */
+static inline uint32_t
+ringbuf_len(const ringbuf_t *rb)
+{
+  return rb->len;
+}
+
+#endif /* !defined(TOR_RINGBUF_H) */
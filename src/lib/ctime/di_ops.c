@@ -280,6 +280,40 @@ select_array_member_cumulative_timei(const uint64_t *entries, int n_entries,
   return i_chosen;
 }
 
+/**
+ * Given an array of <b>n_entries</b> nondecreasing uint64_t values, whose last
+ * element is greater than <b>rand_val</b>, find the first i such that
+ * <b>cumulative</b>[i] is greater than rand_val.
+ *
+ * This is a binary search that always takes the same number of steps for a
+ * given <b>n_entries</b>, and that does not branch on the values it reads.
+ * It does not hide which cache lines it reads.
+ */
+int
+select_array_member_by_cumulative_timei(const uint64_t *cumulative,
+                                        int n_entries, uint64_t rand_val)
+{
+  int pos = 0, step = 1;
+
+  raw_assert(n_entries > 0);
+  raw_assert(gt_i64_timei(cumulative[n_entries-1], rand_val));
+
+  while (step <= n_entries / 2)
+    step <<= 1;
+
+  for ( ; step > 0; step >>= 1) {
+    /* If pos+step entries are all at most rand_val, skip past them. */
+    const int probe = pos + step - 1;
+    const int in_range = (int) (((unsigned) (probe - n_entries)) >> 31);
+    const int idx = probe - ((probe - (n_entries - 1)) & -(1 - in_range));
+    const int le = 1 ^ gt_i64_timei(cumulative[idx], rand_val);
+    pos += step & -(in_range & le);
+  }
+
+  raw_assert(pos < n_entries);
+  return pos;
+}
+
 /**
  * If <b>s</b> is true, then copy <b>n</b> bytes from <b>src</b> to
  * <b>dest</b>.  Otherwise leave <b>dest</b> alone.
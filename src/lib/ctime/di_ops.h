@@ -72,6 +72,9 @@ void *dimap_search(const di_digest256_map_t *map, const uint8_t *key,
 int select_array_member_cumulative_timei(const uint64_t *entries,
                                          int n_entries,
                                          uint64_t total, uint64_t rand_val);
+int select_array_member_by_cumulative_timei(const uint64_t *cumulative,
+                                            int n_entries,
+                                            uint64_t rand_val);
 
 void memcpy_if_true_timei(bool s, void *dest, const void *src, size_t n);
 
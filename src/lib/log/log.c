@@ -29,6 +29,10 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
 #define LOG_PRIVATE
 #include "lib/log/log.h"
@@ -183,6 +187,41 @@ static int pretty_fn_has_parens = 0;
   tor_mutex_release(&log_mutex);                                        \
   STMT_END
 
+/** A mutex held by whoever is writing the contents of the asynchronous log
+ * ring.  When both locks are needed, log_mutex is always taken first. */
+static tor_mutex_t log_write_mutex;
+
+/** If we are logging asynchronously, a ring of queued file log records.
+ * Each record is a log_async_rec_t followed by its message, padded to
+ * LOG_ASYNC_ALIGN bytes.  A record never wraps around the end of the ring;
+ * instead we fill the tail of the ring with a padding record. */
+static char *async_ring = NULL;
+/** Number of bytes in async_ring; a multiple of LOG_ASYNC_ALIGN. */
+static size_t async_ring_size = 0;
+/** Offset of the oldest byte in async_ring that has not been handed to a
+ * writer.  Offsets only grow; positions are taken modulo async_ring_size. */
+static uint64_t async_head = 0;
+/** Offset one past the newest byte in async_ring. */
+static uint64_t async_tail = 0;
+/** Number of bytes after async_head that a writer has finished with, but
+ * that we have not yet released from the ring.  Protected by
+ * log_write_mutex, not log_mutex. */
+static uint64_t async_consumed = 0;
+/** If a writer failed to write to an fd, that fd; otherwise -1.  Protected
+ * by log_write_mutex. */
+static int async_failed_fd = -1;
+/** What to do with a message that doesn't fit in async_ring. */
+static log_async_policy_t async_policy = LOG_ASYNC_BLOCK;
+/** Function to tell our writer that there is something in async_ring. */
+static log_async_wakeup_fn async_wakeup_fn = NULL;
+/** True iff we have called async_wakeup_fn since the writer last looked at
+ * the ring. */
+static int async_wakeup_pending = 0;
+/** Total number of messages we have dropped because async_ring was full. */
+static uint64_t async_n_dropped = 0;
+/** Number of dropped messages that we have not yet noted in the logs. */
+static unsigned async_n_dropped_unreported = 0;
+
 /** What's the lowest log level anybody cares about?  Checking this lets us
  * bail out early from log_debug if we aren't debugging.  */
 int log_global_min_severity_ = LOG_NOTICE;
@@ -472,6 +511,238 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Header for a single record in the asynchronous log ring. */
+typedef struct log_async_rec_t {
+  /** The fd to write to, or -1 if this record is padding. */
+  int32_t fd;
+  /** Number of message bytes following this header. */
+  uint32_t len;
+} log_async_rec_t;
+
+/** Alignment of every record in the asynchronous log ring. */
+#define LOG_ASYNC_ALIGN 8
+CTASSERT(sizeof(log_async_rec_t) == LOG_ASYNC_ALIGN);
+/** Number of ring bytes used by a record holding <b>len</b> message
+ * bytes. */
+#define LOG_ASYNC_REC_SPACE(len) \
+  (sizeof(log_async_rec_t) + (((len) + LOG_ASYNC_ALIGN - 1) & \
+                              ~(size_t)(LOG_ASYNC_ALIGN - 1)))
+/** Smallest ring we will use: enough for several maximum-length
+ * messages. */
+#define LOG_ASYNC_MIN_BUFSIZE (64*1024)
+/** Largest number of records we hand to a single writev() call. */
+#define LOG_ASYNC_MAX_IOV 64
+
+#ifdef _WIN32
+/** Stand-in for the POSIX iovec, so that we can share the batching code. */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif /* defined(_WIN32) */
+
+/** Return true iff a message at <b>severity</b> in <b>domain</b> must reach
+ * its files before logv() returns, even when logging asynchronously.  We are
+ * likely to abort right after a fatal or bug message. */
+static inline int
+log_must_be_synchronous(int severity, log_domain_mask_t domain)
+{
+  return severity == LOG_ERR || (domain & LD_BUG);
+}
+
+/** Write the <b>n</b> buffers in <b>iov</b> to <b>fd</b>, continuing after
+ * short writes.  Return 0 on success and -1 on failure.  May modify
+ * <b>iov</b>. */
+static int
+log_async_writev(int fd, struct iovec *iov, int n)
+{
+#ifndef _WIN32
+  while (n > 0) {
+    ssize_t r = writev(fd, iov, n);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)r >= iov->iov_len) {
+      r -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+#else /* defined(_WIN32) */
+  for (int i = 0; i < n; ++i) {
+    if (write_all_to_fd_minimal(fd, iov[i].iov_base, iov[i].iov_len) < 0)
+      return -1;
+  }
+#endif /* !defined(_WIN32) */
+  return 0;
+}
+
+/** Write every record in the asynchronous log ring from offset <b>from</b>
+ * up to offset <b>to</b>, giving each run of records for the same fd to a
+ * single writev() call.  If a write fails, set *<b>failed_fd_out</b> to the
+ * fd that failed.  Caller must hold log_write_mutex. */
+static void
+log_async_write_range(uint64_t from, uint64_t to, int *failed_fd_out)
+{
+  struct iovec iov[LOG_ASYNC_MAX_IOV];
+  int n_iov = 0;
+  int cur_fd = -1;
+
+  while (from < to) {
+    const log_async_rec_t *rec =
+      (const log_async_rec_t *)(async_ring + (from % async_ring_size));
+    from += LOG_ASYNC_REC_SPACE(rec->len);
+    if (rec->fd < 0)
+      continue;
+    if (n_iov && (rec->fd != cur_fd || n_iov == LOG_ASYNC_MAX_IOV)) {
+      if (log_async_writev(cur_fd, iov, n_iov) < 0)
+        *failed_fd_out = cur_fd;
+      n_iov = 0;
+    }
+    cur_fd = rec->fd;
+    iov[n_iov].iov_base = (char *)(rec + 1);
+    iov[n_iov].iov_len = rec->len;
+    ++n_iov;
+  }
+  if (n_iov) {
+    if (log_async_writev(cur_fd, iov, n_iov) < 0)
+      *failed_fd_out = cur_fd;
+  }
+}
+
+/** Release the ring space that writers have finished with, and mark any
+ * logfile that a writer failed to write to as dead.  Caller must hold both
+ * log_mutex and log_write_mutex. */
+static void
+log_async_reclaim_locked(void)
+{
+  async_head += async_consumed;
+  async_consumed = 0;
+  if (async_failed_fd >= 0) {
+    logfile_t *lf;
+    for (lf = logfiles; lf; lf = lf->next) {
+      if (lf->fd == async_failed_fd && !logfile_is_external(lf))
+        lf->seems_dead = 1;
+    }
+    async_failed_fd = -1;
+  }
+}
+
+/** Write everything in the asynchronous log ring from this thread, waiting
+ * for any writer that is already busy.  Caller must hold log_mutex. */
+static void
+log_async_flush_locked(void)
+{
+  if (!async_ring)
+    return;
+  tor_mutex_acquire(&log_write_mutex);
+  log_async_reclaim_locked();
+  if (async_head != async_tail) {
+    log_async_write_range(async_head, async_tail, &async_failed_fd);
+    async_head = async_tail;
+    log_async_reclaim_locked();
+  }
+  tor_mutex_release(&log_write_mutex);
+}
+
+/** Try to make room for a record of <b>len</b> message bytes destined for
+ * <b>fd</b> at the end of the asynchronous log ring.  On success, return a
+ * pointer to where the message bytes go.  Return NULL if there is no room.
+ * Caller must hold log_mutex. */
+static char *
+log_async_reserve(int fd, size_t len)
+{
+  const size_t space = LOG_ASYNC_REC_SPACE(len);
+  size_t off = (size_t)(async_tail % async_ring_size);
+  const size_t contig = async_ring_size - off;
+  const size_t avail = async_ring_size - (size_t)(async_tail - async_head);
+  log_async_rec_t *rec;
+
+  if (space + (contig < space ? contig : 0) > avail)
+    return NULL;
+  if (contig < space) {
+    /* Pad out the end of the ring, and start over at the beginning. */
+    rec = (log_async_rec_t *)(async_ring + off);
+    rec->fd = -1;
+    rec->len = (uint32_t)(contig - sizeof(log_async_rec_t));
+    async_tail += contig;
+    off = 0;
+  }
+  rec = (log_async_rec_t *)(async_ring + off);
+  rec->fd = fd;
+  rec->len = (uint32_t)len;
+  async_tail += space;
+  return (char *)(rec + 1);
+}
+
+/** Queue <b>len</b> bytes from <b>msg</b> to be written to <b>fd</b> by our
+ * asynchronous writer.  If there is no room, apply async_policy.  Caller
+ * must hold log_mutex. */
+static void
+log_async_enqueue(int fd, const char *msg, size_t len)
+{
+  char *cp;
+
+  if (async_n_dropped_unreported) {
+    char note[64];
+    int n = tor_snprintf(note, sizeof(note),
+                         "[%u log messages dropped: log buffer full]\n",
+                         async_n_dropped_unreported);
+    if (n > 0 && (cp = log_async_reserve(fd, n))) {
+      memcpy(cp, note, n);
+      async_n_dropped_unreported = 0;
+    }
+  }
+
+  cp = log_async_reserve(fd, len);
+  if (!cp && async_policy == LOG_ASYNC_BLOCK) {
+    /* Wait for the writer to finish whatever it is doing, and see whether
+     * that was enough.  If not, do the writing ourselves. */
+    tor_mutex_acquire(&log_write_mutex);
+    log_async_reclaim_locked();
+    tor_mutex_release(&log_write_mutex);
+    cp = log_async_reserve(fd, len);
+    if (!cp) {
+      log_async_flush_locked();
+      cp = log_async_reserve(fd, len);
+    }
+  }
+  if (!cp) {
+    ++async_n_dropped;
+    ++async_n_dropped_unreported;
+    return;
+  }
+  memcpy(cp, msg, len);
+
+  if (!async_wakeup_pending) {
+    async_wakeup_pending = 1;
+    async_wakeup_fn();
+  }
+}
+
+/** Stop logging asynchronously, after writing everything that is queued.
+ * Caller must hold log_mutex. */
+static void
+log_async_disable_locked(void)
+{
+  if (!async_ring)
+    return;
+  log_async_flush_locked();
+  tor_mutex_acquire(&log_write_mutex);
+  tor_free(async_ring);
+  async_ring_size = 0;
+  async_head = async_tail = async_consumed = 0;
+  async_wakeup_fn = NULL;
+  async_wakeup_pending = 0;
+  tor_mutex_release(&log_write_mutex);
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -518,7 +789,11 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
     } else {
       lf->callback(severity, domain, msg_after_prefix);
     }
+  } else if (async_ring && !log_must_be_synchronous(severity, domain)) {
+    log_async_enqueue(lf->fd, buf, msg_len);
   } else {
+    /* Keep this message in order with anything we queued earlier. */
+    log_async_flush_locked();
     if (write_all_to_fd_minimal(lf->fd, buf, msg_len) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -752,6 +1027,7 @@ logs_free_all(void)
   logfile_t *victim, *next;
   smartlist_t *messages, *messages2;
   LOCK_LOGS();
+  log_async_disable_locked();
   next = logfiles;
   logfiles = NULL;
   messages = pending_cb_messages;
@@ -813,6 +1089,127 @@ logs_flush_sigsafe(void)
 #endif /* defined(HAVE_FSYNC) */
 }
 
+/** Start logging to files asynchronously, through a ring buffer of about
+ * <b>bufsize</b> bytes.  Whenever there is newly queued data, call
+ * <b>wakeup</b>, which should arrange for some thread to call
+ * logs_async_write_pending().  When the buffer is full, block or drop
+ * messages according to <b>policy</b>.
+ *
+ * Syslog and callback logs are unaffected.  Errors and bug warnings are
+ * always written before the call that logged them returns.
+ *
+ * Calling this function again replaces the settings, after writing
+ * everything that was queued. */
+void
+logs_set_async(size_t bufsize, log_async_policy_t policy,
+               log_async_wakeup_fn wakeup)
+{
+  raw_assert(wakeup);
+  if (bufsize < LOG_ASYNC_MIN_BUFSIZE)
+    bufsize = LOG_ASYNC_MIN_BUFSIZE;
+  bufsize -= bufsize % LOG_ASYNC_ALIGN;
+
+  LOCK_LOGS();
+  log_async_flush_locked();
+  tor_mutex_acquire(&log_write_mutex);
+  if (bufsize != async_ring_size) {
+    tor_free(async_ring);
+    async_ring = tor_malloc(bufsize);
+    async_ring_size = bufsize;
+    async_head = async_tail = 0;
+  }
+  async_policy = policy;
+  async_wakeup_fn = wakeup;
+  async_wakeup_pending = 0;
+  tor_mutex_release(&log_write_mutex);
+  UNLOCK_LOGS();
+}
+
+/** Stop logging asynchronously, after writing everything that is queued. */
+void
+logs_set_sync(void)
+{
+  LOCK_LOGS();
+  log_async_disable_locked();
+  UNLOCK_LOGS();
+}
+
+/** Return true iff we are currently logging to files asynchronously. */
+int
+logs_are_async(void)
+{
+  int r;
+  LOCK_LOGS();
+  r = async_ring != NULL;
+  UNLOCK_LOGS();
+  return r;
+}
+
+/** Write out everything that is currently queued for asynchronous logging.
+ * The writes happen without holding the log lock, so other threads can keep
+ * logging meanwhile.  Meant to be called from a writer thread after the
+ * wakeup function given to logs_set_async() has run.
+ *
+ * Return the number of bytes of queue that we handled. */
+size_t
+logs_async_write_pending(void)
+{
+  uint64_t from, to;
+  int failed_fd = -1;
+
+  LOCK_LOGS();
+  if (!async_ring) {
+    UNLOCK_LOGS();
+    return 0;
+  }
+  tor_mutex_acquire(&log_write_mutex);
+  log_async_reclaim_locked();
+  from = async_head;
+  to = async_tail;
+  async_wakeup_pending = 0;
+  UNLOCK_LOGS();
+
+  log_async_write_range(from, to, &failed_fd);
+  async_consumed += to - from;
+  if (failed_fd >= 0)
+    async_failed_fd = failed_fd;
+  tor_mutex_release(&log_write_mutex);
+
+  /* Give the space back right away, so that a full ring doesn't have to
+   * wait for our next pass. */
+  if (to != from) {
+    LOCK_LOGS();
+    tor_mutex_acquire(&log_write_mutex);
+    log_async_reclaim_locked();
+    tor_mutex_release(&log_write_mutex);
+    UNLOCK_LOGS();
+  }
+
+  return (size_t)(to - from);
+}
+
+/** Write everything that is queued for asynchronous logging from this
+ * thread. */
+void
+logs_async_flush(void)
+{
+  LOCK_LOGS();
+  log_async_flush_locked();
+  UNLOCK_LOGS();
+}
+
+/** Return the number of messages we have dropped because the asynchronous
+ * log buffer was full. */
+uint64_t
+logs_async_get_n_dropped(void)
+{
+  uint64_t n;
+  LOCK_LOGS();
+  n = async_n_dropped;
+  UNLOCK_LOGS();
+  return n;
+}
+
 /** Remove and free the log entry <b>victim</b> from the linked-list
  * logfiles (it is probably present, but it might not be due to thread
  * racing issues). After this function is called, the caller shouldn't
@@ -917,6 +1314,7 @@ init_logging(int disable_startup_queue)
 {
   if (!log_mutex_initialized) {
     tor_mutex_init(&log_mutex);
+    tor_mutex_init_nonrecursive(&log_write_mutex);
     tor_bug_init_counter();
     log_mutex_initialized = 1;
   }
@@ -1103,6 +1501,7 @@ close_temp_logs(void)
   logfile_t *lf, **p;
 
   LOCK_LOGS();
+  log_async_flush_locked();
   for (p = &logfiles; *p; ) {
     if ((*p)->is_temporary) {
       lf = *p;
@@ -1462,6 +1861,7 @@ void
 truncate_logs(void)
 {
   logfile_t *lf;
+  logs_async_flush();
   for (lf = logfiles; lf; lf = lf->next) {
     if (lf->fd >= 0) {
       tor_ftruncate(lf->fd);
@@ -195,6 +195,25 @@ void log_set_application_name(const char *name);
 MOCK_DECL(void, set_log_time_granularity,(int granularity_msec));
 void truncate_logs(void);
 
+/** What to do with a message when the asynchronous log buffer is full. */
+typedef enum log_async_policy_t {
+  /** Wait for the queued messages to be written, writing them ourselves if
+   * need be. */
+  LOG_ASYNC_BLOCK = 0,
+  /** Discard the message, and count it as dropped. */
+  LOG_ASYNC_DROP = 1,
+} log_async_policy_t;
+/** Callback type used to tell an asynchronous log writer that there is
+ * something to write. Invoked with the log lock held. */
+typedef void (*log_async_wakeup_fn)(void);
+void logs_set_async(size_t bufsize, log_async_policy_t policy,
+                    log_async_wakeup_fn wakeup);
+void logs_set_sync(void);
+int logs_are_async(void);
+size_t logs_async_write_pending(void);
+void logs_async_flush(void);
+uint64_t logs_async_get_n_dropped(void);
+
 void tor_log(int severity, log_domain_mask_t domain, const char *format, ...)
   CHECK_PRINTF(3,4);
 
@@ -46,6 +46,15 @@ logging_metrics_get_stores(void)
       0, NULL);
   metrics_store_entry_update(sentry, tor_bug_get_count());
 
+  sentry = metrics_store_add(
+      the_store,
+      METRICS_TYPE_COUNTER,
+      METRICS_NAME(log_dropped_messages_count),
+      "Total number of log messages dropped because the asynchronous log "
+      "buffer was full",
+      0, NULL);
+  metrics_store_entry_update(sentry, logs_async_get_n_dropped());
+
   if (!stores_list) {
     stores_list = smartlist_new();
     smartlist_add(stores_list, the_store);
@@ -0,0 +1,52 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_hdr_histogram.c
+ * @brief Bucket layout of log-linear histograms that are cheap to
+ *        update.
+ **/
+
+#include "orconfig.h"
+
+#include "lib/intmath/bits.h"
+#include "lib/log/util_bug.h"
+
+#include "lib/metrics/metrics_hdr_histogram.h"
+
+/** Number of buckets in each power of two. */
+#define SUB_BUCKETS (1 << METRICS_HDR_SUB_BITS)
+
+/** Return the index of the bucket of <b>value</b>, or -1 if the value is too
+ * large for any bucket. */
+int
+metrics_hdr_histogram_bucket_idx(uint64_t value)
+{
+  if (value < SUB_BUCKETS) {
+    return (int) value;
+  }
+  if (value >> METRICS_HDR_MAX_BITS) {
+    return -1;
+  }
+
+  const int exp = tor_log2(value);
+  const int shift = exp - METRICS_HDR_SUB_BITS;
+  const int sub = (int) ((value >> shift) & (SUB_BUCKETS - 1));
+  return ((shift + 1) << METRICS_HDR_SUB_BITS) + sub;
+}
+
+/** Return the largest value that goes into the bucket at <b>idx</b>. */
+uint64_t
+metrics_hdr_histogram_bucket_max(int idx)
+{
+  tor_assert(idx >= 0 && idx < METRICS_HDR_N_BUCKETS);
+
+  if (idx < SUB_BUCKETS) {
+    return idx;
+  }
+
+  const int shift = (idx >> METRICS_HDR_SUB_BITS) - 1;
+  const uint64_t sub = idx & (SUB_BUCKETS - 1);
+  const uint64_t lowest = (SUB_BUCKETS + sub) << shift;
+  return lowest + (UINT64_C(1) << shift) - 1;
+}
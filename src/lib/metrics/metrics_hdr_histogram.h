@@ -0,0 +1,31 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_hdr_histogram.h
+ * @brief Header for lib/metrics/metrics_hdr_histogram.c
+ **/
+
+#ifndef TOR_LIB_METRICS_METRICS_HDR_HISTOGRAM_H
+#define TOR_LIB_METRICS_METRICS_HDR_HISTOGRAM_H
+
+#include "lib/cc/torint.h"
+
+/** Number of bits of precision kept below the leading bit of a value: each
+ * power of two is split into 2^METRICS_HDR_SUB_BITS buckets. */
+#define METRICS_HDR_SUB_BITS 2
+/** Values of this many bits or more don't fit in any bucket; they are only
+ * counted in the total. */
+#define METRICS_HDR_MAX_BITS 20
+/** Number of buckets of a log-linear histogram. */
+#define METRICS_HDR_N_BUCKETS \
+  ((METRICS_HDR_MAX_BITS - METRICS_HDR_SUB_BITS + 1) << METRICS_HDR_SUB_BITS)
+
+/* Buckets of the log-linear histograms of metrics_registry.h, in the style
+ * of HdrHistogram: values below 2^METRICS_HDR_SUB_BITS get a bucket each,
+ * and every power of two above that is split into 2^METRICS_HDR_SUB_BITS
+ * equal buckets. Finding the bucket of a value is a few shifts. */
+int metrics_hdr_histogram_bucket_idx(uint64_t value);
+uint64_t metrics_hdr_histogram_bucket_max(int idx);
+
+#endif /* !defined(TOR_LIB_METRICS_METRICS_HDR_HISTOGRAM_H) */
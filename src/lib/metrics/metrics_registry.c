@@ -0,0 +1,399 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_registry.c
+ * @brief Registry of statically allocated metrics that any thread can
+ *        update, with an output that is rendered from cached strings.
+ *
+ * A metrics store is refilled on every MetricsPort request: each metric is
+ * looked up by name, its labels are added and its value is copied from
+ * wherever the subsystem keeps it. A registry instead points at counters,
+ * gauges and histograms that live in static storage, and that hot paths
+ * update directly. Everything in the output except the values themselves is
+ * formatted once, when a metric is added to the registry, so answering a
+ * request is only a matter of reading the values and appending them to the
+ * cached lines.
+ **/
+
+#include "orconfig.h"
+
+#include "lib/container/map.h"
+#include "lib/container/smartlist.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/string/printf.h"
+
+#include "lib/metrics/metrics_registry.h"
+
+#ifndef METRICS_REG_HAVE_ATOMICS
+#include "lib/lock/compat_mutex.h"
+#endif
+
+#include <string.h>
+
+#ifndef METRICS_REG_HAVE_ATOMICS
+/** Lock protecting every metrics_reg_value_t when we have no lock-free
+ * atomics. It is initialized along with the first registry, which is done
+ * before any thread is spawned; until then, no lock is needed. */
+static tor_mutex_t value_mutex;
+/** True iff value_mutex has been initialized. */
+static bool value_mutex_initialized = false;
+
+/** Add <b>n</b> to <b>value</b>. */
+void
+metrics_reg_value_add(metrics_reg_value_t *value, uint64_t n)
+{
+  if (value_mutex_initialized)
+    tor_mutex_acquire(&value_mutex);
+  value->val += n;
+  if (value_mutex_initialized)
+    tor_mutex_release(&value_mutex);
+}
+
+/** Replace <b>value</b> by <b>n</b>. */
+void
+metrics_reg_value_set(metrics_reg_value_t *value, uint64_t n)
+{
+  if (value_mutex_initialized)
+    tor_mutex_acquire(&value_mutex);
+  value->val = n;
+  if (value_mutex_initialized)
+    tor_mutex_release(&value_mutex);
+}
+
+/** Return the current <b>value</b>. */
+uint64_t
+metrics_reg_value_get(metrics_reg_value_t *value)
+{
+  uint64_t v;
+  if (value_mutex_initialized)
+    tor_mutex_acquire(&value_mutex);
+  v = value->val;
+  if (value_mutex_initialized)
+    tor_mutex_release(&value_mutex);
+  return v;
+}
+#endif /* !defined(METRICS_REG_HAVE_ATOMICS) */
+
+/** Record <b>value</b> in <b>hist</b>. */
+void
+metrics_reg_histogram_record(metrics_reg_histogram_t *hist, uint64_t value)
+{
+  const int idx = metrics_hdr_histogram_bucket_idx(value);
+
+  if (idx >= 0) {
+    metrics_reg_value_add(&hist->buckets[idx], 1);
+  }
+  metrics_reg_value_add(&hist->sum, value);
+  metrics_reg_value_add(&hist->count, 1);
+}
+
+/** A metric in a registry, along with the start of each of its output
+ * lines. */
+typedef struct reg_metric_t {
+  /** The metric; which member is set depends on the type of its family. */
+  union {
+    metrics_reg_counter_t *counter;
+    metrics_reg_gauge_t *gauge;
+    metrics_reg_histogram_t *histogram;
+  } u;
+  /** For a counter or a gauge, its whole output line up to the value, e.g.
+   * "tor_foo{label="bar"} ". For a histogram, the same for its _sum line. */
+  char *prefix;
+  /** For a histogram only, the same for its _count line, and for each of
+   * its bucket lines, the last one being the +Inf bucket. */
+  char *count_prefix;
+  char **bucket_prefixes;
+} reg_metric_t;
+
+/** All the metrics of a registry that have the same name. */
+typedef struct reg_family_t {
+  /** Type of all the metrics of the family. */
+  metrics_type_t type;
+  /** The HELP and TYPE comment lines of the family. */
+  char *header;
+  /** The reg_metric_t of the family, in the order they were added. */
+  smartlist_t *metrics;
+} reg_family_t;
+
+/** A registry of metrics in static storage. */
+struct metrics_registry_t {
+  /** Every reg_family_t, in the order they were first added to. */
+  smartlist_t *families;
+  /** The same reg_family_t, indexed by metric name. */
+  strmap_t *families_by_name;
+};
+
+/** Return a newly allocated and empty registry. */
+metrics_registry_t *
+metrics_registry_new(void)
+{
+  metrics_registry_t *reg = tor_malloc_zero(sizeof(*reg));
+
+#ifndef METRICS_REG_HAVE_ATOMICS
+  if (!value_mutex_initialized) {
+    tor_mutex_init(&value_mutex);
+    value_mutex_initialized = true;
+  }
+#endif
+
+  reg->families = smartlist_new();
+  reg->families_by_name = strmap_new();
+
+  return reg;
+}
+
+/** Free <b>metric</b>, but not the metric it points to. */
+static void
+reg_metric_free(reg_metric_t *metric)
+{
+  if (metric->bucket_prefixes) {
+    for (int i = 0; i <= METRICS_HDR_N_BUCKETS; ++i) {
+      tor_free(metric->bucket_prefixes[i]);
+    }
+    tor_free(metric->bucket_prefixes);
+  }
+  tor_free(metric->count_prefix);
+  tor_free(metric->prefix);
+  tor_free(metric);
+}
+
+/** Free the given registry, but not the metrics it points to. */
+void
+metrics_registry_free_(metrics_registry_t *reg)
+{
+  if (reg == NULL) {
+    return;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(reg->families, reg_family_t *, family) {
+    SMARTLIST_FOREACH(family->metrics, reg_metric_t *, metric,
+                      reg_metric_free(metric));
+    smartlist_free(family->metrics);
+    tor_free(family->header);
+    tor_free(family);
+  } SMARTLIST_FOREACH_END(family);
+  smartlist_free(reg->families);
+  strmap_free(reg->families_by_name, NULL);
+  tor_free(reg);
+}
+
+/** Return the family of <b>reg</b> named <b>name</b>, creating it with the
+ * given <b>type</b> and <b>help</b> if there is none. */
+static reg_family_t *
+get_family(metrics_registry_t *reg, metrics_type_t type, const char *name,
+           const char *help)
+{
+  reg_family_t *family = strmap_get(reg->families_by_name, name);
+
+  if (family) {
+    /* A name can't have two types in the output. */
+    tor_assert(family->type == type);
+    return family;
+  }
+
+  family = tor_malloc_zero(sizeof(*family));
+  family->type = type;
+  family->metrics = smartlist_new();
+  tor_asprintf(&family->header, "# HELP %s %s\n# TYPE %s %s\n",
+               name, help, name, metrics_type_to_str(type));
+  smartlist_add(reg->families, family);
+  strmap_set(reg->families_by_name, name, family);
+
+  return family;
+}
+
+/** Return the start of an output line for the metric <b>name</b> followed
+ * by <b>suffix</b>, with <b>label</b> if it isn't NULL, and with
+ * <b>extra</b> as a last label if it isn't NULL. */
+static char *
+format_prefix(const char *name, const char *suffix, const char *label,
+              const char *extra)
+{
+  char *prefix = NULL;
+
+  if (label && extra) {
+    tor_asprintf(&prefix, "%s%s{%s,%s} ", name, suffix, label, extra);
+  } else if (label || extra) {
+    tor_asprintf(&prefix, "%s%s{%s} ", name, suffix, label ? label : extra);
+  } else {
+    tor_asprintf(&prefix, "%s%s ", name, suffix);
+  }
+
+  return prefix;
+}
+
+/** Add a new metric of the given <b>type</b> and <b>name</b> to <b>reg</b>,
+ * with <b>label</b> if it isn't NULL, and return it. */
+static reg_metric_t *
+registry_add(metrics_registry_t *reg, metrics_type_t type, const char *name,
+             const char *help, const char *label)
+{
+  reg_family_t *family;
+  reg_metric_t *metric;
+
+  tor_assert(reg);
+  tor_assert(name);
+
+  family = get_family(reg, type, name, help ? help : "");
+  metric = tor_malloc_zero(sizeof(*metric));
+  smartlist_add(family->metrics, metric);
+
+  if (type != METRICS_TYPE_HISTOGRAM) {
+    metric->prefix = format_prefix(name, "", label, NULL);
+    return metric;
+  }
+
+  metric->prefix = format_prefix(name, "_sum", label, NULL);
+  metric->count_prefix = format_prefix(name, "_count", label, NULL);
+  metric->bucket_prefixes =
+    tor_calloc(METRICS_HDR_N_BUCKETS + 1, sizeof(char *));
+  for (int i = 0; i < METRICS_HDR_N_BUCKETS; ++i) {
+    const uint64_t max = metrics_hdr_histogram_bucket_max(i);
+    char le[64];
+    tor_snprintf(le, sizeof(le), "le=\"%.2f\"", (double) max);
+    metric->bucket_prefixes[i] = format_prefix(name, "_bucket", label, le);
+  }
+  metric->bucket_prefixes[METRICS_HDR_N_BUCKETS] =
+    format_prefix(name, "_bucket", label, "le=\"+Inf\"");
+
+  return metric;
+}
+
+/** Add <b>counter</b> to <b>reg</b> under the given <b>name</b>, with
+ * <b>label</b> if it isn't NULL. The counter must outlive the registry.
+ *
+ * Several metrics can have the same name, as long as they have different
+ * labels; <b>help</b> is only used for the first one. */
+void
+metrics_registry_add_counter(metrics_registry_t *reg,
+                             metrics_reg_counter_t *counter,
+                             const char *name, const char *help,
+                             const char *label)
+{
+  tor_assert(counter);
+  registry_add(reg, METRICS_TYPE_COUNTER, name, help, label)->u.counter =
+    counter;
+}
+
+/** As metrics_registry_add_counter(), for a gauge. */
+void
+metrics_registry_add_gauge(metrics_registry_t *reg,
+                           metrics_reg_gauge_t *gauge,
+                           const char *name, const char *help,
+                           const char *label)
+{
+  tor_assert(gauge);
+  registry_add(reg, METRICS_TYPE_GAUGE, name, help, label)->u.gauge = gauge;
+}
+
+/** As metrics_registry_add_counter(), for a histogram. */
+void
+metrics_registry_add_histogram(metrics_registry_t *reg,
+                               metrics_reg_histogram_t *hist,
+                               const char *name, const char *help,
+                               const char *label)
+{
+  tor_assert(hist);
+  registry_add(reg, METRICS_TYPE_HISTOGRAM, name, help, label)->u.histogram =
+    hist;
+}
+
+/** Append the line that starts with <b>prefix</b> and ends with
+ * <b>value</b> to <b>data</b>. If <b>negative</b>, the value is the
+ * magnitude of a negative number. */
+static void
+add_line(buf_t *data, const char *prefix, uint64_t value, bool negative)
+{
+  char digits[24];
+  char *cp = digits + sizeof(digits);
+
+  *--cp = '\n';
+  do {
+    *--cp = '0' + (char) (value % 10);
+    value /= 10;
+  } while (value);
+  if (negative) {
+    *--cp = '-';
+  }
+
+  buf_add_string(data, prefix);
+  buf_add(data, cp, digits + sizeof(digits) - cp);
+}
+
+/** Append the Prometheus lines of the histogram <b>metric</b> to
+ * <b>data</b>. */
+static void
+format_histogram(const reg_metric_t *metric, buf_t *data)
+{
+  metrics_reg_histogram_t *hist = metric->u.histogram;
+  uint64_t cumulative = 0, count;
+
+  for (int i = 0; i < METRICS_HDR_N_BUCKETS; ++i) {
+    cumulative += metrics_reg_value_get(&hist->buckets[i]);
+    add_line(data, metric->bucket_prefixes[i], cumulative, false);
+  }
+  /* Other threads can record values while we read the buckets, so the
+   * count might be behind them: the +Inf bucket must not be smaller than
+   * the ones before it. */
+  count = metrics_reg_value_get(&hist->count);
+  if (count < cumulative) {
+    count = cumulative;
+  }
+  add_line(data, metric->bucket_prefixes[METRICS_HDR_N_BUCKETS], count,
+           false);
+  add_line(data, metric->prefix, metrics_reg_value_get(&hist->sum), false);
+  add_line(data, metric->count_prefix, count, false);
+}
+
+/** Append the Prometheus output of every metric of <b>family</b> to
+ * <b>data</b>. */
+static void
+format_family(const reg_family_t *family, buf_t *data)
+{
+  buf_add_string(data, family->header);
+
+  SMARTLIST_FOREACH_BEGIN(family->metrics, const reg_metric_t *, metric) {
+    switch (family->type) {
+    case METRICS_TYPE_COUNTER:
+      add_line(data, metric->prefix,
+               metrics_reg_counter_get(metric->u.counter), false);
+      break;
+    case METRICS_TYPE_GAUGE:
+    {
+      const int64_t v = metrics_reg_gauge_get(metric->u.gauge);
+      /* Negate as unsigned so that INT64_MIN works too. */
+      add_line(data, metric->prefix,
+               v < 0 ? UINT64_C(0) - (uint64_t) v : (uint64_t) v, v < 0);
+      break;
+    }
+    case METRICS_TYPE_HISTOGRAM:
+      format_histogram(metric, data);
+      break;
+    default:
+      tor_assert_unreached();
+    }
+  } SMARTLIST_FOREACH_END(metric);
+}
+
+/** Append the output of every metric of <b>reg</b>, in the format
+ * <b>fmt</b>, to <b>data</b>. */
+void
+metrics_registry_get_output(const metrics_format_t fmt,
+                            const metrics_registry_t *reg, buf_t *data)
+{
+  tor_assert(reg);
+  tor_assert(data);
+
+  switch (fmt) {
+  case METRICS_FORMAT_PROMETHEUS:
+    SMARTLIST_FOREACH(reg->families, const reg_family_t *, family,
+                      format_family(family, data));
+    break;
+  default:
+    // LCOV_EXCL_START
+    tor_assert_unreached();
+    // LCOV_EXCL_STOP
+  }
+}
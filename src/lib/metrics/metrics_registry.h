@@ -0,0 +1,166 @@
+/* Copyright (c) 2026, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_registry.h
+ * @brief Header for lib/metrics/metrics_registry.c
+ **/
+
+#ifndef TOR_LIB_METRICS_METRICS_REGISTRY_H
+#define TOR_LIB_METRICS_METRICS_REGISTRY_H
+
+#include "orconfig.h"
+
+#include "lib/buf/buffers.h"
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+
+#include "lib/metrics/metrics_common.h"
+#include "lib/metrics/metrics_hdr_histogram.h"
+
+#if defined(HAVE_STDATOMIC_H) && defined(STDATOMIC_WORKS)
+#include <stdatomic.h>
+/* Only use atomics when they don't need a lock or a helper library. */
+#if ATOMIC_LLONG_LOCK_FREE == 2
+#define METRICS_REG_HAVE_ATOMICS
+#endif
+#endif /* defined(HAVE_STDATOMIC_H) && defined(STDATOMIC_WORKS) */
+
+/** A value of a registry metric.
+ *
+ * Updates and reads are relaxed atomic operations: any thread can update a
+ * value without taking a lock, and a reader sees every update eventually,
+ * but in no particular order with respect to other values. Without lock-free
+ * 64-bit atomics, a single global lock protects all the values instead. */
+typedef struct metrics_reg_value_t {
+#ifdef METRICS_REG_HAVE_ATOMICS
+  atomic_ullong val;
+#else
+  uint64_t val;
+#endif
+} metrics_reg_value_t;
+
+#ifdef METRICS_REG_HAVE_ATOMICS
+#ifndef COCCI
+#define METRICS_REG_LINKAGE static
+#endif
+#else
+#define METRICS_REG_LINKAGE
+#endif
+
+METRICS_REG_LINKAGE void metrics_reg_value_add(metrics_reg_value_t *value,
+                                               uint64_t n);
+METRICS_REG_LINKAGE void metrics_reg_value_set(metrics_reg_value_t *value,
+                                               uint64_t n);
+METRICS_REG_LINKAGE uint64_t metrics_reg_value_get(
+                                               metrics_reg_value_t *value);
+#undef METRICS_REG_LINKAGE
+
+#ifdef METRICS_REG_HAVE_ATOMICS
+/** Add <b>n</b> to <b>value</b>. */
+static inline void
+metrics_reg_value_add(metrics_reg_value_t *value, uint64_t n)
+{
+  (void) atomic_fetch_add_explicit(&value->val, n, memory_order_relaxed);
+}
+/** Replace <b>value</b> by <b>n</b>. */
+static inline void
+metrics_reg_value_set(metrics_reg_value_t *value, uint64_t n)
+{
+  atomic_store_explicit(&value->val, n, memory_order_relaxed);
+}
+/** Return the current <b>value</b>. */
+static inline uint64_t
+metrics_reg_value_get(metrics_reg_value_t *value)
+{
+  return atomic_load_explicit(&value->val, memory_order_relaxed);
+}
+#endif /* defined(METRICS_REG_HAVE_ATOMICS) */
+
+/** A counter that lives in static storage and that hot paths update
+ * directly. The registry it is added to reads it on every MetricsPort
+ * request. */
+typedef struct metrics_reg_counter_t {
+  metrics_reg_value_t value;
+} metrics_reg_counter_t;
+
+/** A gauge, as a metrics_reg_counter_t but it can go down. */
+typedef struct metrics_reg_gauge_t {
+  metrics_reg_value_t value;
+} metrics_reg_gauge_t;
+
+/** A histogram with the log-linear buckets of metrics_hdr_histogram.c. */
+typedef struct metrics_reg_histogram_t {
+  /** Number of values recorded in each bucket (not cumulative). */
+  metrics_reg_value_t buckets[METRICS_HDR_N_BUCKETS];
+  /** Sum of all the recorded values. */
+  metrics_reg_value_t sum;
+  /** Number of recorded values, including those too large for a bucket. */
+  metrics_reg_value_t count;
+} metrics_reg_histogram_t;
+
+/** Add <b>n</b> to <b>counter</b>. */
+static inline void
+metrics_reg_counter_add(metrics_reg_counter_t *counter, uint64_t n)
+{
+  metrics_reg_value_add(&counter->value, n);
+}
+/** Return the current value of <b>counter</b>. */
+static inline uint64_t
+metrics_reg_counter_get(metrics_reg_counter_t *counter)
+{
+  return metrics_reg_value_get(&counter->value);
+}
+/** Add <b>delta</b>, which can be negative, to <b>gauge</b>. */
+static inline void
+metrics_reg_gauge_add(metrics_reg_gauge_t *gauge, int64_t delta)
+{
+  /* Unsigned arithmetic wraps around, which gives the two's complement
+   * result without any undefined behavior. */
+  metrics_reg_value_add(&gauge->value, (uint64_t) delta);
+}
+/** Set <b>gauge</b> to <b>v</b>. */
+static inline void
+metrics_reg_gauge_set(metrics_reg_gauge_t *gauge, int64_t v)
+{
+  metrics_reg_value_set(&gauge->value, (uint64_t) v);
+}
+/** Return the current value of <b>gauge</b>. */
+static inline int64_t
+metrics_reg_gauge_get(metrics_reg_gauge_t *gauge)
+{
+  return (int64_t) metrics_reg_value_get(&gauge->value);
+}
+
+void metrics_reg_histogram_record(metrics_reg_histogram_t *hist,
+                                  uint64_t value);
+
+/* Stub. */
+typedef struct metrics_registry_t metrics_registry_t;
+
+/* Allocators. */
+metrics_registry_t *metrics_registry_new(void);
+void metrics_registry_free_(metrics_registry_t *reg);
+#define metrics_registry_free(reg) \
+  FREE_AND_NULL(metrics_registry_t, metrics_registry_free_, (reg))
+
+/* Modifiers. */
+void metrics_registry_add_counter(metrics_registry_t *reg,
+                                  metrics_reg_counter_t *counter,
+                                  const char *name, const char *help,
+                                  const char *label);
+void metrics_registry_add_gauge(metrics_registry_t *reg,
+                                metrics_reg_gauge_t *gauge,
+                                const char *name, const char *help,
+                                const char *label);
+void metrics_registry_add_histogram(metrics_registry_t *reg,
+                                    metrics_reg_histogram_t *hist,
+                                    const char *name, const char *help,
+                                    const char *label);
+
+/* Accessors. */
+void metrics_registry_get_output(const metrics_format_t fmt,
+                                 const metrics_registry_t *reg,
+                                 buf_t *data);
+
+#endif /* !defined(TOR_LIB_METRICS_METRICS_REGISTRY_H) */
@@ -31,6 +31,16 @@ struct metrics_store_t {
    * One example is an onion service with multiple ports, the port specific
    * metrics will have a port value as a label. */
   strmap_t *entries;
+
+  /** Indexed by metrics entry name. Entries that were in the store before
+   * the last metrics_store_reset(), in reverse order, so that refilling the
+   * store with the same metrics can reuse them instead of allocating and
+   * formatting everything again. */
+  strmap_t *spare;
+
+  /** Registry of statically allocated metrics whose output follows the
+   * one of the entries, or NULL. Unlike the entries, it is not reset. */
+  const metrics_registry_t *registry;
 };
 
 /** Function pointer to the format function of a specific driver. */
@@ -62,7 +72,8 @@ get_output(const metrics_store_t *store, buf_t *data, fmt_driver_fn_t fmt)
   STRMAP_FOREACH(store->entries, key, const smartlist_t *, entries) {
     /* Indicate that we've formatted the comment already for the entries. */
     bool comment_formatted = false;
-    SMARTLIST_FOREACH_BEGIN(entries, const metrics_store_entry_t *, entry) {
+    SMARTLIST_FOREACH_BEGIN(entries, metrics_store_entry_t *, entry) {
+      metrics_store_entry_finish_labels(entry);
       fmt(entry, data, comment_formatted);
       comment_formatted = true;
     } SMARTLIST_FOREACH_END(entry);
@@ -76,6 +87,7 @@ metrics_store_new(void)
   metrics_store_t *store = tor_malloc_zero(sizeof(*store));
 
   store->entries = strmap_new();
+  store->spare = strmap_new();
 
   return store;
 }
@@ -89,6 +101,7 @@ metrics_store_free_(metrics_store_t *store)
   }
 
   strmap_free(store->entries, metrics_store_free_void);
+  strmap_free(store->spare, metrics_store_free_void);
   tor_free(store);
 }
 
@@ -103,6 +116,39 @@ metrics_store_get_all(const metrics_store_t *store, const char *name)
   return strmap_get(store->entries, name);
 }
 
+/** Return an entry of the given type and name that was in the store before
+ * its last reset, ready to be filled again, or NULL if there is none. */
+static metrics_store_entry_t *
+get_spare_entry(metrics_store_t *store, metrics_type_t type,
+                const char *name, const char *help, size_t bucket_count,
+                const int64_t *buckets)
+{
+  smartlist_t *spare = strmap_get(store->spare, name);
+  if (!spare || smartlist_len(spare) == 0) {
+    return NULL;
+  }
+
+  metrics_store_entry_t *entry = smartlist_pop_last(spare);
+  if (!metrics_store_entry_can_recycle(entry, type, bucket_count, buckets)) {
+    metrics_store_entry_free(entry);
+    return NULL;
+  }
+  metrics_store_entry_recycle(entry, help);
+  return entry;
+}
+
+/** Make the output of <b>store</b> include the metrics of <b>reg</b>, which
+ * must outlive the store. The registry metrics must not have the same names
+ * as the store entries. */
+void
+metrics_store_set_registry(metrics_store_t *store,
+                           const metrics_registry_t *reg)
+{
+  tor_assert(store);
+
+  store->registry = reg;
+}
+
 /** Add a new metrics entry to the given store and type. The name MUST be the
  * unique identifier. The help string can be omitted. */
 metrics_store_entry_t *
@@ -122,7 +168,10 @@ metrics_store_add(metrics_store_t *store, metrics_type_t type,
     entries = smartlist_new();
     strmap_set(store->entries, name, entries);
   }
-  entry = metrics_store_entry_new(type, name, help, bucket_count, buckets);
+  entry = get_spare_entry(store, type, name, help, bucket_count, buckets);
+  if (!entry) {
+    entry = metrics_store_entry_new(type, name, help, bucket_count, buckets);
+  }
   smartlist_add(entries, entry);
 
   return entry;
@@ -139,6 +188,9 @@ metrics_store_get_output(const metrics_format_t fmt,
   switch (fmt) {
   case METRICS_FORMAT_PROMETHEUS:
     get_output(store, data, prometheus_format_store_entry);
+    if (store->registry) {
+      metrics_registry_get_output(fmt, store->registry, data);
+    }
     break;
   default:
     // LCOV_EXCL_START
@@ -147,13 +199,22 @@ metrics_store_get_output(const metrics_format_t fmt,
   }
 }
 
-/** Reset a store as in free its content. */
+/** Reset a store as in empty it of its content.
+ *
+ * The entries are kept aside so that when the store is filled again with the
+ * same metrics, which is what happens on every MetricsPort request, they can
+ * be reused along with their labels.  Entries that weren't reused since the
+ * previous reset are freed. */
 void
 metrics_store_reset(metrics_store_t *store)
 {
   if (store == NULL) {
     return;
   }
-  strmap_free(store->entries, metrics_store_free_void);
+  strmap_free(store->spare, metrics_store_free_void);
+  STRMAP_FOREACH(store->entries, key, smartlist_t *, entries) {
+    smartlist_reverse(entries);
+  } STRMAP_FOREACH_END;
+  store->spare = store->entries;
   store->entries = strmap_new();
 }
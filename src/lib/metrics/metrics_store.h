@@ -13,6 +13,7 @@
 #include "lib/container/smartlist.h"
 
 #include "lib/metrics/metrics_common.h"
+#include "lib/metrics/metrics_registry.h"
 #include "lib/metrics/metrics_store_entry.h"
 
 /* Stub. */
@@ -31,6 +32,8 @@ metrics_store_entry_t *metrics_store_add(metrics_store_t *store,
                                          const int64_t *buckets);
 
 void metrics_store_reset(metrics_store_t *store);
+void metrics_store_set_registry(metrics_store_t *store,
+                                const metrics_registry_t *reg);
 
 /* Accessors. */
 smartlist_t *metrics_store_get_all(const metrics_store_t *store,
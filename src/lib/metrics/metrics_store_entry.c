@@ -36,6 +36,7 @@ metrics_store_entry_new(const metrics_type_t type, const char *name,
   entry->type = type;
   entry->name = tor_strdup(name);
   entry->labels = smartlist_new();
+  entry->prev_labels = smartlist_new();
   if (help) {
     entry->help = tor_strdup(help);
   }
@@ -64,6 +65,9 @@ metrics_store_entry_free_(metrics_store_entry_t *entry)
   }
   SMARTLIST_FOREACH(entry->labels, char *, l, tor_free(l));
   smartlist_free(entry->labels);
+  SMARTLIST_FOREACH(entry->prev_labels, char *, l, tor_free(l));
+  smartlist_free(entry->prev_labels);
+  tor_free(entry->labels_str);
   tor_free(entry->name);
   tor_free(entry->help);
 
@@ -160,6 +164,93 @@ metrics_store_entry_reset(metrics_store_entry_t *entry)
   }
 }
 
+/** Return true iff <b>entry</b> can be recycled by its store into a new
+ * entry of the given type and, for histograms, buckets. */
+bool
+metrics_store_entry_can_recycle(const metrics_store_entry_t *entry,
+                                const metrics_type_t type,
+                                size_t bucket_count, const int64_t *buckets)
+{
+  tor_assert(entry);
+
+  if (entry->type != type) {
+    return false;
+  }
+  if (type != METRICS_TYPE_HISTOGRAM) {
+    return true;
+  }
+  if (entry->u.histogram.bucket_count != bucket_count) {
+    return false;
+  }
+  for (size_t i = 0; i < bucket_count; ++i) {
+    if (entry->u.histogram.buckets[i].bucket != buckets[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Prepare <b>entry</b>, which its store is reusing, to be filled again as
+ * if it were new: reset its value, and set its help string to <b>help</b>.
+ *
+ * Its current labels are kept aside: the ones that get added again, in the
+ * same order, are reused without being copied or reformatted. */
+void
+metrics_store_entry_recycle(metrics_store_entry_t *entry, const char *help)
+{
+  tor_assert(entry);
+
+  metrics_store_entry_reset(entry);
+
+  if (help == NULL || entry->help == NULL || strcmp(help, entry->help)) {
+    tor_free(entry->help);
+    if (help) {
+      entry->help = tor_strdup(help);
+    }
+  }
+
+  SMARTLIST_FOREACH(entry->prev_labels, char *, l, tor_free(l));
+  smartlist_clear(entry->prev_labels);
+  smartlist_t *tmp = entry->prev_labels;
+  entry->prev_labels = entry->labels;
+  entry->labels = tmp;
+}
+
+/** Drop any labels that <b>entry</b> had before it was recycled and that
+ * weren't added again, and make sure its cached label string is up to
+ * date. */
+void
+metrics_store_entry_finish_labels(metrics_store_entry_t *entry)
+{
+  tor_assert(entry);
+
+  SMARTLIST_FOREACH_BEGIN(entry->prev_labels, char *, l) {
+    if (l) {
+      /* This label is gone, so the cached string is stale. */
+      tor_free(entry->labels_str);
+      tor_free(l);
+    }
+  } SMARTLIST_FOREACH_END(l);
+  smartlist_clear(entry->prev_labels);
+
+  if (!entry->labels_str) {
+    entry->labels_str = smartlist_join_strings(entry->labels, ",", 0, NULL);
+  }
+}
+
+/** Return the comma-separated labels of <b>entry</b> if we have them cached
+ * and up to date, or NULL otherwise. */
+const char *
+metrics_store_entry_get_labels_str(const metrics_store_entry_t *entry)
+{
+  tor_assert(entry);
+
+  if (smartlist_len(entry->prev_labels) > 0) {
+    return NULL;
+  }
+  return entry->labels_str;
+}
+
 /** Return store entry value. */
 int64_t
 metrics_store_entry_get_value(const metrics_store_entry_t *entry)
@@ -226,6 +317,19 @@ metrics_store_entry_add_label(metrics_store_entry_t *entry,
   tor_assert(entry);
   tor_assert(label);
 
+  /* If this entry was recycled and had this very label at this position,
+   * take it back. */
+  const int idx = smartlist_len(entry->labels);
+  if (idx < smartlist_len(entry->prev_labels)) {
+    char *prev = smartlist_get(entry->prev_labels, idx);
+    if (prev && !strcmp(prev, label)) {
+      smartlist_set(entry->prev_labels, idx, NULL);
+      smartlist_add(entry->labels, prev);
+      return;
+    }
+  }
+
+  tor_free(entry->labels_str);
   smartlist_add(entry->labels, tor_strdup(label));
 }
 
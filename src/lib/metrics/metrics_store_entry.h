@@ -34,6 +34,15 @@ struct metrics_store_entry_t {
    * could be an onion address so the metrics can be differentiate. */
   smartlist_t *labels;
 
+  /** Labels this entry had before it was last recycled by its store. Each
+   * one is moved back into <b>labels</b> if it is added again, so that
+   * refilling a store with the same metrics doesn't copy any label. */
+  smartlist_t *prev_labels;
+
+  /** Cached comma-separated form of <b>labels</b>, or NULL if it has to be
+   * rebuilt. */
+  char *labels_str;
+
   /* Actual data. */
   union {
     metrics_counter_t counter;
@@ -66,6 +75,12 @@ bool metrics_store_entry_has_label(const metrics_store_entry_t *entry,
 metrics_store_entry_t *metrics_store_find_entry_with_label(
         const smartlist_t *entries, const char *label);
 bool metrics_store_entry_is_histogram(const metrics_store_entry_t *entry);
+bool metrics_store_entry_can_recycle(const metrics_store_entry_t *entry,
+                                     const metrics_type_t type,
+                                     size_t bucket_count,
+                                     const int64_t *buckets);
+const char *metrics_store_entry_get_labels_str(
+        const metrics_store_entry_t *entry);
 uint64_t metrics_store_hist_entry_get_count(
         const metrics_store_entry_t *entry);
 int64_t metrics_store_hist_entry_get_sum(const metrics_store_entry_t *entry);
@@ -74,6 +89,9 @@ int64_t metrics_store_hist_entry_get_sum(const metrics_store_entry_t *entry);
 void metrics_store_entry_add_label(metrics_store_entry_t *entry,
                                    const char *label);
 void metrics_store_entry_reset(metrics_store_entry_t *entry);
+void metrics_store_entry_recycle(metrics_store_entry_t *entry,
+                                 const char *help);
+void metrics_store_entry_finish_labels(metrics_store_entry_t *entry);
 void metrics_store_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value);
 void metrics_store_hist_entry_update(metrics_store_entry_t *entry,
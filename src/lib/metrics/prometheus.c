@@ -17,24 +17,57 @@
 
 #include "lib/metrics/prometheus.h"
 
+#include <stdarg.h>
 #include <string.h>
 
-/** Return a static buffer containing all the labels properly formatted
- * for the output as a string.
+static void add_line(buf_t *data, const char *format, ...)
+  CHECK_PRINTF(2, 3);
+
+/** As buf_add_printf(), but format short lines on the stack: the output is
+ * made of many small lines, so this avoids one heap allocation for each. */
+static void
+add_line(buf_t *data, const char *format, ...)
+{
+  char line[256];
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = tor_vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    buf_add(data, line, len);
+    return;
+  }
+
+  va_start(ap, format);
+  buf_add_vprintf(data, format, ap);
+  va_end(ap);
+}
+
+/** Return a string containing all the labels of <b>entry</b> properly
+ * formatted for the output.
  *
- * Subsequent calls to this invalidates the previous result. */
+ * This is the string the entry has cached, if it is up to date; otherwise,
+ * it is a static buffer that subsequent calls invalidate. */
 static const char *
-format_labels(smartlist_t *labels)
+format_labels(const metrics_store_entry_t *entry)
 {
   static char buf[1024];
   char *line = NULL;
+  const char *cached = metrics_store_entry_get_labels_str(entry);
+
+  if (cached) {
+    return cached;
+  }
 
-  if (smartlist_len(labels) == 0) {
+  if (smartlist_len(entry->labels) == 0) {
     buf[0] = '\0';
     goto end;
   }
 
-  line = smartlist_join_strings(labels, ",", 0, NULL);
+  line = smartlist_join_strings(entry->labels, ",", 0, NULL);
   tor_snprintf(buf, sizeof(buf), "%s", line);
 
  end:
@@ -52,34 +85,34 @@ format_histogram(const metrics_store_entry_t *entry, buf_t *data)
 {
   tor_assert(entry->type == METRICS_TYPE_HISTOGRAM);
 
-  const char *labels = format_labels(entry->labels);
+  const char *labels = format_labels(entry);
 
   for (size_t i = 0; i < entry->u.histogram.bucket_count; ++i) {
     metrics_histogram_bucket_t hb = entry->u.histogram.buckets[i];
-    if (strlen(labels) > 0) {
-      buf_add_printf(data, "%s_bucket{%s,le=\"%.2f\"} %" PRIi64 "\n",
-                     entry->name, labels, (double)hb.bucket, hb.value);
+    if (labels[0] != '\0') {
+      add_line(data, "%s_bucket{%s,le=\"%.2f\"} %" PRIi64 "\n",
+               entry->name, labels, (double)hb.bucket, hb.value);
     } else {
-      buf_add_printf(data, "%s_bucket{le=\"%.2f\"} %" PRIi64 "\n",
-                     entry->name, (double)hb.bucket, hb.value);
+      add_line(data, "%s_bucket{le=\"%.2f\"} %" PRIi64 "\n",
+               entry->name, (double)hb.bucket, hb.value);
     }
   }
 
-  if (strlen(labels) > 0) {
-    buf_add_printf(data, "%s_bucket{%s,le=\"+Inf\"} %" PRIi64 "\n",
-                   entry->name, labels,
-                   metrics_store_hist_entry_get_count(entry));
-    buf_add_printf(data, "%s_sum{%s} %" PRIi64 "\n", entry->name, labels,
-                   metrics_store_hist_entry_get_sum(entry));
-    buf_add_printf(data, "%s_count{%s} %" PRIi64 "\n", entry->name, labels,
-                   metrics_store_hist_entry_get_count(entry));
+  if (labels[0] != '\0') {
+    add_line(data, "%s_bucket{%s,le=\"+Inf\"} %" PRIi64 "\n",
+             entry->name, labels,
+             metrics_store_hist_entry_get_count(entry));
+    add_line(data, "%s_sum{%s} %" PRIi64 "\n", entry->name, labels,
+             metrics_store_hist_entry_get_sum(entry));
+    add_line(data, "%s_count{%s} %" PRIi64 "\n", entry->name, labels,
+             metrics_store_hist_entry_get_count(entry));
   } else {
-    buf_add_printf(data, "%s_bucket{le=\"+Inf\"} %" PRIi64 "\n", entry->name,
-                   metrics_store_hist_entry_get_count(entry));
-    buf_add_printf(data, "%s_sum %" PRIi64 "\n", entry->name,
-                   metrics_store_hist_entry_get_sum(entry));
-    buf_add_printf(data, "%s_count %" PRIi64 "\n", entry->name,
-                   metrics_store_hist_entry_get_count(entry));
+    add_line(data, "%s_bucket{le=\"+Inf\"} %" PRIi64 "\n", entry->name,
+             metrics_store_hist_entry_get_count(entry));
+    add_line(data, "%s_sum %" PRIi64 "\n", entry->name,
+             metrics_store_hist_entry_get_sum(entry));
+    add_line(data, "%s_count %" PRIi64 "\n", entry->name,
+             metrics_store_hist_entry_get_count(entry));
   }
 }
 
@@ -92,23 +125,23 @@ prometheus_format_store_entry(const metrics_store_entry_t *entry, buf_t *data,
   tor_assert(data);
 
   if (!no_comment) {
-    buf_add_printf(data, "# HELP %s %s\n", entry->name, entry->help);
-    buf_add_printf(data, "# TYPE %s %s\n", entry->name,
-                   metrics_type_to_str(entry->type));
+    add_line(data, "# HELP %s %s\n", entry->name, entry->help);
+    add_line(data, "# TYPE %s %s\n", entry->name,
+             metrics_type_to_str(entry->type));
   }
 
   switch (entry->type) {
   case METRICS_TYPE_COUNTER: FALLTHROUGH;
   case METRICS_TYPE_GAUGE:
   {
-    const char *labels = format_labels(entry->labels);
-    if (strlen(labels) > 0) {
-      buf_add_printf(data, "%s{%s} %" PRIi64 "\n", entry->name,
-                     labels,
-                     metrics_store_entry_get_value(entry));
+    const char *labels = format_labels(entry);
+    if (labels[0] != '\0') {
+      add_line(data, "%s{%s} %" PRIi64 "\n", entry->name,
+               labels,
+               metrics_store_entry_get_value(entry));
     } else {
-      buf_add_printf(data, "%s %" PRIi64 "\n", entry->name,
-                     metrics_store_entry_get_value(entry));
+      add_line(data, "%s %" PRIi64 "\n", entry->name,
+               metrics_store_entry_get_value(entry));
     }
     break;
   }
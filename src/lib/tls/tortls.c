@@ -135,6 +135,7 @@ tor_tls_free_all(void)
     client_tls_context = NULL;
     tor_tls_context_decref(ctx);
   }
+  tor_tls_free_resumable_sessions();
 }
 
 /** Given a TOR_TLS_* error code, return a string equivalent. */
@@ -75,6 +75,9 @@ void tor_tls_get_state_description(tor_tls_t *tls, char *buf, size_t sz);
 void tor_tls_free_all(void);
 
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
+/** Flag for tor_tls_context_init(): issue TLS 1.3 session tickets, and let
+ * callers keep the ones that they get for resumption later. */
+#define TOR_TLS_CTX_SESSION_RESUMPTION (1u<<1)
 
 void tor_tls_init(void);
 void tls_log_errors(tor_tls_t *tls, int severity, int domain,
@@ -112,6 +115,9 @@ int tor_tls_get_buffer_sizes(tor_tls_t *tls,
 MOCK_DECL(double, tls_get_write_overhead_ratio, (void));
 
 int tor_tls_get_num_server_handshakes(tor_tls_t *tls);
+int tor_tls_resume_session(tor_tls_t *tls, const char *peer_id);
+void tor_tls_keep_sessions_for(tor_tls_t *tls, const char *peer_id);
+int tor_tls_session_was_resumed(tor_tls_t *tls);
 MOCK_DECL(int,tor_tls_cert_matches_key,(const tor_tls_t *tls,
                                         const struct tor_x509_cert_t *cert));
 MOCK_DECL(int,tor_tls_export_key_material,(
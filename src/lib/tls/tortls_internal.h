@@ -31,6 +31,7 @@ int tor_tls_context_init_certificates(tor_tls_context_t *result,
                                       unsigned key_lifetime,
                                       unsigned flags);
 void tor_tls_impl_free_(tor_tls_impl_t *ssl);
+void tor_tls_free_resumable_sessions(void);
 #define tor_tls_impl_free(tls) \
   FREE_AND_NULL(tor_tls_impl_t, tor_tls_impl_free_, (tls))
 
@@ -58,6 +59,7 @@ extern tor_tls_context_t *client_tls_context;
 extern uint16_t v2_cipher_list[];
 extern uint64_t total_bytes_written_over_tls;
 extern uint64_t total_bytes_written_by_tls;
+int tor_tls_get_n_resumable_sessions(void);
 #endif /* defined(TOR_UNIT_TESTS) */
 
 #endif /* !defined(TORTLS_INTERNAL_H) */
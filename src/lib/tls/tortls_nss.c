@@ -642,6 +642,36 @@ tor_tls_get_buffer_sizes(tor_tls_t *tls,
   return -1;
 }
 
+/* We don't implement session resumption with NSS yet: these functions are
+ * here so that callers needn't care. */
+
+int
+tor_tls_resume_session(tor_tls_t *tls, const char *peer_id)
+{
+  tor_assert(tls);
+  tor_assert(peer_id);
+  return 0;
+}
+
+void
+tor_tls_keep_sessions_for(tor_tls_t *tls, const char *peer_id)
+{
+  tor_assert(tls);
+  tor_assert(peer_id);
+}
+
+int
+tor_tls_session_was_resumed(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  return 0;
+}
+
+void
+tor_tls_free_resumable_sessions(void)
+{
+}
+
 MOCK_IMPL(double,
 tls_get_write_overhead_ratio, (void))
 {
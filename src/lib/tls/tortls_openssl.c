@@ -61,6 +61,7 @@ ENABLE_GCC_WARNING("-Wredundant-decls")
 #include "lib/tls/tortls_internal.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
+#include "lib/container/map.h"
 #include "lib/container/smartlist.h"
 #include "lib/string/compat_string.h"
 #include "lib/string/printf.h"
@@ -463,6 +464,175 @@ tor_tls_cert_matches_key,(const tor_tls_t *tls, const tor_x509_cert_t *cert))
   return result;
 }
 
+/** Most sessions that we keep for resumption at once: enough for one with
+ * every relay in the network. */
+#define MAX_RESUMABLE_SESSIONS 16384
+
+/** Map from the identity digest of a server to a session that it gave us,
+ * which we can use once to resume a TLS connection to it. */
+static digestmap_t *resumable_sessions = NULL;
+/** Number of entries in resumable_sessions. */
+static int n_resumable_sessions = 0;
+
+/** Return true iff <b>sess</b> has not expired as of <b>now</b>. */
+static int
+session_is_live(const SSL_SESSION *sess, time_t now)
+{
+  return SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) > now;
+}
+
+/** Remove every expired session from resumable_sessions. */
+static void
+resumable_sessions_prune(time_t now)
+{
+  DIGESTMAP_FOREACH_MODIFY(resumable_sessions, id, SSL_SESSION *, sess) {
+    if (!session_is_live(sess, now)) {
+      SSL_SESSION_free(sess);
+      MAP_DEL_CURRENT(id);
+      --n_resumable_sessions;
+    }
+  } DIGESTMAP_FOREACH_END;
+}
+
+/** Keep <b>sess</b>, which we got from the server with identity digest
+ * <b>peer_id</b>, so that we can resume our next connection to it.  Takes
+ * ownership of <b>sess</b>. */
+static void
+resumable_session_store(const char *peer_id, SSL_SESSION *sess)
+{
+  SSL_SESSION *old;
+
+  if (!resumable_sessions)
+    resumable_sessions = digestmap_new();
+
+  if (!digestmap_get(resumable_sessions, peer_id) &&
+      n_resumable_sessions >= MAX_RESUMABLE_SESSIONS) {
+    resumable_sessions_prune(time(NULL));
+    if (n_resumable_sessions >= MAX_RESUMABLE_SESSIONS) {
+      SSL_SESSION_free(sess);
+      return;
+    }
+  }
+
+  old = digestmap_set(resumable_sessions, peer_id, sess);
+  if (old)
+    SSL_SESSION_free(old);
+  else
+    ++n_resumable_sessions;
+}
+
+/** OpenSSL callback: invoked when a server gives us a new session.  Keep a
+ * copy of it if it can be resumed, and the connection is one we want to
+ * resume.  Always return 0, since we don't keep <b>sess</b> itself. */
+static int
+tor_tls_new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+  tor_tls_t *tls = tor_tls_get_by_ssl(ssl);
+  SSL_SESSION *copy;
+
+  if (!tls || tls->isServer)
+    return 0;
+  /* Only TLS 1.3 resumption still does a fresh key exchange. */
+  if (!SSL_SESSION_is_resumable(sess) ||
+      SSL_SESSION_get_protocol_version(sess) != TLS1_3_VERSION)
+    return 0;
+
+  /* OpenSSL marks <b>sess</b> as unusable if the connection closes without
+   * a TLS shutdown, which is how most of ours close: so we keep a copy. */
+  copy = SSL_SESSION_dup(sess);
+  if (!copy) {
+    tls_log_errors(tls, LOG_INFO, LD_HANDSHAKE, "copying a session");
+    return 0;
+  }
+  if (tls->keep_sessions) {
+    resumable_session_store(tls->session_peer_id, copy);
+  } else {
+    if (tls->pending_session)
+      SSL_SESSION_free(tls->pending_session);
+    tls->pending_session = copy;
+  }
+  return 0;
+}
+
+/** Try to resume a session that we kept for the server with identity digest
+ * <b>peer_id</b> on the client-side connection <b>tls</b>, which has not
+ * started its handshake yet.  Each session is only used once.  Return 1 if
+ * we will offer a session, and 0 otherwise. */
+int
+tor_tls_resume_session(tor_tls_t *tls, const char *peer_id)
+{
+  SSL_SESSION *sess;
+  int r;
+
+  tor_assert(tls);
+  tor_assert(peer_id);
+
+  if (tls->isServer || !resumable_sessions)
+    return 0;
+  sess = digestmap_remove(resumable_sessions, peer_id);
+  if (!sess)
+    return 0;
+  --n_resumable_sessions;
+
+  r = session_is_live(sess, time(NULL)) && SSL_set_session(tls->ssl, sess);
+  SSL_SESSION_free(sess);
+  tls_log_errors(tls, LOG_INFO, LD_HANDSHAKE, "setting session to resume");
+  return r ? 1 : 0;
+}
+
+/** Note that the server on the client-side connection <b>tls</b> has proven
+ * that its identity digest is <b>peer_id</b>: keep any session it has given
+ * us, or will give us, for resuming our next connection to it. */
+void
+tor_tls_keep_sessions_for(tor_tls_t *tls, const char *peer_id)
+{
+  tor_assert(tls);
+  tor_assert(peer_id);
+
+  if (tls->isServer)
+    return;
+  memcpy(tls->session_peer_id, peer_id, DIGEST_LEN);
+  tls->keep_sessions = 1;
+  if (tls->pending_session) {
+    resumable_session_store(peer_id, tls->pending_session);
+    tls->pending_session = NULL;
+  }
+}
+
+/** Return true iff the handshake on <b>tls</b> resumed an earlier
+ * session. */
+int
+tor_tls_session_was_resumed(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  return SSL_session_reused(tls->ssl);
+}
+
+/** Helper: free a kept SSL_SESSION. */
+static void
+ssl_session_free_void(void *sess)
+{
+  SSL_SESSION_free(sess);
+}
+
+/** Release every session that we kept for resumption. */
+void
+tor_tls_free_resumable_sessions(void)
+{
+  digestmap_free(resumable_sessions, ssl_session_free_void);
+  resumable_sessions = NULL;
+  n_resumable_sessions = 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of sessions that we have kept for resumption. */
+int
+tor_tls_get_n_resumable_sessions(void)
+{
+  return n_resumable_sessions;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 void
 tor_tls_context_impl_free_(struct ssl_ctx_st *ctx)
 {
@@ -527,18 +697,22 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
   * historically been chosen for fingerprinting resistance. */
   SSL_CTX_set_options(result->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
-  /* Disable TLS tickets if they're supported.  We never want to use them;
-   * using them can make our perfect forward secrecy a little worse, *and*
-   * create an opportunity to fingerprint us (since it's unusual to use them
-   * with TLS sessions turned off).
+  /* Disable TLS tickets if they're supported, unless we've been asked to
+   * allow session resumption.  Otherwise we never want to use them; using
+   * them can make our perfect forward secrecy a little worse, *and* create
+   * an opportunity to fingerprint us (since it's unusual to use them with
+   * TLS sessions turned off).
    *
    * In 0.2.4, clients advertise support for them though, to avoid a TLS
    * distinguishability vector.  This can give us worse PFS, though, if we
    * get a server that doesn't set SSL_OP_NO_TICKET.  With luck, there will
    * be few such servers by the time 0.2.4 is more stable.
+   *
+   * When we do allow resumption, we only ever resume TLS 1.3 sessions, whose
+   * resumption handshakes still do a fresh key exchange.
    */
 #ifdef SSL_OP_NO_TICKET
-  if (! is_client) {
+  if (! is_client && !(flags & TOR_TLS_CTX_SESSION_RESUMPTION)) {
     SSL_CTX_set_options(result->ctx, SSL_OP_NO_TICKET);
   }
 #endif
@@ -578,7 +752,17 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
     // We no longer do that, since we no longer send multiple certs;
     // that was part of the obsolete v1 handshake.
   }
-  SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  if (flags & TOR_TLS_CTX_SESSION_RESUMPTION) {
+    /* Servers issue one stateless ticket per handshake; clients hand the
+     * tickets they get to tor_tls_new_session_cb(), and we keep them
+     * ourselves. */
+    SSL_CTX_set_num_tickets(result->ctx, 1);
+    SSL_CTX_set_session_cache_mode(result->ctx,
+                   SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(result->ctx, tor_tls_new_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  }
   if (!is_client) {
     tor_assert(result->link_key);
     if (!(pkey = crypto_pk_get_openssl_evp_pkey_(result->link_key,1)))
@@ -827,6 +1011,14 @@ tor_tls_impl_free_(tor_tls_impl_t *ssl)
   if (!ssl)
     return;
 
+  {
+    tor_tls_t *tls = tor_tls_get_by_ssl(ssl);
+    if (tls && tls->pending_session) {
+      SSL_SESSION_free(tls->pending_session);
+      tls->pending_session = NULL;
+    }
+  }
+
 #ifdef SSL_set_tlsext_host_name
   SSL_set_tlsext_host_name(ssl, NULL);
 #endif
@@ -14,6 +14,7 @@
  * lib/tls module.
  **/
 
+#include "lib/crypt_ops/crypto_digest.h"
 #include "lib/net/socket.h"
 
 #define TOR_TLS_MAGIC 0x71571571
@@ -67,6 +68,14 @@ struct tor_tls_t {
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
   /** Argument to pass to negotiated_callback. */
   void *callback_arg;
+  /** A session that the server gave us before we knew who it was, which we
+   * will keep for resumption if it turns out to be who we want. */
+  struct ssl_session_st *pending_session;
+  /** True iff we know that the peer is <b>session_peer_id</b>, and should
+   * keep any sessions that it gives us under that identity. */
+  unsigned int keep_sessions:1;
+  /** Identity digest under which to keep sessions from this peer. */
+  char session_peer_id[DIGEST_LEN];
 #endif /* defined(ENABLE_OPENSSL) */
 #ifdef ENABLE_NSS
   /** Last values retried from tor_get_prfiledesc_byte_counts(). */
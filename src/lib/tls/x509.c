@@ -71,6 +71,20 @@ tor_x509_cert_get_cert_digests(const tor_x509_cert_t *cert)
   return &cert->cert_digests;
 }
 
+/** Check whether <b>cert</b> is currently live, allowing for the same clock
+ * skew as tor_tls_cert_is_valid().  Unlike that function, don't check the
+ * signature.  Return 0 if it is live; otherwise log at <b>severity</b> and
+ * return -1. */
+int
+tor_x509_check_cert_lifetime(int severity, const tor_x509_cert_t *cert,
+                             time_t now)
+{
+  tor_assert(cert);
+  return tor_x509_check_cert_lifetime_internal(severity, cert->cert, now,
+                                               TOR_X509_PAST_SLOP,
+                                               TOR_X509_FUTURE_SLOP);
+}
+
 /** Free all storage held in <b>cert</b> */
 void
 tor_x509_cert_free_(tor_x509_cert_t *cert)
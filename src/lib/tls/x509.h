@@ -71,5 +71,8 @@ int tor_tls_cert_is_valid(int severity,
                           const tor_x509_cert_t *signing_cert,
                           time_t now,
                           int check_rsa_1024);
+int tor_x509_check_cert_lifetime(int severity,
+                                 const tor_x509_cert_t *cert,
+                                 time_t now);
 
 #endif /* !defined(TOR_X509_H) */
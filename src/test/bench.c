@@ -8,6 +8,8 @@
  * \brief Benchmarks for lower level Tor modules.
  **/
 
+#define CHANNEL_OBJECT_PRIVATE
+
 #include "orconfig.h"
 
 #include "core/or/or.h"
@@ -23,25 +25,62 @@
 #include <openssl/obj_mac.h>
 #endif /* defined(ENABLE_OPENSSL) */
 
+#include "core/or/channel.h"
+#include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuituse.h"
+#include "core/or/compiled_policy.h"
+#include "core/or/conflux_pool.h"
+#include "core/or/connection_edge.h"
+#include "core/or/connection_or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/policies.h"
+#include "core/or/reasons.h"
+#include "core/proto/proto_http.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
+#include "lib/metrics/metrics_registry.h"
+#include "lib/metrics/metrics_store.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cpath_build_state_st.h"
+#include "core/or/entry_connection_st.h"
+#include "core/or/extend_info_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/or_connection_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/socks_request_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
+#include "feature/dirauth/bwauth.h"
+#include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/policy_parse.h"
+#include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/dirauth/vote_microdesc_hash_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/networkstatus_voter_info_st.h"
+#include "feature/nodelist/vote_routerstatus_st.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -425,6 +464,56 @@ bench_dmap(void)
   printf("False positive rate on digestset: %.2f%%\n",
          (fp/(double)fpostests)*100);
 
+  /* Now compare against the open-addressed map. */
+  digestflatmap_t *fm = digestflatmap_new();
+  n = 0;
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp,
+                      digestflatmap_set(fm, cp, (void*)1));
+  }
+  pt2 = perftime();
+  printf("digestflatmap_set: %.2f ns per element\n",
+         NANOCOUNT(start, pt2, iters*elts));
+
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp,
+                      n += !!digestflatmap_get(fm, cp));
+    SMARTLIST_FOREACH(sl2, const char *, cp,
+                      n += !!digestflatmap_get(fm, cp));
+  }
+  pt3 = perftime();
+  printf("digestflatmap_get: %.2f ns per element\n",
+         NANOCOUNT(pt2, pt3, iters*elts*2));
+  printf("Hits == %d\n", n);
+
+  /* Inserting into fresh maps measures growth, not just replacement. */
+  const int fresh_iters = iters / 16;
+  for (i = 0; i < fresh_iters; ++i) {
+    digestmap_t *tmp = digestmap_new();
+    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_set(tmp, cp, (void*)1));
+    digestmap_free(tmp, NULL);
+  }
+  pt4 = perftime();
+  printf("digestmap insert into new map: %.2f ns per element\n",
+         NANOCOUNT(pt3, pt4, fresh_iters*elts));
+  for (i = 0; i < fresh_iters; ++i) {
+    digestflatmap_t *tmp = digestflatmap_new();
+    SMARTLIST_FOREACH(sl, const char *, cp,
+                      digestflatmap_set(tmp, cp, (void*)1));
+    digestflatmap_free(tmp, NULL);
+  }
+  end = perftime();
+  printf("digestflatmap insert into new map: %.2f ns per element\n",
+         NANOCOUNT(pt4, end, fresh_iters*elts));
+
+  printf("digestmap memory: %.1f bytes per entry (plus malloc overhead "
+         "for each entry)\n",
+         digestmap_get_memory_usage(dm) / (double)elts);
+  printf("digestflatmap memory: %.1f bytes per entry\n",
+         digestflatmap_get_memory_usage(fm) / (double)elts);
+
+  digestflatmap_free(fm, NULL);
   digestmap_free(dm, NULL);
   digestset_free(ds);
   SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
@@ -669,6 +758,1016 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** If set, a file of server descriptors whose exit policies we should use
+ * for bench_exit_policy(). */
+static const char *exit_policy_descriptors_file = NULL;
+
+/** Add the exit policies from every descriptor in
+ * <b>exit_policy_descriptors_file</b> to <b>policies</b>.  Return the
+ * number of descriptors we found, or -1 on error. */
+static int
+bench_exit_policy_load_descriptors(smartlist_t *policies,
+                                   smartlist_t *routers)
+{
+  char *body = read_file_to_str(exit_policy_descriptors_file, RFTS_BIN, NULL);
+  if (!body) {
+    printf("Couldn't read %s\n", exit_policy_descriptors_file);
+    return -1;
+  }
+  const char *cp = body;
+  router_parse_list_from_string(&cp, NULL, routers, SAVED_NOWHERE, 0, 1,
+                                NULL, NULL);
+  tor_free(body);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri,
+                    if (ri->exit_policy)
+                      smartlist_add(policies, ri->exit_policy));
+  return smartlist_len(routers);
+}
+
+/** Add a few thousand exit policies shaped like the ones relays publish to
+ * <b>policies</b>: the default policy, the reduced policy, and accept-lists
+ * of a few ports, each preceded by the usual private-address rejects and a
+ * reject for the relay's own address. */
+static void
+bench_exit_policy_synthesize(smartlist_t *policies)
+{
+  const char *tails[] = {
+    "reject *:25,reject *:119,reject *:135-139,reject *:445,"
+    "reject *:563,reject *:1214,reject *:4661-4666,"
+    "reject *:6346-6429,reject *:6699,reject *:6881-6999,accept *:*",
+    "accept *:20-23,accept *:43,accept *:53,accept *:79-81,accept *:88,"
+    "accept *:110,accept *:143,accept *:194,accept *:220,accept *:389,"
+    "accept *:443,accept *:464,accept *:465,accept *:531,accept *:543-544,"
+    "accept *:554,accept *:563,accept *:587,accept *:636,accept *:706,"
+    "accept *:749,accept *:873,accept *:902-904,accept *:981,"
+    "accept *:989-995,accept *:1194,accept *:1220,accept *:1293,"
+    "accept *:1500,accept *:1533,accept *:1677,accept *:1723,accept *:1755,"
+    "accept *:1863,accept *:2082-2083,accept *:2086-2087,"
+    "accept *:2095-2096,accept *:2102-2104,accept *:3128,accept *:3389,"
+    "accept *:3690,accept *:4321,accept *:4643,accept *:5050,accept *:5190,"
+    "accept *:5222-5223,accept *:5228,accept *:5900,accept *:6660-6669,"
+    "accept *:6679,accept *:6697,accept *:8000,accept *:8008,accept *:8074,"
+    "accept *:8080,accept *:8082,accept *:8087-8088,accept *:8232-8233,"
+    "accept *:8332-8333,accept *:8443,accept *:8888,accept *:9418,"
+    "accept *:9999,accept *:10000,accept *:11371,accept *:19294,"
+    "accept *:19638,accept *:50002,accept *:64738,reject *:*",
+    "accept *:80,accept *:443,reject *:*",
+    "reject *:*",
+  };
+  const char *private =
+    "reject 0.0.0.0/8:*,reject 169.254.0.0/16:*,reject 127.0.0.0/8:*,"
+    "reject 192.168.0.0/16:*,reject 10.0.0.0/8:*,reject 172.16.0.0/12:*,"
+    "reject6 [::]/127:*,reject6 [fc00::]/7:*,reject6 [fe80::]/10:*,"
+    "reject6 [::ffff:0:0]/96:*,";
+
+  for (int i = 0; i < 4000; ++i) {
+    char *str = NULL;
+    tor_asprintf(&str, "%sreject %d.%d.%d.%d:*,%s", private,
+                 crypto_rand_int_range(1, 224), crypto_rand_int(256),
+                 crypto_rand_int(256), crypto_rand_int(256),
+                 tails[i % ARRAY_LENGTH(tails)]);
+    smartlist_t *items = smartlist_new();
+    smartlist_t *policy = smartlist_new();
+    smartlist_split_string(items, str, ",", 0, 0);
+    SMARTLIST_FOREACH_BEGIN(items, char *, item) {
+      int malformed = 0;
+      addr_policy_t *p =
+        router_parse_addr_policy_item_from_string(item, -1, &malformed);
+      if (p)
+        smartlist_add(policy, p);
+      tor_free(item);
+    } SMARTLIST_FOREACH_END(item);
+    smartlist_free(items);
+    tor_free(str);
+    policy_expand_unspec(&policy);
+    smartlist_add(policies, policy);
+  }
+}
+
+/** Compare exit policy evaluation over the addr_policy_t lists with
+ * evaluation over their compiled forms. */
+static void
+bench_exit_policy(void)
+{
+  smartlist_t *policies = smartlist_new();
+  smartlist_t *routers = smartlist_new();
+  smartlist_t *compiled = smartlist_new();
+  const int n_queries = 256;
+  tor_addr_t *addrs = tor_calloc(n_queries, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(n_queries, sizeof(uint16_t));
+  uint64_t start, end;
+  int i, n_accept = 0;
+
+  if (exit_policy_descriptors_file) {
+    if (bench_exit_policy_load_descriptors(policies, routers) < 0)
+      goto done;
+  } else {
+    bench_exit_policy_synthesize(policies);
+  }
+
+  for (i = 0; i < n_queries; ++i) {
+    if (i % 4 == 3) {
+      uint8_t a6[16];
+      crypto_rand((char*)a6, sizeof(a6));
+      a6[0] = 0x20;
+      tor_addr_from_ipv6_bytes(&addrs[i], a6);
+    } else {
+      tor_addr_from_ipv4h(&addrs[i], crypto_rand_u32());
+    }
+    ports[i] = (i & 1) ? 443 : (uint16_t) crypto_rand_int_range(1, 65536);
+  }
+
+  reset_perftime();
+  start = perftime();
+  SMARTLIST_FOREACH(policies, smartlist_t *, p,
+                    smartlist_add(compiled, compiled_policy_new(p)));
+  end = perftime();
+  printf("Compiled %d exit policies: %.2f usec per policy\n",
+         smartlist_len(policies),
+         NANOCOUNT(start, end, smartlist_len(policies)) / 1000.0);
+
+  start = perftime();
+  SMARTLIST_FOREACH_BEGIN(policies, smartlist_t *, p) {
+    for (i = 0; i < n_queries; ++i)
+      n_accept += compare_tor_addr_to_addr_policy(&addrs[i], ports[i], p) ==
+        ADDR_POLICY_ACCEPTED;
+  } SMARTLIST_FOREACH_END(p);
+  end = perftime();
+  printf("compare_tor_addr_to_addr_policy: %.2f ns per lookup\n",
+         NANOCOUNT(start, end, n_queries * smartlist_len(policies)));
+
+  start = perftime();
+  SMARTLIST_FOREACH_BEGIN(compiled, compiled_policy_t *, cp) {
+    for (i = 0; i < n_queries; ++i)
+      n_accept += compare_tor_addr_to_compiled_policy(&addrs[i], ports[i],
+                                                      cp) ==
+        ADDR_POLICY_ACCEPTED;
+  } SMARTLIST_FOREACH_END(cp);
+  end = perftime();
+  printf("compare_tor_addr_to_compiled_policy: %.2f ns per lookup\n",
+         NANOCOUNT(start, end, n_queries * smartlist_len(compiled)));
+
+  start = perftime();
+  SMARTLIST_FOREACH_BEGIN(compiled, compiled_policy_t *, cp) {
+    for (i = 0; i < n_queries; ++i)
+      n_accept += compare_tor_addr_to_compiled_policy(NULL, ports[i], cp) ==
+        ADDR_POLICY_ACCEPTED;
+  } SMARTLIST_FOREACH_END(cp);
+  end = perftime();
+  printf("compare_tor_addr_to_compiled_policy (unknown address): "
+         "%.2f ns per lookup\n",
+         NANOCOUNT(start, end, n_queries * smartlist_len(compiled)));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Accepted == %d\n", n_accept);
+
+ done:
+  SMARTLIST_FOREACH(compiled, compiled_policy_t *, cp,
+                    compiled_policy_free(cp));
+  if (smartlist_len(routers)) {
+    SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  } else {
+    SMARTLIST_FOREACH(policies, smartlist_t *, p, addr_policy_list_free(p));
+  }
+  smartlist_free(compiled);
+  smartlist_free(routers);
+  smartlist_free(policies);
+  tor_free(addrs);
+  tor_free(ports);
+}
+
+/** Run benchmarks for bandwidth-weighted node selection. */
+static void
+bench_node_select(void)
+{
+  const int n_relays = 7000, n_draws = 100000, n_cold_draws = 100;
+  const int n_rand = 1024;
+  const bandwidth_weight_rule_t rules[] = {
+    WEIGHT_FOR_GUARD, WEIGHT_FOR_MID, WEIGHT_FOR_EXIT, WEIGHT_FOR_DIR
+  };
+  smartlist_t *routers = smartlist_new();
+  smartlist_t *half = smartlist_new();
+  uint64_t *cumulative = tor_calloc(n_relays, sizeof(uint64_t));
+  uint64_t *weights = tor_calloc(n_relays, sizeof(uint64_t));
+  uint64_t *rand_vals = tor_calloc(n_rand, sizeof(uint64_t));
+  uint64_t start, end, total = 0;
+  int i, sum = 0;
+
+  /* Without a consensus, each relay's weight is its (bounded) advertised
+   * bandwidth. */
+  for (i = 0; i < n_relays; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    node_t *node;
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    ri->purpose = ROUTER_PURPOSE_GENERAL;
+    ri->bandwidthrate = ri->bandwidthcapacity =
+      10000 + crypto_rand_int(100000);
+    node = nodelist_set_routerinfo(ri, NULL);
+    node->is_valid = node->is_running = node->is_fast = 1;
+    node->is_possible_guard = (i % 3 == 0);
+    node->is_exit = (i % 5 == 0);
+    smartlist_add(routers, ri);
+    total += ri->bandwidthrate;
+    cumulative[i] = total;
+  }
+  SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
+                    if (node_sl_idx % 2) smartlist_add(half, node));
+
+  for (unsigned r = 0; r < ARRAY_LENGTH(rules); ++r) {
+    const char *name = bandwidth_weight_rule_to_string(rules[r]);
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_cold_draws; ++i) {
+      node_select_index_invalidate();
+      sum += node_sl_choose_by_bandwidth(half, rules[r]) != NULL;
+    }
+    end = perftime();
+    printf("%s: %.2f usec for the first draw after a nodelist change\n",
+           name, MICROCOUNT(start, end, n_cold_draws));
+
+    start = perftime();
+    for (i = 0; i < n_draws; ++i)
+      sum += node_sl_choose_by_bandwidth(half, rules[r]) != NULL;
+    end = perftime();
+    printf("%s: %.0f draws/sec afterwards\n", name,
+           1e9 / NANOCOUNT(start, end, n_draws));
+  }
+
+  /* The selection step on its own, over the whole list. */
+  for (i = 0; i < n_relays; ++i)
+    weights[i] = cumulative[i] - (i ? cumulative[i-1] : 0);
+  for (i = 0; i < n_rand; ++i)
+    rand_vals[i] = crypto_rand_uint64(total);
+
+  start = perftime();
+  for (i = 0; i < n_draws; ++i)
+    sum += select_array_member_cumulative_timei(weights, n_relays, total,
+                                                rand_vals[i % n_rand]);
+  end = perftime();
+  printf("select_array_member_cumulative_timei: %.2f ns per draw\n",
+         NANOCOUNT(start, end, n_draws));
+
+  start = perftime();
+  for (i = 0; i < n_draws; ++i)
+    sum += select_array_member_by_cumulative_timei(cumulative, n_relays,
+                                                   rand_vals[i % n_rand]);
+  end = perftime();
+  printf("select_array_member_by_cumulative_timei: %.2f ns per draw\n",
+         NANOCOUNT(start, end, n_draws));
+
+  /* Looking up a family by verified family ID, four relays per family. */
+  {
+    const int n_lookups = 10000;
+    smartlist_t *family = smartlist_new();
+    int old_enforce = get_options()->EnforceDistinctSubnets;
+    get_options_mutable()->EnforceDistinctSubnets = 0;
+    SMARTLIST_FOREACH_BEGIN(routers, routerinfo_t *, ri) {
+      ri->family_ids = smartlist_new();
+      smartlist_add_asprintf(ri->family_ids, "ed25519:family%d",
+                             ri_sl_idx / 4);
+    } SMARTLIST_FOREACH_END(ri);
+    node_select_index_invalidate();
+
+    start = perftime();
+    for (i = 0; i < n_lookups; ++i) {
+      nodelist_add_node_and_family(family,
+                  smartlist_get(nodelist_get_list(), i % n_relays));
+      sum += smartlist_len(family);
+      smartlist_clear(family);
+    }
+    end = perftime();
+    printf("nodelist_add_node_and_family (family IDs): %.2f usec per "
+           "lookup\n", MICROCOUNT(start, end, n_lookups));
+    get_options_mutable()->EnforceDistinctSubnets = old_enforce;
+    smartlist_free(family);
+  }
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Sum == %d\n", sum);
+
+  nodelist_free_all();
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(routers);
+  smartlist_free(half);
+  tor_free(cumulative);
+  tor_free(weights);
+  tor_free(rand_vals);
+}
+
+/** Run benchmarks for finding circuits for streams, with one open circuit
+ * per SOCKS username, as on a busy scraping proxy. */
+static void
+bench_circuit_get_best(void)
+{
+  const int n_circuits = 10000, n_streams = 100000, n_scan_streams = 100;
+  smartlist_t *conns = smartlist_new();
+  smartlist_t *circs = smartlist_new();
+  routerinfo_t *exit_ri = tor_malloc_zero(sizeof(routerinfo_t));
+  channel_t *fake_chan = tor_malloc_zero(sizeof(channel_t));
+  uint64_t start, end;
+  int i, malformed = 0, n_found = 0;
+  char username[32];
+
+  conflux_pool_init();
+  tor_init_connection_lists();
+  crypto_rand(exit_ri->cache_info.identity_digest, DIGEST_LEN);
+  exit_ri->purpose = ROUTER_PURPOSE_GENERAL;
+  exit_ri->exit_policy = smartlist_new();
+  smartlist_add(exit_ri->exit_policy,
+                router_parse_addr_policy_item_from_string("accept *4:*", -1,
+                                                          &malformed));
+  nodelist_set_routerinfo(exit_ri, NULL);
+
+  for (i = 0; i < n_circuits; ++i) {
+    entry_connection_t *conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+    origin_circuit_t *circ = origin_circuit_new();
+
+    tor_snprintf(username, sizeof(username), "user%d", i);
+    conn->entry_cfg.isolation_flags = ISO_DEFAULT;
+    conn->entry_cfg.session_group = -1;
+    conn->original_dest_address = tor_strdup("192.0.2.1");
+    conn->socks_request->command = SOCKS_COMMAND_CONNECT;
+    strlcpy(conn->socks_request->address, "192.0.2.1",
+            sizeof(conn->socks_request->address));
+    conn->socks_request->port = 443;
+    conn->socks_request->username = tor_strdup(username);
+    conn->socks_request->usernamelen = strlen(username);
+    smartlist_add(conns, conn);
+
+    circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+    circ->build_state->chosen_exit = tor_malloc_zero(sizeof(extend_info_t));
+    memcpy(circ->build_state->chosen_exit->identity_digest,
+           exit_ri->cache_info.identity_digest, DIGEST_LEN);
+    /* Set these directly, so that we don't publish any events. */
+    TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    TO_CIRCUIT(circ)->state = CIRCUIT_STATE_OPEN;
+    TO_CIRCUIT(circ)->n_chan = fake_chan;
+    circuit_origin_index_update(circ);
+    connection_edge_update_circuit_isolation(conn, circ, 0);
+    smartlist_add(circs, circ);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < n_scan_streams; ++i) {
+    const entry_connection_t *conn =
+      smartlist_get(conns, crypto_rand_int(n_circuits));
+    SMARTLIST_FOREACH(circuit_get_global_origin_circuit_list(),
+                      origin_circuit_t *, circ,
+                      n_found += circuit_is_acceptable(circ, conn, 1,
+                                          CIRCUIT_PURPOSE_C_GENERAL, 0, 0,
+                                          approx_time()));
+  }
+  end = perftime();
+  printf("Scanning %d circuits: %.2f usec per stream\n", n_circuits,
+         MICROCOUNT(start, end, n_scan_streams));
+
+  start = perftime();
+  for (i = 0; i < n_streams; ++i) {
+    const entry_connection_t *conn =
+      smartlist_get(conns, crypto_rand_int(n_circuits));
+    n_found += circuit_get_best(conn, 1, CIRCUIT_PURPOSE_C_GENERAL,
+                                0, 0) != NULL;
+  }
+  end = perftime();
+  printf("circuit_get_best with %d circuits: %.2f usec per stream "
+         "(%d streams)\n", n_circuits, MICROCOUNT(start, end, n_streams),
+         n_streams);
+  printf("Found == %d\n", n_found);
+
+  SMARTLIST_FOREACH(circs, origin_circuit_t *, circ,
+                    TO_CIRCUIT(circ)->n_chan = NULL);
+  circuit_free_all();
+  SMARTLIST_FOREACH(conns, entry_connection_t *, conn,
+                    connection_free_(ENTRY_TO_CONN(conn)));
+  conflux_pool_free_all();
+  nodelist_free_all();
+  routerinfo_free(exit_ri);
+  smartlist_free(conns);
+  smartlist_free(circs);
+  tor_free(fake_chan);
+}
+
+/** Number of cells for which bench_cell_dispatch_handler() found a
+ * circuit. */
+static int bench_cell_dispatch_n_found = 0;
+
+/** Cell handler for bench_cell_dispatch(): look up the cell's circuit, the
+ * way command_process_relay_cell() would, and stop there. */
+static void
+bench_cell_dispatch_handler(channel_t *chan, cell_t *cell)
+{
+  if (circuit_get_by_circid_channel(cell->circ_id, chan))
+    ++bench_cell_dispatch_n_found;
+}
+
+static void
+bench_cell_dispatch(void)
+{
+  const int n_rounds = 10000, cells_per_round = 256;
+  const size_t cell_size = get_cell_network_size(1);
+  const int circ_counts[] = { 1, 8, 64 };
+  or_connection_t *conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  channel_tls_t *tlschan = tor_malloc_zero(sizeof(channel_tls_t));
+  channel_t *chan = TLS_CHAN_TO_BASE(tlschan);
+  char *wire = tor_malloc_zero(cells_per_round * cell_size);
+  uint64_t start, end;
+  cell_t cell;
+
+  /* An open connection and channel, with circuits on circuit IDs 1..64,
+   * and no network underneath. */
+  tor_init_connection_lists();
+  conn->base_.state = OR_CONN_STATE_OPEN;
+  conn->link_proto = 5;
+  conn->wide_circ_ids = 1;
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  chan->cell_handler = bench_cell_dispatch_handler;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  tlschan->conn = conn;
+  conn->chan = tlschan;
+  for (int i = 1; i <= 64; ++i)
+    or_circuit_new(i, chan);
+
+  for (size_t c = 0; c < ARRAY_LENGTH(circ_counts); ++c) {
+    /* A round of relay cells that cycles through the circuits, so that no
+     * two cells in a row are on the same one. */
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_RELAY;
+    for (int i = 0; i < cells_per_round; ++i) {
+      packed_cell_t packed;
+      cell.circ_id = 1 + (i % circ_counts[c]);
+      cell_pack(&packed, &cell, 1);
+      memcpy(wire + i * cell_size, packed.body, cell_size);
+    }
+
+    bench_cell_dispatch_n_found = 0;
+    reset_perftime();
+    start = perftime();
+    for (int r = 0; r < n_rounds; ++r) {
+      buf_add(TO_CONN(conn)->inbuf, wire, cells_per_round * cell_size);
+      connection_or_process_inbuf(conn);
+    }
+    end = perftime();
+    tor_assert(bench_cell_dispatch_n_found == n_rounds * cells_per_round);
+    printf("Dispatch relay cells across %d circuits: %.2f nsec per cell "
+           "(%.0f cells/sec)\n", circ_counts[c],
+           NANOCOUNT(start, end, n_rounds * cells_per_round),
+           (double) n_rounds * cells_per_round * 1e9 / (end - start));
+  }
+
+  conn->chan = NULL;
+  circuit_free_all();
+  circuitmux_free(chan->cmux);
+  channel_clear_circid_map(chan);
+  connection_free_(TO_CONN(conn));
+  tor_free(tlschan);
+  tor_free(wire);
+}
+
+static void
+bench_circid_lookup(void)
+{
+  const int n_lookups = 10000000, n_probes = 1<<16;
+  const int chan_counts[] = { 1, 100, 5000 };
+  const int circs_per_chan = 8;
+  channel_t **chans;
+  channel_t **probe_chan = tor_calloc(n_probes, sizeof(channel_t *));
+  circid_t *probe_id = tor_calloc(n_probes, sizeof(circid_t));
+  uint64_t start, end;
+  int i, n_found = 0;
+
+  for (size_t c = 0; c < ARRAY_LENGTH(chan_counts); ++c) {
+    const int n_chans = chan_counts[c];
+    chans = tor_calloc(n_chans, sizeof(channel_t *));
+    for (i = 0; i < n_chans; ++i) {
+      chans[i] = tor_malloc_zero(sizeof(channel_t));
+      channel_init(chans[i]);
+      chans[i]->cmux = circuitmux_alloc();
+      circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+      for (int j = 0; j < circs_per_chan; ++j)
+        or_circuit_new(0x80000000u | crypto_rand_int(1<<30), chans[i]);
+    }
+
+    /* Cells arrive on a random channel for a random one of its circuits,
+     * as they do on a busy relay. */
+    i = 0;
+    SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+      if (i == n_probes)
+        break;
+      probe_chan[i] = TO_OR_CIRCUIT(circ)->p_chan;
+      probe_id[i] = TO_OR_CIRCUIT(circ)->p_circ_id;
+      ++i;
+    } SMARTLIST_FOREACH_END(circ);
+    for (int j = i; j < n_probes; ++j) {
+      probe_chan[j] = probe_chan[j % i];
+      probe_id[j] = probe_id[j % i];
+    }
+    for (int j = n_probes - 1; j > 0; --j) {
+      int k = crypto_rand_int(j + 1);
+      channel_t *tc = probe_chan[j];
+      circid_t tid = probe_id[j];
+      probe_chan[j] = probe_chan[k];
+      probe_id[j] = probe_id[k];
+      probe_chan[k] = tc;
+      probe_id[k] = tid;
+    }
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n_lookups; ++i) {
+      const int p = i & (n_probes - 1);
+      n_found += circuit_get_by_circid_channel(probe_id[p],
+                                               probe_chan[p]) != NULL;
+    }
+    end = perftime();
+    printf("Look up circuits on %d channels, %d circuits each: "
+           "%.2f nsec per lookup\n", n_chans, circs_per_chan,
+           NANOCOUNT(start, end, n_lookups));
+
+    circuit_free_all();
+    for (i = 0; i < n_chans; ++i) {
+      circuitmux_free(chans[i]->cmux);
+      channel_clear_circid_map(chans[i]);
+      tor_free(chans[i]);
+    }
+    tor_free(chans);
+  }
+  printf("Found == %d\n", n_found);
+
+  tor_free(probe_chan);
+  tor_free(probe_id);
+}
+
+static void
+bench_buf_parse(void)
+{
+  const int n_rounds = 2000, reqs_per_round = 256, lines_per_round = 4096;
+  const size_t read_size = 4096;
+  buf_t *wire = buf_new(), *buf = buf_new();
+  char *headers = NULL, *body = NULL, *line;
+  size_t body_used = 0, len, line_len;
+  uint64_t start, end;
+  int n;
+
+  /* A burst of pipelined directory requests, as a directory cache might
+   * see them, each with a handful of headers.  They carry an explicit empty
+   * body, so that each fetch leaves the next request on the buffer. */
+  for (int i = 0; i < reqs_per_round; ++i) {
+    buf_add_printf(wire,
+                   "GET /tor/micro/d/%08x%08x-%08x%08x.z HTTP/1.0\r\n"
+                   "Host: 198.51.100.%d\r\n"
+                   "X-Or-Diff-From-Consensus: %08x%08x%08x%08x\r\n"
+                   "Accept-Encoding: identity, deflate, gzip, x-zstd\r\n"
+                   "If-Modified-Since: Thu, 01 Jan 2026 00:00:00 GMT\r\n"
+                   "Content-Length: 0\r\n"
+                   "\r\n",
+                   i, i * 7, i * 13, i * 31, i & 0xff, i, i, i, i);
+  }
+  len = buf_datalen(wire);
+  line = buf_extract(wire, NULL);
+  buf_clear(wire);
+
+  n = 0;
+  reset_perftime();
+  start = perftime();
+  for (int r = 0; r < n_rounds; ++r) {
+    /* Arrive in network-sized reads, so that requests span chunks. */
+    for (size_t off = 0; off < len; off += read_size)
+      buf_add(buf, line + off, MIN(read_size, len - off));
+    while (fetch_from_buf_http(buf, &headers, 8192, &body, &body_used,
+                               len + 1, 0) == 1) {
+      tor_free(headers);
+      tor_free(body);
+      ++n;
+    }
+  }
+  end = perftime();
+  tor_assert(n == n_rounds * reqs_per_round);
+  tor_assert(buf_datalen(buf) == 0);
+  printf("Parse HTTP requests: %.2f nsec per request (%.0f bytes each)\n",
+         NANOCOUNT(start, end, n), (double) len / reqs_per_round);
+  tor_free(line);
+
+  /* A flood of control port commands. */
+  for (int i = 0; i < lines_per_round; ++i)
+    buf_add_printf(wire, "GETINFO stream-status circuit-status "
+                   "ns/id/%08x%08x%08x%08x%08x\r\n", i, i, i, i, i);
+  len = buf_datalen(wire);
+  line = buf_extract(wire, NULL);
+  buf_clear(wire);
+  char *out = tor_malloc(len);
+
+  n = 0;
+  start = perftime();
+  for (int r = 0; r < n_rounds; ++r) {
+    for (size_t off = 0; off < len; off += read_size)
+      buf_add(buf, line + off, MIN(read_size, len - off));
+    for (;;) {
+      line_len = len;
+      if (buf_get_line(buf, out, &line_len) <= 0)
+        break;
+      ++n;
+    }
+  }
+  end = perftime();
+  tor_assert(n == n_rounds * lines_per_round);
+  printf("Read control lines: %.2f nsec per line (%.0f bytes each)\n",
+         NANOCOUNT(start, end, n), (double) len / lines_per_round);
+  tor_free(line);
+
+  /* The worst case for the header search: a large header block that is
+   * full of near-misses for CRLFCRLF, and never finished. */
+  for (int i = 0; i < 2048; ++i)
+    buf_add_string(wire, "X-Padding: \r\n\r");
+  len = buf_datalen(wire);
+  line = buf_extract(wire, NULL);
+  buf_clear(wire);
+  for (size_t off = 0; off < len; off += read_size)
+    buf_add(buf, line + off, MIN(read_size, len - off));
+
+  start = perftime();
+  for (int r = 0; r < n_rounds; ++r) {
+    int rv = fetch_from_buf_http(buf, &headers, len + 1, &body, &body_used,
+                                 0, 0);
+    tor_assert(rv == 0);
+  }
+  end = perftime();
+  printf("Search incomplete HTTP headers: %.2f nsec per byte\n",
+         NANOCOUNT(start, end, n_rounds * len));
+
+  tor_free(line);
+  tor_free(out);
+  buf_free(wire);
+  buf_free(buf);
+}
+
+static void
+bench_buf_move(void)
+{
+  const int n_rounds = 2000, n_adds = 64;
+  const size_t add_size = 4000;
+  const size_t move_sizes[] = { 512, 1500, 16384 };
+  char *data = tor_malloc_zero(add_size);
+  buf_t *in = buf_new(), *out = buf_new();
+  uint64_t start, end;
+
+  for (size_t m = 0; m < ARRAY_LENGTH(move_sizes); ++m) {
+    size_t total = 0;
+    reset_perftime();
+    start = perftime();
+    for (int r = 0; r < n_rounds; ++r) {
+      for (int i = 0; i < n_adds; ++i)
+        buf_add(in, data, add_size);
+      while (buf_datalen(in)) {
+        size_t n = move_sizes[m];
+        total += n;
+        buf_move_to_buf(out, in, &n);
+        total -= n;
+      }
+      buf_drain(out, buf_datalen(out));
+    }
+    end = perftime();
+    printf("Move %u-byte pieces between buffers: %.2f nsec per kilobyte\n",
+           (unsigned) move_sizes[m], NANOCOUNT(start, end, total / 1024));
+  }
+
+  buf_free(in);
+  buf_free(out);
+  tor_free(data);
+}
+
+/** Fill <b>store</b> with <b>n_names</b> counters of <b>n_labels</b> labels
+ * each, the way the relay metrics code does on every MetricsPort request. */
+static void
+bench_metrics_fill_store(metrics_store_t *store, int n_names, int n_labels)
+{
+  char name[64], value[32];
+
+  for (int i = 0; i < n_names; ++i) {
+    tor_snprintf(name, sizeof(name), "tor_bench_metric_%d", i);
+    for (int j = 0; j < n_labels; ++j) {
+      metrics_store_entry_t *entry =
+        metrics_store_add(store, METRICS_TYPE_COUNTER, name,
+                          "A metric for benchmarking", 0, NULL);
+      tor_snprintf(value, sizeof(value), "type_%d", j);
+      metrics_store_entry_add_label(entry,
+                                    metrics_format_label("type", value));
+      metrics_store_entry_update(entry, i * j);
+    }
+  }
+}
+
+static void
+bench_metrics(void)
+{
+  const int n_names = 100, n_labels = 20, iters = 1000;
+  uint64_t start, end;
+  size_t out_len = 0;
+  metrics_store_t *store = metrics_store_new();
+  buf_t *buf = buf_new();
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < iters; ++i) {
+    metrics_store_reset(store);
+    bench_metrics_fill_store(store, n_names, n_labels);
+  }
+  end = perftime();
+  printf("Refill a store of %d entries: %.2f usec\n",
+         n_names * n_labels, MICROCOUNT(start, end, iters));
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < iters; ++i) {
+    metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+    out_len = buf_datalen(buf);
+    buf_clear(buf);
+  }
+  end = perftime();
+  printf("Render %d entries (%d bytes): %.2f usec\n",
+         n_names * n_labels, (int)out_len, MICROCOUNT(start, end, iters));
+
+  /* The same metrics, kept in a registry instead: there is nothing to fill,
+   * and only the values are formatted on each request. */
+  metrics_reg_counter_t *counters =
+    tor_calloc(n_names * n_labels, sizeof(*counters));
+  metrics_registry_t *reg = metrics_registry_new();
+  for (int i = 0; i < n_names; ++i) {
+    char name[64], value[32];
+    tor_snprintf(name, sizeof(name), "tor_bench_metric_%d", i);
+    for (int j = 0; j < n_labels; ++j) {
+      tor_snprintf(value, sizeof(value), "type_%d", j);
+      metrics_reg_counter_add(&counters[i * n_labels + j], i * j);
+      metrics_registry_add_counter(reg, &counters[i * n_labels + j], name,
+                                   "A metric for benchmarking",
+                                   metrics_format_label("type", value));
+    }
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < iters; ++i) {
+    metrics_registry_get_output(METRICS_FORMAT_PROMETHEUS, reg, buf);
+    out_len = buf_datalen(buf);
+    buf_clear(buf);
+  }
+  end = perftime();
+  printf("Render a registry of %d metrics (%d bytes): %.2f usec\n",
+         n_names * n_labels, (int)out_len, MICROCOUNT(start, end, iters));
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < iters * 1000; ++i) {
+    metrics_reg_counter_add(&counters[i % (n_names * n_labels)], 1);
+  }
+  end = perftime();
+  printf("Increment a registry counter: %.2f nsec\n",
+         NANOCOUNT(start, end, iters * 1000));
+
+  metrics_registry_free(reg);
+  tor_free(counters);
+  buf_free(buf);
+  metrics_store_free(store);
+}
+
+#ifdef HAVE_MODULE_DIRAUTH
+/** Return a new synthetic vote from voter number <b>voter</b>, listing most
+ * of the <b>n_routers</b> relays whose identities are in <b>ids</b>, sorted.
+ * Voters disagree a little about flags, bandwidths and which relays to
+ * list. */
+static networkstatus_t *
+bench_consensus_make_vote(int voter, const char *ids, int n_routers,
+                          time_t now)
+{
+  static const char *flags[] = {
+    "Exit", "Fast", "Guard", "HSDir", "Running", "Stable", "V2Dir", "Valid",
+  };
+  enum { F_EXIT=0, F_FAST, F_GUARD, F_HSDIR, F_RUNNING, F_STABLE, F_V2DIR,
+         F_VALID };
+  networkstatus_t *v = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter_info =
+    tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  tor_weak_rng_t rng;
+
+  tor_init_weak_random(&rng, (unsigned) voter);
+  v->type = NS_TYPE_VOTE;
+  v->valid_after = now;
+  v->fresh_until = now + 3600;
+  v->valid_until = now + 3*3600;
+  v->vote_seconds = v->dist_seconds = 300;
+  v->client_versions = tor_strdup("0.4.8.9");
+  v->server_versions = tor_strdup("0.4.8.9");
+  v->has_measured_bws = 1;
+  v->known_flags = smartlist_new();
+  for (unsigned i = 0; i < ARRAY_LENGTH(flags); ++i)
+    smartlist_add_strdup(v->known_flags, flags[i]);
+  v->supported_methods = smartlist_new();
+  smartlist_add_asprintf(v->supported_methods, "%d",
+                         MAX_SUPPORTED_CONSENSUS_METHOD);
+
+  crypto_rand(voter_info->identity_digest, DIGEST_LEN);
+  crypto_rand(voter_info->vote_digest, DIGEST_LEN);
+  tor_asprintf(&voter_info->nickname, "voter%d", voter);
+  voter_info->address = tor_strdup("192.0.2.1");
+  tor_addr_from_ipv4h(&voter_info->ipv4_addr, 0xc0000201);
+  voter_info->ipv4_dirport = 80;
+  voter_info->ipv4_orport = 443;
+  voter_info->contact = tor_strdup("nobody@example.com");
+  v->voters = smartlist_new();
+  smartlist_add(v->voters, voter_info);
+
+  v->routerstatus_list = smartlist_new();
+  for (int i = 0; i < n_routers; ++i) {
+    vote_routerstatus_t *vrs;
+    vote_microdesc_hash_t *h;
+    char digest256[DIGEST256_LEN];
+    char md64[BASE64_DIGEST256_LEN+1];
+
+    if (tor_weak_random_range(&rng, 20) == 0)
+      continue;
+    vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    memcpy(vrs->status.identity_digest, ids + i*DIGEST_LEN, DIGEST_LEN);
+    memset(vrs->status.descriptor_digest, i & 0xff, DIGEST_LEN);
+    tor_snprintf(vrs->status.nickname, sizeof(vrs->status.nickname),
+                 "relay%d", i);
+    tor_addr_from_ipv4h(&vrs->status.ipv4_addr, 0x0a000000 + i);
+    vrs->status.ipv4_orport = 9001;
+    if (i % 3 == 0) {
+      tor_addr_parse(&vrs->status.ipv6_addr, "2001:db8::1");
+      vrs->status.ipv6_orport = 9001;
+    }
+    vrs->published_on = now - 1800;
+    vrs->flags = (UINT64_C(1)<<F_FAST) | (UINT64_C(1)<<F_RUNNING) |
+      (UINT64_C(1)<<F_VALID) | (UINT64_C(1)<<F_V2DIR);
+    if (i % 5 == 0)
+      vrs->flags |= UINT64_C(1)<<F_EXIT;
+    if (i % 4 == 0)
+      vrs->flags |= UINT64_C(1)<<F_GUARD;
+    if (i % 2 == 0)
+      vrs->flags |= UINT64_C(1)<<F_HSDIR;
+    if (tor_weak_random_range(&rng, 4))
+      vrs->flags |= UINT64_C(1)<<F_STABLE;
+    vrs->version = tor_strdup("Tor 0.4.8.9");
+    vrs->protocols = tor_strdup("Cons=1-2 Desc=1-2 DirCache=2 FlowCtrl=1-2 "
+                                "HSDir=2 HSIntro=4-5 HSRend=1-2 Link=1-5 "
+                                "LinkAuth=1,3 Microdesc=1-2 Padding=2 "
+                                "Relay=1-4");
+    vrs->status.has_bandwidth = 1;
+    vrs->status.bandwidth_kb = 100 + (i % 5000);
+    vrs->has_measured_bw = 1;
+    vrs->measured_bw_kb = vrs->status.bandwidth_kb +
+      tor_weak_random_range(&rng, 50);
+    vrs->status.has_exitsummary = 1;
+    vrs->status.exitsummary =
+      tor_strdup((i % 5 == 0) ? "accept 80,443" : "reject 1-65535");
+
+    memset(digest256, i & 0xff, sizeof(digest256));
+    digest256_to_base64(md64, digest256);
+    h = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
+    tor_asprintf(&h->microdesc_hash_line, "%d sha256=%s\n",
+                 MAX_SUPPORTED_CONSENSUS_METHOD, md64);
+    vrs->microdesc = h;
+    smartlist_add(v->routerstatus_list, vrs);
+  }
+  return v;
+}
+
+/** Helper: compare two DIGEST_LEN-byte identities. */
+static int
+bench_compare_ids_(const void *a, const void *b)
+{
+  return fast_memcmp(a, b, DIGEST_LEN);
+}
+
+/** Run benchmarks for computing a consensus from 9 votes about 10000 relays,
+ * on different numbers of threads. */
+static void
+bench_consensus(void)
+{
+  const int n_votes = 9, n_routers = 10000;
+  const int thread_counts[] = { 1, 2, 4, 8 };
+  const consensus_flavor_t flavors[] = { FLAV_NS, FLAV_MICRODESC };
+  smartlist_t *votes = smartlist_new();
+  char *ids = tor_malloc(n_routers * DIGEST_LEN);
+  crypto_pk_t *identity_key = crypto_pk_new();
+  crypto_pk_t *signing_key = crypto_pk_new();
+  time_t now = time(NULL);
+
+  tor_assert(!crypto_pk_generate_key(identity_key));
+  tor_assert(!crypto_pk_generate_key(signing_key));
+  crypto_rand(ids, n_routers * DIGEST_LEN);
+  qsort(ids, n_routers, DIGEST_LEN, bench_compare_ids_);
+  for (int i = 0; i < n_votes; ++i)
+    smartlist_add(votes, bench_consensus_make_vote(i, ids, n_routers, now));
+  /* The consensus is signed by the first voter. */
+  {
+    networkstatus_t *v = smartlist_get(votes, 0);
+    networkstatus_voter_info_t *voter = smartlist_get(v->voters, 0);
+    crypto_pk_get_digest(identity_key, voter->identity_digest);
+  }
+
+  for (unsigned f = 0; f < ARRAY_LENGTH(flavors); ++f) {
+    char *single = NULL;
+    for (unsigned t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+      monotime_t start, end;
+      char *result;
+      monotime_get(&start);
+      result = networkstatus_compute_consensus_impl(votes, n_votes,
+                                                    identity_key,
+                                                    signing_key, NULL, NULL,
+                                                    flavors[f],
+                                                    thread_counts[t]);
+      monotime_get(&end);
+      tor_assert(result);
+      printf("%s consensus, %d thread(s): %.1f msec (%d bytes)%s\n",
+             networkstatus_get_flavor_name(flavors[f]), thread_counts[t],
+             monotime_diff_usec(&start, &end) / 1000.0, (int)strlen(result),
+             !single ? "" :
+             strcmp(single, result) ? " DIFFERENT" : ", identical");
+      if (!single)
+        single = result;
+      else
+        tor_free(result);
+    }
+    tor_free(single);
+  }
+
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+  smartlist_free(votes);
+  tor_free(ids);
+  crypto_pk_free(identity_key);
+  crypto_pk_free(signing_key);
+}
+
+/** Run benchmarks for reading a bandwidth file with 10000 relay lines, the
+ * first time and when it hasn't changed since the last read. */
+static void
+bench_bwauth_file(void)
+{
+  const int n_lines = 10000, iters = 20;
+  const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  smartlist_t *chunks = smartlist_new();
+  char *fname = NULL, *content = NULL;
+  time_t now = time(NULL);
+  monotime_t start, end;
+  uint8_t digest[DIGEST256_LEN];
+
+  tor_asprintf(&fname, "%s/tor-bench-bwfile-%d", tmpdir, (int)getpid());
+  smartlist_add_asprintf(chunks, "%ld\nversion=1.4.0\nsoftware=sbws\n"
+                         "=====\n", (long)now);
+  for (int i = 0; i < n_lines; ++i) {
+    char id[DIGEST_LEN], hex[HEX_DIGEST_LEN+1];
+    crypto_rand(id, sizeof(id));
+    base16_encode(hex, sizeof(hex), id, sizeof(id));
+    smartlist_add_asprintf(chunks,
+                           "bw=%d bw_mean=803101 bw_median=759683 "
+                           "consensus_bandwidth=1000 "
+                           "consensus_bandwidth_is_unmeasured=False "
+                           "desc_bw_avg=1073741824 desc_bw_bur=1073741824 "
+                           "desc_bw_obs_last=562225 desc_bw_obs_mean=562225 "
+                           "error_circ=0 error_destination=0 error_misc=0 "
+                           "error_second_relay=0 error_stream=0 "
+                           "master_key_ed25519=YaqV4vbvPYKucElk297eVdNArDz9"
+                           "HtIwUoIeo0+cVIpQ nick=relay%d node_id=$%s "
+                           "relay_in_recent_consensus_count=3 "
+                           "relay_recent_measurement_attempt_count=2 "
+                           "success=4 time=2018-05-08T16:13:26\n",
+                           1 + i % 5000, i, hex);
+  }
+  content = smartlist_join_strings(chunks, "", 0, NULL);
+  tor_assert(!write_str_to_file(fname, content, 0));
+  update_approx_time(now);
+
+  monotime_get(&start);
+  for (int i = 0; i < iters; ++i) {
+    dirserv_clear_measured_bw_cache();
+    tor_assert(!dirserv_read_measured_bandwidths(fname, NULL, NULL, digest));
+  }
+  monotime_get(&end);
+  printf("Read and parse %d-line bandwidth file (%d bytes): %.2f msec\n",
+         n_lines, (int)strlen(content),
+         monotime_diff_usec(&start, &end) / 1000.0 / iters);
+
+  monotime_get(&start);
+  for (int i = 0; i < iters; ++i) {
+    tor_assert(!dirserv_read_measured_bandwidths(fname, NULL, NULL, digest));
+  }
+  monotime_get(&end);
+  printf("Read unchanged %d-line bandwidth file: %.2f msec\n",
+         n_lines, monotime_diff_usec(&start, &end) / 1000.0 / iters);
+  tor_assert(dirserv_get_measured_bw_cache_size() == n_lines);
+
+  dirserv_clear_measured_bw_cache();
+  unlink(fname);
+  tor_free(fname);
+  tor_free(content);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+}
+#endif /* defined(HAVE_MODULE_DIRAUTH) */
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -690,6 +1789,7 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_dispatch),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -698,6 +1798,17 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(exit_policy),
+  ENT(node_select),
+  ENT(circuit_get_best),
+  ENT(circid_lookup),
+  ENT(buf_parse),
+  ENT(buf_move),
+  ENT(metrics),
+#ifdef HAVE_MODULE_DIRAUTH
+  ENT(consensus),
+  ENT(bwauth_file),
+#endif
   {NULL,NULL,0}
 };
 
@@ -753,6 +1864,10 @@ main(int argc, const char **argv)
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--exit-policy-descriptors") &&
+               i+1 < argc) {
+      /* Use the exit policies from a cached-descriptors file. */
+      exit_policy_descriptors_file = argv[++i];
     } else {
       benchmark_t *benchmark = find_benchmark(argv[i]);
       ++n_enabled;
@@ -832,6 +832,215 @@ test_buffers_find_contentlen(void *arg)
   ;
 }
 
+/** Check buf_find_string_offset() against tor_memmem() on buffers whose
+ * chunks have random sizes, so that many matches cross chunk boundaries. */
+static void
+test_buffers_find_string(void *arg)
+{
+  (void)arg;
+  buf_t *buf = NULL, *piece = NULL;
+  char data[600], needle[8];
+  int i, j;
+
+  for (i = 0; i < 200; ++i) {
+    size_t len = crypto_rand_int(sizeof(data)) + 1, off = 0;
+    /* A two-letter alphabet makes for plenty of partial matches. */
+    for (j = 0; j < (int)len; ++j)
+      data[j] = crypto_rand_int(2) ? '\r' : '\n';
+
+    buf = buf_new();
+    while (off < len) {
+      size_t n = crypto_rand_int(9) + 1;
+      if (n > len - off)
+        n = len - off;
+      piece = buf_new_with_capacity(n);
+      buf_add(piece, data + off, n);
+      buf_move_all(buf, piece);
+      buf_free(piece);
+      piece = NULL;
+      off += n;
+    }
+    tt_int_op(buf_datalen(buf), OP_EQ, len);
+
+    for (j = 0; j < 10; ++j) {
+      size_t nlen = crypto_rand_int(sizeof(needle)) + 1;
+      int k;
+      for (k = 0; k < (int)nlen; ++k)
+        needle[k] = crypto_rand_int(2) ? '\r' : '\n';
+      const char *cp = tor_memmem(data, len, needle, nlen);
+      tt_int_op(buf_find_string_offset(buf, needle, nlen), OP_EQ,
+                cp ? (int)(cp - data) : -1);
+    }
+    tt_int_op(buf_find_string_offset(buf, data + len - 1, 1), OP_LE,
+              (int)len - 1);
+    buf_free(buf);
+    buf = NULL;
+  }
+
+ done:
+  buf_free(buf);
+  buf_free(piece);
+}
+
+/** Check that buf_move_to_buf() shares chunks rather than copying them, and
+ * that shared storage lives exactly as long as some buffer refers to it. */
+static void
+test_buffers_move_shared(void *arg)
+{
+  (void)arg;
+  buf_t *buf1 = NULL, *buf2 = NULL, *buf3 = NULL;
+  char *junk = tor_malloc(16384), *s = NULL;
+  const char *cp;
+  size_t sz, r, alloc;
+
+  crypto_rand(junk, 16384);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  buf1 = buf_new();
+  buf2 = buf_new();
+  buf_add(buf1, junk, 4000);
+  buf_add(buf1, junk + 4000, 4000);
+  buf_add(buf1, junk + 8000, 4000);
+  alloc = buf_get_total_allocation();
+
+  /* Part of the first chunk becomes a slice of it. */
+  r = 2000;
+  tt_int_op(buf_move_to_buf(buf2, buf1, &r), OP_EQ, 2000);
+  tt_int_op(r, OP_EQ, 0);
+  buf_assert_ok(buf1);
+  buf_assert_ok(buf2);
+  tt_assert(buf2->head->backing == buf1->head);
+  tt_int_op(buf1->head->refcnt, OP_EQ, 2);
+  tt_int_op(buf_get_total_allocation(), OP_LT, alloc + 256);
+  tt_int_op(buf_slack(buf2), OP_EQ, 0);
+
+  /* The rest of it moves as a whole, along with the next chunk; the few
+   * bytes after that are too few to share, so we copy them. */
+  r = buf1->head->datalen + buf1->head->next->datalen + 500;
+  sz = buf_datalen(buf1) - r;
+  buf_move_to_buf(buf2, buf1, &r);
+  buf_assert_ok(buf1);
+  buf_assert_ok(buf2);
+  tt_int_op(buf_datalen(buf1), OP_EQ, sz);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 12000 - sz);
+  tt_assert(! buf2->tail->backing);
+  tt_int_op(buf2->tail->refcnt, OP_EQ, 1);
+  tt_int_op(buf1->head->refcnt, OP_EQ, 1);
+
+  /* Freeing the source leaves the shared storage alone. */
+  buf_free(buf1);
+  s = buf_extract(buf2, &sz);
+  tt_int_op(sz, OP_EQ, buf_datalen(buf2));
+  tt_mem_op(s, OP_EQ, junk, sz);
+  tor_free(s);
+
+  /* Slices of slices share the original storage, and copies of slices are
+   * slices too. */
+  buf3 = buf_new();
+  r = 1500;
+  buf_move_to_buf(buf3, buf2, &r);
+  buf_assert_ok(buf3);
+  tt_assert(buf3->head->backing);
+  tt_assert(! buf3->head->backing->backing);
+  buf1 = buf_copy(buf3);
+  buf_assert_ok(buf1);
+  tt_assert(buf1->head->backing == buf3->head->backing);
+  /* (buf2 holds the chunk itself, and a slice of it.) */
+  tt_int_op(buf1->head->backing->refcnt, OP_EQ, 4);
+
+  /* Pulling up a slice can't grow it in place: it gets a copy instead. */
+  buf_add(buf3, junk + 1500, 1000);
+  buf_pullup(buf3, 2500, &cp, &sz);
+  buf_assert_ok(buf3);
+  tt_int_op(sz, OP_EQ, 2500);
+  tt_mem_op(cp, OP_EQ, junk, 2500);
+  tt_assert(! buf3->head->backing);
+  tt_int_op(buf1->head->backing->refcnt, OP_EQ, 3);
+  s = buf_extract(buf1, &sz);
+  tt_int_op(sz, OP_EQ, 1500);
+  tt_mem_op(s, OP_EQ, junk, 1500);
+  tor_free(s);
+
+  buf_free(buf1);
+  buf_free(buf3);
+  /* buf2 still holds a slice, whose data it counts as its own. */
+  tt_int_op(buf_get_total_allocation(), OP_LT, buf_allocation(buf2));
+  buf_free(buf2);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+  buf_free(buf3);
+  tor_free(junk);
+  tor_free(s);
+}
+
+static int n_external_released = 0;
+static void
+test_buffers_external_release(void *arg)
+{
+  tt_ptr_op(arg, OP_EQ, &n_external_released);
+  ++n_external_released;
+ done:
+  ;
+}
+
+/** Check buf_add_external(), and that we release external memory once, when
+ * the last buffer that refers to it is done with it. */
+static void
+test_buffers_external(void *arg)
+{
+  (void)arg;
+  static const char msg[] = "Hello, external world.\n";
+  const size_t msglen = strlen(msg);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  char tmp[64];
+  size_t sz;
+
+  n_external_released = 0;
+  buf1 = buf_new();
+  buf_add(buf1, "> ", 2);
+  tt_int_op(buf_add_external(buf1, msg, msglen,
+                             test_buffers_external_release,
+                             &n_external_released), OP_EQ, 2 + msglen);
+  buf_assert_ok(buf1);
+  /* We never write into external memory. */
+  tt_int_op(buf_slack(buf1), OP_EQ, 0);
+  buf_add(buf1, "!", 1);
+  buf_assert_ok(buf1);
+  tt_ptr_op(buf1->head->next->data, OP_EQ, msg);
+
+  /* Copies share the memory. */
+  buf2 = buf_copy(buf1);
+  buf_assert_ok(buf2);
+  tt_ptr_op(buf2->head->next->data, OP_EQ, msg);
+
+  sz = sizeof(tmp);
+  tt_int_op(buf_get_line(buf1, tmp, &sz), OP_EQ, 1);
+  tt_str_op(tmp, OP_EQ, "> Hello, external world.\n");
+  tt_int_op(n_external_released, OP_EQ, 0);
+  buf_free(buf1);
+  tt_int_op(n_external_released, OP_EQ, 0);
+
+  buf_drain(buf2, 10);
+  tt_int_op(n_external_released, OP_EQ, 0);
+  buf_drain(buf2, msglen - 8);
+  tt_int_op(n_external_released, OP_EQ, 1);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 1);
+  buf_free(buf2);
+
+  /* Adding nothing releases the memory right away. */
+  buf1 = buf_new();
+  tt_int_op(buf_add_external(buf1, msg, 0, test_buffers_external_release,
+                             &n_external_released), OP_EQ, 0);
+  tt_int_op(n_external_released, OP_EQ, 2);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+}
+
 static void
 test_buffer_peek_startswith(void *arg)
 {
@@ -863,6 +1072,9 @@ struct testcase_t buffer_tests[] = {
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "move_all", test_buffers_move_all, 0, NULL, NULL },
+  { "find_string", test_buffers_find_string, 0, NULL, NULL },
+  { "move_shared", test_buffers_move_shared, TT_FORK, NULL, NULL },
+  { "external", test_buffers_external, TT_FORK, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
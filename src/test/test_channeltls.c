@@ -6,6 +6,7 @@
 #include <math.h>
 
 #define CHANNEL_OBJECT_PRIVATE
+#define CONNECTION_PRIVATE
 #include "core/or/or.h"
 #include "lib/net/address.h"
 #include "lib/buf/buffers.h"
@@ -19,6 +20,7 @@
 #include "core/or/scheduler.h"
 #include "lib/tls/tortls.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/or_connection_st.h"
 #include "core/or/congestion_control_common.h"
 
@@ -30,6 +32,7 @@
 static void test_channeltls_create(void *arg);
 static void test_channeltls_num_bytes_queued(void *arg);
 static void test_channeltls_overhead_estimate(void *arg);
+static void test_channeltls_batch_dispatch(void *arg);
 
 /* Mocks used by channeltls unit tests */
 static size_t tlschan_buf_datalen_mock(const buf_t *buf);
@@ -301,6 +304,97 @@ tlschan_connection_or_connect_mock(const tor_addr_t *addr,
   return result;
 }
 
+/* Circuit IDs and first payload bytes of the cells that reached
+ * tlschan_record_cell_handler(), in order. */
+static circid_t tlschan_recorded_circids[16];
+static uint8_t tlschan_recorded_tags[16];
+static int tlschan_n_recorded = 0;
+
+static void
+tlschan_record_cell_handler(channel_t *chan, cell_t *cell)
+{
+  (void) chan;
+  tor_assert(tlschan_n_recorded < (int) ARRAY_LENGTH(tlschan_recorded_tags));
+  tlschan_recorded_circids[tlschan_n_recorded] = cell->circ_id;
+  tlschan_recorded_tags[tlschan_n_recorded] = cell->payload[0];
+  ++tlschan_n_recorded;
+}
+
+/* Add a fixed-length cell with command <b>command</b> on circuit
+ * <b>circ_id</b> to <b>buf</b>, with <b>tag</b> as its first payload byte.
+ * Uses wide circuit IDs. */
+static void
+tlschan_add_cell(buf_t *buf, circid_t circ_id, uint8_t command, uint8_t tag)
+{
+  cell_t cell;
+  packed_cell_t packed;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.circ_id = circ_id;
+  cell.command = command;
+  cell.payload[0] = tag;
+  cell_pack(&packed, &cell, 1);
+  buf_add(buf, packed.body, get_cell_network_size(1));
+}
+
+static void
+test_channeltls_batch_dispatch(void *arg)
+{
+  or_connection_t *conn = NULL;
+  channel_tls_t *tlschan = NULL;
+  buf_t *inbuf;
+  /* A VPADDING cell with no body. */
+  const char vpadding[] = { 0, 0, 0, 0, (char) CELL_VPADDING, 0, 0 };
+
+  (void) arg;
+
+  conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  conn->base_.state = OR_CONN_STATE_OPEN;
+  conn->link_proto = 5;
+  conn->wide_circ_ids = 1;
+  tlschan = tor_malloc_zero(sizeof(*tlschan));
+  tlschan->base_.state = CHANNEL_STATE_OPEN;
+  tlschan->base_.wide_circ_ids = 1;
+  tlschan->base_.cell_handler = tlschan_record_cell_handler;
+  tlschan->conn = conn;
+  conn->chan = tlschan;
+  inbuf = TO_CONN(conn)->inbuf;
+
+  /* Cells on circuits 7 and 5, a padding cell, and then a var cell that the
+   * batch must not be reordered across. */
+  tlschan_add_cell(inbuf, 7, CELL_RELAY, 1);
+  tlschan_add_cell(inbuf, 5, CELL_RELAY, 2);
+  tlschan_add_cell(inbuf, 7, CELL_RELAY, 3);
+  tlschan_add_cell(inbuf, 0, CELL_PADDING, 4);
+  tlschan_add_cell(inbuf, 5, CELL_DESTROY, 5);
+  tlschan_add_cell(inbuf, 7, CELL_RELAY_EARLY, 6);
+  buf_add(inbuf, vpadding, sizeof(vpadding));
+  tlschan_add_cell(inbuf, 5, CELL_RELAY, 7);
+  tlschan_add_cell(inbuf, 7, CELL_RELAY, 8);
+  /* The start of a cell, which has to wait for the rest. */
+  buf_add(inbuf, vpadding, 3);
+
+  tt_int_op(connection_or_process_inbuf(conn), OP_EQ, 0);
+
+  /* Grouped by circuit ID up to the var cell, in order within each
+   * circuit; the padding cell never reaches the channel's handler. */
+  tt_int_op(tlschan_n_recorded, OP_EQ, 7);
+  const circid_t circids[] = { 5, 5, 7, 7, 7, 5, 7 };
+  const uint8_t tags[] = { 2, 5, 1, 3, 6, 7, 8 };
+  for (int i = 0; i < 7; ++i) {
+    tt_uint_op(tlschan_recorded_circids[i], OP_EQ, circids[i]);
+    tt_uint_op(tlschan_recorded_tags[i], OP_EQ, tags[i]);
+  }
+  tt_uint_op(buf_datalen(inbuf), OP_EQ, 3);
+
+ done:
+  if (conn) {
+    conn->chan = NULL;
+    connection_free_minimal(TO_CONN(conn));
+  }
+  tor_free(tlschan);
+}
+
 static void
 tlschan_fake_close_method(channel_t *chan)
 {
@@ -337,5 +431,6 @@ struct testcase_t channeltls_tests[] = {
     TT_FORK, NULL, NULL },
   { "overhead_estimate", test_channeltls_overhead_estimate,
     TT_FORK, NULL, NULL },
+  { "batch_dispatch", test_channeltls_batch_dispatch, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
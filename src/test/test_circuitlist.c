@@ -182,6 +182,98 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+/* Make sure that a channel's circuit ID table survives growing, and that
+ * removing entries from it doesn't hide the entries that collided with them.
+ */
+static void
+test_clist_maps_many(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *circs[300];
+  const int n = ARRAY_LENGTH(circs);
+  int i;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  memset(circs, 0, sizeof(circs));
+
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+
+  /* Consecutive IDs on one channel, plus a few of the same IDs on another
+   * channel. */
+  for (i = 0; i < n; ++i)
+    circs[i] = or_circuit_new(1000 + i, i < n - 10 ? ch1 : ch2);
+  tt_uint_op(ch1->circid_slots_len, OP_EQ, n - 10);
+  tt_uint_op(ch2->circid_slots_len, OP_EQ, 10);
+  tt_uint_op(ch1->circid_slots_cap, OP_GE, 2 * (n - 10));
+
+  for (i = 0; i < n; ++i) {
+    channel_t *chan = i < n - 10 ? ch1 : ch2;
+    tt_ptr_op(circuit_get_by_circid_channel(1000 + i, chan), OP_EQ,
+              TO_CIRCUIT(circs[i]));
+    tt_ptr_op(circuit_get_by_circid_channel(1000 + i,
+                                            chan == ch1 ? ch2 : ch1),
+              OP_EQ, NULL);
+  }
+
+  /* Free every third circuit on ch1, and check the rest. */
+  for (i = 0; i < n - 10; i += 3) {
+    circuit_free_(TO_CIRCUIT(circs[i]));
+    circs[i] = NULL;
+  }
+  for (i = 0; i < n - 10; ++i) {
+    tt_ptr_op(circuit_get_by_circid_channel(1000 + i, ch1), OP_EQ,
+              circs[i] ? TO_CIRCUIT(circs[i]) : NULL);
+    tt_int_op(circuit_id_in_use_on_channel(1000 + i, ch1), OP_EQ,
+              circs[i] != NULL);
+  }
+
+  /* Placeholders live in the same table. */
+  channel_mark_circid_unusable(ch1, 1000);
+  tt_assert(circuit_id_in_use_on_channel(1000, ch1));
+  tt_ptr_op(circuit_get_by_circid_channel(1000, ch1), OP_EQ, NULL);
+  channel_mark_circid_usable(ch1, 1000);
+  tt_assert(! circuit_id_in_use_on_channel(1000, ch1));
+
+  /* Moving a circuit to another ID moves its slot. */
+  circuit_set_p_circid_chan(circs[1], 5000, ch2);
+  tt_ptr_op(circuit_get_by_circid_channel(1001, ch1), OP_EQ, NULL);
+  tt_ptr_op(circuit_get_by_circid_channel(5000, ch2), OP_EQ,
+            TO_CIRCUIT(circs[1]));
+
+  /* Clearing a channel's table forgets its placeholders. */
+  channel_mark_circid_unusable(ch2, 7000);
+  tt_assert(circuit_id_in_use_on_channel(7000, ch2));
+  for (i = 0; i < n; ++i) {
+    if (circs[i])
+      circuit_free_(TO_CIRCUIT(circs[i]));
+    circs[i] = NULL;
+  }
+  tt_uint_op(ch1->circid_slots_len, OP_EQ, 0);
+  tt_uint_op(ch2->circid_slots_len, OP_EQ, 1);
+  channel_clear_circid_map(ch2);
+  tt_uint_op(ch2->circid_slots_len, OP_EQ, 0);
+  tt_assert(! circuit_id_in_use_on_channel(7000, ch2));
+
+ done:
+  for (i = 0; i < n; ++i) {
+    if (circs[i])
+      circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  channel_clear_circid_map(ch1);
+  channel_clear_circid_map(ch2);
+  tor_free(ch1->cmux);
+  tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -394,6 +486,8 @@ test_pick_circid(void *arg)
  done:
   circuitmux_free(chan1->cmux);
   circuitmux_free(chan2->cmux);
+  channel_clear_circid_map(chan1);
+  channel_clear_circid_map(chan2);
   tor_free(chan1);
   tor_free(chan2);
   bitarray_free(ba);
@@ -486,6 +580,7 @@ test_hs_circuitmap_isolation(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "maps_many", test_clist_maps_many, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
@@ -4,6 +4,7 @@
 /* See LICENSE for licensing information */
 
 #define CIRCUITLIST_PRIVATE
+#define CONNECTION_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
@@ -12,10 +13,14 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitbuild.h"
+#include "core/or/connection_edge.h"
+#include "core/mainloop/connection.h"
 #include "feature/nodelist/nodelist.h"
 
 #include "core/or/cpath_build_state_st.h"
+#include "core/or/entry_connection_st.h"
 #include "core/or/origin_circuit_st.h"
+#include "core/or/socks_request_st.h"
 
 static void
 test_circuit_is_available_for_use_ret_false_when_marked_for_close(void *arg)
@@ -244,6 +249,101 @@ test_needs_circuits_for_build_returns_true_when_more_are_needed(void *arg)
     UNMOCK(router_have_consensus_path);
 }
 
+/** Return true iff <b>circ</b> is in <b>sl</b>, a possibly NULL list. */
+static bool
+list_has_circ(const smartlist_t *sl, const origin_circuit_t *circ)
+{
+  return sl && smartlist_contains(sl, circ);
+}
+
+static void
+test_origin_circuit_index(void *arg)
+{
+  origin_circuit_t *a = NULL, *b = NULL;
+  entry_connection_t *conn1 = NULL, *conn2 = NULL;
+  uint8_t key1[DIGEST_LEN], key2[DIGEST_LEN];
+  (void)arg;
+
+  conn1 = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  conn1->entry_cfg.isolation_flags = ISO_DEFAULT;
+  conn1->original_dest_address = tor_strdup("example.com");
+  conn1->socks_request->username = tor_strdup("alice");
+  conn1->socks_request->usernamelen = strlen("alice");
+  conn2 = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  conn2->entry_cfg.isolation_flags = ISO_DEFAULT;
+  conn2->original_dest_address = tor_strdup("example.com");
+  conn2->socks_request->username = tor_strdup("bob");
+  conn2->socks_request->usernamelen = strlen("bob");
+  tt_int_op(connection_edge_get_isolation_key(conn1, key1), OP_EQ, 0);
+  tt_int_op(connection_edge_get_isolation_key(conn2, key2), OP_EQ, 0);
+  tt_mem_op(key1, OP_NE, key2, DIGEST_LEN);
+
+  /* New circuits go in the bucket for their purpose, state and
+   * internal-ness. */
+  a = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  b = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, CIRCLAUNCH_IS_INTERNAL);
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, false, false, false), a));
+  tt_assert(!list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, false, false, false), b));
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, false, true, false), b));
+
+  /* They move when their state or purpose changes. */
+  circuit_set_state(TO_CIRCUIT(a), CIRCUIT_STATE_OPEN);
+  tt_assert(!list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, false, false, false), a));
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, true, false, false), a));
+  circuit_change_purpose(TO_CIRCUIT(b), CIRCUIT_PURPOSE_C_HSDIR_GET);
+  tt_assert(!list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, false, true, false), b));
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_HSDIR_GET, false, true, false), b));
+
+  /* Once a stream is associated with a circuit, the circuit is listed
+   * under that stream's isolation key. */
+  connection_edge_update_circuit_isolation(conn1, a, 0);
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, true, false, true), a));
+  tt_assert(list_has_circ(circuit_origin_index_get_by_isolation(key1), a));
+  tt_assert(!list_has_circ(circuit_origin_index_get_by_isolation(key2), a));
+
+  /* Once a circuit has mixed values for some key field, it no longer has
+   * a key. */
+  conn2->entry_cfg.isolation_flags = 0;
+  connection_edge_update_circuit_isolation(conn2, a, 0);
+  conn2->entry_cfg.isolation_flags = ISO_DEFAULT;
+  tt_assert(!list_has_circ(circuit_origin_index_get_by_isolation(key1), a));
+  tt_assert(!list_has_circ(circuit_origin_index_get_by_isolation(key2), a));
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, true, false, true), a));
+
+  circuit_clear_isolation(a);
+  tt_assert(list_has_circ(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, true, false, false), a));
+  connection_edge_update_circuit_isolation(conn2, a, 0);
+  tt_assert(list_has_circ(circuit_origin_index_get_by_isolation(key2), a));
+
+  /* Freed circuits leave the index. */
+  circuit_free_(TO_CIRCUIT(a));
+  circuit_free_(TO_CIRCUIT(b));
+  a = b = NULL;
+  tt_ptr_op(circuit_origin_index_get_by_isolation(key2), OP_EQ, NULL);
+  tt_int_op(smartlist_len(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_GENERAL, true, false, false)), OP_EQ, 0);
+  tt_int_op(smartlist_len(circuit_origin_index_get_bucket(
+                  CIRCUIT_PURPOSE_C_HSDIR_GET, false, true, false)), OP_EQ, 0);
+
+ done:
+  if (a)
+    circuit_free_(TO_CIRCUIT(a));
+  if (b)
+    circuit_free_(TO_CIRCUIT(b));
+  connection_free_minimal(ENTRY_TO_CONN(conn1));
+  connection_free_minimal(ENTRY_TO_CONN(conn2));
+}
+
 struct testcase_t circuituse_tests[] = {
  { "marked",
    test_circuit_is_available_for_use_ret_false_when_marked_for_close,
@@ -304,6 +404,10 @@ struct testcase_t circuituse_tests[] = {
  { "more_needed",
    test_needs_circuits_for_build_returns_true_when_more_are_needed,
    TT_FORK, NULL, NULL
+ },
+ { "origin_circuit_index",
+   test_origin_circuit_index,
+   TT_FORK, &helper_pubsub_setup, NULL
  },
   END_OF_TESTCASES
 };
@@ -129,7 +129,8 @@ circuit_establish_circuit_conflux_mock(const uint8_t *conflux_nonce,
   simulate_single_hop_extend(circ, 0);
   simulate_single_hop_extend(circ, 1);
   circ->cpath->prev->ccontrol = tor_malloc_zero(sizeof(congestion_control_t));
-  circ->cpath->prev->ccontrol->sendme_pending_timestamps = smartlist_new();
+  ringbuf_init(&circ->cpath->prev->ccontrol->sendme_pending_timestamps,
+               sizeof(uint64_t));
   circ->cpath->prev->ccontrol->sendme_inc = 31;
 
   return circ;
@@ -509,7 +510,8 @@ simulate_circuit_build(circuit_t *client_circ)
   relay_side->purpose = CIRCUIT_PURPOSE_OR;
   relay_side->n_chan = NULL; // No next hop
   relay_side->ccontrol = tor_malloc_zero(sizeof(congestion_control_t));
-  relay_side->ccontrol->sendme_pending_timestamps = smartlist_new();
+  ringbuf_init(&relay_side->ccontrol->sendme_pending_timestamps,
+               sizeof(uint64_t));
   relay_side->ccontrol->sendme_inc = 31;
   smartlist_add(exit_circs, relay_side);
   simulate_circuit_built(client_circ, relay_side);
@@ -1337,12 +1339,89 @@ test_conflux_switch(void *arg)
   return;
  }
 
+/** Queue out-of-order messages on a bare conflux set, and check that they
+ * come back out in sequence, whether they landed in the reorder ring or in
+ * the overflow priority queue. */
+static void
+test_conflux_ooo_ring(void *arg)
+{
+  conflux_t *cfx = tor_malloc_zero(sizeof(*cfx));
+  conflux_msg_t *c_msg = NULL;
+  uint8_t body[RELAY_PAYLOAD_SIZE_MAX];
+  relay_msg_t msg;
+  const uint64_t far_seq = CONFLUX_OOO_RING_MAX_SLOTS + 10;
+  const uint64_t seqs[] = { 3, 2, 40, 5, far_seq, 4 };
+
+  (void) arg;
+
+  cfx->ooo_q = smartlist_new();
+  memset(&msg, 0, sizeof(msg));
+  msg.command = RELAY_COMMAND_DATA;
+  msg.body = body;
+
+  /* Each message carries its sequence number as its length and contents,
+   * so that we can tell them apart. */
+  for (size_t i = 0; i < ARRAY_LENGTH(seqs); ++i) {
+    memset(body, (uint8_t) seqs[i], sizeof(body));
+    msg.length = (uint16_t) (seqs[i] % sizeof(body));
+    conflux_ooo_add(cfx, conflux_msg_new(seqs[i], &msg));
+  }
+  /* 40 made the ring grow past its initial size; far_seq didn't fit. */
+  tt_uint_op(cfx->ooo_ring_cap, OP_EQ, 64);
+  tt_uint_op(cfx->ooo_ring_len, OP_EQ, 5);
+  tt_int_op(smartlist_len(cfx->ooo_q), OP_EQ, 1);
+  tt_uint_op(conflux_ooo_len(cfx), OP_EQ, ARRAY_LENGTH(seqs));
+  tt_u64_op(conflux_get_total_bytes_allocation(), OP_EQ,
+            ARRAY_LENGTH(seqs) * sizeof(conflux_msg_t) +
+            64 * sizeof(conflux_msg_t *));
+
+  /* Sequence number 1 hasn't arrived yet. */
+  tt_ptr_op(conflux_dequeue_relay_msg(cfx), OP_EQ, NULL);
+
+  /* Deliver it the way conflux_process_relay_msg() does, and the queued
+   * messages follow until the next hole. */
+  cfx->last_seq_delivered++;
+  for (uint64_t seq = 2; seq <= 5; ++seq) {
+    c_msg = conflux_dequeue_relay_msg(cfx);
+    tt_assert(c_msg);
+    tt_u64_op(c_msg->seq, OP_EQ, seq);
+    tt_u64_op(cfx->last_seq_delivered, OP_EQ, seq);
+    tt_ptr_op(c_msg->msg->body, OP_EQ, c_msg->body);
+    tt_int_op(c_msg->msg->length, OP_EQ, seq);
+    tt_int_op(c_msg->msg->body[0], OP_EQ, seq);
+    conflux_relay_msg_free(c_msg);
+  }
+  tt_ptr_op(conflux_dequeue_relay_msg(cfx), OP_EQ, NULL);
+  tt_uint_op(conflux_ooo_len(cfx), OP_EQ, 2);
+
+  /* Skip ahead to the far message: it comes out of the priority queue. */
+  conflux_ooo_clear(cfx);
+  tt_u64_op(conflux_get_total_bytes_allocation(), OP_EQ, 0);
+  cfx->last_seq_delivered = 5;
+  msg.length = 0;
+  conflux_ooo_add(cfx, conflux_msg_new(far_seq, &msg));
+  cfx->last_seq_delivered = far_seq - 1;
+  c_msg = conflux_dequeue_relay_msg(cfx);
+  tt_assert(c_msg);
+  tt_u64_op(c_msg->seq, OP_EQ, far_seq);
+  conflux_relay_msg_free(c_msg);
+  tt_uint_op(conflux_ooo_len(cfx), OP_EQ, 0);
+
+ done:
+  conflux_relay_msg_free(c_msg);
+  conflux_ooo_clear(cfx);
+  smartlist_free(cfx->ooo_q);
+  tor_free(cfx);
+  conflux_msg_pool_free_all();
+}
+
 struct testcase_t conflux_pool_tests[] = {
   { "link", test_conflux_link, TT_FORK, NULL, NULL },
   { "link_retry", test_conflux_link_retry, TT_FORK, NULL, NULL },
   { "link_relink", test_conflux_link_relink, TT_FORK, NULL, NULL },
   { "link_streams", test_conflux_link_streams, TT_FORK, NULL, NULL },
   { "switch", test_conflux_switch, TT_FORK, NULL, NULL },
+  { "ooo_ring", test_conflux_ooo_ring, TT_FORK, NULL, NULL },
   // XXX: These two currently fail, because they are not finished:
   //{ "link_fail", test_conflux_link_fail, TT_FORK, NULL, NULL },
   //{ "close", test_conflux_close, TT_FORK, NULL, NULL },
@@ -16,6 +16,8 @@
 #include "core/or/congestion_control_st.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_vegas.h"
+#include "trunnel/congestion_control.h"
+#include "trunnel/extension.h"
 
 void test_congestion_control_rtt(void *arg);
 void test_congestion_control_clock(void *arg);
@@ -130,7 +132,7 @@ run_rtt_test_vec(congestion_control_t *cc,
                  rtt_vec_t *vec, size_t vec_len)
 {
   for (size_t i = 0; i < vec_len; i++) {
-    enqueue_timestamp(cc->sendme_pending_timestamps,
+    enqueue_timestamp(&cc->sendme_pending_timestamps,
                       vec[i].sent_usec_in);
   }
 
@@ -206,7 +208,7 @@ run_vegas_cwnd_test_vec(congestion_control_t *cc,
                         cwnd_vec_t *vec, size_t vec_len)
 {
   for (size_t i = 0; i < vec_len; i++) {
-    enqueue_timestamp(cc->sendme_pending_timestamps,
+    enqueue_timestamp(&cc->sendme_pending_timestamps,
                       vec[i].sent_usec_in);
   }
 
@@ -379,6 +381,49 @@ test_congestion_control_vegas_cwnd(void *arg)
   return;
 }
 
+/** Encode an extension holding one empty field of each type in
+ * <b>types</b>, and return the result of parsing it as a congestion control
+ * request. */
+static int
+parse_ext_request_of_types(const uint8_t *types, size_t n_types)
+{
+  trn_extension_t *ext = trn_extension_new();
+  uint8_t buf[64];
+  ssize_t len;
+
+  for (size_t i = 0; i < n_types; i++) {
+    trn_extension_field_t *field = trn_extension_field_new();
+    trn_extension_field_set_field_type(field, types[i]);
+    trn_extension_field_set_field_len(field, 0);
+    trn_extension_add_fields(ext, field);
+  }
+  trn_extension_set_num(ext, n_types);
+  len = trn_extension_encode(buf, sizeof(buf), ext);
+  trn_extension_free(ext);
+  tor_assert(len > 0);
+
+  return congestion_control_parse_ext_request(buf, len);
+}
+
+static void
+test_congestion_control_ext_request(void *arg)
+{
+  (void)arg;
+  const uint8_t cc_only[] = { TRUNNEL_EXT_TYPE_CC_FIELD_REQUEST };
+  const uint8_t unknown_only[] = { 0x7f };
+  const uint8_t unknown_then_cc[] = { 0x7f,
+                                      TRUNNEL_EXT_TYPE_CC_FIELD_REQUEST };
+
+  tt_int_op(parse_ext_request_of_types(NULL, 0), OP_EQ, 0);
+  tt_int_op(parse_ext_request_of_types(cc_only, 1), OP_EQ, 1);
+  /* An unrecognized field alone is not a request for congestion control. */
+  tt_int_op(parse_ext_request_of_types(unknown_only, 1), OP_EQ, 0);
+  tt_int_op(parse_ext_request_of_types(unknown_then_cc, 2), OP_EQ, 1);
+
+ done:
+  ;
+}
+
 #define TEST_CONGESTION_CONTROL(name, flags) \
     { #name, test_##name, (flags), NULL, NULL }
 
@@ -386,5 +431,6 @@ struct testcase_t congestion_control_tests[] = {
   TEST_CONGESTION_CONTROL(congestion_control_clock, TT_FORK),
   TEST_CONGESTION_CONTROL(congestion_control_rtt, TT_FORK),
   TEST_CONGESTION_CONTROL(congestion_control_vegas_cwnd, TT_FORK),
+  TEST_CONGESTION_CONTROL(congestion_control_ext_request, 0),
   END_OF_TESTCASES
 };
@@ -11,6 +11,7 @@
 
 #include "lib/container/bitarray.h"
 #include "lib/container/order.h"
+#include "lib/container/ringbuf.h"
 #include "lib/crypt_ops/digestset.h"
 
 /** Helper: return a tristate based on comparing the strings in *<b>a</b> and
@@ -1360,6 +1361,195 @@ test_container_smartlist_strings_eq(void *arg)
   smartlist_free(sl2);
 }
 
+static int n_flatmap_vals_freed = 0;
+
+static void
+count_flatmap_val_free(void *v)
+{
+  (void)v;
+  ++n_flatmap_vals_freed;
+}
+
+/** Run unit tests for the open-addressed digest maps, comparing them
+ * against digestmap_t. */
+static void
+test_container_digestflatmap(void *arg)
+{
+  digestflatmap_t *fm = digestflatmap_new();
+  digestmap_t *ref = digestmap_new();
+  digest256flatmap_t *fm256 = digest256flatmap_new();
+  smartlist_t *keys = smartlist_new();
+  char d[DIGEST_LEN];
+  uint8_t d256[DIGEST256_LEN];
+  size_t mem_before;
+  int i, n;
+  (void)arg;
+
+  /* Empty maps. */
+  memset(d, 7, sizeof(d));
+  tt_ptr_op(digestflatmap_get(fm, d), OP_EQ, NULL);
+  tt_ptr_op(digestflatmap_remove(fm, d), OP_EQ, NULL);
+  tt_assert(digestflatmap_isempty(fm));
+  tt_assert(digestflatmap_iter_done(digestflatmap_iter_init(fm)));
+  digestflatmap_assert_ok(fm);
+
+  /* Insert a lot of keys, replacing some values. */
+  for (i = 0; i < 3000; ++i) {
+    crypto_rand(d, sizeof(d));
+    smartlist_add(keys, tor_memdup(d, sizeof(d)));
+    tt_ptr_op(digestflatmap_set(fm, d, (void*)(intptr_t)(i+1)), OP_EQ, NULL);
+    digestmap_set(ref, d, (void*)(intptr_t)(i+1));
+  }
+  for (i = 0; i < 3000; i += 3) {
+    const char *k = smartlist_get(keys, i);
+    tt_ptr_op(digestflatmap_set(fm, k, (void*)(intptr_t)(i+5000)), OP_EQ,
+              (void*)(intptr_t)(i+1));
+    digestmap_set(ref, k, (void*)(intptr_t)(i+5000));
+  }
+  digestflatmap_assert_ok(fm);
+  tt_int_op(digestflatmap_size(fm), OP_EQ, 3000);
+
+  /* Remove some of them. */
+  for (i = 0; i < 3000; i += 2) {
+    const char *k = smartlist_get(keys, i);
+    tt_ptr_op(digestflatmap_remove(fm, k), OP_EQ, digestmap_remove(ref, k));
+    tt_ptr_op(digestflatmap_remove(fm, k), OP_EQ, NULL);
+  }
+  digestflatmap_assert_ok(fm);
+  tt_int_op(digestflatmap_size(fm), OP_EQ, digestmap_size(ref));
+  SMARTLIST_FOREACH(keys, const char *, k,
+      tt_ptr_op(digestflatmap_get(fm, k), OP_EQ, digestmap_get(ref, k)));
+
+  /* Iterate, removing some entries as we go. */
+  n = 0;
+  DIGESTFLATMAP_FOREACH_MODIFY(fm, k, void *, v) {
+    tt_ptr_op(v, OP_EQ, digestmap_get(ref, k));
+    if (((intptr_t)v) % 5 == 0) {
+      digestmap_remove(ref, k);
+      MAP_DEL_CURRENT(k);
+    }
+    ++n;
+  } DIGESTFLATMAP_FOREACH_END;
+  tt_int_op(n, OP_EQ, 1500);
+  digestflatmap_assert_ok(fm);
+  tt_int_op(digestflatmap_size(fm), OP_EQ, digestmap_size(ref));
+  n = 0;
+  DIGESTFLATMAP_FOREACH(fm, k, void *, v) {
+    tt_ptr_op(v, OP_EQ, digestmap_get(ref, k));
+    ++n;
+  } DIGESTFLATMAP_FOREACH_END;
+  tt_int_op(n, OP_EQ, digestmap_size(ref));
+
+  /* Lots of churn must reuse deleted slots rather than growing forever. */
+  mem_before = digestflatmap_get_memory_usage(fm);
+  for (i = 0; i < 20000; ++i) {
+    crypto_rand(d, sizeof(d));
+    digestflatmap_set(fm, d, (void*)1);
+    tt_ptr_op(digestflatmap_remove(fm, d), OP_EQ, (void*)1);
+  }
+  digestflatmap_assert_ok(fm);
+  tt_int_op(digestflatmap_size(fm), OP_EQ, digestmap_size(ref));
+  tt_u64_op(digestflatmap_get_memory_usage(fm), OP_LE, mem_before * 2);
+
+  n = digestflatmap_size(fm);
+  digestflatmap_free(fm, count_flatmap_val_free);
+  tt_int_op(n_flatmap_vals_freed, OP_EQ, n);
+
+  /* The 256-bit version works the same way. */
+  for (i = 0; i < 100; ++i) {
+    memset(d256, 0, sizeof(d256));
+    d256[31] = (uint8_t)i;
+    digest256flatmap_set(fm256, d256, (void*)(intptr_t)(i+1));
+  }
+  d256[31] = 42;
+  tt_ptr_op(digest256flatmap_get(fm256, d256), OP_EQ, (void*)(intptr_t)43);
+  tt_ptr_op(digest256flatmap_remove(fm256, d256), OP_EQ, (void*)(intptr_t)43);
+  tt_ptr_op(digest256flatmap_get(fm256, d256), OP_EQ, NULL);
+  tt_int_op(digest256flatmap_size(fm256), OP_EQ, 99);
+  digest256flatmap_assert_ok(fm256);
+
+ done:
+  digestflatmap_free(fm, NULL);
+  digest256flatmap_free(fm256, NULL);
+  digestmap_free(ref, NULL);
+  SMARTLIST_FOREACH(keys, char *, k, tor_free(k));
+  smartlist_free(keys);
+}
+
+/** Run unit tests for the ringbuf_t FIFO. */
+static void
+test_container_ringbuf(void *arg)
+{
+  ringbuf_t rb;
+  uint64_t v, next_in = 0, next_out = 0;
+  uint8_t d[DIGEST_LEN];
+  (void)arg;
+
+  ringbuf_init(&rb, sizeof(uint64_t));
+  tt_uint_op(ringbuf_len(&rb), OP_EQ, 0);
+  tt_int_op(ringbuf_pop(&rb, &v), OP_EQ, -1);
+  tt_ptr_op(ringbuf_get(&rb, 0), OP_EQ, NULL);
+
+  /* Reserving doesn't change the contents. */
+  ringbuf_reserve(&rb, 5);
+  tt_uint_op(rb.capacity, OP_EQ, 8);
+  tt_uint_op(ringbuf_len(&rb), OP_EQ, 0);
+
+  /* Wrap around several times without growing. */
+  for (int i = 0; i < 100; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      v = next_in++;
+      memcpy(ringbuf_push(&rb), &v, sizeof(v));
+    }
+    tt_uint_op(ringbuf_len(&rb), OP_EQ, 3);
+    memcpy(&v, ringbuf_get(&rb, 2), sizeof(v));
+    tt_u64_op(v, OP_EQ, next_in - 1);
+    for (int j = 0; j < 3; ++j) {
+      tt_int_op(ringbuf_pop(&rb, &v), OP_EQ, 0);
+      tt_u64_op(v, OP_EQ, next_out++);
+    }
+  }
+  tt_uint_op(rb.capacity, OP_EQ, 8);
+
+  /* Grow while the queue wraps around the end of the array. */
+  for (int j = 0; j < 6; ++j) {
+    v = next_in++;
+    memcpy(ringbuf_push(&rb), &v, sizeof(v));
+  }
+  tt_int_op(ringbuf_pop(&rb, NULL), OP_EQ, 0);
+  ++next_out;
+  for (int j = 0; j < 40; ++j) {
+    v = next_in++;
+    memcpy(ringbuf_push(&rb), &v, sizeof(v));
+  }
+  tt_uint_op(rb.capacity, OP_EQ, 64);
+  tt_uint_op(ringbuf_len(&rb), OP_EQ, 45);
+  for (uint32_t j = 0; j < ringbuf_len(&rb); ++j) {
+    memcpy(&v, ringbuf_get(&rb, j), sizeof(v));
+    tt_u64_op(v, OP_EQ, next_out + j);
+  }
+  while (ringbuf_pop(&rb, &v) == 0)
+    tt_u64_op(v, OP_EQ, next_out++);
+  tt_u64_op(next_out, OP_EQ, next_in);
+
+  /* Elements that aren't a power of two in size. */
+  ringbuf_clear(&rb);
+  ringbuf_init(&rb, DIGEST_LEN);
+  for (int i = 0; i < 10; ++i) {
+    memset(d, i, sizeof(d));
+    memcpy(ringbuf_push(&rb), d, sizeof(d));
+  }
+  for (int i = 0; i < 10; ++i) {
+    tt_int_op(ringbuf_pop(&rb, d), OP_EQ, 0);
+    tt_int_op(d[0], OP_EQ, i);
+    tt_int_op(d[DIGEST_LEN-1], OP_EQ, i);
+  }
+  tt_uint_op(ringbuf_len(&rb), OP_EQ, 0);
+
+ done:
+  ringbuf_clear(&rb);
+}
+
 #define CONTAINER_LEGACY(name)                                          \
   { #name, test_container_ ## name , 0, NULL, NULL }
 
@@ -1383,6 +1573,8 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
+  CONTAINER(digestflatmap, 0),
+  CONTAINER(ringbuf, 0),
   CONTAINER_LEGACY(fp_pair_map),
   CONTAINER(smartlist_most_frequent, 0),
   CONTAINER(smartlist_sort_ptrs, 0),
@@ -3,6 +3,7 @@
 
 #define CONNECTION_PRIVATE
 #define CHANNEL_OBJECT_PRIVATE
+#define CIRCUITLIST_PRIVATE
 #define CONTROL_PRIVATE
 #define CONTROL_EVENTS_PRIVATE
 #define OCIRC_EVENT_PRIVATE
@@ -732,6 +733,140 @@ test_cntev_format_stream(void *arg)
   connection_free_minimal(ENTRY_TO_CONN(ec));
 }
 
+static smartlist_t *saved_encoded_events = NULL;
+
+static void
+mock_queue_control_event_string_encoded(uint16_t event,
+                                        control_event_encoding_t encoding,
+                                        char *msg)
+{
+  tt_int_op(event, OP_EQ, EVENT_CIRC_BANDWIDTH_USED);
+  smartlist_add_asprintf(saved_encoded_events, "%d:%s", (int)encoding, msg);
+ done:
+  tor_free(msg);
+}
+
+/* Test that the once-per-second CIRC_BW sweep queues one message per
+ * format, and only for circuits that have something to report. */
+static void
+test_cntev_circ_bw_batch(void *arg)
+{
+  origin_circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL;
+  char *body = NULL, *expected = NULL;
+  const char *msg;
+  (void)arg;
+
+  MOCK(queue_control_event_string_encoded,
+       mock_queue_control_event_string_encoded);
+  saved_encoded_events = smartlist_new();
+
+  c1 = origin_circuit_new();
+  c2 = origin_circuit_new();
+  c3 = origin_circuit_new();
+  TO_CIRCUIT(c1)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  TO_CIRCUIT(c2)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  TO_CIRCUIT(c3)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  c1->n_read_circ_bw = 10;
+  c1->n_written_circ_bw = 20;
+  c3->n_read_circ_bw = 30;
+  c3->n_delivered_read_circ_bw = 5;
+
+  /* Nobody is listening: nothing is queued, and nothing is reset. */
+  control_testing_set_event_masks(0, 0);
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 0);
+  tt_uint_op(c1->n_read_circ_bw, OP_EQ, 10);
+
+  /* Only ordinary controllers: one message holding a line per circuit. */
+  control_testing_set_event_masks(EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED), 0);
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 1);
+  msg = smartlist_get(saved_encoded_events, 0);
+  tt_ptr_op(strstr(msg, "1:650 CIRC_BW ID="), OP_EQ, msg);
+  tt_assert(strstr(msg, " READ=10 WRITTEN=20 TIME="));
+  tt_assert(strstr(msg, "\r\n650 CIRC_BW ID="));
+  tt_assert(strstr(msg, " READ=30 WRITTEN=0 TIME="));
+  tt_assert(strstr(msg, "DELIVERED_READ=5 "));
+  tt_ptr_op(strstr(msg, " READ=0 WRITTEN=0 "), OP_EQ, NULL);
+  tt_uint_op(c1->n_read_circ_bw, OP_EQ, 0);
+  tt_uint_op(c3->n_delivered_read_circ_bw, OP_EQ, 0);
+
+  /* Nothing new to report: nothing is queued. */
+  SMARTLIST_FOREACH(saved_encoded_events, char *, cp, tor_free(cp));
+  smartlist_clear(saved_encoded_events);
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 0);
+
+  /* Both kinds of controller: one message in each format. */
+  c2->n_written_circ_bw = 7;
+  c2->n_overhead_written_circ_bw = 3;
+  control_testing_set_event_masks(EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED),
+                                  EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 2);
+  msg = smartlist_get(saved_encoded_events, 0);
+  tt_ptr_op(strstr(msg, "1:650 CIRC_BW ID="), OP_EQ, msg);
+  tt_assert(strstr(msg, " READ=0 WRITTEN=7 TIME="));
+  msg = smartlist_get(saved_encoded_events, 1);
+  tt_ptr_op(strstr(msg, "2:650+CIRC_BW_COMPACT TIME="), OP_EQ, msg);
+  tor_asprintf(&body, "%d 0 7 0 0 0 3\r\n", c2->global_identifier);
+  tor_asprintf(&expected, " COUNT=1 LENGTH=%d\r\n%s.\r\n650 OK\r\n",
+               (int)strlen(body), body);
+  tt_assert(strstr(msg, expected));
+  tt_uint_op(c2->n_written_circ_bw, OP_EQ, 0);
+
+  /* Only compact controllers: nothing in the ordinary format. */
+  SMARTLIST_FOREACH(saved_encoded_events, char *, cp, tor_free(cp));
+  smartlist_clear(saved_encoded_events);
+  c1->n_read_circ_bw = 1;
+  control_testing_set_event_masks(0, EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 1);
+  msg = smartlist_get(saved_encoded_events, 0);
+  tt_ptr_op(strstr(msg, "2:650+CIRC_BW_COMPACT TIME="), OP_EQ, msg);
+  tt_assert(strstr(msg, " COUNT=1 "));
+
+  /* Events for a single circuit use the same split. */
+  SMARTLIST_FOREACH(saved_encoded_events, char *, cp, tor_free(cp));
+  smartlist_clear(saved_encoded_events);
+  c3->n_written_circ_bw = 4;
+  control_event_circ_bandwidth_used_for_circ(c3);
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 1);
+  msg = smartlist_get(saved_encoded_events, 0);
+  tt_ptr_op(strstr(msg, "2:650+CIRC_BW_COMPACT TIME="), OP_EQ, msg);
+  tor_free(body);
+  tor_asprintf(&body, "\r\n%d 0 4 0 0 0 0\r\n.\r\n",
+               c3->global_identifier);
+  tt_assert(strstr(msg, body));
+  tt_uint_op(c3->n_written_circ_bw, OP_EQ, 0);
+
+  SMARTLIST_FOREACH(saved_encoded_events, char *, cp, tor_free(cp));
+  smartlist_clear(saved_encoded_events);
+  c3->n_read_circ_bw = 2;
+  control_testing_set_event_masks(EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED),
+                                  EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+  control_event_circ_bandwidth_used_for_circ(c3);
+  tt_int_op(smartlist_len(saved_encoded_events), OP_EQ, 2);
+  msg = smartlist_get(saved_encoded_events, 0);
+  tt_ptr_op(strstr(msg, "1:650 CIRC_BW ID="), OP_EQ, msg);
+  tt_assert(strstr(msg, " READ=2 WRITTEN=0 TIME="));
+  msg = smartlist_get(saved_encoded_events, 1);
+  tt_ptr_op(strstr(msg, "2:650+CIRC_BW_COMPACT TIME="), OP_EQ, msg);
+
+ done:
+  UNMOCK(queue_control_event_string_encoded);
+  SMARTLIST_FOREACH(saved_encoded_events, char *, cp, tor_free(cp));
+  smartlist_free(saved_encoded_events);
+  tor_free(body);
+  tor_free(expected);
+  if (c1)
+    circuit_free_(TO_CIRCUIT(c1));
+  if (c2)
+    circuit_free_(TO_CIRCUIT(c2));
+  if (c3)
+    circuit_free_(TO_CIRCUIT(c3));
+}
+
 #define TEST(name, flags)                               \
   { #name, test_cntev_ ## name, flags, 0, NULL }
 
@@ -751,5 +886,6 @@ struct testcase_t controller_event_tests[] = {
   T_PUBSUB(orconn_state, TT_FORK),
   T_PUBSUB(orconn_state_pt, TT_FORK),
   T_PUBSUB(orconn_state_proxy, TT_FORK),
+  T_PUBSUB(circ_bw_batch, TT_FORK),
   END_OF_TESTCASES
 };
@@ -61,7 +61,9 @@
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/parsecommon.h"
 #include "feature/dirparse/routerparse.h"
+#include "feature/dirparse/sigcommon.h"
 #include "feature/dirparse/unparseable.h"
 #include "feature/nodelist/routerset.h"
 #include "feature/nodelist/torcert.h"
@@ -1130,6 +1132,76 @@ test_dir_routerinfo_parsing(void *arg)
   routerinfo_free(ri);
 }
 
+static int n_check_signature_token_calls = 0;
+static int
+mock_check_signature_token(const char *digest, ssize_t digest_len,
+                           directory_token_t *tok, crypto_pk_t *pkey,
+                           int flags, const char *doctype)
+{
+  ++n_check_signature_token_calls;
+  return check_signature_token__real(digest, digest_len, tok, pkey, flags,
+                                     doctype);
+}
+
+static void
+test_dir_routerinfo_prechecked_sigs(void *arg)
+{
+  (void) arg;
+  smartlist_t *keys = smartlist_new();
+  routerinfo_t *ri = NULL;
+  const char *s = EX_RI_MINIMAL;
+
+  MOCK(check_signature_token, mock_check_signature_token);
+
+  /* A good descriptor has one good RSA signature and three good ed25519
+   * signatures. */
+  router_precheck_signatures_from_string(s, s + strlen(s), keys);
+  tt_int_op(smartlist_len(keys), OP_EQ, 4);
+
+  /* Once we have noted them, we don't check the RSA signature again. */
+  router_note_prechecked_signatures(keys);
+  ri = router_parse_entry_from_string(s, NULL, 0, 0, NULL, NULL);
+  tt_assert(ri);
+  tt_int_op(n_check_signature_token_calls, OP_EQ, 0);
+  routerinfo_free(ri);
+
+  /* ... but we still reject descriptors with other, bad signatures. */
+  ri = router_parse_entry_from_string(EX_RI_BAD_SIG1, NULL, 0, 0, NULL,
+                                      NULL);
+  tt_ptr_op(ri, OP_EQ, NULL);
+  ri = router_parse_entry_from_string(EX_RI_ED_BAD_SIG1, NULL, 0, 0, NULL,
+                                      NULL);
+  tt_ptr_op(ri, OP_EQ, NULL);
+
+  /* After we forget them, we check again. */
+  router_forget_prechecked_signatures();
+  n_check_signature_token_calls = 0;
+  ri = router_parse_entry_from_string(s, NULL, 0, 0, NULL, NULL);
+  tt_assert(ri);
+  tt_int_op(n_check_signature_token_calls, OP_EQ, 1);
+  routerinfo_free(ri);
+  ri = NULL;
+
+  /* Bad signatures don't get keys. */
+  SMARTLIST_FOREACH(keys, uint8_t *, k, tor_free(k));
+  smartlist_clear(keys);
+  s = EX_RI_BAD_SIG1;
+  router_precheck_signatures_from_string(s, s + strlen(s), keys);
+  tt_int_op(smartlist_len(keys), OP_EQ, 3);
+  SMARTLIST_FOREACH(keys, uint8_t *, k, tor_free(k));
+  smartlist_clear(keys);
+  s = EX_RI_ED_BAD_SIG1;
+  router_precheck_signatures_from_string(s, s + strlen(s), keys);
+  tt_int_op(smartlist_len(keys), OP_EQ, 1);
+
+ done:
+  UNMOCK(check_signature_token);
+  router_forget_prechecked_signatures();
+  routerinfo_free(ri);
+  SMARTLIST_FOREACH(keys, uint8_t *, k, tor_free(k));
+  smartlist_free(keys);
+}
+
 #include "example_extrainfo.inc"
 
 static void
@@ -2210,6 +2282,9 @@ test_dir_measured_bw_kb(void *arg)
     "node_id=$557365204145532d32353620696e73746561642e bw=1024 bw=0\n",
     "node_id=$557365204145532d32353620696e73746561642e bw=1024 bw=None\n",
     "node_id=$557365204145532d32353620696e73746561642e bw=-1024\n",
+    /* Test a value that does not fit in a long */
+    ("node_id=$557365204145532d32353620696e73746561642e "
+     "bw=99999999999999999999\n"),
     /* Test incomplete writes due to race conditions, partial copies, etc */
     "node_i",
     "node_i\n",
@@ -3509,6 +3584,7 @@ test_a_networkstatus(
   char *consensus_text2=NULL, *consensus_text3=NULL;
   char *consensus_text_md2=NULL, *consensus_text_md3=NULL;
   char *consensus_text_md=NULL;
+  char *threaded_text=NULL;
   networkstatus_t *con2=NULL, *con_md2=NULL, *con3=NULL, *con_md3=NULL;
   ns_detached_signatures_t *dsig1=NULL, *dsig2=NULL;
 
@@ -3648,6 +3724,25 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Computing the router entries on several threads doesn't change either
+   * consensus. */
+  threaded_text = networkstatus_compute_consensus_impl(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_NS, 4);
+  tt_str_op(threaded_text, OP_EQ, consensus_text);
+  tor_free(threaded_text);
+  threaded_text = networkstatus_compute_consensus_impl(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_MICRODESC, 4);
+  tt_str_op(threaded_text, OP_EQ, consensus_text_md);
+  tor_free(threaded_text);
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
@@ -3854,6 +3949,7 @@ test_a_networkstatus(
   smartlist_free(votes);
   tor_free(consensus_text);
   tor_free(consensus_text_md);
+  tor_free(threaded_text);
 
   networkstatus_vote_free(vote);
   networkstatus_vote_free(v1);
@@ -4584,6 +4680,85 @@ test_dir_bwauth_bw_file_digest256(void *arg)
   update_approx_time(time(NULL));
 }
 
+/** Reading an unchanged bandwidth file again should give the same results
+ * without parsing it again; changing it should make us parse it again. */
+static void
+test_dir_bwauth_bw_file_cache(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("V3BandwidthsFile"));
+  const char *node_hex = "68A483E05A2ABDCA6DA5A3EF8DB5177638A27F80";
+  char *content = NULL, *headers_str = NULL;
+  smartlist_t *headers = smartlist_new();
+  smartlist_t *routerstatuses = smartlist_new();
+  vote_routerstatus_t *vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+  uint8_t digest1[DIGEST256_LEN], digest2[DIGEST256_LEN];
+  long bw;
+
+  base16_decode(vrs->status.identity_digest, DIGEST_LEN,
+                node_hex, HEX_DIGEST_LEN);
+  smartlist_add(routerstatuses, vrs);
+  dirserv_clear_measured_bw_cache();
+
+  tor_asprintf(&content, "%ld\nversion=1.4.0\n=====\n"
+               "node_id=$%s bw=760\n"
+               "node_id=$68A483 bw=1\n", (long)time(NULL), node_hex);
+  write_str_to_file(fname, content, 0);
+
+  /* The first read parses the file, and warns about the bad line. */
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(0, OP_EQ, dirserv_read_measured_bandwidths(fname, routerstatuses,
+                                                       headers, digest1));
+  expect_single_log_msg_containing("Invalid node_id");
+  teardown_capture_of_logs();
+  tt_int_op(smartlist_len(headers), OP_EQ, 2);
+  tt_str_op(smartlist_get(headers, 1), OP_EQ, "version=1.4.0");
+  tt_int_op(vrs->measured_bw_kb, OP_EQ, 760);
+  tt_assert(dirserv_query_measured_bw_cache_kb(vrs->status.identity_digest,
+                                               &bw, NULL));
+  tt_int_op(bw, OP_EQ, 760);
+
+  /* The second read uses what we parsed the first time. */
+  SMARTLIST_FOREACH(headers, char *, c, tor_free(c));
+  smartlist_clear(headers);
+  vrs->measured_bw_kb = 0;
+  vrs->has_measured_bw = 0;
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(0, OP_EQ, dirserv_read_measured_bandwidths(fname, routerstatuses,
+                                                       headers, digest2));
+  expect_no_log_entry();
+  teardown_capture_of_logs();
+  tt_mem_op(digest1, OP_EQ, digest2, DIGEST256_LEN);
+  headers_str = smartlist_join_strings(headers, " ", 0, NULL);
+  tt_str_op(strchr(headers_str, ' '), OP_EQ, " version=1.4.0");
+  tt_int_op(vrs->has_measured_bw, OP_EQ, 1);
+  tt_int_op(vrs->measured_bw_kb, OP_EQ, 760);
+
+  /* A file of the same size with different contents gets parsed again, even
+   * if its modification time hasn't changed. */
+  *strstr(content, "760") = '9';
+  write_str_to_file(fname, content, 0);
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(0, OP_EQ, dirserv_read_measured_bandwidths(fname, routerstatuses,
+                                                       NULL, digest2));
+  expect_single_log_msg_containing("Invalid node_id");
+  teardown_capture_of_logs();
+  tt_mem_op(digest1, OP_NE, digest2, DIGEST256_LEN);
+  tt_int_op(vrs->measured_bw_kb, OP_EQ, 960);
+
+ done:
+  teardown_capture_of_logs();
+  unlink(fname);
+  tor_free(fname);
+  tor_free(content);
+  tor_free(headers_str);
+  SMARTLIST_FOREACH(headers, char *, c, tor_free(c));
+  smartlist_free(headers);
+  SMARTLIST_FOREACH(routerstatuses, vote_routerstatus_t *, rs, tor_free(rs));
+  smartlist_free(routerstatuses);
+  dirserv_clear_measured_bw_cache();
+}
+
 static void
 reset_routerstatus(routerstatus_t *rs,
                    const char *hex_identity_digest,
@@ -7442,6 +7617,7 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(formats_rsa_ed25519, TT_FORK, "es"),
   DIR_ARG(formats_rsa_ed25519, TT_FORK, "bes"),
   DIR(routerinfo_parsing, 0),
+  DIR(routerinfo_prechecked_sigs, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
   DIR(parse_no_onion_keyrouter_list, TT_FORK),
@@ -7456,6 +7632,7 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(measured_bw_kb_cache),
   DIR_LEGACY(dirserv_read_measured_bandwidths),
   DIR(bwauth_bw_file_digest256, 0),
+  DIR(bwauth_bw_file_cache, 0),
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
@@ -11,6 +11,7 @@
 #include "core/mainloop/connection.h"
 #include "core/or/connection_edge.h"
 #include "feature/relay/router.h"
+#include "feature/hibernate/hibernate.h"
 
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
@@ -603,19 +604,14 @@ test_dns_impl_cache_hit_pending(void *arg)
   edge_connection_t *exitconn = create_valid_exitconn();
   or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
 
-  cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
-  cache_entry->magic = CACHED_RESOLVE_MAGIC;
+  cached_resolve_t *cache_entry = cached_resolve_new("torproject.org");
   cache_entry->state = CACHE_STATE_PENDING;
-  cache_entry->minheap_idx = -1;
   cache_entry->expire = time(NULL) + 60 * 60;
 
   (void)arg;
 
   TO_CONN(exitconn)->address = tor_strdup("torproject.org");
 
-  strlcpy(cache_entry->address, TO_CONN(exitconn)->address,
-          sizeof(cache_entry->address));
-
   MOCK(router_my_exit_policy_is_reject_star,
        dns_impl_cache_hit_pending_router_my_exit_policy_is_reject_star);
 
@@ -682,19 +678,14 @@ test_dns_impl_cache_hit_cached(void *arg)
 
   cached_resolve_t *resolve_out = NULL;
 
-  cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
-  cache_entry->magic = CACHED_RESOLVE_MAGIC;
+  cached_resolve_t *cache_entry = cached_resolve_new("torproject.org");
   cache_entry->state = CACHE_STATE_CACHED;
-  cache_entry->minheap_idx = -1;
   cache_entry->expire = time(NULL) + 60 * 60;
 
   (void)arg;
 
   TO_CONN(exitconn)->address = tor_strdup("torproject.org");
 
-  strlcpy(cache_entry->address, TO_CONN(exitconn)->address,
-          sizeof(cache_entry->address));
-
   MOCK(router_my_exit_policy_is_reject_star,
        dns_impl_cache_hit_cached_router_my_exit_policy_is_reject_star);
   MOCK(set_exitconn_info_from_resolve,
@@ -764,7 +755,7 @@ test_dns_impl_cache_miss(void *arg)
 
   TO_CONN(exitconn)->address = tor_strdup("torproject.org");
 
-  strlcpy(query.address, TO_CONN(exitconn)->address, sizeof(query.address));
+  query.address = TO_CONN(exitconn)->address;
 
   MOCK(router_my_exit_policy_is_reject_star,
        dns_impl_cache_miss_router_my_exit_policy_is_reject_star);
@@ -803,6 +794,170 @@ test_dns_impl_cache_miss(void *arg)
   return;
 }
 
+/* Given a pending resolve, we want dns_found_answer() to turn it into a
+ * cached answer in place, and to keep transient errors for a short time
+ * only.  Given a popular cached answer that is about to expire, we want
+ * dns_resolve_impl() to look it up again, and dns_found_answer() to
+ * refresh it in place.
+ */
+static int
+dns_cache_answers_router_my_exit_policy_is_reject_star(void)
+{
+  return 0;
+}
+
+static int
+dns_cache_answers_launch_resolve(cached_resolve_t *resolve)
+{
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+  return 0;
+}
+
+static int
+dns_cache_answers_we_are_hibernating(void)
+{
+  return 0;
+}
+
+static int n_launch_one_resolve = 0;
+
+static int
+dns_cache_answers_launch_one_resolve(const char *address,
+                                     uint8_t query_type,
+                                     const tor_addr_t *ptr_address)
+{
+  (void)address;
+  (void)ptr_address;
+  if (query_type == DNS_IPv4_A)
+    ++n_launch_one_resolve;
+  return 0;
+}
+
+static int
+dns_cache_answers_set_exitconn_info_from_resolve(edge_connection_t *exitconn,
+                                            const cached_resolve_t *resolve,
+                                            char **hostname_out)
+{
+  (void)exitconn;
+  (void)hostname_out;
+  return resolve->res_status_ipv4 == RES_STATUS_DONE_OK ? 0 : -2;
+}
+
+/* Call dns_resolve_impl() for <b>address</b>, and return its result.  Drop
+ * the connection from the pending list if it was made pending. */
+static int
+dns_cache_answers_resolve(const char *address, cached_resolve_t **out)
+{
+  int retval, made_pending = 0;
+  edge_connection_t *exitconn = create_valid_exitconn();
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  cached_resolve_t *resolve = NULL, *resolve_out = NULL;
+  cached_resolve_t query;
+
+  TO_CONN(exitconn)->address = tor_strdup(address);
+  retval = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                            &resolve_out);
+  query.address = address;
+  resolve = dns_get_cache_entry(&query);
+  if (made_pending && resolve) {
+    tor_free(resolve->pending_connections);
+  }
+  *out = resolve;
+
+  tor_free(TO_CONN(exitconn)->address);
+  tor_free(exitconn);
+  tor_free(on_circ);
+  return retval;
+}
+
+static void
+test_dns_cache_answers(void *arg)
+{
+  cached_resolve_t *resolve = NULL, *r = NULL;
+  tor_addr_t addr;
+  time_t now = time(NULL);
+
+  (void)arg;
+
+  MOCK(router_my_exit_policy_is_reject_star,
+       dns_cache_answers_router_my_exit_policy_is_reject_star);
+  MOCK(launch_resolve, dns_cache_answers_launch_resolve);
+  MOCK(launch_one_resolve, dns_cache_answers_launch_one_resolve);
+  MOCK(set_exitconn_info_from_resolve,
+       dns_cache_answers_set_exitconn_info_from_resolve);
+  MOCK(we_are_hibernating, dns_cache_answers_we_are_hibernating);
+
+  dns_init();
+
+  /* A miss, then an answer: the pending entry becomes the cached one. */
+  tt_int_op(dns_cache_answers_resolve("torproject.org", &resolve), OP_EQ, 0);
+  tt_assert(resolve);
+  tt_int_op(resolve->state, OP_EQ, CACHE_STATE_PENDING);
+  tt_u64_op(dns_cache_get_stat(DNS_CACHE_STAT_MISS), OP_EQ, 1);
+
+  tor_addr_parse(&addr, "1.2.3.4");
+  dns_found_answer("torproject.org", DNS_IPv4_A, DNS_ERR_NONE, &addr,
+                   NULL, 600);
+  tt_int_op(resolve->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(resolve->res_status_ipv4, OP_EQ, RES_STATUS_DONE_OK);
+  tt_int_op(resolve->result_ipv4.addr_ipv4, OP_EQ, 0x01020304);
+  tt_i64_op(resolve->expire, OP_GE, now + 600);
+
+  /* Hits, while the answer is fresh, don't refresh it. */
+  tt_int_op(dns_cache_answers_resolve("torproject.org", &r), OP_EQ, 0);
+  tt_ptr_op(r, OP_EQ, resolve);
+  tt_int_op(dns_cache_answers_resolve("torproject.org", &r), OP_EQ, 0);
+  tt_u64_op(dns_cache_get_stat(DNS_CACHE_STAT_HIT), OP_EQ, 2);
+  tt_int_op(n_launch_one_resolve, OP_EQ, 0);
+
+  /* Once it's about to expire, the next hit refreshes it. */
+  resolve->expire = now + 10;
+  tt_int_op(dns_cache_answers_resolve("torproject.org", &r), OP_EQ, 0);
+  tt_int_op(n_launch_one_resolve, OP_EQ, 1);
+  tt_assert(resolve->refresh_ipv4);
+  tt_u64_op(dns_cache_get_stat(DNS_CACHE_STAT_PREFETCH), OP_EQ, 1);
+  /* ... but only once. */
+  tt_int_op(dns_cache_answers_resolve("torproject.org", &r), OP_EQ, 0);
+  tt_int_op(n_launch_one_resolve, OP_EQ, 1);
+
+  tor_addr_parse(&addr, "5.6.7.8");
+  dns_found_answer("torproject.org", DNS_IPv4_A, DNS_ERR_NONE, &addr,
+                   NULL, 900);
+  tt_int_op(resolve->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_assert(!resolve->refresh_ipv4);
+  tt_int_op(resolve->result_ipv4.addr_ipv4, OP_EQ, 0x05060708);
+  tt_i64_op(resolve->expire, OP_GE, now + 900);
+  tt_int_op(resolve->n_hits, OP_EQ, 0);
+
+  /* A transient failure is cached, but not for long. */
+  tt_int_op(dns_cache_answers_resolve("example.com", &resolve), OP_EQ, 0);
+  tt_assert(resolve);
+  dns_found_answer("example.com", DNS_IPv4_A, DNS_ERR_SERVERFAILED, NULL,
+                   NULL, 600);
+  tt_int_op(resolve->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(resolve->res_status_ipv4, OP_EQ, RES_STATUS_DONE_ERR);
+  tt_i64_op(resolve->expire, OP_LE, time(NULL) + 30);
+  tt_int_op(dns_cache_answers_resolve("example.com", &r), OP_EQ, -2);
+  tt_u64_op(dns_cache_get_stat(DNS_CACHE_STAT_NEGATIVE_HIT), OP_EQ, 1);
+
+  /* Overlong names are refused before they reach the cache. */
+  {
+    char name[MAX_ADDRESSLEN + 8];
+    memset(name, 'a', sizeof(name) - 5);
+    strlcpy(name + sizeof(name) - 5, ".com", 5);
+    tt_int_op(dns_cache_answers_resolve(name, &r), OP_EQ, -1);
+    tt_ptr_op(r, OP_EQ, NULL);
+  }
+
+ done:
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  UNMOCK(launch_resolve);
+  UNMOCK(launch_one_resolve);
+  UNMOCK(set_exitconn_info_from_resolve);
+  UNMOCK(we_are_hibernating);
+  dns_free_all();
+}
+
 struct testcase_t dns_tests[] = {
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
    { "configure_ns_fallback", test_dns_configure_ns_fallback,
@@ -821,5 +976,6 @@ struct testcase_t dns_tests[] = {
    { "impl_cache_hit_cached", test_dns_impl_cache_hit_cached,
      TT_FORK, NULL, NULL },
    { "impl_cache_miss", test_dns_impl_cache_miss, TT_FORK, NULL, NULL },
+   { "cache_answers", test_dns_cache_answers, TT_FORK, NULL, NULL },
    END_OF_TESTCASES
 };
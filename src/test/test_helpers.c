@@ -144,6 +144,30 @@ helper_setup_fake_routerlist(void)
   UNMOCK(router_descriptor_is_older_than);
 }
 
+/** Write the file containing our test router descriptors to the router
+ * journal in our cache directory, then load the routerlist from disk. */
+void
+helper_setup_fake_router_journal(void)
+{
+  char *fname = get_cachedir_fname("cached-descriptors.new");
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, TEST_DESCRIPTORS, 0));
+
+  MOCK(router_descriptor_is_older_than,
+       router_descriptor_is_older_than_replacement);
+  update_approx_time(1603981036);
+
+  tt_int_op(0, OP_EQ, router_reload_router_list());
+  tt_int_op(smartlist_len(router_get_routerlist()->routers), OP_EQ,
+            HELPER_NUMBER_OF_DESCRIPTORS);
+  routerlist_assert_ok(router_get_routerlist());
+
+ done:
+  update_approx_time(0);
+  UNMOCK(router_descriptor_is_older_than);
+  tor_free(fname);
+}
+
 void
 connection_write_to_buf_mock(const char *string, size_t len,
                              connection_t *conn, int compressed)
@@ -17,6 +17,7 @@ circuit_t * dummy_origin_circuit_new(int num_cells);
 #define HELPER_NUMBER_OF_DESCRIPTORS 8
 
 void helper_setup_fake_routerlist(void);
+void helper_setup_fake_router_journal(void);
 
 #define GET(path) "GET " path " HTTP/1.0\r\n\r\n"
 void connection_write_to_buf_mock(const char *string, size_t len,
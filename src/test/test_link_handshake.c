@@ -11,6 +11,8 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/connection_or.h"
 #include "core/or/channeltls.h"
 #include "trunnel/link_handshake.h"
@@ -28,6 +30,7 @@
 #define TOR_X509_PRIVATE
 #include "lib/tls/tortls.h"
 #include "lib/tls/x509.h"
+#include "lib/evloop/workqueue.h"
 
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -542,6 +545,146 @@ test_link_handshake_recv_certs_ok_server(void *arg)
   ;
 }
 
+static void
+test_link_handshake_recv_certs_cached(void *arg)
+{
+  certs_data_t *d = arg;
+  const uint64_t hits =
+    or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_HIT);
+  const uint64_t misses =
+    or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_MISS);
+
+  channel_tls_process_certs_cell(d->cell, d->chan);
+  tt_int_op(0, OP_EQ, mock_close_called);
+  tt_int_op(d->c->handshake_state->authenticated, OP_EQ, 1);
+  tt_u64_op(or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_HIT),
+            OP_EQ, hits);
+  tt_u64_op(or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_MISS),
+            OP_EQ, misses + 1);
+
+  /* Now the same peer connects again, with the same certificates. */
+  or_handshake_state_free(d->c->handshake_state);
+  d->c->handshake_state = NULL;
+  tt_int_op(connection_init_or_handshake_state(d->c, 1), OP_EQ, 0);
+  channel_tls_process_certs_cell(d->cell, d->chan);
+  tt_int_op(0, OP_EQ, mock_close_called);
+  tt_int_op(d->c->handshake_state->authenticated, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated_rsa, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated_ed25519, OP_EQ, d->is_ed);
+  tt_u64_op(or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_HIT),
+            OP_EQ, hits + 1);
+  tt_u64_op(or_handshake_certs_cache_get_stat(LINK_CERT_CACHE_STAT_MISS),
+            OP_EQ, misses + 1);
+
+ done:
+  ;
+}
+
+static smartlist_t *fake_work = NULL;
+static struct workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)prio;
+  tt_int_op(fn(NULL, arg), OP_EQ, WQ_RPL_REPLY);
+  smartlist_add(fake_work, reply_fn);
+  smartlist_add(fake_work, arg);
+ done:
+  return (struct workqueue_entry_t *)arg;
+}
+
+static unsigned int
+mock_cpuworker_get_n_threads(void)
+{
+  return 1;
+}
+
+/** Make link handshake checks on <b>conn</b> go to a fake worker thread. */
+static void
+start_fake_workers(or_connection_t *conn)
+{
+  fake_work = smartlist_new();
+  smartlist_add(get_connection_array(), TO_CONN(conn));
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+}
+
+/** Run the replies for the work that mock_cpuworker_queue_work() did. */
+static void
+run_fake_replies(void)
+{
+  for (int i = 0; i < smartlist_len(fake_work); i += 2) {
+    void (*reply_fn)(void *) = smartlist_get(fake_work, i);
+    reply_fn(smartlist_get(fake_work, i+1));
+  }
+  smartlist_clear(fake_work);
+}
+
+/** Undo start_fake_workers(). */
+static void
+stop_fake_workers(or_connection_t *conn)
+{
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(cpuworker_get_n_threads);
+  smartlist_remove(get_connection_array(), TO_CONN(conn));
+  smartlist_free(fake_work);
+}
+
+static void
+test_link_handshake_recv_certs_queued(void *arg)
+{
+  certs_data_t *d = arg;
+  start_fake_workers(d->c);
+  d->c->tls = tor_tls_new(-1, 0);
+
+  channel_tls_process_certs_cell(d->cell, d->chan);
+  /* The worker has the certificates; we're waiting for it. */
+  tt_int_op(smartlist_len(fake_work), OP_EQ, 2);
+  tt_int_op(d->c->handshake_state->link_auth_pending, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->received_certs_cell, OP_EQ, 0);
+  tt_int_op(d->c->handshake_state->authenticated, OP_EQ, 0);
+  tt_ptr_op(d->c->handshake_state->certs->ed_id_sign, OP_EQ, NULL);
+  /* No cells get processed in the meantime. */
+  tt_int_op(connection_or_process_inbuf(d->c), OP_EQ, 0);
+
+  run_fake_replies();
+  tt_int_op(0, OP_EQ, mock_close_called);
+  tt_int_op(d->c->handshake_state->link_auth_pending, OP_EQ, 0);
+  tt_int_op(d->c->handshake_state->received_certs_cell, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated_rsa, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated_ed25519, OP_EQ, 1);
+  tt_ptr_op(d->c->handshake_state->certs->id_cert, OP_NE, NULL);
+  tt_ptr_op(d->c->handshake_state->certs->ed_id_sign, OP_NE, NULL);
+  tt_ptr_op(d->c->handshake_state->certs->ed_sign_link, OP_NE, NULL);
+
+ done:
+  stop_fake_workers(d->c);
+}
+
+static void
+test_link_handshake_recv_certs_queued_closed(void *arg)
+{
+  certs_data_t *d = arg;
+  start_fake_workers(d->c);
+  d->c->tls = tor_tls_new(-1, 0);
+
+  channel_tls_process_certs_cell(d->cell, d->chan);
+  tt_int_op(d->c->handshake_state->link_auth_pending, OP_EQ, 1);
+
+  /* If the connection goes away, the reply just gets dropped. */
+  smartlist_remove(get_connection_array(), TO_CONN(d->c));
+  run_fake_replies();
+  tt_int_op(0, OP_EQ, mock_close_called);
+  tt_int_op(d->c->handshake_state->link_auth_pending, OP_EQ, 1);
+  tt_int_op(d->c->handshake_state->authenticated, OP_EQ, 0);
+
+ done:
+  stop_fake_workers(d->c);
+}
+
 #define CERTS_FAIL(name, code)                          \
   static void                                                           \
   test_link_handshake_recv_certs_ ## name(void *arg)                    \
@@ -1334,6 +1477,50 @@ test_link_handshake_auth_cell(void *arg)
   crypto_pk_free(auth_pubkey);
 }
 
+static void
+test_link_handshake_auth_queued(void *arg)
+{
+  authenticate_data_t *d = arg;
+  start_fake_workers(d->c2);
+
+  channel_tls_process_authenticate_cell(d->cell, d->chan2);
+  tt_int_op(smartlist_len(fake_work), OP_EQ, 2);
+  tt_int_op(d->c2->handshake_state->link_auth_pending, OP_EQ, 1);
+  tt_int_op(d->c2->handshake_state->authenticated, OP_EQ, 0);
+
+  run_fake_replies();
+  tt_int_op(mock_close_called, OP_EQ, 0);
+  tt_int_op(d->c2->handshake_state->link_auth_pending, OP_EQ, 0);
+  tt_int_op(d->c2->handshake_state->authenticated, OP_EQ, 1);
+  tt_int_op(d->c2->handshake_state->authenticated_ed25519, OP_EQ, 1);
+  tt_int_op(d->c2->handshake_state->authenticated_rsa, OP_EQ, 1);
+
+ done:
+  stop_fake_workers(d->c2);
+}
+
+static void
+test_link_handshake_auth_queued_badsig(void *arg)
+{
+  authenticate_data_t *d = arg;
+  start_fake_workers(d->c2);
+  setup_capture_of_logs(LOG_INFO);
+  d->cell->payload[d->cell->payload_len - 5] ^= 0xff;
+
+  channel_tls_process_authenticate_cell(d->cell, d->chan2);
+  tt_int_op(d->c2->handshake_state->link_auth_pending, OP_EQ, 1);
+  tt_int_op(mock_close_called, OP_EQ, 0);
+
+  run_fake_replies();
+  tt_int_op(mock_close_called, OP_EQ, 1);
+  tt_int_op(d->c2->handshake_state->authenticated, OP_EQ, 0);
+  expect_log_msg_containing("Ed25519 signature wasn't valid");
+
+ done:
+  teardown_capture_of_logs();
+  stop_fake_workers(d->c2);
+}
+
 #define AUTHENTICATE_FAIL(name, code)                           \
   static void                                                   \
   test_link_handshake_auth_ ## name(void *arg)                  \
@@ -1477,6 +1664,10 @@ struct testcase_t link_handshake_tests[] = {
   TEST_RCV_CERTS_ED(ok, "Ed25519-Link"),
   TEST_RCV_CERTS_RSA(ok_server, "RSA-Auth"),
   TEST_RCV_CERTS_ED(ok_server, "Ed25519-Auth"),
+  TEST_RCV_CERTS(cached),
+  TEST_RCV_CERTS_ED(cached, "Ed25519-Link"),
+  TEST_RCV_CERTS_ED(queued, "Ed25519-Link"),
+  TEST_RCV_CERTS_ED(queued_closed, "Ed25519-Link"),
   TEST_RCV_CERTS(badstate),
   TEST_RCV_CERTS(badproto),
   TEST_RCV_CERTS(duplicate),
@@ -1534,6 +1725,8 @@ struct testcase_t link_handshake_tests[] = {
 
   TEST_AUTHENTICATE(cell),
   TEST_AUTHENTICATE_ED(cell),
+  TEST_AUTHENTICATE_ED(queued),
+  TEST_AUTHENTICATE_ED(queued_badsig),
   TEST_AUTHENTICATE(badstate),
   TEST_AUTHENTICATE(badproto),
   TEST_AUTHENTICATE(atclient),
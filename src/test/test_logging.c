@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "app/main/log_writer.h"
 #include "lib/err/torerr.h"
 #include "lib/log/log.h"
 #include "test/test.h"
@@ -181,9 +182,162 @@ test_ratelim(void *arg)
   tor_free(msg);
 }
 
+static int n_async_wakeups = 0;
+
+static void
+count_async_wakeup(void)
+{
+  ++n_async_wakeups;
+}
+
+/** Helper: start logging notices and up to <b>fn</b>, with nothing else
+ * logging. */
+static void
+setup_async_file_log(const char *fn)
+{
+  log_severity_list_t severity;
+  set_log_severity_config(LOG_NOTICE, LOG_ERR, &severity);
+  init_logging(1);
+  mark_logs_temp();
+  tt_int_op(open_and_add_file_log(&severity, fn, 1), OP_EQ, 0);
+  close_temp_logs();
+ done:
+  ;
+}
+
+static void
+test_async_queue(void *arg)
+{
+  const char *fn = get_fname("async_queue_log");
+  char *content = NULL;
+  (void)arg;
+
+  setup_async_file_log(fn);
+  n_async_wakeups = 0;
+  logs_set_async(0, LOG_ASYNC_BLOCK, count_async_wakeup);
+  tt_assert(logs_are_async());
+
+  log_notice(LD_GENERAL, "First queued message.");
+  log_notice(LD_GENERAL, "Second queued message.");
+  /* One wakeup is enough until somebody writes the queue. */
+  tt_int_op(n_async_wakeups, OP_EQ, 1);
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(content, OP_NE, NULL);
+  tt_ptr_op(strstr(content, "queued message"), OP_EQ, NULL);
+  tor_free(content);
+
+  tt_u64_op(logs_async_write_pending(), OP_GT, 0);
+  tt_u64_op(logs_async_write_pending(), OP_EQ, 0);
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "First queued message."));
+  tt_assert(strstr(strstr(content, "First queued message."),
+                   "Second queued message."));
+  tor_free(content);
+
+  /* Errors get written at once, after what was already queued. */
+  log_notice(LD_GENERAL, "Third queued message.");
+  tt_int_op(n_async_wakeups, OP_EQ, 2);
+  log_err(LD_GENERAL, "An error that can't wait.");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "Third queued message."));
+  tt_assert(strstr(strstr(content, "Third queued message."),
+                   "An error that can't wait."));
+  tor_free(content);
+  tt_u64_op(logs_async_write_pending(), OP_EQ, 0);
+
+  /* Going back to synchronous logging writes the queue. */
+  log_notice(LD_GENERAL, "Fourth queued message.");
+  logs_set_sync();
+  tt_assert(!logs_are_async());
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "Fourth queued message."));
+  tt_u64_op(logs_async_get_n_dropped(), OP_EQ, 0);
+
+ done:
+  logs_set_sync();
+  tor_free(content);
+}
+
+static void
+test_async_full(void *arg)
+{
+  const char *fn = get_fname("async_full_log");
+  char *content = NULL;
+  char *big = tor_malloc(4001);
+  const log_async_policy_t policy =
+    !strcmp(arg, "drop") ? LOG_ASYNC_DROP : LOG_ASYNC_BLOCK;
+  int i;
+
+  memset(big, 'x', 4000);
+  big[4000] = '\0';
+  setup_async_file_log(fn);
+  logs_set_async(0, policy, count_async_wakeup);
+
+  /* Nobody is writing the queue, so 100 of these can't all fit. */
+  for (i = 0; i < 100; ++i)
+    log_notice(LD_GENERAL, "msg-%d %s", i, big);
+
+  if (policy == LOG_ASYNC_DROP) {
+    tt_u64_op(logs_async_get_n_dropped(), OP_GT, 0);
+    logs_async_write_pending();
+    log_notice(LD_GENERAL, "After the flood.");
+    logs_async_write_pending();
+    content = read_file_to_str(fn, 0, NULL);
+    tt_assert(strstr(content, "log messages dropped"));
+    tt_assert(strstr(strstr(content, "log messages dropped"),
+                     "After the flood."));
+    tt_ptr_op(strstr(content, "msg-99 xxx"), OP_EQ, NULL);
+  } else {
+    tt_u64_op(logs_async_get_n_dropped(), OP_EQ, 0);
+    logs_set_sync();
+    content = read_file_to_str(fn, 0, NULL);
+    tt_assert(strstr(content, "msg-0 xxx"));
+    tt_assert(strstr(strstr(content, "msg-0 xxx"), "msg-99 xxx"));
+    tt_ptr_op(strstr(content, "log messages dropped"), OP_EQ, NULL);
+  }
+
+ done:
+  logs_set_sync();
+  tor_free(big);
+  tor_free(content);
+}
+
+static void
+test_async_writer_thread(void *arg)
+{
+  const char *fn = get_fname("async_thread_log");
+  char *content = NULL;
+  int i;
+  (void)arg;
+
+  setup_async_file_log(fn);
+  tt_int_op(log_writer_start(0, LOG_ASYNC_BLOCK), OP_EQ, 0);
+  tt_assert(log_writer_is_running());
+  for (i = 0; i < 1000; ++i)
+    log_notice(LD_GENERAL, "Message %d from the main thread.", i);
+  log_writer_stop();
+  tt_assert(!log_writer_is_running());
+  tt_assert(!logs_are_async());
+
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "Message 0 from the main thread."));
+  tt_assert(strstr(strstr(content, "Message 0 from the main thread."),
+                   "Message 999 from the main thread."));
+
+ done:
+  log_writer_stop();
+  tor_free(content);
+}
+
 struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
   { "ratelim", test_ratelim, 0, NULL, NULL },
+  { "async_queue", test_async_queue, TT_FORK, NULL, NULL },
+  { "async_full_block", test_async_full, TT_FORK, &passthrough_setup,
+    (void*)"block" },
+  { "async_full_drop", test_async_full, TT_FORK, &passthrough_setup,
+    (void*)"drop" },
+  { "async_writer_thread", test_async_writer_thread, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
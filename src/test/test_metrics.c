@@ -26,6 +26,8 @@
 #include "feature/metrics/metrics.h"
 
 #include "lib/encoding/confline.h"
+#include "lib/metrics/metrics_hdr_histogram.h"
+#include "lib/metrics/metrics_registry.h"
 #include "lib/metrics/metrics_store.h"
 
 #include <limits.h>
@@ -404,6 +406,251 @@ test_store(void *arg)
   metrics_store_free(store);
 }
 
+static void
+test_store_recycle(void *arg)
+{
+  metrics_store_t *store = NULL;
+  metrics_store_entry_t *e1 = NULL, *e2 = NULL, *entry = NULL;
+  const smartlist_t *entries;
+  buf_t *buf = buf_new();
+  char *output = NULL, *first_output = NULL;
+  const char *label1 = NULL;
+
+  (void) arg;
+
+  store = metrics_store_new();
+
+  /* Fill the store once, the way relay_metrics does on each request. */
+  e1 = metrics_store_add(store, METRICS_TYPE_COUNTER, TEST_METRICS_ENTRY_NAME,
+                         TEST_METRICS_ENTRY_HELP, 0, NULL);
+  metrics_store_entry_add_label(e1, TEST_METRICS_ENTRY_LABEL_1);
+  metrics_store_entry_update(e1, 1);
+  e2 = metrics_store_add(store, METRICS_TYPE_COUNTER, TEST_METRICS_ENTRY_NAME,
+                         TEST_METRICS_ENTRY_HELP, 0, NULL);
+  metrics_store_entry_add_label(e2, TEST_METRICS_ENTRY_LABEL_2);
+  metrics_store_entry_update(e2, 2);
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  first_output = buf_extract(buf, NULL);
+  buf_clear(buf);
+  label1 = smartlist_get(e1->labels, 0);
+
+  /* After a reset, the store looks empty... */
+  metrics_store_reset(store);
+  tt_assert(!metrics_store_get_all(store, TEST_METRICS_ENTRY_NAME));
+
+  /* ...but filling it again reuses the same entries, labels included. */
+  entry = metrics_store_add(store, METRICS_TYPE_COUNTER,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP, 0, NULL);
+  tt_ptr_op(entry, OP_EQ, e1);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ, 0);
+  metrics_store_entry_add_label(entry, TEST_METRICS_ENTRY_LABEL_1);
+  tt_ptr_op(smartlist_get(entry->labels, 0), OP_EQ, label1);
+  metrics_store_entry_update(entry, 1);
+  entry = metrics_store_add(store, METRICS_TYPE_COUNTER,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP, 0, NULL);
+  tt_ptr_op(entry, OP_EQ, e2);
+  metrics_store_entry_add_label(entry, TEST_METRICS_ENTRY_LABEL_2);
+  metrics_store_entry_update(entry, 2);
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  output = buf_extract(buf, NULL);
+  buf_clear(buf);
+  tt_str_op(output, OP_EQ, first_output);
+  tor_free(output);
+
+  /* Fill it with different labels and fewer entries: the output must only
+   * show what was added this time. */
+  metrics_store_reset(store);
+  entry = metrics_store_add(store, METRICS_TYPE_COUNTER,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP, 0, NULL);
+  metrics_store_entry_add_label(entry, TEST_METRICS_ENTRY_LABEL_2);
+  metrics_store_entry_update(entry, 5);
+  tt_assert(!metrics_store_entry_has_label(entry,
+                                           TEST_METRICS_ENTRY_LABEL_1));
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  output = buf_extract(buf, NULL);
+  buf_clear(buf);
+  tt_str_op(output, OP_EQ,
+            "# HELP " TEST_METRICS_ENTRY_NAME " "
+            TEST_METRICS_ENTRY_HELP "\n"
+            "# TYPE " TEST_METRICS_ENTRY_NAME " counter\n"
+            TEST_METRICS_ENTRY_NAME "{" TEST_METRICS_ENTRY_LABEL_2 "} 5\n");
+  tor_free(output);
+
+  /* A prefix of the old labels, then nothing: the dropped label must not
+   * linger in the output. */
+  metrics_store_reset(store);
+  entry = metrics_store_add(store, METRICS_TYPE_COUNTER,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP, 0, NULL);
+  metrics_store_entry_update(entry, 7);
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  output = buf_extract(buf, NULL);
+  buf_clear(buf);
+  tt_assert(strstr(output, "\n" TEST_METRICS_ENTRY_NAME " 7\n"));
+  tor_free(output);
+
+  /* A different type can't reuse the entry. */
+  metrics_store_reset(store);
+  entry = metrics_store_add(store, METRICS_TYPE_GAUGE,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP, 0, NULL);
+  tt_int_op(entry->type, OP_EQ, METRICS_TYPE_GAUGE);
+  entries = metrics_store_get_all(store, TEST_METRICS_ENTRY_NAME);
+  tt_int_op(smartlist_len(entries), OP_EQ, 1);
+
+ done:
+  buf_free(buf);
+  tor_free(output);
+  tor_free(first_output);
+  metrics_store_free(store);
+}
+
+static void
+test_hdr_histogram(void *arg)
+{
+  (void) arg;
+
+  /* Small values get a bucket each; then each power of two is split in
+   * four. */
+  tt_int_op(metrics_hdr_histogram_bucket_idx(0), OP_EQ, 0);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(3), OP_EQ, 3);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(4), OP_EQ, 4);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(7), OP_EQ, 7);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(8), OP_EQ, 8);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(9), OP_EQ, 8);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(10), OP_EQ, 9);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(1000), OP_EQ, 35);
+  tt_int_op(metrics_hdr_histogram_bucket_idx((1 << METRICS_HDR_MAX_BITS) - 1),
+            OP_EQ, METRICS_HDR_N_BUCKETS - 1);
+  tt_int_op(metrics_hdr_histogram_bucket_idx(1 << METRICS_HDR_MAX_BITS),
+            OP_EQ, -1);
+
+  /* Every value must land in the bucket whose range holds it. */
+  for (uint64_t v = 0; v < (1 << METRICS_HDR_MAX_BITS); v += 1 + v / 7) {
+    int idx = metrics_hdr_histogram_bucket_idx(v);
+    tt_u64_op(v, OP_LE, metrics_hdr_histogram_bucket_max(idx));
+    if (idx > 0) {
+      tt_u64_op(v, OP_GT, metrics_hdr_histogram_bucket_max(idx - 1));
+    }
+  }
+  tt_u64_op(metrics_hdr_histogram_bucket_max(METRICS_HDR_N_BUCKETS - 1),
+            OP_EQ, (1 << METRICS_HDR_MAX_BITS) - 1);
+
+ done:
+  ;
+}
+
+static void
+test_registry(void *arg)
+{
+  static metrics_reg_counter_t counters[2];
+  static metrics_reg_gauge_t gauge;
+  static metrics_reg_histogram_t hist;
+  metrics_registry_t *reg = NULL;
+  metrics_store_t *store = NULL;
+  metrics_store_entry_t *entry;
+  buf_t *buf = buf_new();
+  char *output = NULL;
+
+  (void) arg;
+
+  metrics_reg_counter_add(&counters[0], 3);
+  metrics_reg_counter_add(&counters[1], 1);
+  metrics_reg_counter_add(&counters[1], 41);
+  tt_u64_op(metrics_reg_counter_get(&counters[1]), OP_EQ, 42);
+  metrics_reg_gauge_set(&gauge, 5);
+  metrics_reg_gauge_add(&gauge, -12);
+  tt_i64_op(metrics_reg_gauge_get(&gauge), OP_EQ, -7);
+
+  metrics_reg_histogram_record(&hist, 2);
+  metrics_reg_histogram_record(&hist, 9);
+  metrics_reg_histogram_record(&hist, 9);
+  metrics_reg_histogram_record(&hist, 1000);
+  metrics_reg_histogram_record(&hist, UINT32_MAX);
+  tt_u64_op(metrics_reg_value_get(&hist.count), OP_EQ, 5);
+  tt_u64_op(metrics_reg_value_get(&hist.buckets[2]), OP_EQ, 1);
+  tt_u64_op(metrics_reg_value_get(&hist.buckets[8]), OP_EQ, 2);
+  tt_u64_op(metrics_reg_value_get(&hist.sum), OP_EQ,
+            2 + 9 + 9 + 1000 + (uint64_t) UINT32_MAX);
+
+  /* Metrics of the same name are output together, under one header, in the
+   * order they were added. */
+  reg = metrics_registry_new();
+  metrics_registry_add_counter(reg, &counters[0], TEST_METRICS_ENTRY_NAME,
+                               TEST_METRICS_ENTRY_HELP,
+                               TEST_METRICS_ENTRY_LABEL_1);
+  metrics_registry_add_gauge(reg, &gauge, "gauge", "A gauge", NULL);
+  metrics_registry_add_counter(reg, &counters[1], TEST_METRICS_ENTRY_NAME,
+                               NULL, TEST_METRICS_ENTRY_LABEL_2);
+
+  static const char *expected =
+    "# HELP " TEST_METRICS_ENTRY_NAME " " TEST_METRICS_ENTRY_HELP "\n"
+    "# TYPE " TEST_METRICS_ENTRY_NAME " counter\n"
+    TEST_METRICS_ENTRY_NAME "{" TEST_METRICS_ENTRY_LABEL_1 "} 3\n"
+    TEST_METRICS_ENTRY_NAME "{" TEST_METRICS_ENTRY_LABEL_2 "} 42\n"
+    "# HELP gauge A gauge\n"
+    "# TYPE gauge gauge\n"
+    "gauge -7\n";
+
+  metrics_registry_get_output(METRICS_FORMAT_PROMETHEUS, reg, buf);
+  output = buf_extract(buf, NULL);
+  tt_str_op(expected, OP_EQ, output);
+  tor_free(output);
+  buf_clear(buf);
+
+  /* Values are read on each request. */
+  metrics_reg_counter_add(&counters[0], 1);
+  metrics_registry_get_output(METRICS_FORMAT_PROMETHEUS, reg, buf);
+  output = buf_extract(buf, NULL);
+  tt_assert(strstr(output, TEST_METRICS_ENTRY_NAME "{"
+                   TEST_METRICS_ENTRY_LABEL_1 "} 4\n"));
+  tor_free(output);
+  buf_clear(buf);
+
+  /* A histogram gets cumulative buckets; the too-large value only shows in
+   * the +Inf bucket. Its output follows the entries of the store it is
+   * attached to. */
+  metrics_registry_add_histogram(reg, &hist, TEST_METRICS_HIST_ENTRY_NAME,
+                                 TEST_METRICS_HIST_ENTRY_HELP,
+                                 TEST_METRICS_ENTRY_LABEL_1);
+  store = metrics_store_new();
+  entry = metrics_store_add(store, METRICS_TYPE_GAUGE, "store_gauge",
+                            "A store gauge", 0, NULL);
+  metrics_store_entry_update(entry, 1);
+  metrics_store_set_registry(store, reg);
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  output = buf_extract(buf, NULL);
+
+  tt_ptr_op(strstr(output, "store_gauge 1\n"), OP_EQ, output +
+            strlen("# HELP store_gauge A store gauge\n"
+                   "# TYPE store_gauge gauge\n"));
+  tt_assert(strstr(output, "# TYPE " TEST_METRICS_HIST_ENTRY_NAME
+                   " histogram\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_bucket{"
+                   TEST_METRICS_ENTRY_LABEL_1 ",le=\"1.00\"} 0\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_bucket{"
+                   TEST_METRICS_ENTRY_LABEL_1 ",le=\"2.00\"} 1\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_bucket{"
+                   TEST_METRICS_ENTRY_LABEL_1 ",le=\"9.00\"} 3\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_bucket{"
+                   TEST_METRICS_ENTRY_LABEL_1 ",le=\"1048575.00\"} 4\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_bucket{"
+                   TEST_METRICS_ENTRY_LABEL_1 ",le=\"+Inf\"} 5\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_sum{"
+                   TEST_METRICS_ENTRY_LABEL_1 "} 4294968315\n"));
+  tt_assert(strstr(output, TEST_METRICS_HIST_ENTRY_NAME "_count{"
+                   TEST_METRICS_ENTRY_LABEL_1 "} 5\n"));
+
+ done:
+  buf_free(buf);
+  tor_free(output);
+  metrics_store_free(store);
+  metrics_registry_free(reg);
+}
+
 struct testcase_t metrics_tests[] = {
 
   { "config", test_config, TT_FORK, NULL, NULL },
@@ -411,6 +658,9 @@ struct testcase_t metrics_tests[] = {
   { "prometheus", test_prometheus, TT_FORK, NULL, NULL },
   { "prometheus_histogram", test_prometheus_histogram, TT_FORK, NULL, NULL },
   { "store", test_store, TT_FORK, NULL, NULL },
+  { "store_recycle", test_store_recycle, TT_FORK, NULL, NULL },
+  { "hdr_histogram", test_hdr_histogram, TT_FORK, NULL, NULL },
+  { "registry", test_registry, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
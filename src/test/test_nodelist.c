@@ -14,8 +14,11 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_hot.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
 
 #include "core/or/extend_info_st.h"
@@ -30,6 +33,7 @@
 
 #include "test/test.h"
 #include "test/log_test_helpers.h"
+#include "test/test_helpers.h"
 
 /** Test the case when node_get_by_id() returns NULL,
  * node_get_verbose_nickname_by_id should return the base 16 encoding
@@ -1418,6 +1422,262 @@ test_nodelist_routerstatus_has_visibly_changed(void *arg)
   return;
 }
 
+/** Make sure that router_choose_random_node() only picks nodes that it is
+ * allowed to pick, and notices when nodes go down. */
+static void
+test_nodelist_router_choose_random_node(void *arg)
+{
+  smartlist_t *excluded = smartlist_new();
+  const smartlist_t *nodelist;
+  const node_t *choice, *n0, *n1;
+  int seen0 = 0, seen1 = 0;
+  (void) arg;
+
+  helper_setup_fake_routerlist();
+  nodelist = nodelist_get_list();
+  tt_int_op(smartlist_len(nodelist), OP_EQ, HELPER_NUMBER_OF_DESCRIPTORS);
+
+  /* Exclude everything but the first two nodes. */
+  n0 = smartlist_get(nodelist, 0);
+  n1 = smartlist_get(nodelist, 1);
+  SMARTLIST_FOREACH(nodelist, node_t *, node,
+                    if (node_sl_idx >= 2) smartlist_add(excluded, node));
+
+  for (int i = 0; i < 200; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_assert(choice == n0 || choice == n1);
+    seen0 += (choice == n0);
+    seen1 += (choice == n1);
+  }
+  tt_int_op(seen0, OP_GT, 0);
+  tt_int_op(seen1, OP_GT, 0);
+
+  /* If we exclude everybody, there's nobody to choose. */
+  smartlist_add(excluded, (node_t *) n0);
+  smartlist_add(excluded, (node_t *) n1);
+  setup_full_capture_of_logs(LOG_WARN);
+  choice = router_choose_random_node(excluded, NULL, 0);
+  expect_single_log_msg_containing("No available nodes");
+  teardown_capture_of_logs();
+  tt_ptr_op(choice, OP_EQ, NULL);
+  smartlist_del_keeporder(excluded, smartlist_len(excluded) - 1);
+  smartlist_del_keeporder(excluded, smartlist_len(excluded) - 1);
+
+  /* Once a node goes down, we must stop choosing it. */
+  router_set_status(n0->identity, 0);
+  for (int i = 0; i < 50; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(choice, OP_EQ, n1);
+  }
+
+  /* And once it comes back, we can choose it again. */
+  router_set_status(n0->identity, 1);
+  seen0 = 0;
+  for (int i = 0; i < 200; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    seen0 += (choice == n0);
+  }
+  tt_int_op(seen0, OP_GT, 0);
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(excluded);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
+/** Make sure that node_sl_choose_by_bandwidth() only picks nodes from its
+ * list, in proportion to their weights. */
+static void
+test_nodelist_node_sl_choose_by_bandwidth(void *arg)
+{
+  smartlist_t *sl = smartlist_new();
+  const smartlist_t *nodelist;
+  const node_t *choice;
+  node_t *n0, *n1;
+  int seen0 = 0, seen1 = 0;
+  (void) arg;
+
+  helper_setup_fake_routerlist();
+  nodelist = nodelist_get_list();
+  n0 = smartlist_get(nodelist, 0);
+  n1 = smartlist_get(nodelist, 1);
+  smartlist_add(sl, n0);
+  smartlist_add(sl, n1);
+
+  /* Without a consensus, these are weighted by their bounded advertised
+   * bandwidth. */
+  n0->ri->bandwidthrate = n0->ri->bandwidthcapacity = 20000;
+  n1->ri->bandwidthrate = n1->ri->bandwidthcapacity = 100000;
+  node_select_index_invalidate();
+
+  for (int i = 0; i < 1200; ++i) {
+    choice = node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_MID);
+    tt_assert(choice == n0 || choice == n1);
+    seen0 += (choice == n0);
+    seen1 += (choice == n1);
+  }
+  /* We expect about 200 and 1000: these bounds fail with negligible
+   * probability. */
+  tt_int_op(seen0, OP_GT, 100);
+  tt_int_op(seen0, OP_LT, 350);
+  tt_int_op(seen1, OP_GT, 850);
+
+  /* The rest of the nodelist doesn't matter. */
+  smartlist_del_keeporder(sl, 0);
+  for (int i = 0; i < 50; ++i) {
+    choice = node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_EXIT);
+    tt_ptr_op(choice, OP_EQ, n1);
+  }
+
+ done:
+  smartlist_free(sl);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
+/** Make sure that the hot node view mirrors the nodelist, and answers the
+ * family and usable-descriptor questions the way the slow paths would. */
+static void
+test_nodelist_node_hot_view(void *arg)
+{
+  smartlist_t *sl = smartlist_new();
+  networkstatus_t *ns = NULL;
+  const smartlist_t *nodelist;
+  node_hot_view_t *hv;
+  node_t *n0, *n1, *n2, *n3;
+  node_t fake_node;
+  int np = -1, nu = -1;
+  (void) arg;
+
+  helper_setup_fake_routerlist();
+  nodelist = nodelist_get_list();
+  n0 = smartlist_get(nodelist, 0);
+  n1 = smartlist_get(nodelist, 1);
+  n2 = smartlist_get(nodelist, 2);
+  n3 = smartlist_get(nodelist, 3);
+
+  /* The view has a copy of every node's flags. */
+  n1->is_exit = n1->is_fast = 1;
+  node_select_index_invalidate();
+  hv = node_hot_view_get();
+  tt_ptr_op(hv->nodelist, OP_EQ, nodelist);
+  tt_int_op(hv->n_nodes, OP_EQ, smartlist_len(nodelist));
+  SMARTLIST_FOREACH_BEGIN(nodelist, const node_t *, node) {
+    tt_uint_op(hv->flags[node_sl_idx], OP_EQ, node_hot_flags_from_node(node));
+    tt_int_op(node_hot_view_node_idx(hv, node), OP_EQ, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  tt_uint_op(hv->flags[0] & (NODE_HOT_RUNNING|NODE_HOT_HAS_RI|NODE_HOT_HAS_RS),
+             OP_EQ, NODE_HOT_RUNNING|NODE_HOT_HAS_RI);
+  tt_uint_op(hv->flags[1] & (NODE_HOT_EXIT|NODE_HOT_FAST), OP_EQ,
+             NODE_HOT_EXIT|NODE_HOT_FAST);
+
+  /* Once we're told that the nodes have changed, it notices. */
+  n1->is_exit = 0;
+  node_select_index_invalidate();
+  hv = node_hot_view_get();
+  tt_uint_op(hv->flags[1] & NODE_HOT_EXIT, OP_EQ, 0);
+
+  /* Nodes that aren't in the nodelist aren't in the view. */
+  memset(&fake_node, 0, sizeof(fake_node));
+  fake_node.nodelist_idx = 1;
+  tt_int_op(node_hot_view_node_idx(hv, &fake_node), OP_EQ, -1);
+  tt_int_op(node_hot_view_add_family_id_members(hv, sl, &fake_node),
+            OP_EQ, -1);
+
+  /* Family IDs: n0 and n2 list one ID, n3 lists that and one more. */
+  n0->ri->family_ids = smartlist_new();
+  smartlist_add_strdup(n0->ri->family_ids, "ed25519:aaaa");
+  n2->ri->family_ids = smartlist_new();
+  smartlist_add_strdup(n2->ri->family_ids, "ed25519:aaaa");
+  n3->ri->family_ids = smartlist_new();
+  smartlist_add_strdup(n3->ri->family_ids, "ed25519:bbbb");
+  smartlist_add_strdup(n3->ri->family_ids, "ed25519:aaaa");
+  smartlist_add_strdup(n3->ri->family_ids, "ed25519:bbbb");
+  node_select_index_invalidate();
+  hv = node_hot_view_get();
+  tt_ptr_op(hv->family_id_start, OP_EQ, NULL);
+
+  tt_int_op(node_hot_view_add_family_id_members(hv, sl, n0), OP_EQ, 0);
+  tt_int_op(hv->n_family_ids, OP_EQ, 2);
+  tt_int_op(smartlist_len(sl), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, n0);
+  tt_ptr_op(smartlist_get(sl, 1), OP_EQ, n2);
+  tt_ptr_op(smartlist_get(sl, 2), OP_EQ, n3);
+  smartlist_clear(sl);
+  tt_int_op(node_hot_view_add_family_id_members(hv, sl, n3), OP_EQ, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, n0);
+  tt_ptr_op(smartlist_get(sl, 1), OP_EQ, n2);
+  tt_ptr_op(smartlist_get(sl, 2), OP_EQ, n3);
+  smartlist_clear(sl);
+  tt_int_op(node_hot_view_add_family_id_members(hv, sl, n1), OP_EQ, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 0);
+
+  /* Usable descriptors: n0, n1 and n2 are running, but we don't have the
+   * descriptor that the consensus lists for n2.  n1 and n2 are exits.  The
+   * last entry has no node at all. */
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  for (int i = 0; i < 5; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    const node_t *node = smartlist_get(nodelist, i);
+    if (i < 4) {
+      memcpy(rs->identity_digest, node->identity, DIGEST_LEN);
+      if (i != 2)
+        memcpy(rs->descriptor_digest,
+               node->ri->cache_info.signed_descriptor_digest, DIGEST_LEN);
+    } else {
+      crypto_rand(rs->identity_digest, DIGEST_LEN);
+    }
+    rs->is_flagged_running = (i != 3);
+    rs->is_exit = (i == 1 || i == 2);
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+
+  tt_int_op(node_hot_view_count_usable(hv, ns, NULL, false, false,
+                                       &np, &nu, sl), OP_EQ, 0);
+  tt_int_op(nu, OP_EQ, 3);
+  tt_int_op(np, OP_EQ, 2);
+  tt_int_op(smartlist_len(sl), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, n0);
+  tt_ptr_op(smartlist_get(sl, 1), OP_EQ, n1);
+  tt_ptr_op(smartlist_get(sl, 2), OP_EQ, n2);
+  tt_ptr_op(hv->consensus, OP_EQ, ns);
+
+  tt_int_op(node_hot_view_count_usable(hv, ns, NULL, true, false,
+                                       &np, &nu, NULL), OP_EQ, 0);
+  tt_int_op(nu, OP_EQ, 2);
+  tt_int_op(np, OP_EQ, 1);
+
+  /* An exit that rejects everything doesn't count, if we care: and, as in
+   * count_usable_descriptors(), it isn't listed either, so that its
+   * bandwidth doesn't count towards the exit fraction. */
+  n1->ri->policy_is_reject_star = 1;
+  node_select_index_invalidate();
+  hv = node_hot_view_get();
+  smartlist_clear(sl);
+  tt_int_op(node_hot_view_count_usable(hv, ns, NULL, true, true,
+                                       &np, &nu, sl), OP_EQ, 0);
+  tt_int_op(nu, OP_EQ, 2);
+  tt_int_op(np, OP_EQ, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, n2);
+  smartlist_clear(sl);
+  tt_int_op(node_hot_view_count_usable(hv, ns, NULL, true, false,
+                                       &np, &nu, sl), OP_EQ, 0);
+  tt_int_op(np, OP_EQ, 1);
+  tt_int_op(smartlist_len(sl), OP_EQ, 2);
+
+ done:
+  smartlist_free(sl);
+  networkstatus_vote_free(ns);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -1439,5 +1699,8 @@ struct testcase_t nodelist_tests[] = {
   NODE(extend_info_describe, 0),
   NODE(router_get_verbose_nickname, 0),
   NODE(routerstatus_has_visibly_changed, 0),
+  NODE(router_choose_random_node, TT_FORK),
+  NODE(node_sl_choose_by_bandwidth, TT_FORK),
+  NODE(node_hot_view, TT_FORK),
   END_OF_TESTCASES
 };
@@ -354,9 +354,75 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+/* Helper: compare uint32_t ages in descending order. */
+static int
+compare_ages_desc_(const void *a_, const void *b_)
+{
+  uint32_t a = *(const uint32_t *)a_, b = *(const uint32_t *)b_;
+  return a < b ? 1 : (a > b ? -1 : 0);
+}
+
+/** Make sure that oom_age_queue_t hands out its victims oldest first. */
+static void
+test_oom_age_queue(void *arg)
+{
+  oom_age_queue_t q;
+  const oom_victim_t *v;
+  const int n = 2000;
+  oom_victim_t *victims = tor_calloc(n, sizeof(oom_victim_t));
+  uint32_t *ages = tor_calloc(n, sizeof(uint32_t));
+  int i;
+  (void)arg;
+
+  memset(&q, 0, sizeof(q));
+
+  /* Buckets never go down as ages go up, and cover every age. */
+  tt_int_op(oom_age_bucket(0), OP_EQ, 0);
+  tt_int_op(oom_age_bucket(7), OP_EQ, 7);
+  tt_int_op(oom_age_bucket(8), OP_EQ, 8);
+  tt_int_op(oom_age_bucket(UINT32_MAX), OP_EQ, OOM_AGE_N_BUCKETS - 1);
+  for (uint32_t age = 1; age < 100000; ++age) {
+    tt_int_op(oom_age_bucket(age), OP_GE, oom_age_bucket(age - 1));
+    tt_int_op(oom_age_bucket(age), OP_LE, oom_age_bucket(age - 1) + 1);
+  }
+
+  /* An empty queue. */
+  oom_age_queue_init(&q, victims, 0);
+  tt_ptr_op(oom_age_queue_peek(&q), OP_EQ, NULL);
+  tt_ptr_op(oom_age_queue_pop(&q), OP_EQ, NULL);
+  oom_age_queue_clear(&q);
+
+  /* Lots of victims, many of which share a bucket or an age. */
+  for (i = 0; i < n; ++i) {
+    if (i % 4 == 0)
+      ages[i] = crypto_rand_int(1000);
+    else if (i % 4 == 1)
+      ages[i] = 500;
+    else
+      ages[i] = (uint32_t) crypto_rand_uint64(UINT32_MAX);
+    victims[i].item = &ages[i];
+    victims[i].age = ages[i];
+  }
+  oom_age_queue_init(&q, victims, n);
+  qsort(ages, n, sizeof(uint32_t), compare_ages_desc_);
+  for (i = 0; i < n; ++i) {
+    v = oom_age_queue_peek(&q);
+    tt_assert(v);
+    tt_ptr_op(oom_age_queue_pop(&q), OP_EQ, v);
+    tt_uint_op(v->age, OP_EQ, ages[i]);
+  }
+  tt_ptr_op(oom_age_queue_pop(&q), OP_EQ, NULL);
+
+ done:
+  oom_age_queue_clear(&q);
+  tor_free(victims);
+  tor_free(ages);
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "age_queue", test_oom_age_queue, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -7,12 +7,14 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
+#include "core/or/compiled_policy.h"
 #include "core/or/policies.h"
 #include "core/or/extendinfo.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2662,6 +2664,132 @@ test_policies_fascist_firewall_choose_address(void *arg)
   UNMOCK(get_options);
 }
 
+/** Helper: parse the comma-separated policy in <b>str</b> into a list of
+ * addr_policy_t. */
+static smartlist_t *
+compiled_policy_test_parse(const char *str)
+{
+  smartlist_t *items = smartlist_new();
+  smartlist_t *policy = smartlist_new();
+  smartlist_split_string(items, str, ",", SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK,
+                         0);
+  SMARTLIST_FOREACH_BEGIN(items, const char *, item) {
+    int malformed = 0;
+    addr_policy_t *p =
+      router_parse_addr_policy_item_from_string(item, -1, &malformed);
+    tor_assert(p);
+    smartlist_add(policy, p);
+  } SMARTLIST_FOREACH_END(item);
+  SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+  smartlist_free(items);
+  policy_expand_unspec(&policy);
+  return policy;
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  static const char *policies[] = {
+    "reject *:25,reject *:119,reject *:135-139,reject *:445,"
+    "reject *:563,reject *:1214,reject *:4661-4666,"
+    "reject *:6346-6429,reject *:6699,reject *:6881-6999,accept *:*",
+    "reject 0.0.0.0/8:*,reject 169.254.0.0/16:*,reject 127.0.0.0/8:*,"
+    "reject 192.168.0.0/16:*,reject 10.0.0.0/8:*,reject 172.16.0.0/12:*,"
+    "reject 198.51.100.7:*,reject6 [fc00::]/7:*,reject6 [::]/127:*,"
+    "reject6 [fe80::]/10:*,reject6 [2001:db8::7]:*,accept *:80,"
+    "accept *:443,accept6 [2001:db8::]/32:1-1024,reject *:*",
+    "accept 10.0.0.0/8:80-90,reject 10.1.0.0/16:85,accept 10.1.2.0/24:*,"
+    "reject 10.1.2.3:22,accept 10.0.0.0/7:22,reject 11.0.0.0/8:1-100,"
+    "accept 0.0.0.0/1:50-60,reject 128.0.0.0/1:55,"
+    "accept6 [2001:db8:1::]/48:443,reject6 [2001:db8::]/32:400-500,"
+    "accept *:1-1000,reject *:*",
+    "reject *:*",
+    "accept *:*",
+    "",
+  };
+  static const char *addrs[] = {
+    "0.0.0.1", "9.255.255.255", "10.0.0.0", "10.1.0.1", "10.1.2.3",
+    "10.1.2.4", "10.2.3.4", "11.0.0.1", "127.0.0.1", "128.0.0.1",
+    "172.16.5.5", "172.32.0.1", "192.168.1.1", "198.51.100.7",
+    "198.51.100.8", "255.255.255.255", "[::]", "[::1]", "[::2]",
+    "[fc00::1]", "[fe80::1]", "[2001:db8::7]", "[2001:db8:1::1]",
+    "[2001:db8:2::1]", "[2001:db9::1]",
+  };
+  static const uint16_t ports[] = {
+    0, 1, 21, 22, 23, 25, 55, 80, 85, 90, 91, 100, 101, 119, 443, 450, 500,
+    501, 1000, 1001, 1024, 1025, 4661, 6429, 6430, 65535,
+  };
+  smartlist_t *policy = NULL;
+  compiled_policy_t *cp = NULL;
+  tor_addr_t addr;
+  (void)arg;
+
+  for (unsigned i = 0; i < ARRAY_LENGTH(policies); ++i) {
+    policy = compiled_policy_test_parse(policies[i]);
+    cp = compiled_policy_new(policy);
+    tt_assert(cp);
+
+    /* Unknown address. */
+    for (unsigned k = 0; k < ARRAY_LENGTH(ports); ++k) {
+      tt_int_op(compare_tor_addr_to_compiled_policy(NULL, ports[k], cp),
+                OP_EQ,
+                compare_tor_addr_to_addr_policy(NULL, ports[k], policy));
+    }
+    for (int k = 1; k <= 65535; k += 37) {
+      tt_int_op(compare_tor_addr_to_compiled_policy(NULL, k, cp), OP_EQ,
+                compare_tor_addr_to_addr_policy(NULL, k, policy));
+    }
+
+    /* Known addresses, with and without a port. */
+    for (unsigned j = 0; j < ARRAY_LENGTH(addrs); ++j) {
+      tt_int_op(tor_addr_parse(&addr, addrs[j]), OP_GE, 0);
+      for (unsigned k = 0; k < ARRAY_LENGTH(ports); ++k) {
+        tt_int_op(compare_tor_addr_to_compiled_policy(&addr, ports[k], cp),
+                  OP_EQ,
+                  compare_tor_addr_to_addr_policy(&addr, ports[k], policy));
+      }
+    }
+
+    /* Random addresses and ports. */
+    for (int j = 0; j < 2000; ++j) {
+      uint16_t port = (uint16_t) crypto_rand_int(65536);
+      if (j & 1) {
+        tor_addr_from_ipv4h(&addr, crypto_rand_u32());
+      } else {
+        uint8_t a6[16];
+        crypto_rand((char*)a6, sizeof(a6));
+        a6[0] = 0x20;
+        a6[1] = 0x01;
+        a6[2] = 0x0d;
+        a6[3] = 0xb8 + (j & 2);
+        tor_addr_from_ipv6_bytes(&addr, a6);
+      }
+      tt_int_op(compare_tor_addr_to_compiled_policy(&addr, port, cp), OP_EQ,
+                compare_tor_addr_to_addr_policy(&addr, port, policy));
+    }
+
+    compiled_policy_free(cp);
+    addr_policy_list_free(policy);
+  }
+
+  /* A NULL policy accepts everything, as for the uncompiled version. */
+  tt_ptr_op(compiled_policy_new(NULL), OP_EQ, NULL);
+  tor_addr_parse(&addr, "1.2.3.4");
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, NULL), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+
+  /* Nested prefixes share trie nodes. */
+  policy = compiled_policy_test_parse(
+         "reject 10.0.0.0/8:*,reject 10.1.0.0/16:*,reject 10.1.2.0/24:*,"
+         "reject 10.1.2.3:*");
+  cp = compiled_policy_new(policy);
+  tt_int_op(compiled_policy_get_n_nodes(cp), OP_EQ, 4);
+
+ done:
+  compiled_policy_free(cp);
+  addr_policy_list_free(policy);
+}
+
 #undef TEST_IPV4_ADDR_STR
 #undef TEST_IPV6_ADDR_STR
 #undef TEST_IPV4_OR_PORT
@@ -2677,6 +2805,7 @@ struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
@@ -3,8 +3,19 @@
 
 #include "orconfig.h"
 
+#define CONNECTION_PRIVATE
+#define PROCESS_DESCS_PRIVATE
 #include "core/or/or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/mainloop/mainloop.h"
 #include "feature/dirauth/process_descs.h"
+#include "feature/dircommon/directory.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/connection_st.h"
+#include "feature/dircommon/dir_connection_st.h"
+#include "feature/nodelist/routerinfo_st.h"
 
 #include "test/test.h"
 
@@ -80,10 +91,113 @@ test_process_descs_versions(void *arg)
   ;
 }
 
+static smartlist_t *fake_work = NULL;
+static struct workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)prio;
+  tt_int_op(fn(NULL, arg), OP_EQ, WQ_RPL_REPLY);
+  smartlist_add(fake_work, reply_fn);
+  smartlist_add(fake_work, arg);
+ done:
+  return (struct workqueue_entry_t *)arg;
+}
+
+static unsigned int fake_n_threads = 0;
+static unsigned int
+mock_cpuworker_get_n_threads(void)
+{
+  return fake_n_threads;
+}
+
+static int n_uploads_done = 0;
+static dir_connection_t *last_upload_conn = NULL;
+static was_router_added_t last_upload_result;
+static const char *last_upload_msg = NULL;
+static void
+upload_done(dir_connection_t *conn, was_router_added_t r, const char *msg)
+{
+  ++n_uploads_done;
+  last_upload_conn = conn;
+  last_upload_result = r;
+  last_upload_msg = msg;
+}
+
+/** Run the replies for the work that mock_cpuworker_queue_work() did. */
+static void
+run_fake_replies(void)
+{
+  for (int i = 0; i < smartlist_len(fake_work); i += 2) {
+    void (*reply_fn)(void *) = smartlist_get(fake_work, i);
+    reply_fn(smartlist_get(fake_work, i+1));
+  }
+  smartlist_clear(fake_work);
+}
+
+static void
+test_process_descs_queued_upload(void *arg)
+{
+  (void)arg;
+  const char body[] = "This is not a descriptor.\n";
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  conn->base_.address = tor_strdup("192.0.2.1");
+  smartlist_add(get_connection_array(), TO_CONN(conn));
+
+  fake_work = smartlist_new();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+
+  /* Without worker threads, the caller has to handle the upload itself. */
+  fake_n_threads = 0;
+  tt_int_op(dirserv_queue_descriptor_upload(conn, body, strlen(body),
+                                            ROUTER_PURPOSE_GENERAL,
+                                            upload_done), OP_EQ, -1);
+  tt_int_op(dirserv_get_n_queued_descriptor_uploads(), OP_EQ, 0);
+
+  /* With them, we queue it, and report back once the main thread has
+   * handled it. */
+  fake_n_threads = 2;
+  tt_int_op(dirserv_queue_descriptor_upload(conn, body, strlen(body),
+                                            ROUTER_PURPOSE_GENERAL,
+                                            upload_done), OP_EQ, 0);
+  tt_int_op(dirserv_get_n_queued_descriptor_uploads(), OP_EQ, 1);
+  run_fake_replies();
+  tt_int_op(n_uploads_done, OP_EQ, 0);
+  tt_int_op(dirserv_get_n_queued_descriptor_uploads(), OP_EQ, 1);
+  desc_upload_commit_cb(NULL, NULL);
+  tt_int_op(dirserv_get_n_queued_descriptor_uploads(), OP_EQ, 0);
+  tt_int_op(n_uploads_done, OP_EQ, 1);
+  tt_ptr_op(last_upload_conn, OP_EQ, conn);
+  tt_int_op(last_upload_result, OP_EQ, ROUTER_IS_ALREADY_KNOWN);
+  tt_str_op(last_upload_msg, OP_EQ, "No descriptors found in your POST.");
+
+  /* If the connection closes in the meantime, we don't report back. */
+  tt_int_op(dirserv_queue_descriptor_upload(conn, body, strlen(body),
+                                            ROUTER_PURPOSE_GENERAL,
+                                            upload_done), OP_EQ, 0);
+  TO_CONN(conn)->marked_for_close = 1;
+  run_fake_replies();
+  desc_upload_commit_cb(NULL, NULL);
+  tt_int_op(dirserv_get_n_queued_descriptor_uploads(), OP_EQ, 0);
+  tt_int_op(n_uploads_done, OP_EQ, 1);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(cpuworker_get_n_threads);
+  smartlist_remove(get_connection_array(), TO_CONN(conn));
+  connection_free_minimal(TO_CONN(conn));
+  dirserv_free_queued_descriptor_uploads();
+  smartlist_free(fake_work);
+}
+
 #define T(name,flags)                                   \
   { #name, test_process_descs_##name, (flags), NULL, NULL }
 
 struct testcase_t process_descs_tests[] = {
   T(versions,0),
+  T(queued_upload,TT_FORK),
   END_OF_TESTCASES
 };
@@ -5,6 +5,14 @@
 #include <math.h>
 #include <time.h>
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef _WIN32
+/* For mkdir() */
+#include <direct.h>
+#endif
+
 #define CONNECTION_PRIVATE
 #define DIRCLIENT_PRIVATE
 #define DIRVOTE_PRIVATE
@@ -35,6 +43,7 @@
 #include "feature/nodelist/routerset.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/routerparse.h"
 #include "feature/dirauth/shared_random.h"
 #include "app/config/statefile.h"
 
@@ -44,6 +53,10 @@
 #include "feature/nodelist/node_st.h"
 #include "app/config/or_state_st.h"
 #include "feature/nodelist/routerstatus_st.h"
+#include "feature/nodelist/desc_store_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerlist_st.h"
+#include "feature/nodelist/signed_descriptor_st.h"
 
 #include "lib/encoding/confline.h"
 #include "lib/buf/buffers.h"
@@ -51,6 +64,7 @@
 #include "test/test.h"
 #include "test/test_dir_common.h"
 #include "test/log_test_helpers.h"
+#include "test/test_helpers.h"
 
 static authority_cert_t *mock_cert;
 
@@ -769,6 +783,61 @@ test_warn_early_consensus(void *arg)
   tor_free(c);
 }
 
+static void
+test_routerlist_journal_mmap(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  routerlist_t *rl;
+  const desc_store_t *store;
+  char *fname = NULL;
+  char d[DIGEST_LEN];
+  (void)arg;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("routerlist_journal"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+
+  helper_setup_fake_router_journal();
+  rl = router_get_routerlist();
+  store = &rl->desc_store;
+  tt_int_op(smartlist_len(rl->routers), OP_EQ, HELPER_NUMBER_OF_DESCRIPTORS);
+
+  /* The journal was short and ended cleanly, so we kept it rather than
+   * rebuilding the store. */
+  tt_u64_op(store->journal_len, OP_EQ, strlen(TEST_DESCRIPTORS));
+  tt_u64_op(store->store_len, OP_EQ, 0);
+  fname = get_cachedir_fname("cached-descriptors");
+  tt_int_op(file_status(fname), OP_EQ, FN_NOENT);
+
+  SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+    const signed_descriptor_t *sd = &ri->cache_info;
+    const char *body = signed_descriptor_get_body(sd);
+    tt_int_op(sd->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+    tt_mem_op(body, OP_EQ,
+              TEST_DESCRIPTORS + sd->saved_offset + sd->annotations_len,
+              sd->signed_descriptor_len);
+    tt_int_op(0, OP_EQ,
+              router_get_router_hash(body, sd->signed_descriptor_len, d));
+    tt_mem_op(d, OP_EQ, sd->signed_descriptor_digest, DIGEST_LEN);
+#ifndef _WIN32
+    /* We read the body from the journal, and don't keep a copy. */
+    tt_ptr_op(sd->signed_descriptor_body, OP_EQ, NULL);
+    tt_ptr_op(body, OP_GE, store->journal_mmap->data);
+    tt_ptr_op(body + sd->signed_descriptor_len, OP_LE,
+              store->journal_mmap->data + store->journal_mmap->size);
+#endif
+  } SMARTLIST_FOREACH_END(ri);
+
+ done:
+  tor_free(fname);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 #define ROUTER(name,flags) \
@@ -785,6 +854,7 @@ struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
   NODE(router_is_already_dir_fetching, TT_FORK),
+  NODE(journal_mmap, TT_FORK),
   ROUTER(pick_directory_server_impl, TT_FORK),
   { "directory_guard_fetch_with_no_dirinfo",
     test_directory_guard_fetch_with_no_dirinfo, TT_FORK, NULL, NULL },
@@ -61,23 +61,22 @@ test_v1_record_digest(void *arg)
    * shouldn't be noted. */
   circ->package_window = CIRCWINDOW_INCREMENT;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_assert(!circ->sendme_last_digests);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 0);
 
   /* This should work now. Package window at CIRCWINDOW_INCREMENT + 1. */
   circ->package_window++;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_assert(circ->sendme_last_digests);
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 1);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 1);
 
   /* Next cell in the package window shouldn't do anything. */
   circ->package_window++;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 1);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 1);
 
   /* The next CIRCWINDOW_INCREMENT should add one more digest. */
   circ->package_window = (CIRCWINDOW_INCREMENT * 2) + 1;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 2);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 2);
 
  done:
   circuit_free_(circ);
@@ -144,13 +143,13 @@ test_v1_build_cell(void *arg)
 
   or_circ = or_circuit_new(1, NULL);
   circ = TO_CIRCUIT(or_circ);
-  circ->sendme_last_digests = smartlist_new();
+  ringbuf_init(&circ->sendme_last_digests, DIGEST_LEN);
 
   cell_digest = crypto_digest_new();
   tt_assert(cell_digest);
   crypto_digest_add_bytes(cell_digest, "AAAAAAAAAAAAAAAAAAAA", 20);
   crypto_digest_get_digest(cell_digest, (char *) digest, sizeof(digest));
-  smartlist_add(circ->sendme_last_digests, tor_memdup(digest, sizeof(digest)));
+  memcpy(ringbuf_push(&circ->sendme_last_digests), digest, sizeof(digest));
 
   /* SENDME v1 payload is 3 bytes + 20 bytes digest. See spec. */
   ret = build_cell_payload_v1(digest, payload);
@@ -161,7 +160,7 @@ test_v1_build_cell(void *arg)
   /* An empty payload means SENDME version 0 thus valid. */
   tt_int_op(sendme_is_valid(circ, payload, 0), OP_EQ, true);
   /* Current phoney digest should have been popped. */
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 0);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 0);
 
   /* An unparseable cell means invalid. */
   setup_full_capture_of_logs(LOG_INFO);
@@ -180,11 +179,11 @@ test_v1_build_cell(void *arg)
   /* Note the wrong digest in the circuit, cell should fail validation. */
   circ->package_window = CIRCWINDOW_INCREMENT + 1;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 1);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 1);
   setup_full_capture_of_logs(LOG_INFO);
   tt_int_op(sendme_is_valid(circ, payload, sizeof(payload)), OP_EQ, false);
   /* After a validation, the last digests is always popped out. */
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 0);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 0);
   expect_log_msg_containing("SENDME v1 cell digest do not match.");
   teardown_capture_of_logs();
 
@@ -192,10 +191,10 @@ test_v1_build_cell(void *arg)
   memcpy(or_circ->crypto.sendme_digest, digest, sizeof(digest));
   circ->package_window = CIRCWINDOW_INCREMENT + 1;
   sendme_record_cell_digest_on_circ(circ, NULL);
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 1);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 1);
   tt_int_op(sendme_is_valid(circ, payload, sizeof(payload)), OP_EQ, true);
   /* After a validation, the last digests is always popped out. */
-  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 0);
+  tt_uint_op(ringbuf_len(&circ->sendme_last_digests), OP_EQ, 0);
 
  done:
   crypto_digest_free(cell_digest);
@@ -1941,6 +1941,113 @@ test_tortls_context_init_one(void *ignored)
   UNMOCK(crypto_pk_new);
 }
 
+/** Helper: run the handshake between <b>client</b> and <b>server</b>, which
+ * are connected to each other, until it finishes.  Then let the client read
+ * whatever the server sent after the handshake.  Return 0 on success. */
+static int
+do_tls_handshake(tor_tls_t *client, tor_tls_t *server)
+{
+  char buf[64];
+  int i;
+
+  for (i = 0; i < 20; ++i) {
+    if (client->state == TOR_TLS_ST_HANDSHAKE &&
+        TOR_TLS_IS_ERROR(tor_tls_handshake(client)))
+      return -1;
+    if (server->state == TOR_TLS_ST_HANDSHAKE &&
+        TOR_TLS_IS_ERROR(tor_tls_handshake(server)))
+      return -1;
+    if (client->state == TOR_TLS_ST_OPEN && server->state == TOR_TLS_ST_OPEN)
+      break;
+  }
+  if (client->state != TOR_TLS_ST_OPEN || server->state != TOR_TLS_ST_OPEN)
+    return -1;
+  if (tor_tls_read(client, buf, sizeof(buf)) != TOR_TLS_WANTREAD)
+    return -1;
+  return 0;
+}
+
+static void
+test_tortls_session_resumption(void *ignored)
+{
+  (void)ignored;
+  crypto_pk_t *key1 = pk_generate(2), *key2 = pk_generate(3);
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  char peer_id[DIGEST_LEN], other_id[DIGEST_LEN];
+
+  memset(peer_id, 'A', sizeof(peer_id));
+  memset(other_id, 'B', sizeof(other_id));
+
+#define NEW_PAIR() do {                                                 \
+    tor_tls_free(client);                                               \
+    tor_tls_free(server);                                               \
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);  \
+    tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);                \
+    tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);                \
+    client = tor_tls_new(fds[0], 0);                                    \
+    server = tor_tls_new(fds[1], 1);                                    \
+    tt_assert(client);                                                  \
+    tt_assert(server);                                                  \
+  } while (0)
+
+  /* Without resumption, we don't keep any sessions. */
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key1, key2, 86400), OP_EQ, 0);
+  NEW_PAIR();
+  tt_int_op(do_tls_handshake(client, server), OP_EQ, 0);
+  tor_tls_keep_sessions_for(client, peer_id);
+  tt_int_op(tor_tls_get_n_resumable_sessions(), OP_EQ, 0);
+
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER|
+                                 TOR_TLS_CTX_SESSION_RESUMPTION,
+                                 key1, key2, 86400), OP_EQ, 0);
+
+  /* A full handshake gets us a session, which we keep once we know who the
+   * server is. */
+  NEW_PAIR();
+  tt_int_op(tor_tls_resume_session(client, peer_id), OP_EQ, 0);
+  tt_int_op(do_tls_handshake(client, server), OP_EQ, 0);
+  tt_assert(!tor_tls_session_was_resumed(client));
+  tt_int_op(tor_tls_get_n_resumable_sessions(), OP_EQ, 0);
+  tor_tls_keep_sessions_for(client, peer_id);
+  tt_int_op(tor_tls_get_n_resumable_sessions(), OP_EQ, 1);
+
+  /* We only offer it to the same server, and only once. */
+  NEW_PAIR();
+  tt_int_op(tor_tls_resume_session(client, other_id), OP_EQ, 0);
+  tt_int_op(tor_tls_resume_session(client, peer_id), OP_EQ, 1);
+  tt_int_op(tor_tls_get_n_resumable_sessions(), OP_EQ, 0);
+  tt_int_op(do_tls_handshake(client, server), OP_EQ, 0);
+  tt_assert(tor_tls_session_was_resumed(client));
+  tt_assert(tor_tls_session_was_resumed(server));
+  /* The server still knows its certificate, and we still know the one it
+   * sent us the first time. */
+  tt_assert(tor_tls_peer_has_cert(client));
+
+  /* The resumed connection gets a new session for next time. */
+  tor_tls_keep_sessions_for(client, peer_id);
+  tt_int_op(tor_tls_get_n_resumable_sessions(), OP_EQ, 1);
+
+  /* If the server rotates its keys, resumption fails, but the handshake
+   * still works. */
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER|
+                                 TOR_TLS_CTX_SESSION_RESUMPTION,
+                                 key2, key1, 86400), OP_EQ, 0);
+  NEW_PAIR();
+  tt_int_op(tor_tls_resume_session(client, peer_id), OP_EQ, 1);
+  tt_int_op(do_tls_handshake(client, server), OP_EQ, 0);
+  tt_assert(!tor_tls_session_was_resumed(client));
+#undef NEW_PAIR
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  tor_tls_free_all();
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+}
+
 #define LOCAL_TEST_CASE(name, flags)                    \
   { #name, test_tortls_##name, (flags|TT_FORK), NULL, NULL }
 
@@ -1986,5 +2093,6 @@ struct testcase_t tortls_openssl_tests[] = {
   LOCAL_TEST_CASE(cert_new, 0),
   LOCAL_TEST_CASE(cert_is_valid, 0),
   LOCAL_TEST_CASE(context_init_one, 0),
+  LOCAL_TEST_CASE(session_resumption, 0),
   END_OF_TESTCASES
 };
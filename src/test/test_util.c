@@ -5222,6 +5222,34 @@ test_util_memcpy_iftrue_timei(void *arg)
   ;
 }
 
+static void
+test_util_select_cumulative_timei(void *arg)
+{
+  (void)arg;
+  uint64_t cumulative[40];
+
+  for (int n = 1; n <= (int)ARRAY_LENGTH(cumulative); ++n) {
+    /* Some zero-weight entries, so that the array has runs of equal
+     * values. */
+    uint64_t total = 0;
+    for (int i = 0; i < n; ++i) {
+      total += (i % 3 == 1) ? 0 : crypto_rand_int_range(1, 10);
+      cumulative[i] = total;
+    }
+    if (total == 0)
+      continue;
+    for (uint64_t r = 0; r < total; ++r) {
+      int expected = 0;
+      while (cumulative[expected] <= r)
+        ++expected;
+      tt_int_op(select_array_member_by_cumulative_timei(cumulative, n, r),
+                OP_EQ, expected);
+    }
+  }
+ done:
+  ;
+}
+
 static void
 test_util_di_map(void *arg)
 {
@@ -6998,6 +7026,7 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(strtok),
   UTIL_LEGACY(di_ops),
   UTIL_TEST(memcpy_iftrue_timei, 0),
+  UTIL_TEST(select_cumulative_timei, 0),
   UTIL_TEST(di_map, 0),
   UTIL_TEST(round_to_next_multiple_of, 0),
   UTIL_TEST(laplace, 0),